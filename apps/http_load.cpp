@@ -0,0 +1,98 @@
+#include "http_load.hpp"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+    void usage()
+    {
+        std::cerr << "Usage: http_load <host> <port> <target> [options]\n"
+                  << "  -c <connections>  persistent connections (default 16)\n"
+                  << "  -t <threads>      io threads (default 1)\n"
+                  << "  -d <seconds>      test duration (default 10)\n"
+                  << "  -r <rate>         total requests/s, open loop; 0 = closed loop (default 0)\n"
+                  << "  -p <depth>        pipelined requests per connection (default 1)\n"
+                  << "  -m <method>       request method (default GET)\n"
+                  << "  -b <bytes>        send a request body of this many bytes\n"
+                  << "  --tls             use TLS, the certificate is not verified\n"
+                  << "Example:\n"
+                  << "    http_load 127.0.0.1 8080 /index.html -c 64 -t 4 -d 30 -r 20000\n";
+    }
+
+    void print_latency(char const *title, client_async::LatencyHistogram const &h)
+    {
+        std::printf("%s (us)\n", title);
+        for (double q : {0.5, 0.9, 0.99, 0.999, 0.9999})
+            std::printf("  p%-7g %10llu\n", q * 100, static_cast<unsigned long long>(h.quantile(q)));
+        std::printf("  max      %10llu\n", static_cast<unsigned long long>(h.max_us));
+        std::printf("  mean     %10.1f\n", h.count ? static_cast<double>(h.sum_us) / static_cast<double>(h.count) : 0.0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    client_async::LoadOptions options;
+    options.host = argv[1];
+    options.port = argv[2];
+    options.target = argv[3];
+    for (int i = 4; i < argc; ++i)
+    {
+        auto value = [&]() -> char const *
+        {
+            if (i + 1 >= argc)
+            {
+                usage();
+                std::exit(EXIT_FAILURE);
+            }
+            return argv[++i];
+        };
+        if (!std::strcmp(argv[i], "-c"))
+            options.connections = std::max(1, std::atoi(value()));
+        else if (!std::strcmp(argv[i], "-t"))
+            options.threads = std::max(1, std::atoi(value()));
+        else if (!std::strcmp(argv[i], "-d"))
+            options.duration = std::chrono::seconds(std::max(1, std::atoi(value())));
+        else if (!std::strcmp(argv[i], "-r"))
+            options.rate = std::atof(value());
+        else if (!std::strcmp(argv[i], "-p"))
+            options.pipeline = std::max(1, std::atoi(value()));
+        else if (!std::strcmp(argv[i], "-m"))
+        {
+            options.method = http::string_to_verb(value());
+            if (options.method == http::verb::unknown)
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!std::strcmp(argv[i], "-b"))
+            options.body.assign(static_cast<std::size_t>(std::max(0, std::atoi(value()))), 'x');
+        else if (!std::strcmp(argv[i], "--tls"))
+            options.tls = true;
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    client_async::LoadResult result = client_async::run_load(options);
+
+    std::printf("%s loop, %d connections, %d threads, pipeline %d%s\n",
+                options.rate > 0 ? "open" : "closed", options.connections, options.threads,
+                options.pipeline, options.tls ? ", tls" : "");
+    std::printf("requests %llu, errors %llu, %.1f req/s, %.2f MB read\n",
+                static_cast<unsigned long long>(result.completed), static_cast<unsigned long long>(result.errors),
+                result.rps(), static_cast<double>(result.bytes) / 1e6);
+    print_latency(options.rate > 0 ? "latency from intended send time" : "latency", result.corrected);
+    if (options.rate > 0)
+        print_latency("latency from actual send time (not corrected for coordinated omission)", result.uncorrected);
+    return result.completed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -19,11 +19,14 @@
 int main(int argc, char *argv[])
 {
     // Check command line arguments.
-    if (argc != 5)
+    if (argc != 5 && argc != 6)
     {
-        std::cerr << "Usage: advanced-server-flex <address> <port> <doc_root> <threads>\n"
+        std::cerr << "Usage: advanced-server-flex <address> <port> <doc_root> <threads> [<handoff_socket>]\n"
                   << "Example:\n"
-                  << "    advanced-server-flex 0.0.0.0 8080 . 1\n";
+                  << "    advanced-server-flex 0.0.0.0 8080 . 1\n"
+                  << "    advanced-server-flex 0.0.0.0 8080 . 1 /tmp/advanced-server-flex.sock\n"
+                  << "Starting a second instance with the same <handoff_socket> takes over\n"
+                  << "the listening socket of the running one, which then drains and exits.\n";
         return EXIT_FAILURE;
     }
     auto const address = net::ip::make_address(argv[1]);
@@ -31,14 +34,22 @@ int main(int argc, char *argv[])
     auto const doc_root = std::make_shared<std::string>(argv[3]);
     auto const threads = std::max<int>(1, std::atoi(argv[4]));
     server_async::HttpServer server(address, port, doc_root, threads);
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    if (argc == 6)
+        server.enable_handoff(argv[5]);
+#endif
 
     const char *cert_filepath = "apps/fixtures/cert.pem";
     const char *key_filepath = "apps/fixtures/key.pem";
     const char *dh_filepath = "apps/fixtures/dh.pem";
+    const char *ecdsa_cert_filepath = "apps/fixtures/ecdsa_cert.pem";
+    const char *ecdsa_key_filepath = "apps/fixtures/ecdsa_key.pem";
 
     server_async::SSLCertHolder ssl_cert_holder{server_async::read_whole_file(cert_filepath),
                                                 server_async::read_whole_file(key_filepath),
-                                                server_async::read_whole_file(dh_filepath)};
+                                                server_async::read_whole_file(dh_filepath),
+                                                server_async::read_whole_file(ecdsa_cert_filepath),
+                                                server_async::read_whole_file(ecdsa_key_filepath)};
 
     // server_async::HandlerFunc<server_async::plain_http_session> plain_handler =
     //     std::bind(&handler<server_async::plain_http_session>, std::placeholders::_1, std::placeholders::_2);
@@ -48,8 +59,8 @@ int main(int argc, char *argv[])
     //     std::bind(&handler<server_async::plain_http_session>, std::placeholders::_1, std::placeholders::_2);
     // auto ssl_handler =
     //     std::bind(&handler<server_async::ssl_http_session>, std::placeholders::_1, std::placeholders::_2);
-    server_async::handler<server_async::plain_http_session> plain_handler{};
-    server_async::handler<server_async::ssl_http_session> ssl_handler{};
+    server_async::handler<server_async::plain_http_session> plain_handler{*doc_root};
+    server_async::handler<server_async::ssl_http_session> ssl_handler{*doc_root};
     server.start(ssl_cert_holder, plain_handler, ssl_handler);
 
     return EXIT_SUCCESS;
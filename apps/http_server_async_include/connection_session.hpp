@@ -4,6 +4,8 @@
 #define CONNECTION_SESSION_H
 
 #include "server_async_util.h"
+#include "dns_cache.hpp"
+#include "happy_eyeballs.hpp"
 
 namespace server_async
 {
@@ -26,46 +28,45 @@ namespace server_async
         template <class Body, class Allocator>
         void do_accept(http::request<Body, http::basic_fields<Allocator>> req)
         {                                           // Connect to the target server specified in the request
-            const auto &target_host = req.target(); // Extract the target host
-            boost::asio::ip::tcp::resolver resolver(derived().client_socket().get_executor());
-            auto endpoints = resolver.resolve(target_host, "443"); // Example: HTTPS port
-            tcp::socket target_socket_{derived().client_socket().get_executor()};
-            // Initiate an asynchronous connection to the target server
+            std::string target_host{req.target()}; // Extract the target host
+            auto target_socket = std::make_shared<tcp::socket>(derived().client_socket().get_executor());
             auto self = derived().shared_from_this();
-            tcp::socket &cs = derived().client_socket();
-
-            boost::asio::async_connect(target_socket_, endpoints,
-                                       [this, self, &req](beast::error_code ec, const auto & /*endpoint*/)
-                                       {
-                                           if (!ec)
-                                           {
-                                               // Send "200 Connection Established" response
-                                               http::response<http::string_body> res{http::status::ok, req.version()};
-                                               res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-                                               res.keep_alive(req.keep_alive());
-                                               bool keep_alive = req.keep_alive();
-
-                                               // Serialize the response into a buffer
-                                               //    beast::flat_buffer buffer;
-                                            //    http::serializer<false, http::empty_body> serializer{res};
-                                               //    serializer.prepare_payload(); // Ensure the payload is prepared for serialization
-                                               //    beast::flat_buffer response_buffer;
-                                               //    beast::ostream(response_buffer) << res;
-                                               //    http::write(response_buffer, serializer);
-
-                                            //    beast::http::async_write( // Modify this line to use beast::http::async_write
-                                            //        derived().client_socket(),
-                                            //        std::move(res),
-                                            //        beast::bind_front_handler(
-                                            //            &connection_session::on_write,
-                                            //            derived().shared_from_this(),
-                                            //            keep_alive));
-                                           }
-                                           else
-                                           {
-                                               // Handle connection error
-                                           }
-                                       });
+            unsigned version = req.version();
+            bool keep_alive = req.keep_alive();
+
+            // Resolved through the shared cache, the io thread never blocks on DNS.
+            DnsCache::instance().async_resolve(
+                target_host, "443", // Example: HTTPS port
+                derived().client_socket().get_executor(),
+                [self, target_socket, version, keep_alive](beast::error_code ec, DnsCache::Endpoints const &endpoints)
+                {
+                    if (ec)
+                        return fail(ec, "resolve");
+                    // Initiate an asynchronous connection to the target server
+                    HappyEyeballs::async_connect(*target_socket, endpoints,
+                                                 [self, target_socket, version, keep_alive](beast::error_code ec, const auto & /*endpoint*/)
+                                                 {
+                                                     if (!ec)
+                                                     {
+                                                         // Send "200 Connection Established" response
+                                                         http::response<http::string_body> res{http::status::ok, version};
+                                                         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                                                         res.keep_alive(keep_alive);
+
+                                                         //    beast::http::async_write( // Modify this line to use beast::http::async_write
+                                                         //        derived().client_socket(),
+                                                         //        std::move(res),
+                                                         //        beast::bind_front_handler(
+                                                         //            &connection_session::on_write,
+                                                         //            derived().shared_from_this(),
+                                                         //            keep_alive));
+                                                     }
+                                                     else
+                                                     {
+                                                         // Handle connection error
+                                                     }
+                                                 });
+                });
 
             // Return an empty generator for now, as this is handled asynchronously
             // return http::message_generator();
@@ -0,0 +1,331 @@
+#pragma once
+#ifndef SERVER_ASYNC_CRYPTO_POOL_HPP
+#define SERVER_ASYNC_CRYPTO_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/read.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/write.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "server_async_util.h"
+#include "metrics.hpp"
+
+// TLS handshakes on a dedicated thread pool.
+//
+// The private key operation of a full handshake (an RSA signature costs
+// about a millisecond) would otherwise run on an io thread, in front of
+// every established connection that thread serves. Here only the OpenSSL
+// computation, SSL_do_handshake() over a private memory BIO pair, runs on
+// the pool. The socket reads and writes stay on the session's strand, so
+// drain and timeouts keep working on the session as before.
+//
+// OpenSSL's async jobs need an engine or provider that pauses, and a
+// private key callback only exists in BoringSSL. Running the whole
+// handshake step on the pool works with any key and any OpenSSL build.
+namespace server_async
+{
+    // Fixed number of threads with a bound on queued work. Past the bound
+    // a handshake step runs on the calling io thread again, so a flood of
+    // new clients slows the io threads down rather than queueing without limit.
+    class CryptoPool
+    {
+    public:
+        CryptoPool(std::size_t threads, std::size_t max_pending)
+            : pool_(threads), max_pending_(max_pending)
+        {
+        }
+
+        CryptoPool(const CryptoPool &) = delete;
+        CryptoPool &operator=(const CryptoPool &) = delete;
+
+        // Jobs not yet started are dropped, a running one finishes first.
+        ~CryptoPool()
+        {
+            pool_.stop();
+            pool_.join();
+        }
+
+        // Queues `job` unless max_pending jobs are already queued or running.
+        template <class Job>
+        bool
+        try_post(Job &&job)
+        {
+            if (pending_.fetch_add(1, std::memory_order_relaxed) >= max_pending_)
+            {
+                pending_.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            Metrics::instance().crypto_queued();
+            net::post(pool_, [this, job = std::forward<Job>(job)]() mutable
+                      {
+                          job();
+                          pending_.fetch_sub(1, std::memory_order_relaxed);
+                          Metrics::instance().crypto_finished();
+                      });
+            return true;
+        }
+
+        std::size_t
+        pending() const
+        {
+            return pending_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        net::thread_pool pool_;
+        std::size_t const max_pending_;
+        std::atomic<std::size_t> pending_{0};
+    };
+
+    namespace detail
+    {
+        // Server side handshake of an ssl::stream, computed on a CryptoPool.
+        //
+        // asio's engine keeps its BIO pair private, so the SSL object is
+        // pointed at a pair of ours for the handshake and back at asio's
+        // afterwards. Records are read from the socket one at a time: the
+        // handshake stops reading exactly after the client's Finished, and
+        // whatever the client sent next is still in the socket for asio.
+        class pooled_handshake : public std::enable_shared_from_this<pooled_handshake>
+        {
+        public:
+            using Handler = std::function<void(beast::error_code, std::size_t)>;
+
+            pooled_handshake(ssl::stream<beast::tcp_stream> &stream, CryptoPool &pool, Handler handler)
+                : stream_(stream), pool_(pool), handler_(std::move(handler))
+            {
+            }
+
+            // A step dropped at shutdown ends here. `handler_` still holds
+            // the session, so the SSL object is alive to take its BIOs back.
+            ~pooled_handshake()
+            {
+                restore_bios();
+            }
+
+            // Runs on the session's strand. `initial` holds bytes already
+            // read from the socket, e.g. by async_detect_ssl.
+            void
+            start(net::const_buffer initial)
+            {
+                SSL *ssl = stream_.native_handle();
+                if (BIO_new_bio_pair(&internal_, bio_size, &external_, bio_size) != 1)
+                    return finish(ssl::error::unspecified_system_error);
+                asio_bio_ = SSL_get_rbio(ssl);
+                BIO_up_ref(asio_bio_);
+                SSL_set_bio(ssl, internal_, internal_);
+                SSL_set_accept_state(ssl);
+
+                initial_size_ = initial.size();
+                if (!feed(static_cast<unsigned char const *>(initial.data()), initial.size()))
+                    return finish(ssl::error::unexpected_result);
+                if (header_have_ > 0 || record_left_ > 0)
+                    return read_more();
+                step();
+            }
+
+        private:
+            // Room for a maximum sized record plus the server's first flight.
+            static constexpr int bio_size = 64 * 1024;
+            // TLS 1.2 allows 2048 bytes of expansion over a 16 KiB plaintext.
+            static constexpr std::size_t max_record = 16 * 1024 + 2048;
+
+            ssl::stream<beast::tcp_stream> &stream_;
+            CryptoPool &pool_;
+            Handler handler_;
+            BIO *asio_bio_ = nullptr;
+            BIO *internal_ = nullptr; // owned by the SSL object while set
+            BIO *external_ = nullptr;
+            std::size_t initial_size_ = 0;
+
+            // Where the bytes fed so far are in the record framing.
+            unsigned char header_[5] = {};
+            std::size_t header_have_ = 0;
+            std::size_t record_left_ = 0;
+            std::vector<unsigned char> in_;
+
+            // Written by the step on the pool, read back on the strand.
+            int result_ = 0;
+            int ssl_error_ = SSL_ERROR_NONE;
+            unsigned long err_ = 0;
+            std::vector<unsigned char> out_;
+
+            // Hands `n` bytes to OpenSSL and follows the record headers.
+            bool
+            feed(unsigned char const *p, std::size_t n)
+            {
+                if (n > 0 && BIO_write(external_, p, static_cast<int>(n)) != static_cast<int>(n))
+                    return false;
+                while (n > 0)
+                {
+                    if (record_left_ > 0)
+                    {
+                        std::size_t take = std::min(record_left_, n);
+                        record_left_ -= take;
+                        p += take;
+                        n -= take;
+                        continue;
+                    }
+                    header_[header_have_++] = *p++;
+                    --n;
+                    // Content type 20 to 24 and a 3.x version, or it is not TLS.
+                    if ((header_have_ == 1 && (header_[0] < 20 || header_[0] > 24)) ||
+                        (header_have_ == 2 && header_[1] != 3))
+                        return false;
+                    if (header_have_ == sizeof header_)
+                    {
+                        header_have_ = 0;
+                        record_left_ = std::size_t(header_[3]) << 8 | header_[4];
+                        if (record_left_ == 0 || record_left_ > max_record)
+                            return false;
+                    }
+                }
+                return true;
+            }
+
+            // Reads the rest of the current record, header first.
+            void
+            read_more()
+            {
+                std::size_t n = record_left_ > 0 ? record_left_ : sizeof header_ - header_have_;
+                in_.resize(n);
+                net::async_read(
+                    stream_.next_layer(),
+                    net::buffer(in_),
+                    [self = shared_from_this()](beast::error_code ec, std::size_t)
+                    {
+                        if (ec)
+                            return self->finish(ec);
+                        if (!self->feed(self->in_.data(), self->in_.size()))
+                            return self->finish(ssl::error::unexpected_result);
+                        if (self->header_have_ > 0 || self->record_left_ > 0)
+                            return self->read_more();
+                        self->step();
+                    });
+            }
+
+            // One SSL_do_handshake, on the pool when it has room. The step
+            // counts as work of the stream's io_context until on_step() ran,
+            // so run() does not return while it is on the pool.
+            void
+            step()
+            {
+                auto work = net::prefer(stream_.get_executor(), net::execution::outstanding_work.tracked);
+                bool queued = pool_.try_post(
+                    [self = shared_from_this(), work]
+                    {
+                        self->compute();
+                        net::post(work,
+                                  [self]
+                                  { self->on_step(); });
+                    });
+                if (queued)
+                    return;
+                Metrics::instance().crypto_inline();
+                compute();
+                on_step();
+            }
+
+            // Runs on whichever thread does the step. OpenSSL's error queue
+            // is per thread, so the error is taken out here.
+            void
+            compute()
+            {
+                ERR_clear_error();
+                result_ = SSL_do_handshake(stream_.native_handle());
+                ssl_error_ = result_ == 1 ? SSL_ERROR_NONE : SSL_get_error(stream_.native_handle(), result_);
+                err_ = ERR_get_error();
+                ERR_clear_error();
+                out_.resize(BIO_ctrl_pending(external_));
+                if (!out_.empty())
+                    BIO_read(external_, out_.data(), static_cast<int>(out_.size()));
+            }
+
+            // Back on the strand: send what the step wrote, then go on.
+            void
+            on_step()
+            {
+                if (out_.empty())
+                    return next();
+                net::async_write(
+                    stream_.next_layer(),
+                    net::buffer(out_),
+                    [self = shared_from_this()](beast::error_code ec, std::size_t)
+                    {
+                        if (ec)
+                            return self->finish(ec);
+                        self->next();
+                    });
+            }
+
+            void
+            next()
+            {
+                switch (ssl_error_)
+                {
+                case SSL_ERROR_NONE:
+                    // Ciphertext past the handshake would be lost with our BIOs.
+                    if (BIO_ctrl_pending(internal_) > 0)
+                        return finish(ssl::error::unexpected_result);
+                    return finish({});
+                case SSL_ERROR_WANT_READ:
+                    return read_more();
+                case SSL_ERROR_WANT_WRITE:
+                    return step();
+                case SSL_ERROR_SSL:
+                    return finish(beast::error_code(static_cast<int>(err_), net::error::get_ssl_category()));
+                default:
+                    return finish(ssl::error::stream_truncated);
+                }
+            }
+
+            void
+            restore_bios()
+            {
+                if (asio_bio_)
+                {
+                    // Hands our reference back and frees `internal_`.
+                    SSL_set_bio(stream_.native_handle(), asio_bio_, asio_bio_);
+                    asio_bio_ = nullptr;
+                    internal_ = nullptr;
+                }
+                if (external_)
+                    BIO_free(std::exchange(external_, nullptr));
+                if (internal_)
+                    BIO_free(std::exchange(internal_, nullptr));
+            }
+
+            void
+            finish(beast::error_code ec)
+            {
+                restore_bios();
+                // All of the initial bytes went into the handshake.
+                std::exchange(handler_, nullptr)(ec, initial_size_);
+            }
+        };
+    }
+
+    // Like stream.async_handshake(server, buffer, handler), with the OpenSSL
+    // work on `pool`. Call it on the stream's strand; `handler` runs there too.
+    template <class Handler>
+    void
+    async_pooled_handshake(ssl::stream<beast::tcp_stream> &stream,
+                           CryptoPool &pool,
+                           net::const_buffer initial,
+                           Handler &&handler)
+    {
+        std::make_shared<detail::pooled_handshake>(stream, pool, std::forward<Handler>(handler))
+            ->start(initial);
+    }
+}
+
+#endif
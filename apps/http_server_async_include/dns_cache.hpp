@@ -0,0 +1,279 @@
+#pragma once
+#ifndef SERVER_ASYNC_DNS_CACHE_HPP
+#define SERVER_ASYNC_DNS_CACHE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/execution.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include "dns_resolver.hpp"
+#include "metrics.hpp"
+
+// Name resolution shared by the proxy paths and the client.
+//
+// tcp::resolver runs getaddrinfo() on one background thread per io_context,
+// so lookups of different names queue behind each other and every request
+// pays for its own. The cache answers repeated names from memory, remembers
+// failures for a short while, lets concurrent lookups of one name wait for a
+// single resolution, and resolves a name again in the background shortly
+// before it expires, so busy names never miss.
+//
+// Misses go to DnsResolver on the caller's io_context, or to getaddrinfo()
+// on the cache's threads for service names and when the native resolver
+// is off or has no nameserver.
+namespace server_async
+{
+    // How long a resolved name is used at most: DnsResolver answers keep
+    // their record TTL up to this, getaddrinfo() reports none and gets it
+    // whole. 0 disables caching. HttpServer::set_dns_cache() changes it.
+    inline std::atomic<std::int64_t> &dns_cache_ttl_ms()
+    {
+        static std::atomic<std::int64_t> ttl{60000};
+        return ttl;
+    }
+
+    // How long a failed lookup is answered from the cache.
+    inline std::atomic<std::int64_t> &dns_negative_ttl_ms()
+    {
+        static std::atomic<std::int64_t> ttl{5000};
+        return ttl;
+    }
+
+    class DnsCache
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+        using Endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+
+        // Names held at most; expired ones are dropped first.
+        static constexpr std::size_t max_entries = 4096;
+
+        static DnsCache &
+        instance()
+        {
+            static DnsCache cache{4};
+            return cache;
+        }
+
+        explicit DnsCache(std::size_t threads) : pool_(threads) {}
+
+        DnsCache(const DnsCache &) = delete;
+        DnsCache &operator=(const DnsCache &) = delete;
+
+        ~DnsCache()
+        {
+            pool_.stop();
+            pool_.join();
+        }
+
+        // Resolves `host` and `port` and calls handler(error_code, Endpoints)
+        // through `ex`, never from within this call.
+        template <class Executor, class Handler>
+        void
+        async_resolve(std::string const &host, std::string const &port, Executor const &ex, Handler &&handler)
+        {
+            // Counts as work of the caller's io_context, as the resolver's operation did.
+            auto work = boost::asio::prefer(ex, boost::asio::execution::outstanding_work.tracked);
+            Waiter waiter = [work, handler = std::forward<Handler>(handler)](boost::system::error_code ec, Endpoints const &endpoints) mutable
+            {
+                boost::asio::post(work, [handler = std::move(handler), ec, endpoints]() mutable
+                                  { handler(ec, endpoints); });
+            };
+
+            // A port of digits must be a port number; other names are services.
+            std::optional<unsigned short> number;
+            if (!port.empty() && std::all_of(port.begin(), port.end(), [](char c)
+                                             { return c >= '0' && c <= '9'; }))
+            {
+                number = port_number(port);
+                if (!number)
+                    return waiter(boost::asio::error::service_not_found, {});
+            }
+
+            // An address needs no lookup.
+            boost::system::error_code ec;
+            auto address = boost::asio::ip::make_address(host, ec);
+            if (!ec && number)
+                return waiter({}, Endpoints{{address, *number}});
+
+            std::string key = host + ":" + port;
+            auto now = clock::now();
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end())
+            {
+                make_room(now);
+                it = entries_.emplace(key, Entry{}).first;
+            }
+            Entry &entry = it->second;
+            if (entry.resolved && now < entry.expires)
+            {
+                Metrics::instance().dns_lookup(Metrics::DnsLookup::hit);
+                bool refresh = !entry.resolving && now >= entry.refresh_at;
+                entry.resolving = entry.resolving || refresh;
+                auto ec = entry.ec;
+                auto endpoints = entry.endpoints;
+                lock.unlock();
+                if (refresh)
+                {
+                    Metrics::instance().dns_lookup(Metrics::DnsLookup::refresh);
+                    resolve(ex, host, port, number, std::move(key));
+                }
+                return waiter(ec, endpoints);
+            }
+            entry.waiters.push_back(std::move(waiter));
+            if (entry.resolving)
+            {
+                Metrics::instance().dns_lookup(Metrics::DnsLookup::coalesced);
+                return;
+            }
+            entry.resolving = true;
+            lock.unlock();
+            Metrics::instance().dns_lookup(Metrics::DnsLookup::miss);
+            resolve(ex, host, port, number, std::move(key));
+        }
+
+        // Forgets every name, e.g. after the system's resolver configuration changed.
+        void
+        clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = entries_.begin(); it != entries_.end();)
+                it = it->second.resolving ? std::next(it) : entries_.erase(it);
+        }
+
+    private:
+        using Waiter = std::function<void(boost::system::error_code, Endpoints const &)>;
+
+        struct Entry
+        {
+            bool resolved = false;  // ec and endpoints hold a result
+            bool resolving = false; // a lookup is queued or running
+            boost::system::error_code ec;
+            Endpoints endpoints;
+            clock::time_point expires;
+            clock::time_point refresh_at;
+            std::vector<Waiter> waiters;
+        };
+
+        // The value of a port of digits, unless it is above 65535.
+        static std::optional<unsigned short>
+        port_number(std::string const &port)
+        {
+            unsigned value = 0;
+            auto [end, ec] = std::from_chars(port.data(), port.data() + port.size(), value);
+            if (ec != std::errc() || end != port.data() + port.size() || value > 65535)
+                return std::nullopt;
+            return static_cast<unsigned short>(value);
+        }
+
+        // One resolution of `host`, then every waiter gets the result.
+        // `number` is the port when it was given as one.
+        void
+        resolve(boost::asio::any_io_executor ex, std::string host, std::string port, std::optional<unsigned short> number, std::string key)
+        {
+            DnsResolver &native = DnsResolver::system();
+            if (dns_native().load(std::memory_order_relaxed) && number && native.usable())
+            {
+                native.async_resolve(std::move(ex), host,
+                                     [this, key = std::move(key), number = *number](boost::system::error_code ec, DnsResolver::Addresses addresses, std::chrono::seconds ttl)
+                                     {
+                                         Endpoints endpoints;
+                                         for (auto const &address : addresses)
+                                             endpoints.emplace_back(address, number);
+                                         done(key, ec, std::move(endpoints), ttl);
+                                     });
+                return;
+            }
+            boost::asio::post(pool_, [this, host = std::move(host), port = std::move(port), key = std::move(key)]
+                              {
+                                  boost::system::error_code ec;
+                                  Endpoints endpoints;
+                                  boost::asio::ip::tcp::resolver resolver(pool_);
+                                  for (auto const &r : resolver.resolve(host, port, ec))
+                                      endpoints.push_back(r.endpoint());
+                                  if (!ec && endpoints.empty())
+                                      ec = boost::asio::error::host_not_found;
+                                  done(key, ec, std::move(endpoints), std::chrono::seconds::max());
+                              });
+        }
+
+        void
+        done(std::string const &key, boost::system::error_code ec, Endpoints endpoints, std::chrono::seconds record_ttl)
+        {
+            auto now = clock::now();
+            auto ttl = std::chrono::milliseconds(dns_cache_ttl_ms().load(std::memory_order_relaxed));
+            if (record_ttl < std::chrono::duration_cast<std::chrono::seconds>(ttl))
+                ttl = std::max<std::chrono::milliseconds>(record_ttl, std::chrono::seconds(1));
+            std::vector<Waiter> waiters;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                Entry &entry = entries_[key];
+                waiters.swap(entry.waiters);
+                entry.resolving = false;
+                // A failed refresh keeps serving the names it had, an
+                // abandoned lookup (its io_context stopped) leaves no trace.
+                bool abandoned = ec == boost::asio::error::operation_aborted;
+                if (abandoned)
+                {
+                    if (!entry.resolved)
+                        entries_.erase(key);
+                }
+                else if (!ec || !entry.resolved || entry.ec || now >= entry.expires)
+                {
+                    entry.resolved = true;
+                    entry.ec = ec;
+                    entry.endpoints = endpoints;
+                    if (ec)
+                        entry.expires = now + std::chrono::milliseconds(dns_negative_ttl_ms().load(std::memory_order_relaxed));
+                    else
+                        entry.expires = now + ttl;
+                    // Busy names are resolved again in the last fifth of their TTL.
+                    entry.refresh_at = ec ? entry.expires : now + ttl * 4 / 5;
+                }
+                else
+                {
+                    entry.refresh_at = std::min(entry.expires, now + std::chrono::milliseconds(dns_negative_ttl_ms().load(std::memory_order_relaxed)));
+                }
+                if (!abandoned)
+                {
+                    ec = entry.ec;
+                    endpoints = entry.endpoints;
+                }
+            }
+            for (auto &waiter : waiters)
+                waiter(ec, endpoints);
+        }
+
+        // Called with the lock held before a new name goes in.
+        void
+        make_room(clock::time_point now)
+        {
+            if (entries_.size() < max_entries)
+                return;
+            for (auto it = entries_.begin(); it != entries_.end();)
+                it = !it->second.resolving && now >= it->second.expires ? entries_.erase(it) : std::next(it);
+            for (auto it = entries_.begin(); entries_.size() >= max_entries && it != entries_.end();)
+                it = it->second.resolving ? std::next(it) : entries_.erase(it);
+        }
+
+        boost::asio::thread_pool pool_;
+        std::mutex mutex_;
+        std::unordered_map<std::string, Entry> entries_;
+    };
+}
+
+#endif
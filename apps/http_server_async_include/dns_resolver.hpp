@@ -0,0 +1,680 @@
+#pragma once
+#ifndef SERVER_ASYNC_DNS_RESOLVER_HPP
+#define SERVER_ASYNC_DNS_RESOLVER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+// A DNS stub resolver on the io_context.
+//
+// getaddrinfo() blocks, so asio runs it on a background thread and a cache
+// miss costs a thread for the whole lookup. This resolver sends the queries
+// itself over UDP from the calling io thread: A and AAAA go out together, a
+// server that does not answer in time is retried and then the next one is
+// tried, and a truncated answer is asked again over TCP. Names come from
+// /etc/hosts first and the nameservers, search domains and timeouts from
+// /etc/resolv.conf, as for the system resolver. nsswitch.conf is not read:
+// sources other than files and dns need getaddrinfo, see dns_native().
+namespace server_async
+{
+    // Resolve cache misses with DnsResolver rather than getaddrinfo() when
+    // the port is numeric and resolv.conf names a nameserver.
+    // HttpServer::set_dns_resolver() changes it.
+    inline std::atomic<bool> &dns_native()
+    {
+        static std::atomic<bool> native{true};
+        return native;
+    }
+
+    // The parts of resolv.conf(5) a stub resolver uses.
+    struct DnsConfig
+    {
+        std::vector<boost::asio::ip::udp::endpoint> nameservers;
+        std::vector<std::string> search;
+        int ndots = 1;
+        std::chrono::milliseconds timeout{std::chrono::seconds(5)};
+        int attempts = 2;
+
+        static DnsConfig
+        parse(std::istream &in)
+        {
+            DnsConfig config;
+            std::string line;
+            while (std::getline(in, line))
+            {
+                line = line.substr(0, line.find_first_of("#;"));
+                std::istringstream words(line);
+                std::string key;
+                if (!(words >> key))
+                    continue;
+                if (key == "nameserver")
+                {
+                    std::string value;
+                    boost::system::error_code ec;
+                    // glibc uses the first three.
+                    if (words >> value && config.nameservers.size() < 3)
+                    {
+                        auto address = boost::asio::ip::make_address(value, ec);
+                        if (!ec)
+                            config.nameservers.emplace_back(address, 53);
+                    }
+                }
+                else if (key == "search" || key == "domain")
+                {
+                    // The last of either line wins.
+                    config.search.clear();
+                    for (std::string domain; words >> domain;)
+                        config.search.push_back(lower(domain));
+                }
+                else if (key == "options")
+                {
+                    for (std::string option; words >> option;)
+                    {
+                        auto colon = option.find(':');
+                        if (colon == std::string::npos)
+                            continue;
+                        int value = std::atoi(option.c_str() + colon + 1);
+                        std::string name = option.substr(0, colon);
+                        if (name == "ndots")
+                            config.ndots = std::clamp(value, 0, 15);
+                        else if (name == "timeout")
+                            config.timeout = std::chrono::seconds(std::clamp(value, 1, 30));
+                        else if (name == "attempts")
+                            config.attempts = std::clamp(value, 1, 5);
+                    }
+                }
+            }
+            return config;
+        }
+
+        static DnsConfig
+        load(std::string const &path = "/etc/resolv.conf")
+        {
+            std::ifstream in(path);
+            return parse(in);
+        }
+
+        static std::string
+        lower(std::string s)
+        {
+            for (char &c : s)
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            return s;
+        }
+    };
+
+    // Names and their addresses from hosts(5).
+    class HostsFile
+    {
+    public:
+        static HostsFile
+        parse(std::istream &in)
+        {
+            HostsFile hosts;
+            std::string line;
+            while (std::getline(in, line))
+            {
+                std::istringstream words(line.substr(0, line.find('#')));
+                std::string value;
+                boost::system::error_code ec;
+                if (!(words >> value))
+                    continue;
+                auto address = boost::asio::ip::make_address(value, ec);
+                if (ec)
+                    continue;
+                for (std::string name; words >> name;)
+                {
+                    auto &addresses = hosts.names_[DnsConfig::lower(name)];
+                    if (std::find(addresses.begin(), addresses.end(), address) == addresses.end())
+                        addresses.push_back(address);
+                }
+            }
+            return hosts;
+        }
+
+        static HostsFile
+        load(std::string const &path = "/etc/hosts")
+        {
+            std::ifstream in(path);
+            return parse(in);
+        }
+
+        // Addresses of `name`, lower case without a trailing dot.
+        std::vector<boost::asio::ip::address> const *
+        find(std::string const &name) const
+        {
+            auto it = names_.find(name);
+            return it == names_.end() ? nullptr : &it->second;
+        }
+
+    private:
+        std::unordered_map<std::string, std::vector<boost::asio::ip::address>> names_;
+    };
+
+    namespace dns
+    {
+        enum : std::uint16_t
+        {
+            type_a = 1,
+            type_cname = 5,
+            type_aaaa = 28,
+            class_in = 1
+        };
+
+        enum : unsigned
+        {
+            rcode_ok = 0,
+            rcode_servfail = 2,
+            rcode_nxdomain = 3
+        };
+
+        constexpr std::size_t header_size = 12;
+
+        // What a response says about one name and type.
+        struct Answer
+        {
+            unsigned rcode = rcode_ok;
+            bool truncated = false;
+            std::vector<boost::asio::ip::address> addresses;
+            std::uint32_t ttl = std::numeric_limits<std::uint32_t>::max();
+        };
+
+        // `name` in wire format, false if it is not a valid host name.
+        inline bool
+        encode_name(std::string_view name, std::vector<std::uint8_t> &out)
+        {
+            if (!name.empty() && name.back() == '.')
+                name.remove_suffix(1);
+            if (name.empty() || name.size() > 253)
+                return false;
+            while (!name.empty())
+            {
+                auto dot = std::min(name.find('.'), name.size());
+                if (dot == 0 || dot > 63)
+                    return false;
+                out.push_back(static_cast<std::uint8_t>(dot));
+                out.insert(out.end(), name.begin(), name.begin() + dot);
+                name.remove_prefix(std::min(dot + 1, name.size()));
+            }
+            out.push_back(0);
+            return true;
+        }
+
+        // A recursive query for `name` and `type`, empty if `name` is invalid.
+        inline std::vector<std::uint8_t>
+        make_query(std::uint16_t id, std::string_view name, std::uint16_t type)
+        {
+            std::vector<std::uint8_t> query = {
+                static_cast<std::uint8_t>(id >> 8), static_cast<std::uint8_t>(id),
+                0x01, 0x00, // RD
+                0, 1,       // one question
+                0, 0, 0, 0, 0, 0};
+            if (!encode_name(name, query))
+                return {};
+            query.insert(query.end(), {static_cast<std::uint8_t>(type >> 8), static_cast<std::uint8_t>(type), 0, class_in});
+            return query;
+        }
+
+        inline std::uint16_t
+        read16(std::uint8_t const *p)
+        {
+            return static_cast<std::uint16_t>(p[0] << 8 | p[1]);
+        }
+
+        // Moves `pos` past the (possibly compressed) name there.
+        inline bool
+        skip_name(std::uint8_t const *p, std::size_t n, std::size_t &pos)
+        {
+            for (int labels = 0; labels < 128; ++labels)
+            {
+                if (pos >= n)
+                    return false;
+                std::uint8_t len = p[pos];
+                if ((len & 0xC0) == 0xC0)
+                {
+                    pos += 2;
+                    return pos <= n;
+                }
+                if (len & 0xC0)
+                    return false;
+                pos += 1 + len;
+                if (len == 0)
+                    return pos <= n;
+            }
+            return false;
+        }
+
+        // Reads the response in `p` to `query`. False if it is not one:
+        // another ID or question, or malformed. The question is compared
+        // ignoring case, for servers that randomize it.
+        inline bool
+        parse_response(std::uint8_t const *p, std::size_t n, std::vector<std::uint8_t> const &query, Answer &out)
+        {
+            std::size_t question = query.size() - header_size;
+            if (n < header_size + question || p[0] != query[0] || p[1] != query[1] || !(p[2] & 0x80) || read16(p + 4) != 1)
+                return false;
+            for (std::size_t i = header_size; i < header_size + question; ++i)
+                if (std::tolower(p[i]) != std::tolower(query[i]))
+                    return false;
+            std::uint16_t type = read16(query.data() + query.size() - 4);
+            out = Answer{};
+            out.truncated = p[2] & 0x02;
+            out.rcode = p[3] & 0x0F;
+            std::size_t pos = header_size + question;
+            for (unsigned answers = read16(p + 6); answers > 0; --answers)
+            {
+                if (!skip_name(p, n, pos) || pos + 10 > n)
+                    return !out.addresses.empty() || out.truncated;
+                std::uint16_t rtype = read16(p + pos);
+                std::uint16_t rclass = read16(p + pos + 2);
+                std::uint32_t ttl = std::uint32_t(read16(p + pos + 4)) << 16 | read16(p + pos + 6);
+                std::uint16_t rdlength = read16(p + pos + 8);
+                pos += 10;
+                if (pos + rdlength > n)
+                    return !out.addresses.empty() || out.truncated;
+                // Records of the type asked for, at the end of whatever CNAME chain leads there.
+                if (rclass == class_in && rtype == type && type == type_a && rdlength == 4)
+                {
+                    boost::asio::ip::address_v4::bytes_type bytes;
+                    std::copy(p + pos, p + pos + 4, bytes.begin());
+                    out.addresses.push_back(boost::asio::ip::make_address_v4(bytes));
+                    out.ttl = std::min(out.ttl, ttl);
+                }
+                else if (rclass == class_in && rtype == type && type == type_aaaa && rdlength == 16)
+                {
+                    boost::asio::ip::address_v6::bytes_type bytes;
+                    std::copy(p + pos, p + pos + 16, bytes.begin());
+                    out.addresses.push_back(boost::asio::ip::make_address_v6(bytes));
+                    out.ttl = std::min(out.ttl, ttl);
+                }
+                else if (rclass == class_in && rtype == type_cname)
+                {
+                    out.ttl = std::min(out.ttl, ttl);
+                }
+                pos += rdlength;
+            }
+            return true;
+        }
+
+        inline std::uint16_t
+        random_id()
+        {
+            thread_local std::mt19937 engine{std::random_device{}()};
+            return static_cast<std::uint16_t>(engine());
+        }
+
+        // One name and type asked of the nameservers in turn, `attempts`
+        // rounds, each try from a new socket and so a new source port.
+        class query : public std::enable_shared_from_this<query>
+        {
+        public:
+            using Handler = std::function<void(boost::system::error_code, Answer)>;
+
+            query(boost::asio::any_io_executor ex, std::shared_ptr<DnsConfig const> config,
+                  std::string name, std::uint16_t type, Handler handler)
+                : config_(std::move(config)), name_(std::move(name)), type_(type), handler_(std::move(handler)),
+                  udp_(ex), tcp_(ex), timer_(ex)
+            {
+            }
+
+            // The io_context went away with the query in flight.
+            ~query()
+            {
+                if (handler_)
+                    std::exchange(handler_, nullptr)(boost::asio::error::operation_aborted, {});
+            }
+
+            void
+            start()
+            {
+                next();
+            }
+
+        private:
+            std::shared_ptr<DnsConfig const> config_;
+            std::string name_;
+            std::uint16_t type_;
+            Handler handler_;
+            boost::asio::ip::udp::socket udp_;
+            boost::asio::ip::tcp::socket tcp_;
+            boost::asio::steady_timer timer_;
+            boost::asio::ip::udp::endpoint server_;
+            boost::asio::ip::udp::endpoint sender_;
+            std::vector<std::uint8_t> query_;
+            std::vector<std::uint8_t> in_;
+            std::array<std::uint8_t, 2> length_{};
+            std::size_t tries_ = 0;
+            unsigned generation_ = 0; // handlers of an abandoned try see another value
+
+            // The next server, or the end of the last round.
+            void
+            next()
+            {
+                ++generation_;
+                boost::system::error_code ec;
+                udp_.close(ec);
+                tcp_.close(ec);
+                auto const &servers = config_->nameservers;
+                if (servers.empty() || tries_ >= servers.size() * static_cast<std::size_t>(config_->attempts))
+                    return finish(boost::asio::error::host_not_found_try_again, {});
+                server_ = servers[tries_++ % servers.size()];
+                query_ = make_query(random_id(), name_, type_);
+                if (query_.empty())
+                    return finish(boost::asio::error::host_not_found, {});
+                udp_.open(server_.protocol(), ec);
+                if (ec)
+                    return next();
+                arm_timer();
+                udp_.async_send_to(
+                    boost::asio::buffer(query_), server_,
+                    [self = shared_from_this(), gen = generation_](boost::system::error_code ec, std::size_t)
+                    {
+                        if (gen != self->generation_)
+                            return;
+                        if (ec)
+                            return self->next();
+                        self->receive();
+                    });
+            }
+
+            // Closing the sockets makes the pending operation fail and move on.
+            void
+            arm_timer()
+            {
+                timer_.expires_after(config_->timeout);
+                timer_.async_wait(
+                    [self = shared_from_this(), gen = generation_](boost::system::error_code ec)
+                    {
+                        if (ec || gen != self->generation_)
+                            return;
+                        self->udp_.close(ec);
+                        self->tcp_.close(ec);
+                    });
+            }
+
+            void
+            receive()
+            {
+                // Without EDNS a response over UDP is at most 512 bytes.
+                in_.resize(512);
+                udp_.async_receive_from(
+                    boost::asio::buffer(in_), sender_,
+                    [self = shared_from_this(), gen = generation_](boost::system::error_code ec, std::size_t n)
+                    {
+                        if (gen != self->generation_)
+                            return;
+                        if (ec)
+                            return self->next();
+                        // Datagrams from elsewhere or for another query are not the answer.
+                        Answer answer;
+                        if (self->sender_ != self->server_ || !parse_response(self->in_.data(), n, self->query_, answer))
+                            return self->receive();
+                        if (answer.truncated)
+                            return self->over_tcp();
+                        self->answered(std::move(answer));
+                    });
+            }
+
+            // The same question again over TCP, for the whole answer.
+            void
+            over_tcp()
+            {
+                boost::system::error_code ec;
+                udp_.close(ec);
+                arm_timer();
+                query_.insert(query_.begin(), {static_cast<std::uint8_t>(query_.size() >> 8), static_cast<std::uint8_t>(query_.size())});
+                tcp_.async_connect(
+                    {server_.address(), server_.port()},
+                    [self = shared_from_this(), gen = generation_](boost::system::error_code ec)
+                    {
+                        if (gen != self->generation_)
+                            return;
+                        if (ec)
+                            return self->next();
+                        boost::asio::async_write(
+                            self->tcp_, boost::asio::buffer(self->query_),
+                            [self, gen](boost::system::error_code ec, std::size_t)
+                            {
+                                if (gen != self->generation_)
+                                    return;
+                                if (ec)
+                                    return self->next();
+                                self->query_.erase(self->query_.begin(), self->query_.begin() + 2);
+                                self->read_tcp();
+                            });
+                    });
+            }
+
+            void
+            read_tcp()
+            {
+                boost::asio::async_read(
+                    tcp_, boost::asio::buffer(length_),
+                    [self = shared_from_this(), gen = generation_](boost::system::error_code ec, std::size_t)
+                    {
+                        if (gen != self->generation_)
+                            return;
+                        if (ec)
+                            return self->next();
+                        self->in_.resize(read16(self->length_.data()));
+                        boost::asio::async_read(
+                            self->tcp_, boost::asio::buffer(self->in_),
+                            [self, gen](boost::system::error_code ec, std::size_t n)
+                            {
+                                if (gen != self->generation_)
+                                    return;
+                                Answer answer;
+                                if (ec || !parse_response(self->in_.data(), n, self->query_, answer) || answer.truncated)
+                                    return self->next();
+                                self->answered(std::move(answer));
+                            });
+                    });
+            }
+
+            // NXDOMAIN and NODATA are answers; a failing server is skipped.
+            void
+            answered(Answer answer)
+            {
+                if (answer.rcode != rcode_ok && answer.rcode != rcode_nxdomain)
+                    return next();
+                finish({}, std::move(answer));
+            }
+
+            void
+            finish(boost::system::error_code ec, Answer answer)
+            {
+                ++generation_;
+                timer_.cancel();
+                boost::system::error_code ignored;
+                udp_.close(ignored);
+                tcp_.close(ignored);
+                std::exchange(handler_, nullptr)(ec, std::move(answer));
+            }
+        };
+
+        // A and AAAA of each name the search list makes of the host, until one has addresses.
+        class lookup : public std::enable_shared_from_this<lookup>
+        {
+        public:
+            using Handler = std::function<void(boost::system::error_code, std::vector<boost::asio::ip::address>, std::chrono::seconds)>;
+
+            lookup(boost::asio::any_io_executor ex, std::shared_ptr<DnsConfig const> config,
+                   std::vector<std::string> names, Handler handler)
+                : ex_(std::move(ex)), config_(std::move(config)), names_(std::move(names)), handler_(std::move(handler))
+            {
+            }
+
+            ~lookup()
+            {
+                if (handler_)
+                    std::exchange(handler_, nullptr)(boost::asio::error::operation_aborted, {}, {});
+            }
+
+            void
+            start()
+            {
+                next_name();
+            }
+
+        private:
+            boost::asio::any_io_executor ex_;
+            std::shared_ptr<DnsConfig const> config_;
+            std::vector<std::string> names_;
+            Handler handler_;
+            std::size_t name_ = 0;
+            int pending_ = 0;
+            std::array<boost::system::error_code, 2> ec_;
+            std::array<Answer, 2> answers_;
+
+            void
+            next_name()
+            {
+                if (name_ >= names_.size())
+                    return finish(boost::asio::error::host_not_found, {}, {});
+                std::string const &name = names_[name_++];
+                pending_ = 2;
+                std::uint16_t const types[2] = {type_a, type_aaaa};
+                for (std::size_t i = 0; i < 2; ++i)
+                    std::make_shared<query>(
+                        ex_, config_, name, types[i],
+                        [self = shared_from_this(), i](boost::system::error_code ec, Answer answer)
+                        {
+                            self->ec_[i] = ec;
+                            self->answers_[i] = std::move(answer);
+                            if (--self->pending_ == 0)
+                                self->on_answers();
+                        })
+                        ->start();
+            }
+
+            // IPv6 first, the family RFC 8305 section 4 has HappyEyeballs
+            // start with. It falls back to IPv4 as soon as IPv6 fails.
+            void
+            on_answers()
+            {
+                std::vector<boost::asio::ip::address> addresses;
+                std::uint32_t ttl = std::numeric_limits<std::uint32_t>::max();
+                for (std::size_t i : {1, 0})
+                {
+                    if (ec_[i] || answers_[i].addresses.empty())
+                        continue;
+                    addresses.insert(addresses.end(), answers_[i].addresses.begin(), answers_[i].addresses.end());
+                    ttl = std::min(ttl, answers_[i].ttl);
+                }
+                if (!addresses.empty())
+                    return finish({}, std::move(addresses), std::chrono::seconds(ttl));
+                // A server that did not answer stops the search, as in glibc.
+                for (auto const &ec : ec_)
+                    if (ec)
+                        return finish(ec, {}, {});
+                next_name();
+            }
+
+            void
+            finish(boost::system::error_code ec, std::vector<boost::asio::ip::address> addresses, std::chrono::seconds ttl)
+            {
+                std::exchange(handler_, nullptr)(ec, std::move(addresses), ttl);
+            }
+        };
+    }
+
+    class DnsResolver
+    {
+    public:
+        using Addresses = std::vector<boost::asio::ip::address>;
+
+        DnsResolver(DnsConfig config, HostsFile hosts)
+            : config_(std::make_shared<DnsConfig const>(std::move(config))), hosts_(std::move(hosts))
+        {
+        }
+
+        // The system's configuration, read on first use.
+        static DnsResolver &
+        system()
+        {
+            static DnsResolver resolver{DnsConfig::load(), HostsFile::load()};
+            return resolver;
+        }
+
+        bool
+        usable() const
+        {
+            return !config_->nameservers.empty();
+        }
+
+        DnsConfig const &
+        config() const
+        {
+            return *config_;
+        }
+
+        // Calls handler(error_code, Addresses, std::chrono::seconds ttl) on
+        // `ex`, never from within this call. Names from hosts(5) come with
+        // the largest TTL, the caller's cap applies.
+        template <class Handler>
+        void
+        async_resolve(boost::asio::any_io_executor ex, std::string const &host, Handler &&handler)
+        {
+            std::string name = DnsConfig::lower(host);
+            if (!name.empty() && name.back() == '.')
+                name.pop_back();
+            if (auto addresses = hosts_.find(name))
+            {
+                boost::asio::post(ex, [handler = std::forward<Handler>(handler), addresses = *addresses]() mutable
+                                  { handler(boost::system::error_code{}, std::move(addresses), std::chrono::seconds::max()); });
+                return;
+            }
+            std::make_shared<dns::lookup>(std::move(ex), config_, candidates(host), std::forward<Handler>(handler))->start();
+        }
+
+        // The names res_search() would try for `host`, in order.
+        std::vector<std::string>
+        candidates(std::string const &host) const
+        {
+            std::string name = DnsConfig::lower(host);
+            if (!name.empty() && name.back() == '.')
+                return {name};
+            std::vector<std::string> names;
+            bool absolute_first = std::count(name.begin(), name.end(), '.') >= config_->ndots;
+            if (absolute_first)
+                names.push_back(name);
+            for (auto const &domain : config_->search)
+                names.push_back(name + "." + domain);
+            if (!absolute_first)
+                names.push_back(name);
+            return names;
+        }
+
+    private:
+        std::shared_ptr<DnsConfig const> config_;
+        HostsFile hosts_;
+    };
+}
+
+#endif
@@ -6,20 +6,25 @@
 #include <boost/beast/http.hpp>
 #include "http_handler_util.hpp"
 #include "http_handler.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "session_registry.hpp"
 
 namespace server_async
 {
 
+    // Answers synchronously, so it lives on the caller's stack and only
+    // refers to the request held by the session's parser.
     template <typename SessionType>
-    class FileRequestHandler : public RequestHandlerbase<SessionType, EmptyBodyRequest>
+    class FileRequestHandler : public RequestHandlerbase<SessionType, EmptyBodyRequest const &>
     {
     public:
         FileRequestHandler(std::shared_ptr<SessionType> session, const std::string &doc_root, EmptyBodyParser &req0)
-            : RequestHandlerbase<SessionType, EmptyBodyRequest>(std::move(session), req0.get()), doc_root(doc_root)
+            : RequestHandlerbase<SessionType, EmptyBodyRequest const &>(std::move(session), req0.get()), doc_root(doc_root)
         {
         }
 
-        void handle_request() override
+        void handle_request()
         {
             // Make sure we can handle the method
 
@@ -41,12 +46,14 @@ namespace server_async
             // Attempt to open the file
             beast::error_code ec;
             http::file_body::value_type body;
+            auto open_start = std::chrono::steady_clock::now();
             body.open(path.c_str(), beast::file_mode::scan, ec);
+            this->session->timings().open += std::chrono::steady_clock::now() - open_start;
 
             // Handle the case where the file doesn't exist
             if (ec == beast::errc::no_such_file_or_directory)
             {
-                std::cerr << "File not found: " << doc_root << "/" << path << std::endl;
+                SA_LOG_WARN("File not found: " << doc_root << "/" << path);
                 return this->session->queue_write(this->not_found(this->req0.target()));
             }
 
@@ -100,14 +107,14 @@ namespace server_async
         // curl -v  -X POST -T learn.md http://localhost:8080/upload/data //100-continue
         // curl -v -X POST -H "Content-Type: application/octet-stream" --data-binary "@learn.md" http://localhost:8080/upload/data
         // ebr[http::field::content_type] == "application/x-www-form-urlencoded" &&
-        void handle_request() override
+        void handle_request()
         {
             http::file_body::value_type body;
             beast::error_code ec;
             body.open("upload_tmp_file", beast::file_mode::write, ec);
             if (ec)
             {
-                std::cerr << "Error: " << ec.message() << std::endl;
+                SA_LOG_ERROR("Error: " << ec.message());
                 this->session->do_eof();
                 return;
             }
@@ -117,16 +124,20 @@ namespace server_async
             // https://www.boost.org/doc/libs/1_86_0/libs/beast/doc/html/beast/concepts/Body.html
             // http::request_parser<http::file_body> new_parser{std::move(ep)};
             new_parser.get().body() = std::move(body);
-            std::cout << "buffer size: " << this->session->buffer_.size() << std::endl;
-            std::cout << "request: " << new_parser.get().base() << std::endl;
+            SA_LOG_DEBUG("buffer size: " << this->session->buffer_.size());
+            SA_LOG_DEBUG("request: " << new_parser.get().base());
             // https://www.boost.org/doc/libs/1_86_0/libs/beast/doc/html/beast/ref/boost__beast__http__async_read/overload1.html
-            http::async_read(
-                this->session->stream(),
-                this->session->buffer_,
-                new_parser,
-                beast::bind_front_handler(
-                    &FileUploadHandler::on_read,
-                    this->shared_from_this()));
+            this->session->visit_stream(
+                [this](auto &stream)
+                {
+                    http::async_read(
+                        stream,
+                        this->session->buffer_,
+                        new_parser,
+                        beast::bind_front_handler(
+                            &FileUploadHandler::on_read,
+                            this->shared_from_this()));
+                });
             // [self = this->shared_from_this(), nsession = this->session->shared_from_this()](beast::error_code ec, std::size_t bytes_transferred)
             // {
             //     boost::ignore_unused(bytes_transferred);
@@ -146,20 +157,22 @@ namespace server_async
 
         void on_read(beast::error_code ec, std::size_t bytes_transferred)
         {
-            boost::ignore_unused(bytes_transferred);
             if (ec)
             {
-                std::cerr << "Error: " << ec.message() << std::endl;
+                SA_LOG_ERROR("Error: " << ec.message());
                 return;
             }
+            Metrics::instance().add_bytes_in(static_cast<std::size_t>(SessionKind::http), bytes_transferred);
             bool keep_alive = new_parser.get()[http::field::connection] == "keep-alive";
 
-            std::cout << "keep alive: " << keep_alive << std::endl;
+            SA_LOG_DEBUG("keep alive: " << keep_alive);
             http::response<http::empty_body> res{http::status::ok, new_parser.get().version()};
             res.keep_alive(keep_alive);
+            // Content-Length: 0, otherwise a keep-alive client reads until the connection closes.
+            res.prepare_payload();
             this->session->queue_write(std::move(res));
             this->session->continue_read_if_needed();
-            std::cout << "Handling file upload..." << std::endl;
+            SA_LOG_DEBUG("Handling file upload...");
         }
 
     private:
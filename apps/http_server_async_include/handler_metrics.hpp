@@ -0,0 +1,44 @@
+#pragma once
+#ifndef HANDLER_METRICS_H
+#define HANDLER_METRICS_H
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include "http_handler_util.hpp"
+#include "http_handler.hpp"
+#include "metrics.hpp"
+
+namespace server_async
+{
+
+    // Serves the merged metrics in Prometheus text format.
+    // Synchronous like FileRequestHandler, so it lives on the caller's stack.
+    template <typename SessionType>
+    class MetricsRequestHandler : public RequestHandlerbase<SessionType, EmptyBodyRequest const &>
+    {
+    public:
+        MetricsRequestHandler(std::shared_ptr<SessionType> session, EmptyBodyParser &req0)
+            : RequestHandlerbase<SessionType, EmptyBodyRequest const &>(std::move(session), req0.get())
+        {
+        }
+
+        void handle_request()
+        {
+            if (this->req0.method() != http::verb::get &&
+                this->req0.method() != http::verb::head)
+                return this->session->queue_write(this->bad_request("Unknown HTTP-method"));
+
+            http::response<http::string_body> res{http::status::ok, this->req0.version()};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, "text/plain; version=0.0.4");
+            res.set(http::field::cache_control, "no-store");
+            res.keep_alive(this->req0.keep_alive());
+            if (this->req0.method() == http::verb::get)
+                res.body() = Metrics::instance().render();
+            res.prepare_payload();
+            return this->session->queue_write(std::move(res));
+        }
+    };
+}
+
+#endif
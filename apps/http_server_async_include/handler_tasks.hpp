@@ -6,20 +6,26 @@
 #include <boost/beast/http.hpp>
 #include "http_handler_util.hpp"
 #include "http_handler.hpp"
+#include "logger.hpp"
+#include "router.hpp"
 
 namespace server_async
 {
 
     template <typename SessionType>
-    class TaskRequestHandler : public RequestHandlerbase<SessionType, EmptyBodyRequest>
+    class TaskRequestHandler : public RequestHandlerbase<SessionType, EmptyBodyRequest const &>
     {
     public:
-        TaskRequestHandler(std::shared_ptr<SessionType> session, const std::string &doc_root, EmptyBodyParser &req0)
-            : RequestHandlerbase<SessionType, EmptyBodyRequest>(std::move(session), req0.get()), doc_root(doc_root)
+        // `params` is what the /tasks route captured: "t_uuid" and, below
+        // it, the wildcard. Its views point into the request target.
+        TaskRequestHandler(std::shared_ptr<SessionType> session, const std::string &doc_root, EmptyBodyParser &req0,
+                           RouteParams const &params)
+            : RequestHandlerbase<SessionType, EmptyBodyRequest const &>(std::move(session), req0.get()), doc_root(doc_root),
+              params(params)
         {
         }
 
-        void handle_request() override
+        void handle_request()
         {
             // Make sure we can handle the method
 
@@ -27,6 +33,8 @@ namespace server_async
                 this->req0.method() != http::verb::head)
                 return this->session->queue_write(this->bad_request("Unknown HTTP-method"));
 
+            SA_LOG_DEBUG("task: " << params.get("t_uuid") << ", action: " << params.wildcard);
+
             // Request path must be absolute and not contain "..".
             if (this->req0.target().empty() ||
                 this->req0.target()[0] != '/' ||
@@ -41,12 +49,14 @@ namespace server_async
             // Attempt to open the file
             beast::error_code ec;
             http::file_body::value_type body;
+            auto open_start = std::chrono::steady_clock::now();
             body.open(path.c_str(), beast::file_mode::scan, ec);
+            this->session->timings().open += std::chrono::steady_clock::now() - open_start;
 
             // Handle the case where the file doesn't exist
             if (ec == beast::errc::no_such_file_or_directory)
             {
-                std::cerr << "File not found: " << doc_root << "/" << path << std::endl;
+                SA_LOG_WARN("File not found: " << doc_root << "/" << path);
                 return this->session->queue_write(this->not_found(this->req0.target()));
             }
 
@@ -82,6 +92,7 @@ namespace server_async
 
     private:
         const std::string &doc_root;
+        RouteParams const &params;
     };
 
 }
@@ -0,0 +1,204 @@
+#pragma once
+#ifndef SERVER_ASYNC_HAPPY_EYEBALLS_HPP
+#define SERVER_ASYNC_HAPPY_EYEBALLS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/error.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "metrics.hpp"
+
+// Upstream connects after RFC 8305 (Happy Eyeballs v2).
+//
+// asio::async_connect() tries resolved endpoints one after the other, so an
+// address that swallows SYNs, typically a broken IPv6 path, costs the whole
+// kernel connect timeout before the next one is tried. The connector
+// alternates the address families and starts the next attempt as soon as
+// one fails or once the attempt delay has passed, leaving the earlier ones
+// running. The first connection wins and the rest are closed.
+namespace server_async
+{
+    // The Connection Attempt Delay of RFC 8305, which recommends 250 ms and
+    // no less than 100 ms. HttpServer::set_connect_attempt_delay() changes it.
+    inline std::atomic<std::int64_t> &connect_attempt_delay_ms()
+    {
+        static std::atomic<std::int64_t> delay{250};
+        return delay;
+    }
+
+    class HappyEyeballs : public std::enable_shared_from_this<HappyEyeballs>
+    {
+    public:
+        using tcp = boost::asio::ip::tcp;
+        using Endpoints = std::vector<tcp::endpoint>;
+        using Handler = std::function<void(boost::system::error_code, tcp::endpoint)>;
+        using duration = std::chrono::steady_clock::duration;
+
+        // Connects `socket` to one of `endpoints` and calls
+        // handler(error_code, endpoint) once on the socket's executor, never
+        // from within this call. The socket must outlive the operation,
+        // which the handler usually guarantees by holding its owner. After
+        // `timeout` every attempt is given up with error::timed_out. The
+        // returned connector can cancel() the operation while it runs.
+        template <class ConnectHandler>
+        static std::weak_ptr<HappyEyeballs>
+        async_connect(tcp::socket &socket, Endpoints const &endpoints, ConnectHandler &&handler, duration timeout = duration::max())
+        {
+            auto connector = std::make_shared<HappyEyeballs>(socket, interleave(endpoints), Handler(std::forward<ConnectHandler>(handler)), timeout);
+            connector->start();
+            return connector;
+        }
+
+        // The order attempts are made in: the families alternate, starting
+        // with the one the resolver put first, each keeping its own order.
+        // That is the RFC 6724 order of getaddrinfo(), or IPv6 first from
+        // DnsResolver, as RFC 8305 section 4 prefers without a sorted list.
+        static Endpoints
+        interleave(Endpoints const &endpoints)
+        {
+            Endpoints first, second, out;
+            for (auto const &endpoint : endpoints)
+                (endpoint.protocol() == endpoints.front().protocol() ? first : second).push_back(endpoint);
+            for (std::size_t i = 0; i < first.size() || i < second.size(); ++i)
+            {
+                if (i < first.size())
+                    out.push_back(first[i]);
+                if (i < second.size())
+                    out.push_back(second[i]);
+            }
+            return out;
+        }
+
+        HappyEyeballs(tcp::socket &socket, Endpoints endpoints, Handler handler, duration timeout)
+            : target_(socket),
+              endpoints_(std::move(endpoints)),
+              handler_(std::move(handler)),
+              timeout_(timeout),
+              delay_(socket.get_executor()),
+              deadline_(socket.get_executor())
+        {
+            // In-flight attempts refer to their sockets, which must not move.
+            attempts_.reserve(endpoints_.size());
+        }
+
+        // Closes every attempt, so none is moved into the socket any more.
+        // The handler gets error::operation_aborted, never from within this
+        // call. Runs on the socket's executor.
+        void
+        cancel()
+        {
+            if (!done_)
+                finish(boost::asio::error::operation_aborted, endpoints_.size(), true);
+        }
+
+    private:
+        void
+        start()
+        {
+            if (endpoints_.empty())
+            {
+                done_ = true;
+                boost::asio::post(target_.get_executor(), [handler = std::move(handler_)]
+                                  { handler(boost::asio::error::host_not_found, tcp::endpoint{}); });
+                return;
+            }
+            if (timeout_ != duration::max())
+            {
+                deadline_.expires_after(timeout_);
+                deadline_.async_wait([self = shared_from_this()](boost::system::error_code ec)
+                                     {
+                                         if (!ec && !self->done_)
+                                             self->finish(boost::asio::error::timed_out, self->endpoints_.size());
+                                     });
+            }
+            attempt();
+        }
+
+        void
+        attempt()
+        {
+            std::size_t i = next_++;
+            attempts_.emplace_back(target_.get_executor());
+            ++pending_;
+            attempts_[i].async_connect(endpoints_[i], [self = shared_from_this(), i](boost::system::error_code ec)
+                                       { self->connected(i, ec); });
+            if (next_ == endpoints_.size())
+                return;
+            delay_.expires_after(std::chrono::milliseconds(connect_attempt_delay_ms().load(std::memory_order_relaxed)));
+            delay_.async_wait([self = shared_from_this(), armed = next_](boost::system::error_code ec)
+                              {
+                                  // A failed attempt may have started this one already.
+                                  if (!ec && !self->done_ && self->next_ == armed)
+                                      self->attempt();
+                              });
+        }
+
+        void
+        connected(std::size_t i, boost::system::error_code ec)
+        {
+            --pending_;
+            if (done_)
+                return;
+            if (!ec)
+                return finish(ec, i);
+            Metrics::instance().connect_attempt(Metrics::ConnectAttempt::failed);
+            error_ = ec;
+            if (next_ < endpoints_.size())
+                attempt();
+            else if (pending_ == 0)
+                finish(error_, endpoints_.size());
+        }
+
+        void
+        finish(boost::system::error_code ec, std::size_t winner, bool defer = false)
+        {
+            done_ = true;
+            delay_.cancel();
+            deadline_.cancel();
+            for (std::size_t i = 0; i < attempts_.size(); ++i)
+            {
+                if (i == winner)
+                    continue;
+                boost::system::error_code ignored;
+                attempts_[i].close(ignored);
+            }
+            for (std::size_t i = 0; i < pending_; ++i)
+                Metrics::instance().connect_attempt(Metrics::ConnectAttempt::cancelled);
+            tcp::endpoint endpoint;
+            if (winner < attempts_.size())
+            {
+                Metrics::instance().connect_attempt(Metrics::ConnectAttempt::won);
+                target_ = std::move(attempts_[winner]);
+                endpoint = endpoints_[winner];
+            }
+            auto handler = std::move(handler_);
+            if (defer)
+                return boost::asio::post(target_.get_executor(), [handler = std::move(handler), ec, endpoint]
+                                         { handler(ec, endpoint); });
+            handler(ec, endpoint);
+        }
+
+        tcp::socket &target_;
+        Endpoints endpoints_;
+        Handler handler_;
+        duration timeout_;
+        boost::asio::steady_timer delay_;
+        boost::asio::steady_timer deadline_;
+        std::vector<tcp::socket> attempts_;
+        std::size_t next_ = 0;    // endpoint of the next attempt
+        std::size_t pending_ = 0; // attempts still connecting
+        bool done_ = false;
+        boost::system::error_code error_;
+    };
+}
+
+#endif
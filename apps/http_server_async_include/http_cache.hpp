@@ -0,0 +1,1006 @@
+#pragma once
+#ifndef SERVER_ASYNC_HTTP_CACHE_HPP
+#define SERVER_ASYNC_HTTP_CACHE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/parser.hpp>
+#include <boost/beast/http/rfc7230.hpp>
+#include <boost/beast/http/write.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "logger.hpp"
+#include "metrics.hpp"
+
+// Shared HTTP cache of the forward proxy, RFC 9111.
+//
+// Responses to GET are kept per URL and, when they carry Vary, per value
+// of the request fields they vary on. Small bodies live in memory, larger
+// ones in files of a directory listed by an mmap'd index, so lookups and
+// LRU bookkeeping never touch the file system and the disk tier survives a
+// restart. A stale response with a validator is revalidated with the
+// origin and served again after a 304.
+namespace server_async
+{
+    struct HttpCacheOptions
+    {
+        // Bytes of bodies kept in memory, 0 keeps none there.
+        std::uint64_t memory_bytes = 64ull << 20;
+        // Bodies up to this size are kept in memory, larger ones on disk.
+        std::uint64_t memory_object_max = 256ull << 10;
+        // Directory of the disk tier, empty for none. One process per directory.
+        std::string disk_dir;
+        // Bytes of bodies kept on disk; one body may take an eighth.
+        std::uint64_t disk_bytes = 1ull << 30;
+        // Responses the disk index has room for.
+        std::size_t disk_slots = 16384;
+    };
+
+    // Seconds since the epoch of an HTTP-date in any of its three formats.
+    inline std::optional<std::int64_t> parse_http_date(boost::beast::string_view value)
+    {
+#ifndef _WIN32
+        std::string text(value);
+        for (char const *format : {"%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %d %H:%M:%S %Y"})
+        {
+            std::tm tm{};
+            char const *end = strptime(text.c_str(), format, &tm);
+            if (end && *end == '\0')
+                return static_cast<std::int64_t>(timegm(&tm));
+        }
+#endif
+        return std::nullopt;
+    }
+
+    // The Cache-Control directives of a request or response that a shared cache acts on.
+    struct CacheControl
+    {
+        bool no_store = false;
+        bool no_cache = false;
+        bool is_private = false;
+        bool is_public = false;
+        bool must_revalidate = false;
+        bool only_if_cached = false;
+        std::optional<std::int64_t> max_age;
+        std::optional<std::int64_t> s_maxage;
+        std::optional<std::int64_t> min_fresh;
+        std::optional<std::int64_t> max_stale; // max() for max-stale without a value
+
+        template <bool isRequest, class Fields>
+        static CacheControl
+        parse(boost::beast::http::header<isRequest, Fields> const &h)
+        {
+            namespace http = boost::beast::http;
+            CacheControl cc;
+            auto range = h.equal_range(http::field::cache_control);
+            for (auto it = range.first; it != range.second; ++it)
+                cc.parse_directives(it->value());
+            // HTTP/1.0 caches only know the pragma.
+            if (isRequest && range.first == range.second)
+                for (auto const &token : http::token_list{h[http::field::pragma]})
+                    if (boost::beast::iequals(token, "no-cache"))
+                        cc.no_cache = true;
+            return cc;
+        }
+
+    private:
+        // Directives are comma separated name[=value], the value possibly
+        // quoted; private and no-cache with a field list count as unqualified.
+        void
+        parse_directives(boost::beast::string_view value)
+        {
+            std::size_t i = 0;
+            while (i < value.size())
+            {
+                std::size_t end = i;
+                bool quoted = false;
+                for (; end < value.size() && (quoted || value[end] != ','); ++end)
+                    if (value[end] == '"')
+                        quoted = !quoted;
+                directive(value.substr(i, end - i));
+                i = end + 1;
+            }
+        }
+
+        void
+        directive(boost::beast::string_view d)
+        {
+            auto trim = [](boost::beast::string_view s)
+            {
+                while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+                    s.remove_prefix(1);
+                while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+                    s.remove_suffix(1);
+                return s;
+            };
+            auto eq = d.find('=');
+            auto name = trim(d.substr(0, eq));
+            auto arg = eq == boost::beast::string_view::npos ? boost::beast::string_view{} : trim(d.substr(eq + 1));
+            if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"')
+                arg = arg.substr(1, arg.size() - 2);
+            // An invalid number makes the response stale rather than fresh forever.
+            auto seconds = [&]() -> std::int64_t
+            {
+                std::int64_t n = 0;
+                if (arg.empty())
+                    return 0;
+                for (char c : arg)
+                {
+                    if (c < '0' || c > '9')
+                        return 0;
+                    n = std::min<std::int64_t>(n * 10 + (c - '0'), std::int64_t(1) << 31);
+                }
+                return n;
+            };
+            using boost::beast::iequals;
+            if (iequals(name, "no-store"))
+                no_store = true;
+            else if (iequals(name, "no-cache"))
+                no_cache = true;
+            else if (iequals(name, "private"))
+                is_private = true;
+            else if (iequals(name, "public"))
+                is_public = true;
+            else if (iequals(name, "must-revalidate") || iequals(name, "proxy-revalidate"))
+                must_revalidate = true;
+            else if (iequals(name, "only-if-cached"))
+                only_if_cached = true;
+            else if (iequals(name, "max-age"))
+                max_age = seconds();
+            else if (iequals(name, "s-maxage"))
+                s_maxage = seconds();
+            else if (iequals(name, "min-fresh"))
+                min_fresh = seconds();
+            else if (iequals(name, "max-stale"))
+                max_stale = arg.empty() ? std::numeric_limits<std::int64_t>::max() : seconds();
+        }
+    };
+
+    // How long a response is fresh for a shared cache, RFC 9111 section 4.2.1.
+    // Without explicit freshness, a tenth of the time since Last-Modified, up
+    // to a day, for statuses that allow a heuristic (section 4.2.2).
+    inline std::int64_t
+    freshness_lifetime(boost::beast::http::response_header<> const &h, std::int64_t response_time)
+    {
+        namespace http = boost::beast::http;
+        auto cc = CacheControl::parse(h);
+        if (cc.s_maxage)
+            return *cc.s_maxage;
+        if (cc.max_age)
+            return *cc.max_age;
+        auto date = parse_http_date(h[http::field::date]).value_or(response_time);
+        if (h.count(http::field::expires))
+        {
+            auto expires = parse_http_date(h[http::field::expires]);
+            return expires ? std::max<std::int64_t>(0, *expires - date) : 0;
+        }
+        switch (h.result_int())
+        {
+        case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            break;
+        default:
+            if (!cc.is_public)
+                return 0;
+        }
+        auto last_modified = parse_http_date(h[http::field::last_modified]);
+        if (!last_modified)
+            return 0;
+        return std::clamp<std::int64_t>((date - *last_modified) / 10, 0, 86400);
+    }
+
+    // The response's age when it arrived, RFC 9111 section 4.2.3.
+    inline std::int64_t
+    initial_age(boost::beast::http::response_header<> const &h, std::int64_t request_time, std::int64_t response_time)
+    {
+        namespace http = boost::beast::http;
+        std::int64_t age_value = 0;
+        auto age = h[http::field::age];
+        if (!age.empty() && std::all_of(age.begin(), age.end(), [](char c)
+                                        { return c >= '0' && c <= '9'; }))
+            age_value = std::stoll(std::string(age.substr(0, 10)));
+        auto date = parse_http_date(h[http::field::date]).value_or(response_time);
+        std::int64_t apparent_age = std::max<std::int64_t>(0, response_time - date);
+        std::int64_t corrected_age_value = age_value + std::max<std::int64_t>(0, response_time - request_time);
+        return std::max(apparent_age, corrected_age_value);
+    }
+
+    // May a shared cache store `res` to `req`, RFC 9111 section 3.
+    inline bool
+    storable(boost::beast::http::request_header<> const &req, boost::beast::http::response_header<> const &res)
+    {
+        namespace http = boost::beast::http;
+        if (req.method() != http::verb::get)
+            return false;
+        auto req_cc = CacheControl::parse(req);
+        auto res_cc = CacheControl::parse(res);
+        if (req_cc.no_store || res_cc.no_store || res_cc.is_private)
+            return false;
+        // Partial content and responses to conditional requests are not the resource.
+        int status = res.result_int();
+        if (status < 200 || status == 206 || status == 304)
+            return false;
+        for (auto const &token : http::token_list{res[http::field::vary]})
+            if (token == "*")
+                return false;
+        bool explicit_freshness = res_cc.max_age || res_cc.s_maxage || res.count(http::field::expires);
+        if (req.count(http::field::authorization) && !(res_cc.is_public || res_cc.s_maxage || res_cc.must_revalidate))
+            return false;
+        // Cookies are someone's session, even where the RFC would allow them.
+        if (res.count(http::field::set_cookie) && !res_cc.is_public)
+            return false;
+        return explicit_freshness || res_cc.is_public || res.count(http::field::last_modified) || res.count(http::field::etag);
+    }
+
+    // One stored response. Entries are immutable once published, a refresh replaces them.
+    struct CacheEntry
+    {
+        std::string key;
+        // The request fields the response varies on, lower case, and their values.
+        std::vector<std::pair<std::string, std::string>> vary;
+        // End-to-end fields, the framing is added when it is served.
+        boost::beast::http::response_header<> header;
+        std::int64_t response_time = 0;
+        std::int64_t initial_age = 0;
+        std::int64_t lifetime = 0;
+        std::uint64_t size = 0;
+        // The body, in memory or in the file `path`.
+        std::shared_ptr<std::string const> body;
+        std::string path;
+
+        std::int64_t
+        age(std::int64_t now) const
+        {
+            return initial_age + std::max<std::int64_t>(0, now - response_time);
+        }
+
+        bool
+        has_validator() const
+        {
+            return header.count(boost::beast::http::field::etag) || header.count(boost::beast::http::field::last_modified);
+        }
+    };
+
+    class HttpCache
+    {
+    public:
+        struct Lookup
+        {
+            std::shared_ptr<CacheEntry const> entry;
+            bool fresh = false;
+        };
+
+        // Request fields, lower case, and their values.
+        using Vary = std::vector<std::pair<std::string, std::string>>;
+
+        class Writer;
+
+        // Disabled until HttpServer::set_http_cache() configures it.
+        static HttpCache &
+        instance()
+        {
+            static HttpCache cache;
+            return cache;
+        }
+
+        HttpCache() = default;
+
+        explicit HttpCache(HttpCacheOptions options)
+        {
+            configure(std::move(options));
+        }
+
+        HttpCache(const HttpCache &) = delete;
+        HttpCache &operator=(const HttpCache &) = delete;
+
+        ~HttpCache()
+        {
+            close_disk();
+        }
+
+        // The key of a URL: the host in lower case and the port spelled out.
+        static std::string
+        key(boost::beast::string_view host, boost::beast::string_view port, boost::beast::string_view target)
+        {
+            return "http://" + lower(host) + ":" + std::string(port) + std::string(target);
+        }
+
+        // The request fields `res` varies on, with their values in `req`.
+        static Vary
+        vary_of(boost::beast::http::request_header<> const &req, boost::beast::http::response_header<> const &res)
+        {
+            namespace http = boost::beast::http;
+            Vary vary;
+            for (auto const &token : http::token_list{res[http::field::vary]})
+            {
+                auto name = lower(token);
+                vary.emplace_back(name, field_values(req, name));
+            }
+            return vary;
+        }
+
+        // `key` narrowed to the values `req` has for the fields of `vary`.
+        static std::string
+        variant_key(std::string const &key, Vary const &vary, boost::beast::http::request_header<> const &req)
+        {
+            std::string out = key;
+            for (auto const &field : vary)
+                out += "\n" + field.first + ": " + field_values(req, field.first);
+            return out;
+        }
+
+        // Whether `req` has the values of `vary`.
+        static bool
+        matches(Vary const &vary, boost::beast::http::request_header<> const &req)
+        {
+            for (auto const &[name, value] : vary)
+                if (field_values(req, name) != value)
+                    return false;
+            return true;
+        }
+
+        static std::int64_t
+        now()
+        {
+            return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        // Starts over with `options`, picking up what the disk tier stored before.
+        void
+        configure(HttpCacheOptions options)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            close_disk();
+            entries_.clear();
+            memory_lru_.clear();
+            disk_lru_.clear();
+            free_slots_.clear();
+            memory_used_ = disk_used_ = uses_ = 0;
+            ++generation_;
+            options_ = std::move(options);
+            if (!options_.disk_dir.empty())
+                open_disk();
+            enabled_ = options_.memory_bytes > 0 || index_;
+        }
+
+        bool
+        enabled() const
+        {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        // The stored response for `req`, if there is one, and whether the
+        // request lets it be served without asking the origin.
+        std::optional<Lookup>
+        lookup(std::string const &key, boost::beast::http::request_header<> const &req, std::int64_t now)
+        {
+            auto cc = CacheControl::parse(req);
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end())
+                return std::nullopt;
+            for (auto stored : it->second)
+            {
+                if (!matches(stored->entry->vary, req))
+                    continue;
+                touch(stored);
+                auto const &entry = *stored->entry;
+                auto res_cc = CacheControl::parse(entry.header);
+                std::int64_t age = entry.age(now);
+                bool fresh = age < entry.lifetime;
+                // A client may take a stale response, unless the origin said otherwise.
+                if (!fresh && cc.max_stale && !res_cc.must_revalidate && age - entry.lifetime <= *cc.max_stale)
+                    fresh = true;
+                if (res_cc.no_cache || cc.no_cache || (cc.max_age && age > *cc.max_age) ||
+                    (cc.min_fresh && entry.lifetime - age < *cc.min_fresh))
+                    fresh = false;
+                return Lookup{stored->entry, fresh};
+            }
+            return std::nullopt;
+        }
+
+        // A writer for the body of `res` if it may be stored, nullptr if not.
+        std::unique_ptr<Writer>
+        store(std::string const &key, boost::beast::http::request_header<> const &req,
+              boost::beast::http::response_header<> const &res, std::int64_t request_time, std::int64_t response_time);
+
+        // The entry updated by a 304 (RFC 9111 section 4.3.4): its fields
+        // are replaced by the ones the 304 carries and its age starts over.
+        std::shared_ptr<CacheEntry const>
+        refresh(std::shared_ptr<CacheEntry const> const &entry, boost::beast::http::response_header<> const &not_modified,
+                std::int64_t request_time, std::int64_t response_time)
+        {
+            namespace http = boost::beast::http;
+            auto updated = std::make_shared<CacheEntry>(*entry);
+            for (auto const &field : not_modified)
+            {
+                auto name = field.name();
+                if (name == http::field::content_length || name == http::field::transfer_encoding ||
+                    name == http::field::content_range || name == http::field::connection)
+                    continue;
+                updated->header.erase(field.name_string());
+            }
+            for (auto const &field : not_modified)
+            {
+                auto name = field.name();
+                if (name == http::field::content_length || name == http::field::transfer_encoding ||
+                    name == http::field::content_range || name == http::field::connection)
+                    continue;
+                updated->header.insert(field.name_string(), field.value());
+            }
+            updated->response_time = response_time;
+            updated->initial_age = initial_age(not_modified, request_time, response_time);
+            updated->lifetime = freshness_lifetime(updated->header, response_time);
+
+            // The meta file is rewritten before the entry is swapped, the
+            // lock is not held across file I/O.
+            bool on_disk = !entry->path.empty();
+            if (on_disk && !write_meta(*updated))
+                return updated;
+            bool live = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(entry->key);
+                if (it != entries_.end())
+                    for (auto stored : it->second)
+                    {
+                        if (stored->entry == entry)
+                            stored->entry = updated;
+                        else if (!on_disk || stored->entry->path != entry->path)
+                            continue;
+                        live = true;
+                        break;
+                    }
+            }
+            // Released meanwhile, the meta file just written goes with its body.
+            if (on_disk && !live)
+                discard_files(entry->path);
+            return updated;
+        }
+
+        // Drops every response stored for `key`, after an unsafe request to it.
+        void
+        invalidate(std::string const &key)
+        {
+            std::vector<std::string> doomed;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = entries_.find(key);
+                if (it == entries_.end())
+                    return;
+                auto variants = it->second;
+                for (auto stored : variants)
+                    erase(stored, doomed);
+            }
+            discard_files(doomed);
+        }
+
+        // Bytes held by the memory and the disk tier.
+        std::pair<std::uint64_t, std::uint64_t>
+        usage() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return {memory_used_, disk_used_};
+        }
+
+    private:
+        static constexpr std::size_t no_slot = static_cast<std::size_t>(-1);
+        static constexpr char index_magic[8] = {'S', 'A', 'C', 'A', 'C', 'H', 'E', '1'};
+
+        // The index file: this header, then one slot per stored body.
+        struct IndexHeader
+        {
+            char magic[8];
+            std::uint64_t slots;
+            std::uint64_t next_id;
+            std::uint64_t reserved[5];
+        };
+
+        // A body on disk, in the files <id>.meta and <id>.body. Id 0 is a free slot.
+        struct IndexSlot
+        {
+            std::uint64_t id;
+            std::uint64_t size;
+            std::uint64_t last_used; // value of uses_ then
+            std::uint64_t reserved[5];
+        };
+
+        static_assert(sizeof(IndexHeader) == 64 && sizeof(IndexSlot) == 64);
+
+        struct Stored
+        {
+            std::shared_ptr<CacheEntry const> entry;
+            std::size_t slot = no_slot;
+        };
+
+        // A tier's responses, most recently used first.
+        using Lru = std::list<Stored>;
+
+        static std::string
+        lower(boost::beast::string_view s)
+        {
+            std::string out(s);
+            for (auto &c : out)
+                c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            return out;
+        }
+
+        // All values of the request field `name`, as one list.
+        static std::string
+        field_values(boost::beast::http::request_header<> const &req, std::string const &name)
+        {
+            std::string out;
+            auto range = req.equal_range(name);
+            for (auto it = range.first; it != range.second; ++it)
+                out += (out.empty() ? "" : ", ") + std::string(it->value());
+            return out;
+        }
+
+        // Publishes a complete entry, replacing the one for the same variant.
+        void
+        insert(std::shared_ptr<CacheEntry const> entry, std::uint64_t id, std::uint64_t generation)
+        {
+            std::vector<std::string> doomed;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                insert_locked(std::move(entry), id, generation, doomed);
+            }
+            discard_files(doomed);
+        }
+
+        void
+        insert_locked(std::shared_ptr<CacheEntry const> entry, std::uint64_t id, std::uint64_t generation,
+                      std::vector<std::string> &doomed)
+        {
+            if (generation != generation_)
+                return doomed.push_back(entry->path);
+            Stored stored{entry, no_slot};
+            if (id != 0)
+            {
+                stored.slot = free_slot(doomed);
+                if (stored.slot == no_slot)
+                    return doomed.push_back(entry->path);
+            }
+            if (auto it = entries_.find(entry->key); it != entries_.end())
+                for (auto variant : it->second)
+                    if (variant->entry->vary == entry->vary)
+                    {
+                        erase(variant, doomed);
+                        break;
+                    }
+            auto &lru = stored.slot == no_slot ? memory_lru_ : disk_lru_;
+            lru.push_front(std::move(stored));
+            auto &variants = entries_[entry->key];
+            variants.insert(variants.begin(), lru.begin());
+            if (id != 0)
+            {
+                slots()[lru.front().slot] = IndexSlot{id, entry->size, ++uses_, {}};
+                disk_used_ += entry->size;
+            }
+            else
+                memory_used_ += entry->size;
+            evict(doomed);
+        }
+
+        // Moves `stored` to the front of its tier's LRU list.
+        void
+        touch(Lru::iterator stored)
+        {
+            auto &lru = stored->slot == no_slot ? memory_lru_ : disk_lru_;
+            lru.splice(lru.begin(), lru, stored);
+            if (index_ && stored->slot != no_slot)
+                slots()[stored->slot].last_used = ++uses_;
+        }
+
+        // Removes `stored` from the cache; the files of a disk entry are
+        // added to `doomed`, for the caller to remove once it unlocked.
+        void
+        erase(Lru::iterator stored, std::vector<std::string> &doomed)
+        {
+            auto it = entries_.find(stored->entry->key);
+            auto &variants = it->second;
+            variants.erase(std::find(variants.begin(), variants.end(), stored));
+            if (variants.empty())
+                entries_.erase(it);
+            if (stored->slot == no_slot)
+            {
+                memory_used_ -= stored->entry->size;
+                memory_lru_.erase(stored);
+                return;
+            }
+            disk_used_ -= stored->entry->size;
+            if (index_)
+            {
+                slots()[stored->slot].id = 0;
+                free_slots_.push_back(stored->slot);
+            }
+            doomed.push_back(stored->entry->path);
+            disk_lru_.erase(stored);
+        }
+
+        // Least recently used responses go until both tiers fit.
+        void
+        evict(std::vector<std::string> &doomed)
+        {
+            while (memory_used_ > options_.memory_bytes && !memory_lru_.empty())
+                erase(std::prev(memory_lru_.end()), doomed);
+            while (disk_used_ > options_.disk_bytes && !disk_lru_.empty())
+                erase(std::prev(disk_lru_.end()), doomed);
+        }
+
+        std::string
+        file(std::uint64_t id, char const *suffix) const
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "/%016llx.%s", static_cast<unsigned long long>(id), suffix);
+            return options_.disk_dir + name;
+        }
+
+        // Removes the body file at `path` and its meta file.
+        static void
+        discard_files(std::string const &path)
+        {
+            if (path.empty())
+                return;
+            std::remove(path.c_str());
+            auto meta = path.substr(0, path.size() - 4) + "meta";
+            std::remove(meta.c_str());
+        }
+
+        static void
+        discard_files(std::vector<std::string> const &paths)
+        {
+            for (auto const &path : paths)
+                discard_files(path);
+        }
+
+        // What an entry is besides its body, in a file next to it:
+        // a version line, the key, the times, the Vary values, the header.
+        static std::string
+        encode_meta(CacheEntry const &entry)
+        {
+            std::ostringstream out;
+            out << "SAC1\n"
+                << entry.key << "\n"
+                << entry.response_time << " " << entry.initial_age << " " << entry.lifetime << " " << entry.size << "\n"
+                << entry.vary.size() << "\n";
+            for (auto const &[name, value] : entry.vary)
+                out << name << "\n"
+                    << value << "\n";
+            out << entry.header;
+            return out.str();
+        }
+
+        static bool
+        decode_meta(std::string const &text, CacheEntry &entry)
+        {
+            namespace http = boost::beast::http;
+            std::istringstream in(text);
+            std::string line;
+            std::size_t vary = 0;
+            if (!std::getline(in, line) || line != "SAC1" || !std::getline(in, entry.key) ||
+                !(in >> entry.response_time >> entry.initial_age >> entry.lifetime >> entry.size >> vary) || vary > 64)
+                return false;
+            in.ignore(1);
+            for (std::size_t i = 0; i < vary; ++i)
+            {
+                std::string name, value;
+                if (!std::getline(in, name) || !std::getline(in, value))
+                    return false;
+                entry.vary.emplace_back(std::move(name), std::move(value));
+            }
+            std::string raw = text.substr(static_cast<std::size_t>(in.tellg()));
+            http::response_parser<http::empty_body> parser;
+            parser.skip(true);
+            boost::beast::error_code ec;
+            parser.put(boost::asio::buffer(raw), ec);
+            if (ec || !parser.is_header_done())
+                return false;
+            entry.header = std::move(parser.get().base());
+            return true;
+        }
+
+        // Rewrites the meta file of a disk entry in place, atomically.
+        bool
+        write_meta(CacheEntry const &entry)
+        {
+            auto meta = entry.path.substr(0, entry.path.size() - 4) + "meta";
+            // Two refreshes of one entry may write at once.
+            auto tmp = meta + "." + std::to_string(++meta_writes_) + ".tmp";
+            {
+                std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+                out << encode_meta(entry);
+                if (!out.flush())
+                    return false;
+            }
+            return std::rename(tmp.c_str(), meta.c_str()) == 0;
+        }
+
+        std::uint64_t
+        allocate_id()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return index_ ? index_->next_id++ : 0;
+        }
+
+        IndexSlot *
+        slots() const
+        {
+            return reinterpret_cast<IndexSlot *>(index_ + 1);
+        }
+
+        // A free slot of the index, the least recently used one's if all are taken.
+        std::size_t
+        free_slot(std::vector<std::string> &doomed)
+        {
+            if (!index_)
+                return no_slot;
+            if (free_slots_.empty() && !disk_lru_.empty())
+                erase(std::prev(disk_lru_.end()), doomed);
+            if (free_slots_.empty())
+                return no_slot;
+            std::size_t slot = free_slots_.back();
+            free_slots_.pop_back();
+            return slot;
+        }
+
+        // Maps the index of options_.disk_dir and takes back the bodies it lists.
+        void
+        open_disk()
+        {
+#ifndef _WIN32
+            ::mkdir(options_.disk_dir.c_str(), 0755);
+            std::string path = options_.disk_dir + "/index";
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0)
+            {
+                SA_LOG_WARN("HTTP cache: cannot open " << path << ": " << std::strerror(errno));
+                return;
+            }
+            index_size_ = sizeof(IndexHeader) + options_.disk_slots * sizeof(IndexSlot);
+            struct stat st{};
+            bool fresh = ::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) != index_size_;
+            if (fresh && (::ftruncate(fd, 0) != 0 || ::ftruncate(fd, static_cast<off_t>(index_size_)) != 0))
+            {
+                SA_LOG_WARN("HTTP cache: cannot size " << path << ": " << std::strerror(errno));
+                ::close(fd);
+                return;
+            }
+            void *map = ::mmap(nullptr, index_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED)
+            {
+                SA_LOG_WARN("HTTP cache: cannot map " << path << ": " << std::strerror(errno));
+                return;
+            }
+            index_ = static_cast<IndexHeader *>(map);
+            if (fresh || std::memcmp(index_->magic, index_magic, sizeof(index_magic)) != 0 || index_->slots != options_.disk_slots)
+            {
+                std::memset(map, 0, index_size_);
+                std::memcpy(index_->magic, index_magic, sizeof(index_magic));
+                index_->slots = options_.disk_slots;
+                index_->next_id = 1;
+            }
+            std::vector<std::pair<std::uint64_t, Stored>> loaded;
+            for (std::size_t i = index_->slots; i-- > 0;)
+            {
+                auto &slot = slots()[i];
+                if (slot.id == 0)
+                {
+                    free_slots_.push_back(i);
+                    continue;
+                }
+                auto entry = std::make_shared<CacheEntry>();
+                entry->path = file(slot.id, "body");
+                std::ifstream meta(file(slot.id, "meta"), std::ios::binary);
+                std::string text((std::istreambuf_iterator<char>(meta)), std::istreambuf_iterator<char>());
+                struct stat body{};
+                if (!decode_meta(text, *entry) || ::stat(entry->path.c_str(), &body) != 0 ||
+                    static_cast<std::uint64_t>(body.st_size) != entry->size)
+                {
+                    discard_files(entry->path);
+                    slot.id = 0;
+                    free_slots_.push_back(i);
+                    continue;
+                }
+                disk_used_ += entry->size;
+                uses_ = std::max(uses_, slot.last_used);
+                loaded.emplace_back(slot.last_used, Stored{std::move(entry), i});
+            }
+            // The LRU order is what the slots recorded.
+            std::sort(loaded.begin(), loaded.end(), [](auto const &a, auto const &b)
+                      { return a.first > b.first; });
+            for (auto &[last_used, stored] : loaded)
+            {
+                disk_lru_.push_back(std::move(stored));
+                entries_[disk_lru_.back().entry->key].push_back(std::prev(disk_lru_.end()));
+            }
+#endif
+        }
+
+        void
+        close_disk()
+        {
+#ifndef _WIN32
+            if (index_)
+                ::munmap(index_, index_size_);
+#endif
+            index_ = nullptr;
+        }
+
+        mutable std::mutex mutex_;
+        std::atomic<bool> enabled_{false};
+        HttpCacheOptions options_;
+        std::uint64_t generation_ = 0;
+        std::uint64_t uses_ = 0; // ticks on every disk insert and hit, the LRU order of the index
+        std::atomic<std::uint64_t> meta_writes_{0};
+        Lru memory_lru_;
+        Lru disk_lru_;
+        std::unordered_map<std::string, std::vector<Lru::iterator>> entries_; // by key, newest variant first
+        std::vector<std::size_t> free_slots_; // of the index
+        std::uint64_t memory_used_ = 0;
+        std::uint64_t disk_used_ = 0;
+        IndexHeader *index_ = nullptr;
+        std::size_t index_size_ = 0;
+    };
+
+    // Collects the body of a storable response as it is relayed and
+    // publishes the entry once it is complete. A body that outgrows the
+    // memory tier continues in a file; one too large for any tier, or a
+    // writer destroyed before commit(), leaves nothing behind.
+    class HttpCache::Writer
+    {
+    public:
+        Writer(HttpCache &cache, std::shared_ptr<CacheEntry> entry, std::uint64_t generation, HttpCacheOptions const &options)
+            : cache_(cache), entry_(std::move(entry)), generation_(generation),
+              memory_max_(options.memory_bytes > 0 ? options.memory_object_max : 0),
+              disk_max_(options.disk_dir.empty() ? 0 : options.disk_bytes / 8)
+        {
+        }
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        ~Writer()
+        {
+            if (out_.is_open())
+                out_.close();
+            if (!committed_ && !entry_->path.empty())
+                std::remove((entry_->path + ".tmp").c_str());
+        }
+
+        void
+        append(void const *data, std::size_t n)
+        {
+            if (failed_)
+                return;
+            size_ += n;
+            if (!out_.is_open())
+            {
+                memory_.append(static_cast<char const *>(data), n);
+                if (size_ <= memory_max_)
+                    return;
+                if (size_ > disk_max_ || !spill())
+                    return fail();
+                return;
+            }
+            if (size_ > disk_max_ || !out_.write(static_cast<char const *>(data), static_cast<std::streamsize>(n)))
+                fail();
+        }
+
+        // The body is complete: the entry becomes visible to lookups.
+        void
+        commit()
+        {
+            if (failed_ || committed_)
+                return;
+            committed_ = true;
+            entry_->size = size_;
+            if (!out_.is_open())
+            {
+                entry_->body = std::make_shared<std::string const>(std::move(memory_));
+                cache_.insert(std::move(entry_), 0, generation_);
+                return;
+            }
+            out_.close();
+            if (!out_ || std::rename((entry_->path + ".tmp").c_str(), entry_->path.c_str()) != 0 || !cache_.write_meta(*entry_))
+            {
+                cache_.discard_files(entry_->path);
+                return;
+            }
+            cache_.insert(std::move(entry_), id_, generation_);
+        }
+
+    private:
+        // Moves what was collected in memory to a file of the disk tier.
+        bool
+        spill()
+        {
+            id_ = cache_.allocate_id();
+            if (id_ == 0)
+                return false;
+            entry_->path = cache_.file(id_, "body");
+            out_.open(entry_->path + ".tmp", std::ios::binary | std::ios::trunc);
+            if (!out_.write(memory_.data(), static_cast<std::streamsize>(memory_.size())))
+                return false;
+            std::string().swap(memory_);
+            return true;
+        }
+
+        void
+        fail()
+        {
+            failed_ = true;
+            std::string().swap(memory_);
+            if (out_.is_open())
+                out_.close();
+            if (!entry_->path.empty())
+                std::remove((entry_->path + ".tmp").c_str());
+        }
+
+        HttpCache &cache_;
+        std::shared_ptr<CacheEntry> entry_;
+        std::uint64_t generation_;
+        std::uint64_t memory_max_;
+        std::uint64_t disk_max_;
+        std::uint64_t size_ = 0;
+        std::uint64_t id_ = 0;
+        std::string memory_;
+        std::ofstream out_;
+        bool failed_ = false;
+        bool committed_ = false;
+    };
+
+    inline std::unique_ptr<HttpCache::Writer>
+    HttpCache::store(std::string const &key, boost::beast::http::request_header<> const &req,
+                     boost::beast::http::response_header<> const &res, std::int64_t request_time, std::int64_t response_time)
+    {
+        namespace http = boost::beast::http;
+        if (!enabled() || !storable(req, res))
+            return nullptr;
+        auto entry = std::make_shared<CacheEntry>();
+        entry->key = key;
+        entry->header = res;
+        entry->header.erase(http::field::content_length);
+        entry->header.erase(http::field::transfer_encoding);
+        entry->vary = vary_of(req, res);
+        entry->response_time = response_time;
+        entry->initial_age = initial_age(res, request_time, response_time);
+        entry->lifetime = freshness_lifetime(res, response_time);
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::make_unique<Writer>(*this, std::move(entry), generation_, options_);
+    }
+}
+
+#endif
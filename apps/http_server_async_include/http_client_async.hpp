@@ -15,6 +15,9 @@
 #include <thread>
 #include <future>
 
+#include "dns_cache.hpp"
+#include "happy_eyeballs.hpp"
+
 namespace beast = boost::beast;   // from <boost/beast.hpp>
 namespace http = beast::http;     // from <boost/beast/http.hpp>
 namespace net = boost::asio;      // from <boost/asio.hpp>
@@ -34,7 +37,6 @@ namespace client_async
     // Performs an HTTP GET and prints the response
     class session : public std::enable_shared_from_this<session>
     {
-        tcp::resolver resolver_;
         beast::tcp_stream stream_;
         beast::flat_buffer buffer_; // (Must persist between reads)
         http::request<http::empty_body> req_;
@@ -46,7 +48,7 @@ namespace client_async
         // Objects are constructed with a strand to
         // ensure that handlers do not execute concurrently.
         explicit session(net::io_context &ioc)
-            : resolver_(net::make_strand(ioc)), stream_(net::make_strand(ioc)), response_future_(response_promise_.get_future())
+            : stream_(net::make_strand(ioc)), response_future_(response_promise_.get_future())
         {
         }
 
@@ -70,10 +72,11 @@ namespace client_async
             req_.set(http::field::host, host);
             req_.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
 
-            // Look up the domain name
-            resolver_.async_resolve(
+            // Look up the domain name, shared with every other lookup of the process
+            server_async::DnsCache::instance().async_resolve(
                 host,
                 port,
+                stream_.get_executor(),
                 beast::bind_front_handler(
                     &session::on_resolve,
                     shared_from_this()));
@@ -82,20 +85,19 @@ namespace client_async
         void
         on_resolve(
             beast::error_code ec,
-            tcp::resolver::results_type results)
+            server_async::DnsCache::Endpoints const &results)
         {
             if (ec)
                 return fail(ec, "resolve");
 
-            // Set a timeout on the operation
-            stream_.expires_after(std::chrono::seconds(30));
-
-            // Make the connection on the IP address we get from a lookup
-            stream_.async_connect(
+            // Race the addresses we got from the lookup, 30 seconds at most
+            server_async::HappyEyeballs::async_connect(
+                stream_.socket(),
                 results,
                 beast::bind_front_handler(
                     &session::on_connect,
-                    shared_from_this()));
+                    shared_from_this()),
+                std::chrono::seconds(30));
         }
 
         void
@@ -164,7 +166,6 @@ namespace client_async
     // Performs an HTTP GET and prints the response
     class session_ssl : public std::enable_shared_from_this<session_ssl>
     {
-        tcp::resolver resolver_;
         ssl::stream<beast::tcp_stream> stream_;
         beast::flat_buffer buffer_; // (Must persist between reads)
         http::request<http::empty_body> req_;
@@ -176,7 +177,7 @@ namespace client_async
         explicit session_ssl(
             net::any_io_executor ex,
             ssl::context &ctx)
-            : resolver_(ex), stream_(ex, ctx), response_future_(response_promise_.get_future())
+            : stream_(ex, ctx), response_future_(response_promise_.get_future())
         {
         }
 
@@ -207,10 +208,11 @@ namespace client_async
             req_.set(http::field::host, host);
             req_.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
 
-            // Look up the domain name
-            resolver_.async_resolve(
+            // Look up the domain name, shared with every other lookup of the process
+            server_async::DnsCache::instance().async_resolve(
                 host,
                 port,
+                stream_.get_executor(),
                 beast::bind_front_handler(
                     &session_ssl::on_resolve,
                     shared_from_this()));
@@ -219,20 +221,19 @@ namespace client_async
         void
         on_resolve(
             beast::error_code ec,
-            tcp::resolver::results_type results)
+            server_async::DnsCache::Endpoints const &results)
         {
             if (ec)
                 return fail(ec, "resolve");
 
-            // Set a timeout on the operation
-            beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
-
-            // Make the connection on the IP address we get from a lookup
-            beast::get_lowest_layer(stream_).async_connect(
+            // Race the addresses we got from the lookup, 30 seconds at most
+            server_async::HappyEyeballs::async_connect(
+                beast::get_lowest_layer(stream_).socket(),
                 results,
                 beast::bind_front_handler(
                     &session_ssl::on_connect,
-                    shared_from_this()));
+                    shared_from_this()),
+                std::chrono::seconds(30));
         }
 
         void
@@ -6,16 +6,23 @@
 #include <iostream>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
+#include <cstdint>
+#include <limits>
 #include <optional>
 #include <boost/url.hpp>
 #include "socket_copier.h"
+#include "upstream_pool.hpp"
+#include "proxy_headers.hpp"
+#include "http_cache.hpp"
+#include "single_flight.hpp"
+#include "logger.hpp"
 
 using boost::asio::ip::tcp;
 
 namespace server_async
 {
 
-  template <typename StreamType, typename Derived, size_t max_length = 4096>
+  template <typename StreamType, typename Derived>
   class http_copier
   {
   public:
@@ -31,17 +38,26 @@ namespace server_async
     // }
     http_copier(
         StreamType &&stream_,
-        http::request<http::empty_body> &&req_,
-        beast::flat_buffer &&buffer_)
+        http::request_parser<http::empty_body> &&parser,
+        beast::flat_buffer &&buffer_,
+        SessionRegistry &registry_)
         : stream_(std::move(stream_)),
-          req_(std::move(req_)),
           buffer_(std::move(buffer_)),
           remote_socket_(stream_.get_executor()),
-          resolver_(stream_.get_executor()),
-          to_remote_buffer(std::make_shared<std::array<char, max_length>>()),
-          to_client_buffer(std::make_shared<std::array<char, max_length>>())
+          registry_(registry_),
+          to_remote_buffer(make_relay_buffer()),
+          to_client_buffer(make_relay_buffer())
     {
+      // The session read the header, the body is read from where it stopped.
+      req_parser_.emplace(std::move(parser));
+      req_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
     }
+
+    ~http_copier()
+    {
+      leave_flight();
+    }
+
     // Access the derived class, this is part of
     // the Curiously Recurring Template Pattern idiom.
     Derived &
@@ -49,6 +65,8 @@ namespace server_async
     {
       return static_cast<Derived &>(*this);
     }
+    // After a protocol upgrade the rest of both directions is relayed as
+    // bytes. The connection is neither pooled nor read for further requests.
     void write_unconsumed()
     {
       // Asynchronously write the data to the destination socket
@@ -60,108 +78,995 @@ namespace server_async
           {
             if (ec)
             {
-              std::cerr << "Error writing to proxy server: " << ec.message() << std::endl;
+              SA_LOG_ERROR("Error writing to proxy server: " << ec.message());
             }
             else
             {
-              std::cout << "starting relay...." << std::endl;
-              std::cout << "start fetching....." << std::endl;
+              SA_LOG_DEBUG("starting relay....");
+              SA_LOG_DEBUG("start fetching.....");
               do_relay(self, self->remote_socket_, self->stream_, self->to_client_buffer, false);
-              std::cout << "start sending......" << std::endl;
+              SA_LOG_DEBUG("start sending......");
               do_relay(self, self->stream_, self->remote_socket_, self->to_remote_buffer, true);
             }
           });
     }
+    // Closes both ends of the connection, any pending relay completes with
+    // an error and a connect under way gives up its attempts.
+    void close()
+    {
+      closed_ = true;
+      if (auto connecting = connecting_.lock())
+        connecting->cancel();
+      if (flight_timer_)
+        flight_timer_->cancel();
+      beast::error_code ec;
+      beast::get_lowest_layer(stream_).socket().close(ec);
+      remote_socket_.close(ec);
+    }
+
     void send_parsed_request()
     {
-      // req_.erase(http::field::proxy_connection);
-    
-      // std::ostringstream oss;
-      // beast::error_code ec;
-      // server_async::write_ostream(oss, req_, ec);
-      // http::request_serializer<http::empty_body> sr{req_};
-      // sr.split(true);
-      std::cout << "request: " << req_ << std::endl;
-      http::async_write(remote_socket_, req_,
-                        [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
-                        {
-                          if (!ec)
-                          {
-                            std::cout << "write request done." << std::endl;
-                            self->write_unconsumed();
-                          }
-                          else
-                          {
-                            std::cerr << "Error writing to proxy server: " << ec.message() << std::endl;
-                          }
-                        });
+      SA_LOG_DEBUG("request: " << request().base());
+      req_serializer_.emplace(request());
+      http::async_write_header(remote_socket_, *req_serializer_,
+                               [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+                               {
+                                 if (!ec)
+                                 {
+                                   SA_LOG_DEBUG("write request header done.");
+                                   if (self->req_has_body_)
+                                     self->buffer_.reserve(body_read_size);
+                                   if (self->req_has_body_ && self->expect_continue_)
+                                     return self->send_continue();
+                                   return self->relay_request_body();
+                                 }
+                                 if (self->retry_fresh(ec))
+                                   return;
+                                 SA_LOG_ERROR("Error writing to proxy server: " << ec.message());
+                                 self->send_error(http::status::bad_gateway);
+                               });
     }
 
     void start()
     {
-      std::cout << "start........" << std::endl;
-      boost::urls::url_view url{req_.target()};
-      // tcp::resolver resolver_(socket_.get_executor());
-      // auto delimiter_pos = target_endpoints_.find(':');
+      // Unlike a tunnel the connection has request boundaries, so a
+      // graceful drain can end it after the current response.
+      registration_ = registry_.add(
+          SessionKind::http,
+          [weak = std::weak_ptr<Derived>(derived().shared_from_this()), ex = stream_.get_executor()](bool force)
+          {
+            if (auto self = weak.lock())
+              net::post(ex, [self, force]
+                        { self->on_drain(force); });
+          });
+      // A response may take long, the keep-alive wait sets its own timeout.
+      beast::get_lowest_layer(stream_).expires_never();
+      route();
+    }
+
+  private:
+    // Runs on the strand. A connection waiting for its next request is
+    // closed right away, a busy one answers with "Connection: close" and
+    // closes after the response. Past an upgrade there is no request
+    // boundary, only the forced drain ends it.
+    void on_drain(bool force)
+    {
+      if (force || awaiting_request_)
+        close();
+    }
+
+    // The request being forwarded, its body streamed through req_parser_.
+    http::request<http::buffer_body> &request()
+    {
+      return req_parser_->get();
+    }
+
+    // Sends the request to the origin in its URL, on a pooled connection
+    // when there is one. Every request on the client connection is routed
+    // on its own.
+    void route()
+    {
+      auto &req = request();
+      // The url_view constructor throws on a malformed target, and nothing
+      // above the io_context would catch it.
+      auto parsed = boost::urls::parse_absolute_uri(req.target());
+      if (!parsed || !parsed->has_authority() || parsed->host().empty())
+      {
+        SA_LOG_ERROR("Malformed proxy target: " << req.target());
+        return send_error(http::status::bad_request);
+      }
+      boost::urls::url_view url = *parsed;
 
       std::string host = url.host();
       std::string port = url.port().empty() ? "80" : url.port();
+      origin_ = host + ":" + port;
 
-      req_.set(http::field::host, host);
-      // req_.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+      // The origin gets the path in origin-form and the authority of the
+      // URL as Host. `url` views the old target, it is done with first.
+      std::string authority = url.port().empty() ? host : origin_;
+      std::string target(url.encoded_path());
+      if (target.empty())
+        target = "/";
+      if (url.has_query())
+        target += "?" + std::string(url.encoded_query());
+      req.target(target);
+      req.set(http::field::host, authority);
 
-      // req_.target(path); // Set the target path
-      // Optionally, you can handle the query if needed
-      if (!url.query().empty())
+      // The client's connection fields are about the client connection.
+      // An upgrade is the one thing the origin has to hear of, the origin
+      // connection is kept alive otherwise.
+      client_keep_alive_ = req_parser_->keep_alive() && !registry_.draining();
+      bool upgrade = req_parser_->upgrade();
+      std::string protocol{req[http::field::upgrade]};
+      strip_hop_by_hop(req);
+      if (upgrade)
       {
-        req_.target(url.path() + "?" + url.query()); // Append query if present
+        req.set(http::field::upgrade, protocol);
+        req.set(http::field::connection, "upgrade");
       }
       else
+        req.keep_alive(true);
+      append_via(req);
+
+      // The proxy answers 100-continue itself right before it reads the
+      // body, the origin then gets the body without having to ask for it.
+      expect_continue_ = req.version() >= 11 && beast::iequals(req[http::field::expect], "100-continue");
+      if (expect_continue_)
+        req.erase(http::field::expect);
+
+      req_has_body_ = !req_parser_->is_done();
+      if ((HttpCache::instance().enabled() || request_coalescing().load(std::memory_order_relaxed)) && !upgrade)
       {
-        req_.target(url.path());
+        cache_key_ = HttpCache::key(host, port, target);
+        if (consult_cache() || join_flight(cache_key_))
+          return;
       }
+      fetch();
+    }
 
-      std::cout << "start resolve: " << host << ", port: " << port << "version: " << req_.version() << std::endl;
-      // tcp::resolver::results_type target_endpoints_resolved_ = resolver_.resolve(host, port);
-      // std::cout << "result: " << target_endpoints_resolved_.begin()->endpoint() << std::endl;
-      resolver_.async_resolve(host, port,
-                              [self = derived().shared_from_this()](boost::system::error_code ec, tcp::resolver::results_type results)
+    // Sends the request to the origin, on a pooled connection when there is one.
+    void fetch()
+    {
+      // A stale stored response is asked for only if it changed.
+      auto &req = request();
+      if (cached_)
+      {
+        auto const &stored = cached_->header;
+        if (stored.count(http::field::etag))
+          req.set(http::field::if_none_match, stored[http::field::etag]);
+        if (stored.count(http::field::last_modified))
+          req.set(http::field::if_modified_since, stored[http::field::last_modified]);
+      }
+      if (auto pooled = UpstreamPool::local().checkout(origin_, stream_.get_executor()))
+      {
+        SA_LOG_DEBUG("reusing connection to " << origin_);
+        remote_socket_ = std::move(*pooled);
+        reused_ = true;
+        Metrics::instance().upstream_connection(true);
+        return send_parsed_request();
+      }
+      auto colon = origin_.rfind(':');
+      connect(origin_.substr(0, colon), origin_.substr(colon + 1));
+    }
+
+    // Answers a GET or HEAD from the cache when it holds a fresh response.
+    // A stale one with a validator is kept in cached_ to be revalidated,
+    // unless the client made the request a conditional one itself, and is
+    // served again if the origin answers 304. Returns whether the request
+    // was answered.
+    bool consult_cache()
+    {
+      auto &req = request();
+      if (!HttpCache::instance().enabled() || (req.method() != http::verb::get && req.method() != http::verb::head) || req_has_body_)
+        return false;
+      request_time_ = HttpCache::now();
+      auto found = HttpCache::instance().lookup(cache_key_, req, request_time_);
+      if (found && found->fresh && serve_cached(found->entry))
+      {
+        Metrics::instance().http_cache(Metrics::CacheResult::hit);
+        return true;
+      }
+      if (CacheControl::parse(req).only_if_cached)
+      {
+        send_error(http::status::gateway_timeout);
+        return true;
+      }
+      if (found && found->entry->has_validator() &&
+          !req.count(http::field::if_none_match) && !req.count(http::field::if_modified_since))
+        cached_ = found->entry;
+      return false;
+    }
+
+    // Attaches a GET to an identical one in flight, whose response it then
+    // shares, or lets later ones attach to this one. Returns whether the
+    // request waits for another's response.
+    bool join_flight(std::string const &key)
+    {
+      auto &req = request();
+      if (!request_coalescing().load(std::memory_order_relaxed) || req.method() != http::verb::get || req_has_body_)
+        return false;
+      // A range or a precondition asks for something else than the
+      // response, a request for a new one may not get one already under way.
+      auto cc = CacheControl::parse(req);
+      if (cc.no_cache || cc.no_store || cc.max_age || req.count(http::field::range) || req.count(http::field::if_range) ||
+          req.count(http::field::if_match) || req.count(http::field::if_unmodified_since))
+        return false;
+      // The client's own validators would make the response a 304 for it only.
+      bool conditional = req.count(http::field::if_none_match) || req.count(http::field::if_modified_since);
+      auto [flight, reader] = Flights::instance().join(key, !conditional);
+      if (!flight)
+        return false;
+      flight_ = std::move(flight);
+      if (!reader)
+      {
+        flight_leader_ = true;
+        return false;
+      }
+      flight_reader_ = *reader;
+      on_flight();
+      return true;
+    }
+
+    // The flight this request follows has the response header, or gave up
+    // and the request goes to the origin itself.
+    void on_flight()
+    {
+      if (!flight_)
+        return;
+      auto state = flight_->wait(flight_reader_, [self = derived().shared_from_this()]
+                                 { net::post(self->stream_.get_executor(), [self]
+                                             { self->on_flight(); }); });
+      if (state == Flight::State::waiting)
+        return await_flight();
+      flight_waiting_ = false;
+      if (state == Flight::State::revalidated)
+      {
+        auto entry = flight_->entry();
+        leave_flight();
+        if (!serve_cached(entry))
+          return fetch();
+        Metrics::instance().http_cache(Metrics::CacheResult::coalesced);
+        return;
+      }
+      bool shared = state == Flight::State::streaming || state == Flight::State::complete;
+      if (shared && HttpCache::matches(flight_->vary(), request()))
+      {
+        Metrics::instance().http_cache(Metrics::CacheResult::coalesced);
+        return serve_flight();
+      }
+      // Another variant: the requests for this one share a flight of their own.
+      std::string variant;
+      if (shared && flight_->key() == cache_key_)
+        variant = HttpCache::variant_key(cache_key_, flight_->vary(), request());
+      leave_flight();
+      if (!variant.empty() && join_flight(variant))
+        return;
+      fetch();
+    }
+
+    // The leader lets its followers share the response if a shared cache
+    // could store it for reuse, or sends them to the origin on their own.
+    void offer_flight()
+    {
+      auto &res = res_parser_->get();
+      bool shareable = res.result_int() != 204 && storable(request(), res) &&
+                       !CacheControl::parse(res).no_cache && freshness_lifetime(res, HttpCache::now()) > 0;
+      if (!shareable)
+        return flight_->decline();
+      http::response_header<> header = res.base();
+      header.erase(http::field::content_length);
+      header.erase(http::field::transfer_encoding);
+      std::optional<std::uint64_t> length;
+      if (auto n = res_parser_->content_length())
+        length = *n;
+      flight_->respond(std::move(header), length, HttpCache::vary_of(request(), res));
+    }
+
+    // A follower gives the leader coalesced_wait_ms() for each step, the
+    // wait ends early when the flight wakes it.
+    void await_flight()
+    {
+      flight_waiting_ = true;
+      if (!flight_timer_)
+        flight_timer_.emplace(stream_.get_executor());
+      flight_timer_->expires_after(std::chrono::milliseconds(coalesced_wait_ms().load(std::memory_order_relaxed)));
+      flight_timer_->async_wait(
+          [self = derived().shared_from_this(), armed = ++flight_waits_](boost::system::error_code ec)
+          {
+            if (ec || !self->flight_waiting_ || armed != self->flight_waits_)
+              return;
+            SA_LOG_DEBUG("coalesced request for " << self->cache_key_ << " stalled");
+            self->leave_flight();
+            if (self->flight_started_)
+              return self->fail_exchange(net::error::timed_out, "coalesced response");
+            self->fetch();
+          });
+    }
+
+    // Leaves the flight the request led or followed. A leader that did
+    // not finish its response lets the followers go.
+    void leave_flight()
+    {
+      flight_waiting_ = false;
+      if (!flight_)
+        return;
+      if (flight_leader_)
+        flight_->abort();
+      else
+        flight_->detach(flight_reader_);
+      flight_.reset();
+      flight_leader_ = false;
+    }
+
+    void connect(std::string const &host, std::string const &port)
+    {
+      reused_ = false;
+      SA_LOG_DEBUG("start resolve: " << host << ", port: " << port << "version: " << request().version());
+      DnsCache::instance().async_resolve(host, port, stream_.get_executor(),
+                              [self = derived().shared_from_this()](boost::system::error_code ec, DnsCache::Endpoints const &results)
                               {
+                                if (self->closed_)
+                                  return;
                                 if (!ec)
                                 {
-                                  std::cout << "result: " << results.begin()->endpoint() << std::endl;
-                                  boost::asio::async_connect(self->remote_socket_, results,
-                                                             [self](boost::system::error_code ec, const tcp::endpoint &)
-                                                             {
-                                                               if (!ec)
+                                  SA_LOG_DEBUG("result: " << results.front());
+                                  self->connecting_ = HappyEyeballs::async_connect(self->remote_socket_, results,
+                                                               [self](boost::system::error_code ec, const tcp::endpoint &)
                                                                {
-                                                                 self->send_parsed_request();
-                                                               }
-                                                               else
-                                                               {
-                                                                 std::cerr << "Error connecting to remote server: " << ec.message() << std::endl;
-                                                                 //  self->cleanup();
-                                                               }
-                                                             });
+                                                                 if (ec == net::error::operation_aborted)
+                                                                   return;
+                                                                 if (!ec)
+                                                                 {
+                                                                   Metrics::instance().upstream_connection(false);
+                                                                   self->send_parsed_request();
+                                                                 }
+                                                                 else
+                                                                 {
+                                                                   SA_LOG_ERROR("Error connecting to remote server: " << ec.message());
+                                                                   self->send_error(http::status::bad_gateway);
+                                                                 }
+                                                               });
                                 }
                                 else
                                 {
-                                  std::cerr << "Error resolving target endpoints: " << ec.message() << ", value: " << ec.value() << std::endl;
-                                  // self->cleanup();
+                                  SA_LOG_ERROR("Error resolving target endpoints: " << ec.message() << ", value: " << ec.value());
+                                  self->send_error(http::status::bad_gateway);
                                 }
                               });
-    };
+    }
+
+    // A pooled connection the origin closed just as it was taken fails on
+    // the first write or read. Without a body nothing of the request is
+    // lost yet, so it goes again on a new connection.
+    bool retry_fresh(boost::system::error_code const &ec)
+    {
+      if (!reused_ || req_has_body_ || response_started_ || ec == net::error::operation_aborted)
+        return false;
+      SA_LOG_DEBUG("pooled connection to " << origin_ << " failed: " << ec.message() << ", reconnecting");
+      beast::error_code ignored;
+      remote_socket_.close(ignored);
+      remote_buffer_.consume(remote_buffer_.size());
+      auto colon = origin_.rfind(':');
+      connect(origin_.substr(0, colon), origin_.substr(colon + 1));
+      return true;
+    }
+
+    // The client holds the body back until it hears 100 (Continue).
+    void send_continue()
+    {
+      static constexpr char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+      expect_continue_ = false;
+      net::async_write(
+          stream_, net::buffer(interim, sizeof(interim) - 1),
+          [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec)
+              return self->fail_exchange(ec, "write 100 continue");
+            self->relay_request_body();
+          });
+    }
+
+    // One piece of the request body from the client to the origin, read
+    // by the parser, so any framing works, and framed again by the serializer.
+    void relay_request_body()
+    {
+      auto &body = request().body();
+      if (req_parser_->is_done())
+      {
+        body.data = nullptr;
+        body.size = 0;
+        body.more = false;
+        return write_request_body(0);
+      }
+      auto chunk = to_remote_buffer->acquire();
+      body.data = chunk.data();
+      body.size = chunk.size();
+      http::async_read(
+          stream_, buffer_, *req_parser_,
+          [self = derived().shared_from_this(), size = chunk.size()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec == http::error::need_buffer)
+              ec = {};
+            if (ec)
+              return self->fail_exchange(ec, "read request body");
+            auto &body = self->request().body();
+            std::size_t n = size - body.size;
+            body.data = self->to_remote_buffer->data();
+            body.size = n;
+            body.more = !self->req_parser_->is_done();
+            self->write_request_body(n);
+          });
+    }
+
+    void write_request_body(std::size_t n)
+    {
+      http::async_write(
+          remote_socket_, *req_serializer_,
+          [self = derived().shared_from_this(), n](boost::system::error_code ec, std::size_t)
+          {
+            if (ec == http::error::need_buffer)
+              ec = {};
+            if (ec)
+              return self->fail_exchange(ec, "write request body");
+            Metrics::instance().add_bytes_in(static_cast<std::size_t>(SessionKind::tunnel), n);
+            self->to_remote_buffer->adapt(n);
+            if (!self->req_parser_->is_done() || !self->req_serializer_->is_done())
+              return self->relay_request_body();
+            self->read_response();
+          });
+    }
+
+    void read_response()
+    {
+      res_parser_.emplace();
+      // Not boost::none: Boost 1.74 compares the optional and rejects every length.
+      res_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+      // The response to HEAD announces a body it does not carry.
+      res_parser_->skip(request().method() == http::verb::head);
+      http::async_read_header(
+          remote_socket_, remote_buffer_, *res_parser_,
+          [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec)
+            {
+              if (self->retry_fresh(ec))
+                return;
+              SA_LOG_ERROR("Error reading response header: " << ec.message());
+              return self->send_error(http::status::bad_gateway);
+            }
+            self->response_started_ = true;
+            if (self->cached_ && self->res_parser_->get().result() == http::status::not_modified)
+              return self->revalidated();
+            self->rewrite_response();
+            self->serializer_.emplace(self->res_parser_->get());
+            http::async_write_header(
+                self->stream_, *self->serializer_,
+                [self](boost::system::error_code ec, std::size_t)
+                {
+                  if (ec)
+                    return self->fail_exchange(ec, "write response header");
+                  auto status = self->res_parser_->get().result_int();
+                  if (status == 101)
+                    return self->upgrade();
+                  // An interim response is followed by the real one.
+                  if (status / 100 == 1)
+                    return self->read_response();
+                  // Beast reads as much as the buffer has room for, and
+                  // an empty one would be read into 512 bytes at a time.
+                  self->remote_buffer_.reserve(body_read_size);
+                  self->relay_body();
+                });
+          });
+    }
+
+    // Swaps the origin's connection fields for the client connection's.
+    // A body the origin ends by closing is chunked to an HTTP/1.1 client,
+    // whose connection then stays open.
+    void rewrite_response()
+    {
+      auto &res = res_parser_->get();
+      append_via(res);
+      // A switch of protocols keeps its Connection and Upgrade.
+      if (res.result() == http::status::switching_protocols)
+        return;
+      origin_keep_alive_ = res_parser_->keep_alive();
+      strip_hop_by_hop(res);
+      // An interim response says nothing about the connection.
+      if (res.result_int() / 100 == 1)
+        return;
+      if (!cache_key_.empty())
+        cache_response();
+      if (flight_leader_)
+        offer_flight();
+      if (res_parser_->need_eof() && request().version() >= 11)
+      {
+        res.version(11);
+        res.chunked(true);
+      }
+      client_keep_alive_ = client_keep_alive_ && !registry_.draining() && (!res_parser_->need_eof() || res.chunked());
+      res.keep_alive(client_keep_alive_);
+    }
+
+    // Starts storing a cacheable response to GET, whose body is collected
+    // as it is relayed. A successful unsafe request makes what is stored
+    // for its URL outdated.
+    void cache_response()
+    {
+      auto &req = request();
+      auto &res = res_parser_->get();
+      if (!HttpCache::instance().enabled())
+        return;
+      if (req.method() == http::verb::get)
+      {
+        Metrics::instance().http_cache(Metrics::CacheResult::miss);
+        cache_writer_ = HttpCache::instance().store(cache_key_, req, res, request_time_, HttpCache::now());
+        if (cache_writer_)
+          Metrics::instance().http_cache(Metrics::CacheResult::store);
+      }
+      else if (req.method() != http::verb::head && req.method() != http::verb::options &&
+               req.method() != http::verb::trace && res.result_int() < 400)
+        HttpCache::instance().invalidate(cache_key_);
+    }
+
+    // The origin confirmed the stored response: its header is refreshed
+    // and it is served, the origin connection is free for the next request.
+    void revalidated()
+    {
+      origin_keep_alive_ = res_parser_->keep_alive() && res_parser_->is_done();
+      // The validators were the proxy's, the client asked for the response.
+      request().erase(http::field::if_none_match);
+      request().erase(http::field::if_modified_since);
+      auto entry = HttpCache::instance().refresh(cached_, res_parser_->get().base(), request_time_, HttpCache::now());
+      Metrics::instance().http_cache(Metrics::CacheResult::revalidated);
+      if (flight_leader_)
+        flight_->revalidated(entry);
+      if (!serve_cached(entry))
+        send_error(http::status::bad_gateway);
+    }
+
+    // Writes a stored response to the client, or a 304 if it matches the
+    // client's own validators. False if its body is gone from the disk.
+    bool serve_cached(std::shared_ptr<CacheEntry const> const &entry)
+    {
+      auto &req = request();
+      std::uint64_t size = entry->size;
+      if (!entry->body)
+      {
+        beast::error_code ec;
+        cached_file_.open(entry->path.c_str(), beast::file_mode::scan, ec);
+        if (ec)
+          return false;
+      }
+      cached_ = entry;
+      cached_left_ = size;
+      cached_response_.emplace();
+      auto &res = *cached_response_;
+      res.base() = entry->header;
+      res.version(req.version() >= 11 ? 11 : 10);
+      res.set(http::field::age, std::to_string(entry->age(HttpCache::now())));
+      bool not_modified = client_not_modified(entry->header);
+      if (not_modified)
+      {
+        res.result(http::status::not_modified);
+        res.reason("");
+        cached_left_ = 0;
+      }
+      else
+        res.content_length(size);
+      res.keep_alive(client_keep_alive_);
+      cached_serializer_.emplace(res);
+      if (not_modified || req.method() == http::verb::head)
+      {
+        write_cached_header();
+        return true;
+      }
+      write_cached_body();
+      return true;
+    }
+
+    // Writes a response of the proxy's own that has no body.
+    void write_cached_header()
+    {
+      http::async_write_header(
+          stream_, *cached_serializer_,
+          [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec)
+              return self->fail_exchange(ec, "write cached response");
+            self->finish_exchange();
+          });
+    }
+
+    // Answers with the response of the flight, its body as the leader reads it.
+    void serve_flight()
+    {
+      auto &req = request();
+      cached_response_.emplace();
+      auto &res = *cached_response_;
+      res.base() = flight_->header();
+      res.version(req.version() >= 11 ? 11 : 10);
+      bool not_modified = client_not_modified(res);
+      if (not_modified)
+      {
+        res.result(http::status::not_modified);
+        res.reason("");
+      }
+      else if (auto length = flight_->length())
+        res.content_length(*length);
+      else if (req.version() >= 11)
+        res.chunked(true);
+      else
+        client_keep_alive_ = false;
+      res.keep_alive(client_keep_alive_);
+      cached_serializer_.emplace(res);
+      if (not_modified)
+        return write_cached_header();
+      write_flight_body();
+    }
+
+    // One piece of the flight's body, or a wait for the next.
+    void write_flight_body()
+    {
+      if (!flight_)
+        return;
+      Flight::State state;
+      auto piece = flight_->read(flight_reader_, [self = derived().shared_from_this()]
+                                 { net::post(self->stream_.get_executor(), [self]
+                                             { self->write_flight_body(); }); },
+                                 state);
+      if (!piece.chunk && state == Flight::State::streaming)
+        return await_flight();
+      flight_waiting_ = false;
+      if (!piece.chunk && state != Flight::State::complete)
+        return fail_exchange(net::error::connection_aborted, "coalesced response");
+      flight_started_ = true;
+      auto &body = cached_response_->body();
+      body.data = const_cast<char *>(piece.data);
+      body.size = piece.size;
+      body.more = piece.chunk != nullptr;
+      flight_piece_ = std::move(piece.chunk);
+      http::async_write(
+          stream_, *cached_serializer_,
+          [self = derived().shared_from_this(), n = piece.size](boost::system::error_code ec, std::size_t)
+          {
+            if (ec == http::error::need_buffer)
+              ec = {};
+            if (ec)
+              return self->fail_exchange(ec, "write coalesced body");
+            Metrics::instance().add_bytes_out(static_cast<std::size_t>(SessionKind::tunnel), n);
+            self->flight_piece_.reset();
+            if (!self->cached_serializer_->is_done())
+              return self->write_flight_body();
+            self->finish_exchange();
+          });
+    }
+
+    // The client's conditional GET for a response the proxy has, RFC 9110 section 13.2.2.
+    bool client_not_modified(http::response_header<> const &header)
+    {
+      auto &req = request();
+      if (req.method() != http::verb::get && req.method() != http::verb::head)
+        return false;
+      auto etag = header[http::field::etag];
+      if (req.count(http::field::if_none_match))
+      {
+        // Weak comparison: "W/" does not matter.
+        auto weak = [](beast::string_view tag)
+        {
+          while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+            tag.remove_prefix(1);
+          while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+            tag.remove_suffix(1);
+          return tag.starts_with("W/") ? tag.substr(2) : tag;
+        };
+        auto list = req[http::field::if_none_match];
+        for (std::size_t i = 0; i <= list.size();)
+        {
+          auto end = std::min(list.find(',', i), list.size());
+          auto candidate = weak(list.substr(i, end - i));
+          if (candidate == "*" || (!etag.empty() && candidate == weak(etag)))
+            return true;
+          i = end + 1;
+        }
+        return false;
+      }
+      auto since = parse_http_date(req[http::field::if_modified_since]);
+      auto modified = parse_http_date(header[http::field::last_modified]);
+      return since && modified && *modified <= *since;
+    }
+
+    // One piece of a stored body, the whole of it from memory.
+    void write_cached_body()
+    {
+      auto &body = cached_response_->body();
+      std::size_t n = 0;
+      if (cached_left_ > 0 && cached_->body)
+      {
+        n = static_cast<std::size_t>(cached_left_);
+        body.data = const_cast<char *>(cached_->body->data() + cached_->size - cached_left_);
+      }
+      else if (cached_left_ > 0)
+      {
+        auto chunk = to_client_buffer->acquire();
+        beast::error_code ec;
+        n = cached_file_.read(chunk.data(), static_cast<std::size_t>(std::min<std::uint64_t>(chunk.size(), cached_left_)), ec);
+        if (!ec && n == 0)
+          ec = net::error::eof;
+        if (ec)
+          return fail_exchange(ec, "read cached body");
+        body.data = chunk.data();
+      }
+      cached_left_ -= n;
+      body.size = n;
+      body.more = cached_left_ > 0;
+      http::async_write(
+          stream_, *cached_serializer_,
+          [self = derived().shared_from_this(), n](boost::system::error_code ec, std::size_t)
+          {
+            if (ec == http::error::need_buffer)
+              ec = {};
+            if (ec)
+              return self->fail_exchange(ec, "write cached body");
+            Metrics::instance().add_bytes_out(static_cast<std::size_t>(SessionKind::tunnel), n);
+            if (!self->cached_->body)
+              self->to_client_buffer->adapt(n);
+            if (!self->cached_serializer_->is_done())
+              return self->write_cached_body();
+            self->finish_exchange();
+          });
+    }
+
+    // One piece of the response body from the origin to the client,
+    // decoded by the parser and framed again by the serializer.
+    void relay_body()
+    {
+      auto &body = res_parser_->get().body();
+      if (client_gone_ && res_parser_->is_done())
+        return finish_for_followers();
+      if (res_parser_->is_done())
+      {
+        body.data = nullptr;
+        body.size = 0;
+        body.more = false;
+        return write_body(0);
+      }
+      // Followers a window behind hold the origin back.
+      if (flight_leader_ && flight_->throttled([self = derived().shared_from_this()]
+                                               { net::post(self->stream_.get_executor(), [self]
+                                                           { self->relay_body(); }); }))
+        return;
+      auto chunk = to_client_buffer->acquire();
+      body.data = chunk.data();
+      body.size = chunk.size();
+      http::async_read(
+          remote_socket_, remote_buffer_, *res_parser_,
+          [self = derived().shared_from_this(), size = chunk.size()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec == http::error::need_buffer)
+              ec = {};
+            if (ec)
+              return self->fail_exchange(ec, "read response body");
+            auto &body = self->res_parser_->get().body();
+            std::size_t n = size - body.size;
+            body.data = self->to_client_buffer->data();
+            body.size = n;
+            body.more = !self->res_parser_->is_done();
+            if (self->cache_writer_)
+              self->cache_writer_->append(body.data, n);
+            if (self->flight_leader_)
+              self->flight_->publish(body.data, n);
+            if (self->client_gone_)
+            {
+              self->to_client_buffer->adapt(n);
+              return self->relay_body();
+            }
+            self->write_body(n);
+          });
+    }
+
+    void write_body(std::size_t n)
+    {
+      http::async_write(
+          stream_, *serializer_,
+          [self = derived().shared_from_this(), n](boost::system::error_code ec, std::size_t)
+          {
+            if (ec == http::error::need_buffer)
+              ec = {};
+            if (ec && self->flight_leader_ && self->flight_->followed())
+              return self->relay_for_followers(ec);
+            if (ec)
+              return self->fail_exchange(ec, "write response body");
+            Metrics::instance().add_bytes_out(static_cast<std::size_t>(SessionKind::tunnel), n);
+            self->to_client_buffer->adapt(n);
+            if (!self->res_parser_->is_done() || !self->serializer_->is_done())
+              return self->relay_body();
+            self->finish_exchange();
+          });
+    }
+
+    // The client of a leader went away: the rest of the response is still
+    // read for the followers, and the cache, the client connection is closed.
+    void relay_for_followers(boost::system::error_code ec)
+    {
+      SA_LOG_DEBUG("Forward proxy client left, relaying for the followers: " << ec.message());
+      client_gone_ = true;
+      beast::error_code ignored;
+      beast::get_lowest_layer(stream_).socket().close(ignored);
+      relay_body();
+    }
+
+    void finish_for_followers()
+    {
+      if (cache_writer_)
+        cache_writer_->commit();
+      cache_writer_.reset();
+      flight_->finish();
+      leave_flight();
+      close();
+    }
+
+    // The response is complete: the origin connection goes back to the
+    // pool if both sides kept it alive, the client gets to send its next request.
+    void finish_exchange()
+    {
+      if (origin_keep_alive_ && remote_socket_.is_open() && remote_buffer_.size() == 0)
+        UpstreamPool::local().checkin(origin_, std::move(remote_socket_));
+      beast::error_code ec;
+      remote_socket_.close(ec);
+      if (cache_writer_)
+        cache_writer_->commit();
+      cache_writer_.reset();
+      if (flight_leader_)
+        flight_->finish();
+      leave_flight();
+      flight_piece_.reset();
+      flight_started_ = false;
+      cache_key_.clear();
+      cached_.reset();
+      cached_serializer_.reset();
+      cached_response_.reset();
+      cached_file_.close(ec);
+      remote_socket_ = tcp::socket(stream_.get_executor());
+      serializer_.reset();
+      res_parser_.reset();
+      req_serializer_.reset();
+      if (remote_buffer_.size() == 0)
+        remote_buffer_.shrink_to_fit();
+      if (buffer_.size() == 0)
+        buffer_.shrink_to_fit();
+      to_client_buffer->release();
+      to_remote_buffer->release();
+      if (!client_keep_alive_ || registry_.draining())
+        return derived().shutdown_client();
+      read_request();
+    }
+
+    // Waits for the next request on the client connection.
+    void read_request()
+    {
+      req_parser_.emplace();
+      req_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+      reused_ = response_started_ = origin_keep_alive_ = false;
+      beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+      awaiting_request_ = true;
+      http::async_read_header(
+          stream_, buffer_, *req_parser_,
+          [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+          {
+            self->awaiting_request_ = false;
+            // Closed by a drain.
+            if (ec == net::error::operation_aborted)
+              return;
+            if (ec)
+            {
+              if (ec != http::error::end_of_stream)
+                SA_LOG_DEBUG("Error reading next proxy request: " << ec.message());
+              return self->shutdown_client();
+            }
+            beast::get_lowest_layer(self->stream_).expires_never();
+            // The session routes anything but absolute targets, which this
+            // connection is no longer attached to.
+            if (self->request().method() == http::verb::connect || !self->request().target().starts_with("http"))
+              return self->send_error(http::status::bad_request);
+            self->route();
+          });
+    }
+
+    // The origin switched protocols: the rest is relayed as bytes.
+    void upgrade()
+    {
+      net::async_write(
+          stream_, remote_buffer_.data(),
+          [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec)
+              return self->fail_exchange(ec, "write upgraded");
+            self->remote_buffer_.consume(self->remote_buffer_.size());
+            self->write_unconsumed();
+          });
+    }
+
+    // Answers with `status` if no response is under way, then closes.
+    void send_error(http::status status)
+    {
+      if (response_started_)
+        return fail_exchange(net::error::connection_aborted, "origin");
+      leave_flight();
+      beast::error_code ignored;
+      remote_socket_.close(ignored);
+      error_response_.emplace(status, request().version());
+      error_response_->set(http::field::server, BOOST_BEAST_VERSION_STRING);
+      error_response_->set(http::field::content_type, "text/plain");
+      error_response_->keep_alive(false);
+      error_response_->body() = std::string(http::obsolete_reason(status)) + "\n";
+      error_response_->prepare_payload();
+      http::async_write(
+          stream_, *error_response_,
+          [self = derived().shared_from_this()](boost::system::error_code ec, std::size_t)
+          {
+            if (ec)
+              return fail(ec, "write proxy error");
+            self->shutdown_client();
+          });
+    }
+
+    // Either side failed mid exchange: the client sees the connection end.
+    void fail_exchange(boost::system::error_code ec, char const *what)
+    {
+      if (ec != net::error::operation_aborted)
+        SA_LOG_WARN("Forward proxy " << what << ": " << ec.message());
+      leave_flight();
+      close();
+    }
 
   protected:
     beast::flat_buffer buffer_;
-    http::request<http::empty_body> req_;
     StreamType stream_;
     tcp::socket remote_socket_;
+    std::weak_ptr<HappyEyeballs> connecting_; // the connect to the origin under way
+    bool closed_ = false;
 
   private:
-    tcp::resolver resolver_; // need keep live for who async operations.
-    std::shared_ptr<std::array<char, max_length>> to_remote_buffer;
-    std::shared_ptr<std::array<char, max_length>> to_client_buffer;
+    static constexpr std::size_t body_read_size = 64 << 10;
+
+    SessionRegistry &registry_;
+    SessionRegistry::Registration registration_;
+    std::shared_ptr<RelayBuffer> to_remote_buffer;
+    std::shared_ptr<RelayBuffer> to_client_buffer;
+
+    std::string origin_;                  // "host:port", the pool key
+    bool reused_ = false;                 // remote_socket_ came from the pool
+    bool req_has_body_ = false;
+    bool expect_continue_ = false;        // the client waits for 100 before the body
+    bool response_started_ = false;       // bytes of the response reached the client
+    bool client_keep_alive_ = false;      // the client connection outlives the exchange
+    bool awaiting_request_ = false;       // between two requests of the client
+    bool origin_keep_alive_ = false;      // the origin connection may go back to the pool
+    beast::flat_buffer remote_buffer_;
+    std::optional<http::request_parser<http::buffer_body>> req_parser_;
+    std::optional<http::request_serializer<http::buffer_body>> req_serializer_;
+    std::optional<http::response_parser<http::buffer_body>> res_parser_;
+    std::optional<http::response_serializer<http::buffer_body>> serializer_;
+    std::optional<http::response<http::string_body>> error_response_;
+
+    std::string cache_key_;                          // empty unless the cache is on
+    std::int64_t request_time_ = 0;                  // when the request went to the origin
+    std::shared_ptr<CacheEntry const> cached_;       // being revalidated or served
+    std::unique_ptr<HttpCache::Writer> cache_writer_; // collects the body being relayed
+    std::optional<http::response<http::buffer_body>> cached_response_;
+    std::optional<http::response_serializer<http::buffer_body>> cached_serializer_;
+    beast::file cached_file_;
+    std::uint64_t cached_left_ = 0;                  // bytes of the stored body still to send
+
+    std::shared_ptr<Flight> flight_;                  // the GET in flight this one leads or follows
+    bool flight_leader_ = false;
+    std::size_t flight_reader_ = 0;
+    std::shared_ptr<std::string const> flight_piece_; // being written to the client
+    std::optional<net::steady_timer> flight_timer_;   // bounds a follower's wait
+    std::uint64_t flight_waits_ = 0;                  // the wait flight_timer_ is armed for
+    bool flight_waiting_ = false;                     // for the leader's header or body
+    bool flight_started_ = false;                     // the coalesced response reached the client
+    bool client_gone_ = false;                        // the leader relays for its followers only
   };
 
   class plain_http_copy : public http_copier<beast::tcp_stream, plain_http_copy>,
@@ -170,17 +1075,27 @@ namespace server_async
   public:
     plain_http_copy(
         beast::tcp_stream &&stream_,
-        http::request<http::empty_body> &&req_,
-        beast::flat_buffer &&buffer_)
+        http::request_parser<http::empty_body> &&parser,
+        beast::flat_buffer &&buffer_,
+        SessionRegistry &registry_)
         : http_copier<beast::tcp_stream, plain_http_copy>(
               std::move(stream_),
-              std::move(req_),
-              std::move(buffer_))
+              std::move(parser),
+              std::move(buffer_),
+              registry_)
     {
     }
     void
     do_eof()
     {
+      shutdown_client();
+    }
+
+    void
+    shutdown_client()
+    {
+      // A TLS connection handed over after kTLS took its records ends with close_notify.
+      ktls_send_close_notify(stream_.socket().native_handle());
       // Send a TCP shutdown
       beast::error_code ec;
       stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
@@ -194,34 +1109,31 @@ namespace server_async
   public:
     ssl_http_copy(
         ssl_beast_stream &&stream_,
-        http::request<http::empty_body> &&req_,
-        beast::flat_buffer &&buffer_)
+        http::request_parser<http::empty_body> &&parser,
+        beast::flat_buffer &&buffer_,
+        SessionRegistry &registry_)
         : http_copier<ssl_beast_stream, ssl_http_copy>(
               std::move(stream_),
-              std::move(req_),
-              std::move(buffer_))
+              std::move(parser),
+              std::move(buffer_),
+              registry_)
     {
     }
     void
     do_eof()
     {
-      // Set the timeout.
-      beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
-
-      // Perform the SSL shutdown
-      stream_.async_shutdown(
-          beast::bind_front_handler(
-              &ssl_http_copy::on_shutdown,
-              shared_from_this()));
+      if (ssl_relay_ended(relays_done_, remote_socket_, stream_))
+        shutdown_client();
     }
 
     void
-    on_shutdown(beast::error_code ec)
+    shutdown_client()
     {
-      if (ec)
-        return fail(ec, "shutdown");
-      // At this point the connection is closed gracefully
+      ssl_shutdown(shared_from_this(), stream_);
     }
+
+  private:
+    int relays_done_ = 0;
   };
 }
 
@@ -9,14 +9,16 @@
 namespace server_async
 {
 
+    // Common state of the request handlers. There is no virtual interface,
+    // every handler is used through its concrete type and provides
+    // `void handle_request()`.
+    // RequestType is a reference for handlers that finish before the parser is
+    // reused, and a value for handlers that outlive it (copy).
     template <typename SessionType, typename RequestType>
     class RequestHandlerbase
     {
     public:
-        RequestHandlerbase(std::shared_ptr<SessionType> &&session, RequestType req0 /*copy*/) : session(std::move(session)), req0(req0) {}
-        virtual ~RequestHandlerbase() = default;
-        // This will be the common interface for handling requests
-        virtual void handle_request() = 0;
+        RequestHandlerbase(std::shared_ptr<SessionType> &&session, RequestType req0) : session(std::move(session)), req0(req0) {}
 
     protected:
         // Utility to create a bad request response
@@ -19,6 +19,9 @@ namespace server_async
         std::string cert;
         std::string key;
         std::string dh;
+        // Optional ECDSA certificate served next to `cert` to clients that support it.
+        std::string ecdsa_cert;
+        std::string ecdsa_key;
     };
 
     using SessionVariant = std::variant<std::shared_ptr<plain_http_session>, std::shared_ptr<ssl_http_session>>;
@@ -37,11 +40,11 @@ namespace server_async
     // template <typename SessionType>
     // using HandlerFunc = std::function<void(std::shared_ptr<SessionType>, EmptyBodyParser)>;
 
+    // The request entry point, one per session type, defined next to the
+    // route table in http_server_async.hpp. Sessions and listeners only
+    // hold references to it.
     template <typename SessionType>
-    struct HandlerEntryPoint
-    {
-        virtual void operator()(std::shared_ptr<SessionType>, EmptyBodyParser &&) = 0;
-    };
+    struct HandlerEntryPoint;
 
     // using HandlerCommon = std::function<void(EmptyBodyParser, SessionVariant)>;
     // using HandlerFunc = std::function<http::message_generator(std::shared_ptr<Derived>, EmptyBodyParser)>;
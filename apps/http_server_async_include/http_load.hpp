@@ -0,0 +1,406 @@
+#pragma once
+#ifndef HTTP_LOAD_HPP
+#define HTTP_LOAD_HPP
+
+#include "http_client_async.hpp"
+#include "metrics.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/optional.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace client_async
+{
+    using LatencyHistogram = server_async::LatencyHistogram;
+
+    struct LoadOptions
+    {
+        std::string host = "127.0.0.1";
+        std::string port = "8080";
+        std::string target = "/";
+        http::verb method = http::verb::get;
+        // Sent with every request when not empty, e.g. to load an upload route.
+        std::string body;
+        std::string content_type = "application/octet-stream";
+        bool tls = false;
+        int connections = 16;
+        int threads = 1;
+        std::chrono::seconds duration{10};
+        // Requests per second over all connections, 0 runs closed-loop:
+        // every connection sends the next request as soon as one completes.
+        double rate = 0;
+        // Requests a connection may have outstanding at once.
+        int pipeline = 1;
+    };
+
+    struct LoadResult
+    {
+        std::uint64_t completed = 0;
+        std::uint64_t errors = 0;
+        // Responses with a 4xx/5xx status, also counted in `errors`.
+        std::uint64_t error_responses = 0;
+        std::uint64_t bytes = 0;
+        std::chrono::steady_clock::duration elapsed{};
+        // Measured from when a request was due to be sent. In open-loop mode
+        // this charges queueing behind a stalled response to the latency,
+        // which hides coordinated omission. In closed-loop mode both match.
+        LatencyHistogram corrected;
+        // Measured from when the request was actually written.
+        LatencyHistogram uncorrected;
+
+        double rps() const
+        {
+            auto secs = std::chrono::duration<double>(elapsed).count();
+            return secs > 0 ? static_cast<double>(completed) / secs : 0;
+        }
+
+        void merge(LoadResult const &other)
+        {
+            completed += other.completed;
+            errors += other.errors;
+            error_responses += other.error_responses;
+            bytes += other.bytes;
+            corrected.merge(other.corrected);
+            uncorrected.merge(other.uncorrected);
+        }
+    };
+
+    // Shared by all connections of a run.
+    struct LoadPlan
+    {
+        LoadOptions options;
+        std::string request; // serialized once, written as is
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point end;
+        // Interval between two requests of the same connection in open-loop mode.
+        std::chrono::steady_clock::duration interval{};
+
+        std::mutex mtx;
+        LoadResult result;
+    };
+
+    // One persistent keep-alive connection driving requests until the plan ends.
+    // Stream is beast::tcp_stream or ssl::stream<beast::tcp_stream>.
+    template <class Stream>
+    class load_session : public std::enable_shared_from_this<load_session<Stream>>
+    {
+        static constexpr bool is_ssl = !std::is_same_v<Stream, beast::tcp_stream>;
+        using clock = std::chrono::steady_clock;
+        // How long responses still under way at the end of the plan may
+        // take before their connection is given up.
+        static constexpr std::chrono::seconds end_grace{5};
+
+        struct Outstanding
+        {
+            clock::time_point intended;
+            clock::time_point sent;
+        };
+
+        LoadPlan &plan_;
+        Stream stream_;
+        net::steady_timer timer_;
+        beast::flat_buffer buffer_;
+        boost::optional<http::response_parser<http::string_body>> parser_;
+        // Requests written or waiting to be written, oldest first.
+        std::deque<Outstanding> outstanding_;
+        std::size_t unsent_ = 0;
+        bool writing_ = false;
+        bool reading_ = false;
+        bool timer_armed_ = false;
+        bool done_ = false;
+        std::uint64_t next_ = 0; // open-loop: index of the next scheduled request
+        clock::duration offset_{};
+        LoadResult result_;
+
+    public:
+        template <class... Args>
+        load_session(LoadPlan &plan, net::any_io_executor ex, Args &&...args)
+            : plan_(plan), stream_(ex, std::forward<Args>(args)...), timer_(ex)
+        {
+        }
+
+        // `offset` staggers the open-loop schedules of the connections.
+        void
+        run(tcp::resolver::results_type const &endpoints, clock::duration offset)
+        {
+            offset_ = offset;
+            beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+            beast::get_lowest_layer(stream_).async_connect(
+                endpoints,
+                beast::bind_front_handler(
+                    &load_session::on_connect,
+                    this->shared_from_this()));
+        }
+
+    private:
+        void
+        on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+        {
+            if (ec)
+                return finish(ec, "connect");
+
+            beast::get_lowest_layer(stream_).socket().set_option(tcp::no_delay(true), ec);
+            if constexpr (is_ssl)
+            {
+                if (!SSL_set_tlsext_host_name(stream_.native_handle(), plan_.options.host.c_str()))
+                    return finish(beast::error_code{static_cast<int>(::ERR_get_error()), net::error::get_ssl_category()}, "sni");
+                stream_.async_handshake(
+                    ssl::stream_base::client,
+                    beast::bind_front_handler(
+                        &load_session::on_handshake,
+                        this->shared_from_this()));
+            }
+            else
+            {
+                on_handshake({});
+            }
+        }
+
+        void
+        on_handshake(beast::error_code ec)
+        {
+            if (ec)
+                return finish(ec, "handshake");
+            // A stalled server fails the connection rather than holding the run.
+            beast::get_lowest_layer(stream_).expires_at(plan_.end + end_grace);
+            fill();
+        }
+
+        // Queue as many requests as the mode and pipeline depth allow.
+        void
+        fill()
+        {
+            auto now = clock::now();
+            std::size_t depth = static_cast<std::size_t>(std::max(1, plan_.options.pipeline));
+            while (outstanding_.size() < depth)
+            {
+                clock::time_point intended = now;
+                if (now < plan_.start)
+                {
+                    arm_timer(plan_.start);
+                    break;
+                }
+                if (plan_.options.rate > 0)
+                {
+                    intended = plan_.start + offset_ + plan_.interval * static_cast<clock::rep>(next_);
+                    if (intended > now)
+                    {
+                        arm_timer(intended);
+                        break;
+                    }
+                    ++next_;
+                }
+                if (intended >= plan_.end)
+                    break;
+                outstanding_.push_back({intended, {}});
+                ++unsent_;
+            }
+
+            do_write();
+            do_read();
+            maybe_finish();
+        }
+
+        void
+        arm_timer(clock::time_point when)
+        {
+            if (timer_armed_ || when >= plan_.end)
+                return;
+            timer_armed_ = true;
+            timer_.expires_at(when);
+            timer_.async_wait(
+                [self = this->shared_from_this()](beast::error_code ec)
+                {
+                    self->timer_armed_ = false;
+                    if (!ec && !self->done_)
+                        self->fill();
+                });
+        }
+
+        void
+        do_write()
+        {
+            if (writing_ || unsent_ == 0)
+                return;
+            writing_ = true;
+            outstanding_[outstanding_.size() - unsent_].sent = clock::now();
+            net::async_write(
+                stream_,
+                net::buffer(plan_.request),
+                beast::bind_front_handler(
+                    &load_session::on_write,
+                    this->shared_from_this()));
+        }
+
+        void
+        on_write(beast::error_code ec, std::size_t)
+        {
+            writing_ = false;
+            if (ec)
+                return finish(ec, "write");
+            --unsent_;
+            do_read();
+            do_write();
+        }
+
+        void
+        do_read()
+        {
+            if (reading_ || outstanding_.size() == unsent_)
+                return;
+            reading_ = true;
+            parser_.emplace();
+            parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+            http::async_read(
+                stream_,
+                buffer_,
+                *parser_,
+                beast::bind_front_handler(
+                    &load_session::on_read,
+                    this->shared_from_this()));
+        }
+
+        void
+        on_read(beast::error_code ec, std::size_t bytes_transferred)
+        {
+            reading_ = false;
+            if (ec)
+                return finish(ec, "read");
+
+            auto now = clock::now();
+            Outstanding const &o = outstanding_.front();
+            auto us = [](clock::duration d)
+            {
+                return static_cast<std::uint64_t>(std::max<std::int64_t>(
+                    0, std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+            };
+            result_.corrected.record(us(now - o.intended));
+            result_.uncorrected.record(us(now - o.sent));
+            outstanding_.pop_front();
+
+            result_.bytes += bytes_transferred;
+            if (parser_->get().result_int() >= 400)
+            {
+                ++result_.errors;
+                ++result_.error_responses;
+            }
+            else
+                ++result_.completed;
+
+            if (!parser_->get().keep_alive())
+                return finish({}, "keep-alive");
+            fill();
+        }
+
+        void
+        maybe_finish()
+        {
+            // Nothing in flight and nothing scheduled: the plan has ended.
+            if (outstanding_.empty() && !timer_armed_)
+                finish({}, nullptr);
+        }
+
+        void
+        finish(beast::error_code ec, char const *what)
+        {
+            if (done_)
+                return;
+            done_ = true;
+            if (ec && what)
+            {
+                fail(ec, what);
+                ++result_.errors;
+            }
+            // Requests still outstanding at the end are not counted either way.
+            timer_.cancel();
+            beast::error_code ignored;
+            beast::get_lowest_layer(stream_).socket().shutdown(tcp::socket::shutdown_both, ignored);
+
+            std::lock_guard<std::mutex> lock(plan_.mtx);
+            plan_.result.merge(result_);
+        }
+    };
+
+    // Run a load test to completion and return the merged results.
+    inline LoadResult
+    run_load(LoadOptions const &options)
+    {
+        net::io_context ioc{options.threads};
+        ssl::context ctx{ssl::context::tls_client};
+        // The tool measures our own servers, usually with self-signed certificates.
+        ctx.set_verify_mode(ssl::verify_none);
+
+        tcp::resolver resolver{ioc};
+        beast::error_code ec;
+        auto endpoints = resolver.resolve(options.host, options.port, ec);
+        if (ec)
+        {
+            fail(ec, "resolve");
+            return {};
+        }
+
+        LoadPlan plan;
+        plan.options = options;
+        {
+            http::request<http::string_body> req{options.method, options.target, 11};
+            req.set(http::field::host, options.host);
+            req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+            // Spelled out, some handlers look for the header rather than the version.
+            req.set(http::field::connection, "keep-alive");
+            if (!options.body.empty())
+            {
+                req.set(http::field::content_type, options.content_type);
+                req.body() = options.body;
+                req.prepare_payload();
+            }
+            std::ostringstream os;
+            os << req;
+            plan.request = os.str();
+        }
+
+        int connections = std::max(1, options.connections);
+        if (options.rate > 0)
+            plan.interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(connections / options.rate));
+        // Connections are set up before the clock starts.
+        plan.start = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+        plan.end = plan.start + options.duration;
+
+        for (int i = 0; i < connections; ++i)
+        {
+            auto offset = plan.interval * i / connections;
+            auto strand = net::make_strand(ioc);
+            if (options.tls)
+                std::make_shared<load_session<ssl::stream<beast::tcp_stream>>>(plan, strand, ctx)->run(endpoints, offset);
+            else
+                std::make_shared<load_session<beast::tcp_stream>>(plan, strand)->run(endpoints, offset);
+        }
+
+        // Closed-loop sessions keep sending until the end of the plan.
+        net::steady_timer deadline{ioc};
+        deadline.expires_at(plan.end);
+        deadline.async_wait([](beast::error_code) {});
+
+        std::vector<std::thread> pool;
+        for (int i = 1; i < options.threads; ++i)
+            pool.emplace_back([&ioc]
+                              { ioc.run(); });
+        ioc.run();
+        for (auto &t : pool)
+            t.join();
+
+        plan.result.elapsed = plan.end - plan.start;
+        return std::move(plan.result);
+    }
+}
+
+#endif
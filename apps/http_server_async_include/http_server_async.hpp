@@ -5,94 +5,139 @@
 #include "http_handler_util.hpp"
 #include "string_util.hpp"
 #include "handler_file.hpp"
+#include "handler_metrics.hpp"
+#include "handler_tasks.hpp"
+#include "router.hpp"
+#include "logger.hpp"
 
 namespace server_async
 {
-    template <typename SessionType>
-    struct handler : server_async::HandlerEntryPoint<SessionType>
+    enum class Route
     {
-        void operator()(std::shared_ptr<SessionType> session, server_async::EmptyBodyParser &&ep)
-        {
-            server_async::EmptyBodyRequest &ebr = ep.get();
+        root,
+        tasks,
+        task,
+        task_action,
+        index,
+        favicon,
+        upload,
+        metrics
+    };
 
-            boost::system::result<boost::urls::url> rv = boost::urls::parse_origin_form(ebr.target());
-            if (rv.has_error())
-            {
-                std::cerr << "Error: " << rv.error().message() << std::endl;
-                return session->do_eof();
-            }
+    inline const char *route_name(Route route)
+    {
+        switch (route)
+        {
+        case Route::root:
+            return "root";
+        case Route::tasks:
+            return "tasks";
+        case Route::task:
+            return "task";
+        case Route::task_action:
+            return "task_action";
+        case Route::index:
+            return "index";
+        case Route::favicon:
+            return "favicon";
+        case Route::upload:
+            return "upload";
+        case Route::metrics:
+            return "metrics";
+        }
+        return "unknown";
+    }
 
-            const std::string &path = rv.value().path();
-            size_t pos = 0;
-            std::vector<std::string_view> segments = server_async::all_segments(path);
-            // start router
-            if (segments.empty())
-            {
-                std::cout << "root path" << std::endl;
-            }
-            else if (segments[0] == "tasks")
-            {
-                switch (segments.size())
-                {
-                case 1: // /tasks
-                    /* code */
-                    break;
-                case 2: // tasks/t_uuid
-                    /* code */
-                    break;
-                case 3: // tasks/t_uuid/...
-                case 4:
-                    /* code */
-                    break;
+    // The route table, built once on first use.
+    inline Router<Route> const &routes()
+    {
+        static Router<Route> const router = []
+        {
+            Router<Route> r;
+            r.add("/", Route::root);
+            r.add("/tasks", Route::tasks);
+            r.add("/tasks/{t_uuid}", Route::task);
+            r.add("/tasks/{t_uuid}/*", Route::task_action);
+            r.add("/index.html", Route::index);
+            r.add("/favicon.ico", Route::favicon);
+            r.add("/upload/data", Route::upload);
+            r.add("/metrics", Route::metrics);
+            for (Route route : {Route::root, Route::tasks, Route::task, Route::task_action,
+                                Route::index, Route::favicon, Route::upload, Route::metrics})
+                Metrics::instance().name_route(static_cast<std::size_t>(route), route_name(route));
+            return r;
+        }();
+        return router;
+    }
 
-                default:
-                    break;
-                }
-            }
-            else if (path == "/index.html")
-            {
-                std::cout << "index.html" << std::endl;
-            }
-            else if (path == "/favicon.ico")
-            {
-                std::cout << "favicon.ico" << std::endl;
-            }
-            else
-            {
-                std::cout << "unknown path" << std::endl;
-            }
+    // The request entry point, one per session type. Dispatch is resolved
+    // at compile time: the session calls operator() directly instead of
+    // through a vtable.
+    template <typename SessionType>
+    struct HandlerEntryPoint
+    {
+        std::string doc_root = ".";
 
-            if (ebr[http::field::content_type].find("multipart/form-data") != std::string::npos ||
-                ebr.target() == "/upload/data")
-            {
-                std::make_shared<server_async::FileUploadHandler<SessionType>>(session, ep)
-                    ->handle_request();
-                return;
-            }
+        void operator()(std::shared_ptr<SessionType>, EmptyBodyParser &&);
+    };
 
-            // boost::urls::router router;
+    template <typename SessionType>
+    using handler = HandlerEntryPoint<SessionType>;
 
-            std::cout << "path: " << path << std::endl;
+    template <typename SessionType>
+    void HandlerEntryPoint<SessionType>::operator()(std::shared_ptr<SessionType> session, server_async::EmptyBodyParser &&ep)
+    {
+        server_async::EmptyBodyRequest &ebr = ep.get();
 
-            std::string prefix_tasks = "/tasks";
-            // size_t pos = 0;
+        // url_view only points into the request target, nothing is copied.
+        boost::system::result<boost::urls::url_view> rv = boost::urls::parse_origin_form(ebr.target());
+        if (rv.has_error())
+        {
+            SA_LOG_ERROR("Error: " << rv.error().message());
+            return session->do_eof();
+        }
 
-            // a long if else chain
-            // auto cr = std::make_shared<server_async::ResponseCreator>(
-            //     [&session](http::message_generator &&mg)
-            //     {
-            //         session->queue_write(std::move(mg));
-            //     });
+        std::string_view path = rv.value().encoded_path();
+        RouteParams params;
+        const Route *route = routes().match(path, params);
+        if (route)
+            session->set_route(static_cast<std::size_t>(*route));
 
-            std::shared_ptr<std::string const> const doc_root = std::make_shared<std::string>("."); // std::make_shared<std::string>(argv[3]);
-            // you must consume the ep or destroy it by release. because parser don't support copy and assign. request object do.
-            std::make_shared<server_async::FileRequestHandler<SessionType>>(session, *doc_root, ep)
+        // start router
+        if (ebr[http::field::content_type].find("multipart/form-data") != std::string::npos ||
+            (route && *route == Route::upload))
+        {
+            std::make_shared<server_async::FileUploadHandler<SessionType>>(session, ep)
                 ->handle_request();
+            return;
+        }
 
-            // return
-
-            std::cout << "Handling request..." << std::endl;
+        if (route)
+        {
+            switch (*route)
+            {
+            case Route::tasks:       // /tasks
+            case Route::task:        // /tasks/{t_uuid}, params.get("t_uuid")
+            case Route::task_action: // /tasks/{t_uuid}/..., params.wildcard
+                server_async::TaskRequestHandler<SessionType>{std::move(session), doc_root, ep, params}.handle_request();
+                return;
+            case Route::metrics:
+                server_async::MetricsRequestHandler<SessionType>{std::move(session), ep}.handle_request();
+                return;
+            default:
+                break;
+            }
         }
-    };
+
+        SA_LOG_DEBUG("path: " << path);
+
+        // Synchronous handlers live on this stack frame, only the upload
+        // handler above needs to outlive the call.
+        // you must consume the ep or destroy it by release. because parser don't support copy and assign. request object do.
+        server_async::FileRequestHandler<SessionType>{std::move(session), doc_root, ep}
+            .handle_request();
+
+        SA_LOG_DEBUG("Handling request...");
+    }
 }
 #endif
@@ -4,10 +4,16 @@
 
 #include "socket_session.hpp"
 #include "connection_session.hpp"
+#include "crypto_pool.hpp"
 #include "socket_copier.h"
 #include "http_copier.h"
 #include "http_handler.hpp"
 #include "http_handler_util.hpp"
+#include "ktls.hpp"
+#include "session_registry.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "request_timing.hpp"
 
 namespace server_async
 {
@@ -21,6 +27,16 @@ namespace server_async
     {
         std::shared_ptr<std::string const> doc_root_;
         HandlerEntryPoint<Derived> &handle_func;
+        SessionRegistry &registry_;
+        SessionRegistry::Registration registration_;
+        // true from the moment a request header is read until its response is written.
+        bool in_flight_ = false;
+        // Metrics labels of the request being handled, set by on_read and the handler.
+        std::size_t route_ = Metrics::unrouted;
+        http::verb method_ = http::verb::unknown;
+        // Responses queued so far, tells on_read whether the handler answered synchronously.
+        std::size_t responses_queued_ = 0;
+        RequestTimings timings_;
 
         // Access the derived class, this is part of
         // the Curiously Recurring Template Pattern idiom.
@@ -31,7 +47,28 @@ namespace server_async
         }
 
         static constexpr std::size_t queue_limit = 8; // max responses
-        std::queue<http::message_generator> response_queue_;
+        static constexpr std::uint64_t route_body_limit = 1024 * 1024; // Beast's default for requests
+
+        // A response waiting to be written, with what is needed to record it once sent.
+        struct queued_response
+        {
+            http::message_generator msg;
+            std::size_t route;
+            http::verb method;
+            unsigned status; // 0 when the handler queued a type-erased message
+            std::chrono::steady_clock::time_point header_done;
+            std::chrono::steady_clock::time_point queued;
+            PhaseDurations phases;
+            // Body sent with sendfile() once `msg`, the header, is written.
+            std::optional<http::file_body::value_type> sendfile;
+            std::uint64_t sendfile_offset = 0;
+        };
+        std::queue<queued_response> response_queue_;
+#if SERVER_ASYNC_HAS_KTLS
+        // Bounds a sendfile() wait for room in the socket, which the
+        // stream's own timeout does not see.
+        std::optional<net::steady_timer> sendfile_timer_;
+#endif
 
         // The parser is stored in an optional container so we can
         // construct it from scratch it at the beginning of each new message.
@@ -42,11 +79,52 @@ namespace server_async
         // Construct the session
         http_session(
             beast::flat_buffer buffer,
-            HandlerEntryPoint<Derived> &handle_func)
+            HandlerEntryPoint<Derived> &handle_func,
+            SessionRegistry &registry)
             // std::shared_ptr<std::string const> const &doc_root
             // )
-            : handle_func(handle_func), buffer_(std::move(buffer))
+            : handle_func(handle_func), registry_(registry), buffer_(std::move(buffer))
+        {
+        }
+
+        // Make the session visible to the server's drain logic.
+        // Must be called once the session is owned by a shared_ptr.
+        void
+        register_session()
+        {
+            registration_ = registry_.add(
+                SessionKind::http,
+                [weak = std::weak_ptr<Derived>(derived().shared_from_this()),
+                 ex = derived().stream().get_executor()](bool force)
+                {
+                    if (auto self = weak.lock())
+                        net::post(ex, [self, force]
+                                  { self->on_drain(force); });
+                });
+        }
+
+        // Runs on the session's strand.
+        void
+        on_drain(bool force)
+        {
+            // The stream has been handed to a copier, which drains itself.
+            if (!registration_.active())
+                return;
+
+            // An idle keep-alive connection is closed right away, a busy one
+            // closes after its response because draining turns off keep-alive.
+            if (force || !in_flight_)
+            {
+                beast::error_code ec;
+                beast::get_lowest_layer(derived().stream()).socket().close(ec);
+            }
+        }
+
+        // Phase timestamps, detect_session and the listener fill in the connection setup.
+        RequestTimings &
+        timings()
         {
+            return timings_;
         }
 
         void
@@ -54,10 +132,14 @@ namespace server_async
         {
             // Construct a new parser for each message
             parser_.emplace();
+            timings_.begin_read();
 
             // Apply a reasonable limit to the allowed size
             // of the body in bytes to prevent abuse.
             // parser_->body_limit(10000);
+            // The forward proxy streams bodies of any size, the limit for
+            // local routes is applied once the header says where it goes.
+            parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
 
             // Set the timeout.
             beast::get_lowest_layer(
@@ -72,27 +154,43 @@ namespace server_async
             //     beast::bind_front_handler(
             //         &http_session::on_read,
             //         derived().shared_from_this()));
-            http::async_read_header(
-                derived().stream(),
-                buffer_,
-                *parser_,
-                beast::bind_front_handler(
-                    &http_session::on_read,
-                    derived().shared_from_this()));
+            derived().visit_stream(
+                [this](auto &stream)
+                {
+                    http::async_read_header(
+                        stream,
+                        buffer_,
+                        *parser_,
+                        beast::bind_front_handler(
+                            &http_session::on_read,
+                            derived().shared_from_this()));
+                });
         }
 
         void
         on_read(beast::error_code ec, std::size_t bytes_transferred)
         {
-            boost::ignore_unused(bytes_transferred);
-
             // This means they closed the connection
             if (ec == http::error::end_of_stream)
                 return derived().do_eof();
 
+            // The drain closed an idle connection.
+            if (ec == net::error::operation_aborted && registry_.draining())
+                return;
+
             if (ec)
                 return fail(ec, "read");
 
+            in_flight_ = true;
+            route_ = Metrics::unrouted;
+            method_ = parser_->get().method();
+            timings_.header_done = std::chrono::steady_clock::now();
+            Metrics::instance().add_bytes_in(static_cast<std::size_t>(SessionKind::http), bytes_transferred);
+
+            // Once the server is draining every response carries "Connection: close".
+            if (registry_.draining())
+                parser_->get().keep_alive(false);
+
             // See if it is a WebSocket Upgrade
             if (websocket::is_upgrade(parser_->get()))
             {
@@ -102,6 +200,13 @@ namespace server_async
 
                 // Create a websocket session, transferring ownership
                 // of both the socket and the HTTP request.
+                registration_.reset();
+                // Records of a kTLS connection are the kernel's business, it continues as plain TCP.
+                if constexpr (std::is_same_v<Derived, ssl_http_session>)
+                    if (derived().ktls())
+                        return make_websocket_session(
+                            derived().release_plain_stream(),
+                            parser_->release());
                 return make_websocket_session(
                     derived().release_stream(),
                     parser_->release());
@@ -117,50 +222,60 @@ namespace server_async
                 //     ->start();
                 if constexpr (std::is_same_v<Derived, plain_http_session>)
                 {
-                    std::cout << "Handling plain HTTP session.\n";
+                    SA_LOG_DEBUG("Handling plain HTTP session.");
+                    registration_.reset();
                     auto st = derived().release_stream();
                     std::shared_ptr<plain_socket_copy> copier =
-                        std::make_shared<plain_socket_copy>(std::move(st), std::move(buffer_), parser_->release());
+                        std::make_shared<plain_socket_copy>(std::move(st), std::move(buffer_), parser_->release(), registry_);
 
                     return copier->start();
                 }
                 else if constexpr (std::is_same_v<Derived, ssl_http_session>)
                 {
+                    registration_.reset();
+                    if (derived().ktls())
+                        return std::make_shared<plain_socket_copy>(derived().release_plain_stream(), std::move(buffer_), parser_->release(), registry_)
+                            ->start();
                     auto st = derived().release_stream();
                     std::shared_ptr<ssl_socket_copy> copier =
-                        std::make_shared<ssl_socket_copy>(std::move(st), std::move(buffer_), parser_->release());
+                        std::make_shared<ssl_socket_copy>(std::move(st), std::move(buffer_), parser_->release(), registry_);
                     return copier->start();
                 }
                 else
                 {
-                    std::cout << "Unknown HTTP session type.\n";
+                    SA_LOG_ERROR("Unknown HTTP session type.");
                     return;
                 }
             }
             else if (parser_->get().target().starts_with("http"))
             {
-                std::cout << "got absolute target: " << parser_->get().target() << std::endl;
+                SA_LOG_DEBUG("got absolute target: " << parser_->get().target());
                 // start_http_copy(parser_->release());
                 // we need send the serialized req first then the unconsumed buffer.
                 if constexpr (std::is_same_v<Derived, plain_http_session>)
                 {
-                    std::cout << "Handling plain HTTP session.\n";
+                    SA_LOG_DEBUG("Handling plain HTTP session.");
+                    registration_.reset();
                     auto st = derived().release_stream();
                     std::shared_ptr<plain_http_copy> copier =
-                        std::make_shared<plain_http_copy>(std::move(st), parser_->release(), std::move(buffer_));
+                        std::make_shared<plain_http_copy>(std::move(st), std::move(*parser_), std::move(buffer_), registry_);
 
                     return copier->start();
                 }
                 else if constexpr (std::is_same_v<Derived, ssl_http_session>)
                 {
+                    registration_.reset();
+                    if (derived().ktls())
+                        return std::make_shared<plain_http_copy>(derived().release_plain_stream(), std::move(*parser_), std::move(buffer_), registry_)
+                            ->start();
                     auto st = derived().release_stream();
                     std::shared_ptr<ssl_http_copy> copier =
-                        std::make_shared<ssl_http_copy>(std::move(st), parser_->release(), std::move(buffer_));
+                        std::make_shared<ssl_http_copy>(std::move(st), std::move(*parser_), std::move(buffer_), registry_);
                     return copier->start();
                 }
                 else
                 {
-                    std::cout << "Unknown HTTP session type.\n";
+                    SA_LOG_ERROR("Unknown HTTP session type.");
                     return;
                 }
             }
@@ -176,28 +291,86 @@ namespace server_async
             // http::request_parser<http::empty_body> r2{std::move(r1)};
             // http::request_parser<http::string_body> r2{std::move(r1)};
 
+            // Local routes keep Beast's default limit on request bodies.
+            parser_->body_limit(route_body_limit);
+            if (auto length = parser_->content_length(); length && *length > route_body_limit)
+                return fail(http::error::body_limit, "read");
+
             auto const &headers = parser_->get().base();
 
+            bool keep_alive = parser_->get().keep_alive();
+            std::size_t queued_before = responses_queued_;
             handle_func(derived().shared_from_this(), std::move(parser_.get()));
             // queue_write(std::make_shared<FileRequestHandler>(*doc_root_, parser_->release())->handle_request());
 
-            // If we aren't at the queue limit, try to pipeline another request
-            // if handle_func take long time to call queue_write, the queue may exceed the limit. but it's no harm.
-            // if (response_queue_.size() < queue_limit)
-            //     do_read();
+            // A handler that answered synchronously is done with the parser and the
+            // stream, so read the next request (pipelined or keep-alive) unless the
+            // queue is full. A handler still reading the body resumes the read itself.
+            if (keep_alive && responses_queued_ != queued_before)
+                continue_read_if_needed();
         }
 
         void continue_read_if_needed()
         {
+            if (registry_.draining())
+                return;
             if (response_queue_.size() < queue_limit)
                 do_read();
         }
 
+        // Label the current request for metrics, called by the handler.
+        void
+        set_route(std::size_t id)
+        {
+            route_ = id;
+        }
+
+        // Typed responses are recorded with their status code.
+        template <class Body, class Fields>
+        void
+        queue_write(http::response<Body, Fields> &&response)
+        {
+            unsigned status = response.result_int();
+            push_response(http::message_generator(std::move(response)), status);
+        }
+
+        // A file on a kTLS connection goes out with sendfile(): the header
+        // through the stream, the body from the page cache straight into the
+        // kernel's record encryption without a copy through user space.
+        void
+        queue_write(http::response<http::file_body> &&response)
+        {
+            unsigned status = response.result_int();
+#if SERVER_ASYNC_HAS_KTLS
+            if (derived().sendfile_ok())
+            {
+                http::file_body::value_type body = std::move(response.body());
+                http::response<http::empty_body> header{std::move(response.base())};
+                header.content_length(body.size());
+                return push_response(http::message_generator(std::move(header)), status, std::move(body));
+            }
+#endif
+            push_response(http::message_generator(std::move(response)), status);
+        }
+
         void
         queue_write(http::message_generator response)
         {
+            push_response(std::move(response), 0);
+        }
+
+        void
+        push_response(http::message_generator response, unsigned status,
+                      std::optional<http::file_body::value_type> sendfile = std::nullopt)
+        {
+            auto now = std::chrono::steady_clock::now();
+            PhaseDurations phases = timings_.on_queued(now);
+            timings_.first_request = false;
+
+            ++responses_queued_;
             // Allocate and store the work
-            response_queue_.push(std::move(response));
+            response_queue_.push(queued_response{std::move(response), route_, method_, status, timings_.header_done, now, phases,
+                                                 std::move(sendfile)});
             // // move from on_read to here. because the handle_func may access the underlying buffer.
             // if (response_queue_.size() < queue_limit)
             //     do_read();
@@ -214,17 +387,82 @@ namespace server_async
         {
             if (!response_queue_.empty())
             {
-                bool keep_alive = response_queue_.front().keep_alive();
+                bool keep_alive = response_queue_.front().msg.keep_alive();
+
+                derived().visit_stream(
+                    [this, keep_alive](auto &stream)
+                    {
+                        beast::async_write(
+                            stream,
+                            std::move(response_queue_.front().msg),
+                            beast::bind_front_handler(
+                                &http_session::on_write,
+                                derived().shared_from_this(),
+                                keep_alive));
+                    });
+            }
+        }
 
-                beast::async_write(
-                    derived().stream(),
-                    std::move(response_queue_.front()),
-                    beast::bind_front_handler(
-                        &http_session::on_write,
-                        derived().shared_from_this(),
-                        keep_alive));
+#if SERVER_ASYNC_HAS_KTLS
+        // Sends the body of the front response after its header. `sent`
+        // counts the bytes written so far, header included.
+        void
+        do_sendfile(bool keep_alive, std::size_t sent)
+        {
+            static constexpr std::size_t sendfile_chunk = 1 << 20;
+            queued_response &front = response_queue_.front();
+            auto &socket = beast::get_lowest_layer(derived().stream()).socket();
+            beast::error_code ec;
+            socket.native_non_blocking(true, ec);
+            while (!ec && front.sendfile_offset < front.sendfile->size())
+            {
+                off_t offset = static_cast<off_t>(front.sendfile_offset);
+                std::size_t count = static_cast<std::size_t>(
+                    std::min<std::uint64_t>(front.sendfile->size() - front.sendfile_offset, sendfile_chunk));
+                ssize_t n = ::sendfile(socket.native_handle(), front.sendfile->file().native_handle(), &offset, count);
+                if (n > 0)
+                {
+                    front.sendfile_offset += static_cast<std::uint64_t>(n);
+                    sent += static_cast<std::size_t>(n);
+                }
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    // A client that stops reading is cut off like any stalled write.
+                    if (!sendfile_timer_)
+                        sendfile_timer_.emplace(socket.get_executor());
+                    sendfile_timer_->expires_after(std::chrono::seconds(30));
+                    sendfile_timer_->async_wait(
+                        [self = derived().shared_from_this()](beast::error_code ec)
+                        {
+                            if (!ec)
+                                beast::get_lowest_layer(self->stream()).socket().close(ec);
+                        });
+                    return socket.async_wait(
+                        tcp::socket::wait_write,
+                        [self = derived().shared_from_this(), keep_alive, sent](beast::error_code ec)
+                        {
+                            self->sendfile_timer_->cancel();
+                            if (ec)
+                                return fail(ec, "sendfile");
+                            self->do_sendfile(keep_alive, sent);
+                        });
+                }
+                else if (n < 0 && errno != EINTR)
+                {
+                    ec.assign(errno, beast::system_category());
+                }
+                else if (n == 0)
+                {
+                    // The file shrank under us, the response cannot be completed.
+                    ec = net::error::eof;
+                }
             }
+            if (ec)
+                return fail(ec, "sendfile");
+            front.sendfile.reset();
+            on_write(keep_alive, {}, sent);
         }
+#endif
 
         void
         on_write(
@@ -232,11 +470,15 @@ namespace server_async
             beast::error_code ec,
             std::size_t bytes_transferred)
         {
-            boost::ignore_unused(bytes_transferred);
-
             if (ec)
                 return fail(ec, "write");
 
+#if SERVER_ASYNC_HAS_KTLS
+            if (response_queue_.front().sendfile)
+                return do_sendfile(keep_alive, bytes_transferred);
+#endif
+            record_sent(response_queue_.front(), bytes_transferred);
+
             if (!keep_alive)
             {
                 // This means we should close the connection, usually because
@@ -246,13 +488,41 @@ namespace server_async
 
             // Resume the read if it has been paused
             // if (response_queue_.size() == queue_limit)
-            if (response_queue_.size() >= queue_limit)
+            if (response_queue_.size() >= queue_limit && !registry_.draining())
                 do_read();
 
             response_queue_.pop();
 
+            if (response_queue_.empty())
+            {
+                in_flight_ = false;
+                // A response queued before the drain started may still say keep-alive,
+                // the connection is idle now.
+                if (registry_.draining())
+                    return on_drain(false);
+            }
+
             do_write();
         }
+
+        void
+        record_sent(queued_response &sent, std::size_t bytes_transferred)
+        {
+            auto now = std::chrono::steady_clock::now();
+            sent.phases[static_cast<std::size_t>(Phase::write)] = now - sent.queued;
+
+            Metrics &metrics = Metrics::instance();
+            metrics.record_request(sent.route, sent.status, now - sent.header_done);
+            metrics.record_phases(sent.phases);
+            metrics.add_bytes_out(static_cast<std::size_t>(SessionKind::http), bytes_transferred);
+
+            auto threshold = slow_request_threshold_us().load(std::memory_order_relaxed);
+            auto service = std::chrono::duration_cast<std::chrono::microseconds>(now - sent.header_done).count();
+            if (threshold > 0 && service > threshold)
+                SA_LOG_WARN("slow request: " << http::to_string(sent.method) << " route=" << metrics.route_name(sent.route)
+                                             << " status=" << sent.status << " total=" << service << "us"
+                                             << PhaseBreakdown{sent.phases});
+        }
         // virtual boost::asio::io_context &get_io_context() = 0;
     };
 
@@ -269,9 +539,10 @@ namespace server_async
         plain_http_session(
             beast::tcp_stream &&stream,
             beast::flat_buffer &&buffer,
-            HandlerEntryPoint<plain_http_session> &handle_func)
+            HandlerEntryPoint<plain_http_session> &handle_func,
+            SessionRegistry &registry)
             : http_session<plain_http_session>(
-                  std::move(buffer), handle_func),
+                  std::move(buffer), handle_func, registry),
               stream_(std::move(stream))
         {
         }
@@ -280,6 +551,8 @@ namespace server_async
         void
         run()
         {
+            this->timings().start();
+            this->register_session();
             this->do_read();
         }
 
@@ -295,6 +568,20 @@ namespace server_async
             return stream_.socket();
         }
 
+        // Called by the base class with the stream requests and responses go through.
+        template <class F>
+        void
+        visit_stream(F &&f)
+        {
+            f(stream_);
+        }
+
+        bool
+        sendfile_ok() const
+        {
+            return false;
+        }
+
         // boost::asio::io_context &get_io_context()
         // {
         //     // return boost::asio::use_service<boost::asio::io_context>(stream_.get_executor().context());
@@ -328,7 +615,14 @@ namespace server_async
         : public http_session<ssl_http_session>,
           public std::enable_shared_from_this<ssl_http_session>
     {
+        // Filled in during the handshake, declared first so it outlives the SSL object.
+        KtlsCapture ktls_capture_;
         ssl::stream<beast::tcp_stream> stream_;
+        // Where the handshake computation runs, the io thread when null.
+        CryptoPool *crypto_pool_;
+        bool ktls_requested_ = false;
+        // The kernel encrypts and decrypts records, the SSL object is unused since.
+        bool ktls_ = false;
 
     public:
         // Create the http_session
@@ -336,27 +630,46 @@ namespace server_async
             beast::tcp_stream &&stream,
             ssl::context &ctx,
             beast::flat_buffer &&buffer,
-            HandlerEntryPoint<ssl_http_session> &handle_func)
+            HandlerEntryPoint<ssl_http_session> &handle_func,
+            SessionRegistry &registry,
+            CryptoPool *crypto_pool = nullptr)
             // std::shared_ptr<std::string const> const &doc_root
             // )
             : http_session<ssl_http_session>(
                   std::move(buffer),
-                  handle_func
+                  handle_func,
+                  registry
                   //   doc_root
                   ),
-              stream_(std::move(stream), ctx)
+              stream_(std::move(stream), ctx),
+              crypto_pool_(crypto_pool)
         {
+            ktls_requested_ = ktls_enabled().load(std::memory_order_relaxed);
+            if (ktls_requested_)
+                ktls_capture(stream_.native_handle(), ktls_capture_);
         }
 
         // Start the session
         void
         run()
         {
+            timings().start();
+            register_session();
+
             // Set the timeout.
             beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
 
             // Perform the SSL handshake
             // Note, this is the buffered version of the handshake.
+            timings().handshake_start = std::chrono::steady_clock::now();
+            if (crypto_pool_)
+                return async_pooled_handshake(
+                    stream_,
+                    *crypto_pool_,
+                    buffer_.data(),
+                    beast::bind_front_handler(
+                        &ssl_http_session::on_handshake,
+                        shared_from_this()));
             stream_.async_handshake(
                 ssl::stream_base::server,
                 buffer_.data(),
@@ -377,6 +690,37 @@ namespace server_async
         {
             return stream_.lowest_layer();
         }
+
+        // Called by the base class with the stream requests and responses go
+        // through: the TCP stream itself once the kernel handles the records.
+        template <class F>
+        void
+        visit_stream(F &&f)
+        {
+            if (ktls_)
+                f(stream_.next_layer());
+            else
+                f(stream_);
+        }
+
+        bool
+        ktls() const
+        {
+            return ktls_;
+        }
+
+        bool
+        sendfile_ok() const
+        {
+            return ktls_;
+        }
+
+        // The TCP stream of a kTLS connection, for a session or copier taking it over.
+        beast::tcp_stream
+        release_plain_stream()
+        {
+            return std::move(stream_.next_layer());
+        }
         // boost::asio::io_context &get_io_context()
         // {
         //     // return boost::asio::use_service<boost::asio::io_context>(stream_.get_executor().context());
@@ -394,6 +738,14 @@ namespace server_async
         void
         do_eof()
         {
+            if (ktls_)
+            {
+                beast::error_code ec;
+                ktls_send_close_notify(socket().native_handle());
+                socket().shutdown(tcp::socket::shutdown_send, ec);
+                return;
+            }
+
             // Set the timeout.
             beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
 
@@ -412,10 +764,31 @@ namespace server_async
         {
             if (ec)
                 return fail(ec, "handshake");
+            timings().handshake_done = std::chrono::steady_clock::now();
+            Metrics::instance().tls_handshake(SSL_session_reused(stream_.native_handle()) == 1);
 
             // Consume the portion of the buffer used by the handshake
             buffer_.consume(bytes_used);
 
+            if (ktls_requested_)
+            {
+                ktls_capture_done(stream_.native_handle());
+                // Bytes already read past the handshake are ciphertext the kernel never sees.
+                KtlsResult result = buffer_.size() == 0
+                                        ? enable_ktls(stream_.native_handle(), socket().native_handle(), ktls_capture_)
+                                        : KtlsResult::unavailable;
+                ktls_capture_ = {};
+                if (result == KtlsResult::failed)
+                {
+                    SA_LOG_ERROR("ktls: kernel took the send keys but not the receive keys, closing");
+                    beast::error_code ec;
+                    socket().close(ec);
+                    return;
+                }
+                ktls_ = result == KtlsResult::offloaded;
+                Metrics::instance().ktls(ktls_);
+            }
+
             do_read();
         }
 
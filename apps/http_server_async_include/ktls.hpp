@@ -0,0 +1,384 @@
+#pragma once
+#ifndef SERVER_ASYNC_KTLS_HPP
+#define SERVER_ASYNC_KTLS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+
+#if defined(__linux__) && __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#define SERVER_ASYNC_HAS_KTLS 1
+#else
+#define SERVER_ASYNC_HAS_KTLS 0
+#endif
+
+// Kernel TLS: after the handshake the record keys go to the kernel with
+// setsockopt(SOL_TLS), then plain reads and writes on the socket are TLS
+// records on the wire and sendfile() can serve files without a copy
+// through user space.
+//
+// The handshake runs on OpenSSL over memory BIOs (that is how asio's
+// ssl::stream works), so OpenSSL cannot enable kTLS itself. Instead the
+// keys are derived here: TLS 1.3 traffic secrets come from the keylog
+// callback, TLS 1.2 keys from the master secret, and the TLS 1.3 write
+// sequence number from counting the session tickets sent.
+namespace server_async
+{
+    // Whether TLS sessions try to offload records to the kernel after the
+    // handshake. HttpServer::set_ktls() changes it.
+    inline std::atomic<bool> &ktls_enabled()
+    {
+        static std::atomic<bool> enabled{false};
+        return enabled;
+    }
+
+    // What a connection captures during its handshake.
+    struct KtlsCapture
+    {
+        // TLS 1.3 application traffic secrets, empty for TLS 1.2.
+        std::vector<unsigned char> client_secret;
+        std::vector<unsigned char> server_secret;
+        // TLS 1.3 tickets go out under the server traffic key after the handshake.
+        std::uint64_t tickets_sent = 0;
+    };
+
+    // Record protection state of one direction.
+    struct KtlsDirection
+    {
+        std::vector<unsigned char> key;
+        // 4 byte salt for AES-GCM under TLS 1.2, the 12 byte nonce otherwise.
+        std::vector<unsigned char> iv;
+        std::uint64_t seq = 0;
+    };
+
+    struct KtlsKeys
+    {
+        int version = 0;    // TLS1_2_VERSION or TLS1_3_VERSION
+        int cipher_nid = 0; // NID_aes_128_gcm, NID_aes_256_gcm or NID_chacha20_poly1305
+        KtlsDirection tx;   // server to client
+        KtlsDirection rx;   // client to server
+    };
+
+    enum class KtlsResult
+    {
+        offloaded,
+        // Left on OpenSSL, the connection carries on as before.
+        unavailable,
+        // Half configured, the connection has to be closed.
+        failed
+    };
+
+    namespace detail
+    {
+        inline int ktls_capture_index()
+        {
+            static int const index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+            return index;
+        }
+
+        inline KtlsCapture *ktls_capture_of(SSL const *ssl)
+        {
+            return static_cast<KtlsCapture *>(SSL_get_ex_data(ssl, ktls_capture_index()));
+        }
+
+        inline std::vector<unsigned char> from_hex(std::string_view hex)
+        {
+            auto nibble = [](char c)
+            { return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; };
+            std::vector<unsigned char> bytes(hex.size() / 2);
+            for (std::size_t i = 0; i < bytes.size(); ++i)
+                bytes[i] = static_cast<unsigned char>(nibble(hex[2 * i]) << 4 | nibble(hex[2 * i + 1]));
+            return bytes;
+        }
+
+        // Lines are "<label> <client random> <secret>" in NSS key log format.
+        inline void ktls_keylog_callback(SSL const *ssl, char const *line)
+        {
+            KtlsCapture *capture = ktls_capture_of(ssl);
+            if (!capture)
+                return;
+            std::string_view text{line};
+            auto label_end = text.find(' ');
+            auto secret_start = text.rfind(' ');
+            if (label_end == std::string_view::npos || secret_start == label_end)
+                return;
+            std::string_view label = text.substr(0, label_end);
+            if (label == "CLIENT_TRAFFIC_SECRET_0")
+                capture->client_secret = from_hex(text.substr(secret_start + 1));
+            else if (label == "SERVER_TRAFFIC_SECRET_0")
+                capture->server_secret = from_hex(text.substr(secret_start + 1));
+        }
+
+        inline void ktls_msg_callback(int write_p, int, int content_type, void const *buf, std::size_t len, SSL *, void *arg)
+        {
+            if (write_p && content_type == SSL3_RT_HANDSHAKE && len > 0 &&
+                static_cast<unsigned char const *>(buf)[0] == SSL3_MT_NEWSESSION_TICKET)
+                ++static_cast<KtlsCapture *>(arg)->tickets_sent;
+        }
+
+        // HKDF-Expand-Label of RFC 8446 section 7.1 with an empty context.
+        inline bool expand_label(EVP_MD const *md, std::vector<unsigned char> const &secret,
+                                 std::string_view label, std::vector<unsigned char> &out)
+        {
+            std::vector<unsigned char> info;
+            info.push_back(static_cast<unsigned char>(out.size() >> 8));
+            info.push_back(static_cast<unsigned char>(out.size()));
+            info.push_back(static_cast<unsigned char>(6 + label.size()));
+            info.insert(info.end(), {'t', 'l', 's', '1', '3', ' '});
+            info.insert(info.end(), label.begin(), label.end());
+            info.push_back(0);
+
+            EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+            std::size_t out_len = out.size();
+            bool ok = pctx &&
+                      EVP_PKEY_derive_init(pctx) == 1 &&
+                      EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) == 1 &&
+                      EVP_PKEY_CTX_set_hkdf_md(pctx, md) == 1 &&
+                      EVP_PKEY_CTX_set1_hkdf_key(pctx, secret.data(), static_cast<int>(secret.size())) == 1 &&
+                      EVP_PKEY_CTX_add1_hkdf_info(pctx, info.data(), static_cast<int>(info.size())) == 1 &&
+                      EVP_PKEY_derive(pctx, out.data(), &out_len) == 1;
+            EVP_PKEY_CTX_free(pctx);
+            return ok;
+        }
+
+        // The TLS 1.2 key block, RFC 5246 section 6.3.
+        inline bool key_block(SSL *ssl, EVP_MD const *md, std::vector<unsigned char> &out)
+        {
+            unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+            std::size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof master);
+            unsigned char client_random[SSL3_RANDOM_SIZE];
+            unsigned char server_random[SSL3_RANDOM_SIZE];
+            SSL_get_client_random(ssl, client_random, sizeof client_random);
+            SSL_get_server_random(ssl, server_random, sizeof server_random);
+            static constexpr unsigned char label[] = "key expansion";
+
+            EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+            std::size_t out_len = out.size();
+            bool ok = pctx &&
+                      EVP_PKEY_derive_init(pctx) == 1 &&
+                      EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) == 1 &&
+                      EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, static_cast<int>(master_len)) == 1 &&
+                      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, label, static_cast<int>(sizeof label - 1)) == 1 &&
+                      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random, sizeof server_random) == 1 &&
+                      EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random, sizeof client_random) == 1 &&
+                      EVP_PKEY_derive(pctx, out.data(), &out_len) == 1;
+            EVP_PKEY_CTX_free(pctx);
+            OPENSSL_cleanse(master, sizeof master);
+            return ok;
+        }
+    }
+
+    // Installs the keylog callback kTLS needs for TLS 1.3 secrets. Only
+    // connections prepared with ktls_capture() record anything.
+    inline void enable_ktls_capture(SSL_CTX *ctx)
+    {
+        SSL_CTX_set_keylog_callback(ctx, detail::ktls_keylog_callback);
+    }
+
+    // Starts recording what enable_ktls() needs, before the handshake.
+    // `capture` must stay put until ktls_capture_done().
+    inline void ktls_capture(SSL *ssl, KtlsCapture &capture)
+    {
+        SSL_set_ex_data(ssl, detail::ktls_capture_index(), &capture);
+        SSL_set_msg_callback(ssl, detail::ktls_msg_callback);
+        SSL_set_msg_callback_arg(ssl, &capture);
+    }
+
+    inline void ktls_capture_done(SSL *ssl)
+    {
+        SSL_set_msg_callback(ssl, nullptr);
+        SSL_set_msg_callback_arg(ssl, nullptr);
+        SSL_set_ex_data(ssl, detail::ktls_capture_index(), nullptr);
+    }
+
+    // Record keys and sequence numbers of both directions right after the
+    // handshake, or nothing for a protocol or cipher the kernel cannot take.
+    inline std::optional<KtlsKeys> derive_ktls_keys(SSL *ssl, KtlsCapture const &capture)
+    {
+        KtlsKeys keys;
+        keys.version = SSL_version(ssl);
+        SSL_CIPHER const *cipher = SSL_get_current_cipher(ssl);
+        if (!cipher || (keys.version != TLS1_2_VERSION && keys.version != TLS1_3_VERSION))
+            return std::nullopt;
+        keys.cipher_nid = SSL_CIPHER_get_cipher_nid(cipher);
+        std::size_t key_len = 0;
+        switch (keys.cipher_nid)
+        {
+        case NID_aes_128_gcm:
+            key_len = 16;
+            break;
+        case NID_aes_256_gcm:
+        case NID_chacha20_poly1305:
+            key_len = 32;
+            break;
+        default:
+            return std::nullopt;
+        }
+        EVP_MD const *md = SSL_CIPHER_get_handshake_digest(cipher);
+        if (!md)
+            return std::nullopt;
+
+        if (keys.version == TLS1_3_VERSION)
+        {
+            if (capture.client_secret.empty() || capture.server_secret.empty())
+                return std::nullopt;
+            for (auto [direction, secret] : {std::pair{&keys.tx, &capture.server_secret},
+                                             std::pair{&keys.rx, &capture.client_secret}})
+            {
+                direction->key.resize(key_len);
+                direction->iv.resize(12);
+                if (!detail::expand_label(md, *secret, "key", direction->key) ||
+                    !detail::expand_label(md, *secret, "iv", direction->iv))
+                    return std::nullopt;
+            }
+            // Finished went under the handshake keys, only tickets were sent since.
+            keys.tx.seq = capture.tickets_sent;
+            keys.rx.seq = 0;
+            return keys;
+        }
+
+        // client key, server key, client iv, server iv; AEAD suites have no MAC keys.
+        std::size_t iv_len = keys.cipher_nid == NID_chacha20_poly1305 ? 12 : 4;
+        std::vector<unsigned char> block(2 * key_len + 2 * iv_len);
+        if (!detail::key_block(ssl, md, block))
+            return std::nullopt;
+        auto at = block.begin();
+        keys.rx.key.assign(at, at + key_len);
+        keys.tx.key.assign(at + key_len, at + 2 * key_len);
+        keys.rx.iv.assign(at + 2 * key_len, at + 2 * key_len + iv_len);
+        keys.tx.iv.assign(at + 2 * key_len + iv_len, block.end());
+        OPENSSL_cleanse(block.data(), block.size());
+        // Each side's Finished was the first record under the new keys.
+        keys.tx.seq = 1;
+        keys.rx.seq = 1;
+        return keys;
+    }
+
+#if SERVER_ASYNC_HAS_KTLS
+    namespace detail
+    {
+        template <class Info>
+        bool set_crypto_info(int fd, int direction, int version, int cipher_type, KtlsDirection const &keys)
+        {
+            Info info;
+            std::memset(&info, 0, sizeof info);
+            info.info.version = version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+            info.info.cipher_type = static_cast<unsigned short>(cipher_type);
+            unsigned char seq[8];
+            for (int i = 0; i < 8; ++i)
+                seq[i] = static_cast<unsigned char>(keys.seq >> (56 - 8 * i));
+
+            std::memcpy(info.key, keys.key.data(), sizeof info.key);
+            std::memcpy(info.rec_seq, seq, sizeof seq);
+            if constexpr (sizeof(info.salt) > 0)
+            {
+                // AES-GCM: 4 byte salt plus 8 bytes of nonce. TLS 1.2 sends the
+                // 8 bytes explicitly, starting them at the sequence number.
+                std::memcpy(info.salt, keys.iv.data(), sizeof info.salt);
+                if (version == TLS1_3_VERSION)
+                    std::memcpy(info.iv, keys.iv.data() + sizeof info.salt, sizeof info.iv);
+                else
+                    std::memcpy(info.iv, seq, sizeof info.iv);
+            }
+            else
+            {
+                std::memcpy(info.iv, keys.iv.data(), sizeof info.iv);
+            }
+            bool ok = ::setsockopt(fd, SOL_TLS, direction, &info, sizeof info) == 0;
+            OPENSSL_cleanse(&info, sizeof info);
+            return ok;
+        }
+
+        inline bool set_crypto_info(int fd, int direction, KtlsKeys const &keys, KtlsDirection const &state)
+        {
+            switch (keys.cipher_nid)
+            {
+            case NID_aes_128_gcm:
+                return set_crypto_info<tls12_crypto_info_aes_gcm_128>(fd, direction, keys.version, TLS_CIPHER_AES_GCM_128, state);
+#ifdef TLS_CIPHER_AES_GCM_256
+            case NID_aes_256_gcm:
+                return set_crypto_info<tls12_crypto_info_aes_gcm_256>(fd, direction, keys.version, TLS_CIPHER_AES_GCM_256, state);
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+            case NID_chacha20_poly1305:
+                return set_crypto_info<tls12_crypto_info_chacha20_poly1305>(fd, direction, keys.version, TLS_CIPHER_CHACHA20_POLY1305, state);
+#endif
+            default:
+                return false;
+            }
+        }
+    }
+
+    // Moves record protection of `ssl`'s connection into the kernel, both
+    // directions or neither. OpenSSL must not have buffered ciphertext past
+    // the handshake: the kernel would never see those records.
+    inline KtlsResult enable_ktls(SSL *ssl, int fd, KtlsCapture const &capture)
+    {
+        if (BIO_ctrl_pending(SSL_get_rbio(ssl)) != 0 || SSL_pending(ssl) != 0)
+            return KtlsResult::unavailable;
+        auto keys = derive_ktls_keys(ssl, capture);
+        if (!keys)
+            return KtlsResult::unavailable;
+        // RX goes first: kernels take TLS 1.3 and some ciphers for TX
+        // before RX, and the tls module passes data through untouched until
+        // a direction is set, so a refused RX leaves the connection on OpenSSL.
+        KtlsResult result = KtlsResult::unavailable;
+        if (::setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == 0 &&
+            detail::set_crypto_info(fd, TLS_RX, *keys, keys->rx))
+            result = detail::set_crypto_info(fd, TLS_TX, *keys, keys->tx) ? KtlsResult::offloaded : KtlsResult::failed;
+        OPENSSL_cleanse(keys->tx.key.data(), keys->tx.key.size());
+        OPENSSL_cleanse(keys->rx.key.data(), keys->rx.key.size());
+        return result;
+    }
+
+    // Ends the TLS stream of an offloaded socket: a close_notify alert goes
+    // out as its own record. Does nothing on any other socket.
+    inline void ktls_send_close_notify(int fd)
+    {
+        // Just the common part, the only length the kernel takes for every cipher.
+        tls_crypto_info info;
+        socklen_t len = sizeof info;
+        if (::getsockopt(fd, SOL_TLS, TLS_TX, &info, &len) != 0)
+            return;
+        OPENSSL_cleanse(&info, sizeof info);
+
+        unsigned char alert[2] = {1 /* warning */, 0 /* close_notify */};
+        iovec iov{alert, sizeof alert};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(unsigned char))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+        *CMSG_DATA(cmsg) = SSL3_RT_ALERT;
+        ::sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+#else
+    inline KtlsResult enable_ktls(SSL *, int, KtlsCapture const &)
+    {
+        return KtlsResult::unavailable;
+    }
+
+    inline void ktls_send_close_notify(int)
+    {
+    }
+#endif
+}
+
+#endif
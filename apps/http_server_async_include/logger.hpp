@@ -0,0 +1,356 @@
+#pragma once
+#ifndef SERVER_ASYNC_LOGGER_H
+#define SERVER_ASYNC_LOGGER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace server_async
+{
+    enum class LogLevel : int
+    {
+        debug,
+        info,
+        warn,
+        error,
+        off
+    };
+
+    inline std::string_view to_string(LogLevel level)
+    {
+        switch (level)
+        {
+        case LogLevel::debug:
+            return "debug";
+        case LogLevel::info:
+            return "info";
+        case LogLevel::warn:
+            return "warn";
+        case LogLevel::error:
+            return "error";
+        default:
+            return "off";
+        }
+    }
+
+    inline LogLevel parse_log_level(std::string_view s, LogLevel fallback = LogLevel::info)
+    {
+        for (LogLevel l : {LogLevel::debug, LogLevel::info, LogLevel::warn, LogLevel::error, LogLevel::off})
+            if (s == to_string(l))
+                return l;
+        return fallback;
+    }
+
+    // Asynchronous logger.
+    //
+    // Every thread that logs gets its own single-producer/single-consumer
+    // ring of fixed-size records, so io threads never take a lock or
+    // allocate to log a line. A background thread drains all rings,
+    // orders the batch by timestamp and writes it with one flush.
+    // When a ring is full the record is dropped and counted instead of
+    // blocking the producer.
+    class Logger
+    {
+    public:
+        static constexpr std::size_t ring_size = 1024; // records per thread, power of two
+        static constexpr std::size_t max_line = 240;   // longer messages are truncated
+
+    private:
+        struct Record
+        {
+            std::chrono::system_clock::time_point time;
+            LogLevel level;
+            std::uint16_t size;
+            char text[max_line];
+        };
+
+        struct Ring
+        {
+            std::array<Record, ring_size> records;
+            alignas(64) std::atomic<std::size_t> head{0}; // next slot to write, owned by the producer
+            alignas(64) std::atomic<std::size_t> tail{0}; // next slot to read, owned by the flusher
+            std::atomic<bool> retired{false};
+
+            Record *claim()
+            {
+                std::size_t h = head.load(std::memory_order_relaxed);
+                if (h - tail.load(std::memory_order_acquire) >= ring_size)
+                    return nullptr;
+                return &records[h & (ring_size - 1)];
+            }
+
+            void publish() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+        };
+
+    public:
+        // Lines below warn go to `out`, the rest to `err`.
+        explicit Logger(std::FILE *out = stdout, std::FILE *err = stderr,
+                        std::chrono::milliseconds flush_interval = std::chrono::milliseconds(20))
+            : out_(out), err_(err), flush_interval_(flush_interval), id_(next_instance_id())
+        {
+            if (const char *env = std::getenv("SERVER_ASYNC_LOG_LEVEL"))
+                set_level(parse_log_level(env));
+            flusher_ = std::thread([this]
+                                   { run(); });
+        }
+
+        Logger(const Logger &) = delete;
+        Logger &operator=(const Logger &) = delete;
+
+        ~Logger()
+        {
+            {
+                std::lock_guard<std::mutex> lock(wake_mtx_);
+                stop_ = true;
+            }
+            wake_.notify_one();
+            flusher_.join();
+            flush();
+        }
+
+        static Logger &instance()
+        {
+            static Logger logger;
+            return logger;
+        }
+
+        void set_level(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+        LogLevel level() const { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+        bool enabled(LogLevel level) const { return static_cast<int>(level) >= level_.load(std::memory_order_relaxed); }
+
+        // Records lost because a producer's ring was full.
+        std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+        // Formats one record in place in the calling thread's ring and
+        // publishes it on destruction.
+        class Line
+        {
+        public:
+            Line(Logger &logger, LogLevel level) : logger_(logger), ring_(logger.local_ring())
+            {
+                record_ = ring_->claim();
+                if (!record_)
+                {
+                    logger_.dropped_.fetch_add(1, std::memory_order_relaxed);
+                    buf_.reset(scratch_, sizeof(scratch_));
+                    return;
+                }
+                record_->level = level;
+                record_->time = std::chrono::system_clock::now();
+                buf_.reset(record_->text, sizeof(record_->text));
+            }
+
+            ~Line()
+            {
+                if (!record_)
+                    return;
+                record_->size = static_cast<std::uint16_t>(buf_.size());
+                ring_->publish();
+            }
+
+            Line(const Line &) = delete;
+            Line &operator=(const Line &) = delete;
+
+            std::ostream &stream() { return stream_; }
+
+        private:
+            // Writes into a fixed buffer and silently truncates.
+            class FixedBuf : public std::streambuf
+            {
+            public:
+                void reset(char *data, std::size_t size) { setp(data, data + size); }
+                std::size_t size() const { return static_cast<std::size_t>(pptr() - pbase()); }
+
+            protected:
+                int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+            };
+
+            Logger &logger_;
+            Ring *ring_;
+            Record *record_ = nullptr;
+            FixedBuf buf_;
+            std::ostream stream_{&buf_};
+            char scratch_[1];
+        };
+
+        // Write everything logged so far. Safe to call from any thread.
+        void flush()
+        {
+            std::lock_guard<std::mutex> lock(consumer_mtx_);
+            drain();
+        }
+
+    private:
+        // Per-thread handle. The logger keeps the ring alive after the
+        // thread exits until the flusher has written what is left in it.
+        struct LocalRing
+        {
+            std::uint64_t owner = 0;
+            std::shared_ptr<Ring> ring;
+
+            ~LocalRing()
+            {
+                if (ring)
+                    ring->retired.store(true, std::memory_order_release);
+            }
+        };
+
+        static std::uint64_t next_instance_id()
+        {
+            static std::atomic<std::uint64_t> next{0};
+            return ++next;
+        }
+
+        Ring *local_ring()
+        {
+            thread_local LocalRing local;
+            if (local.owner != id_)
+            {
+                if (local.ring)
+                    local.ring->retired.store(true, std::memory_order_release);
+                local.ring = std::make_shared<Ring>();
+                local.owner = id_;
+                std::lock_guard<std::mutex> lock(rings_mtx_);
+                rings_.push_back(local.ring);
+            }
+            return local.ring.get();
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(wake_mtx_);
+            while (!stop_)
+            {
+                wake_.wait_for(lock, flush_interval_);
+                lock.unlock();
+                flush();
+                lock.lock();
+            }
+        }
+
+        // Caller holds consumer_mtx_.
+        void drain()
+        {
+            {
+                std::lock_guard<std::mutex> lock(rings_mtx_);
+                snapshot_ = rings_;
+            }
+
+            batch_.clear();
+            heads_.clear();
+            for (auto &ring : snapshot_)
+            {
+                std::size_t t = ring->tail.load(std::memory_order_relaxed);
+                std::size_t h = ring->head.load(std::memory_order_acquire);
+                heads_.push_back(h);
+                for (; t != h; ++t)
+                    batch_.push_back(&ring->records[t & (ring_size - 1)]);
+            }
+            std::stable_sort(batch_.begin(), batch_.end(), [](Record const *a, Record const *b)
+                             { return a->time < b->time; });
+
+            bool wrote_out = false, wrote_err = false;
+            for (Record const *r : batch_)
+            {
+                std::FILE *f = r->level >= LogLevel::warn ? err_ : out_;
+                write_record(f, *r);
+                (f == err_ ? wrote_err : wrote_out) = true;
+            }
+            if (wrote_out)
+                std::fflush(out_);
+            if (wrote_err && err_ != out_)
+                std::fflush(err_);
+
+            // Only hand the slots back once the records are written.
+            for (std::size_t i = 0; i < snapshot_.size(); ++i)
+                snapshot_[i]->tail.store(heads_[i], std::memory_order_release);
+            snapshot_.clear();
+
+            std::lock_guard<std::mutex> lock(rings_mtx_);
+            rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](std::shared_ptr<Ring> const &ring)
+                                        { return ring->retired.load(std::memory_order_acquire) &&
+                                                 ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire); }),
+                         rings_.end());
+        }
+
+        static void write_record(std::FILE *f, Record const &r)
+        {
+            using namespace std::chrono;
+            auto since_epoch = r.time.time_since_epoch();
+            std::time_t secs = duration_cast<seconds>(since_epoch).count();
+            auto micros = duration_cast<microseconds>(since_epoch).count() % 1000000;
+            std::tm tm{};
+            gmtime_r(&secs, &tm);
+            char stamp[32];
+            std::size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+            std::string_view level = to_string(r.level);
+            std::fprintf(f, "%.*s.%06ldZ [%.*s] %.*s\n", static_cast<int>(n), stamp, static_cast<long>(micros),
+                         static_cast<int>(level.size()), level.data(), static_cast<int>(r.size), r.text);
+        }
+
+        std::FILE *out_;
+        std::FILE *err_;
+        std::chrono::milliseconds flush_interval_;
+        std::uint64_t id_;
+        std::atomic<int> level_{static_cast<int>(LogLevel::info)};
+        std::atomic<std::uint64_t> dropped_{0};
+
+        std::mutex rings_mtx_;
+        std::vector<std::shared_ptr<Ring>> rings_;
+
+        std::mutex consumer_mtx_;
+        std::vector<std::shared_ptr<Ring>> snapshot_;
+        std::vector<std::size_t> heads_;
+        std::vector<Record const *> batch_;
+
+        std::mutex wake_mtx_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+        std::thread flusher_;
+    };
+}
+
+// Usage: SA_LOG_INFO("accepted " << endpoint);
+// The stream expression is only evaluated when the level is enabled.
+#define SA_LOG_AT(logger, lvl, expr)                                  \
+    do                                                                \
+    {                                                                 \
+        ::server_async::Logger &sa_logger_ = (logger);                \
+        if (sa_logger_.enabled(lvl))                                  \
+        {                                                             \
+            ::server_async::Logger::Line sa_line_(sa_logger_, (lvl)); \
+            sa_line_.stream() << expr;                                \
+        }                                                             \
+    } while (0)
+
+#define SA_LOG(lvl, expr) SA_LOG_AT(::server_async::Logger::instance(), lvl, expr)
+
+// Debug logs are compiled out of release builds entirely.
+#if defined(RELEASE_BUILD)
+#define SA_LOG_DEBUG(expr) \
+    do                     \
+    {                      \
+    } while (0)
+#else
+#define SA_LOG_DEBUG(expr) SA_LOG(::server_async::LogLevel::debug, expr)
+#endif
+#define SA_LOG_INFO(expr) SA_LOG(::server_async::LogLevel::info, expr)
+#define SA_LOG_WARN(expr) SA_LOG(::server_async::LogLevel::warn, expr)
+#define SA_LOG_ERROR(expr) SA_LOG(::server_async::LogLevel::error, expr)
+
+#endif
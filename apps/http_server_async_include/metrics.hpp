@@ -0,0 +1,566 @@
+#pragma once
+#ifndef SERVER_ASYNC_METRICS_H
+#define SERVER_ASYNC_METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "request_timing.hpp"
+
+namespace server_async
+{
+    // Log-linear latency buckets in the spirit of HdrHistogram: values
+    // below 16 get one bucket each, every power of two above is split
+    // into 16 linear sub-buckets, so any value is within 1/16 (~6%) of its
+    // bucket's bounds. Values are microseconds; the top bucket absorbs
+    // everything beyond ~9.5 hours.
+    struct LatencyBuckets
+    {
+        static constexpr unsigned sub_bits = 4;
+        static constexpr unsigned sub_count = 1u << sub_bits;
+        static constexpr unsigned max_msb = 35;
+        static constexpr std::size_t count = (max_msb - sub_bits + 2) * sub_count;
+
+        static std::size_t index(std::uint64_t v)
+        {
+            if (v < sub_count)
+                return static_cast<std::size_t>(v);
+            unsigned msb = 63u - static_cast<unsigned>(__builtin_clzll(v));
+            if (msb > max_msb)
+                return count - 1;
+            unsigned shift = msb - sub_bits;
+            return (msb - sub_bits + 1) * sub_count + static_cast<std::size_t>((v >> shift) & (sub_count - 1));
+        }
+
+        // Largest value that lands in bucket `i`.
+        static std::uint64_t upper(std::size_t i)
+        {
+            if (i < sub_count)
+                return i;
+            unsigned msb = static_cast<unsigned>(i / sub_count) + sub_bits - 1;
+            unsigned shift = msb - sub_bits;
+            std::uint64_t lower = (sub_count + i % sub_count) << shift;
+            return lower + (std::uint64_t{1} << shift) - 1;
+        }
+    };
+
+    // A single-threaded histogram over LatencyBuckets, used for merged
+    // snapshots and by tools that record from one strand.
+    struct LatencyHistogram
+    {
+        std::vector<std::uint64_t> buckets = std::vector<std::uint64_t>(LatencyBuckets::count);
+        std::uint64_t count = 0;
+        std::uint64_t sum_us = 0;
+        std::uint64_t max_us = 0;
+
+        void record(std::uint64_t us)
+        {
+            ++buckets[LatencyBuckets::index(us)];
+            ++count;
+            sum_us += us;
+            max_us = std::max(max_us, us);
+        }
+
+        void merge(LatencyHistogram const &other)
+        {
+            for (std::size_t i = 0; i < buckets.size(); ++i)
+                buckets[i] += other.buckets[i];
+            count += other.count;
+            sum_us += other.sum_us;
+            max_us = std::max(max_us, other.max_us);
+        }
+
+        // Upper bound of the bucket holding the q-th quantile, in microseconds,
+        // capped at the largest value seen when that is known.
+        std::uint64_t quantile(double q) const
+        {
+            if (count == 0)
+                return 0;
+            std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(count - 1)) + 1;
+            std::uint64_t seen = 0;
+            std::size_t i = 0;
+            while (i + 1 < buckets.size() && (seen += buckets[i]) < rank)
+                ++i;
+            std::uint64_t v = LatencyBuckets::upper(i);
+            return max_us ? std::min(v, max_us) : v;
+        }
+    };
+
+    enum class StatusClass : unsigned
+    {
+        other,
+        informational,
+        success,
+        redirect,
+        client_error,
+        server_error,
+        count
+    };
+
+    inline StatusClass status_class(unsigned status)
+    {
+        if (status < 100 || status > 599)
+            return StatusClass::other;
+        return static_cast<StatusClass>(status / 100);
+    }
+
+    // Request, byte and session counters plus per-route latency histograms.
+    //
+    // Every thread records into its own shard and is the only writer of
+    // it, so recording is a relaxed load and store on a cache line no
+    // other thread writes: no locks and no contended read-modify-writes.
+    // A scrape walks all shards and adds them up, which may see a
+    // request counted but not yet its latency; Prometheus tolerates that.
+    // A thread's shard is handed to the next new thread once it exits,
+    // counts and all, so the shards never outnumber the threads recording
+    // at the same time.
+    class Metrics
+    {
+    public:
+        static constexpr std::size_t max_routes = 16;
+        // Requests that matched no route or could not be parsed.
+        static constexpr std::size_t unrouted = max_routes - 1;
+        static constexpr std::size_t kinds = 2; // SessionKind::http, SessionKind::tunnel
+
+        // How DnsCache answered a lookup; a refresh also counts as a hit.
+        enum class DnsLookup : unsigned
+        {
+            hit,
+            miss,
+            coalesced,
+            refresh,
+            count
+        };
+
+        // How a HappyEyeballs connection attempt ended.
+        enum class ConnectAttempt : unsigned
+        {
+            won,
+            failed,
+            cancelled,
+            count
+        };
+
+        // What the forward proxy's HttpCache and request coalescing did for a request.
+        enum class CacheResult : unsigned
+        {
+            hit,
+            revalidated,
+            miss,
+            store,
+            coalesced,
+            count
+        };
+
+        struct Snapshot
+        {
+            using Histogram = LatencyHistogram;
+
+            struct Route : Histogram
+            {
+                std::array<std::uint64_t, static_cast<std::size_t>(StatusClass::count)> requests{};
+            };
+
+            std::array<Route, max_routes> routes;
+            std::array<Histogram, phase_count> phases;
+            std::array<std::uint64_t, kinds> bytes_in{};
+            std::array<std::uint64_t, kinds> bytes_out{};
+            std::array<std::uint64_t, kinds> opened{};
+            std::array<std::uint64_t, kinds> closed{};
+            std::array<std::uint64_t, 2> handshakes{}; // full, resumed
+            std::array<std::uint64_t, 2> ktls{};       // left on OpenSSL, offloaded
+            std::array<std::uint64_t, 3> crypto{};     // handshake steps queued on the crypto pool, finished there, run on an io thread
+            std::array<std::uint64_t, 2> relay_buffer_bytes{}; // taken from and given back to the relay buffer pools
+            std::array<std::uint64_t, 3> upstream{};           // forward proxy requests on a new connection, on a pooled one, idle connections dropped
+            std::array<std::uint64_t, static_cast<std::size_t>(DnsLookup::count)> dns{};
+            std::array<std::uint64_t, static_cast<std::size_t>(ConnectAttempt::count)> connect{};
+            std::array<std::uint64_t, static_cast<std::size_t>(CacheResult::count)> cache{};
+        };
+
+        Metrics() : id_(next_instance_id()), pool_(std::make_shared<ShardPool>())
+        {
+            names_[unrouted] = "unmatched";
+        }
+
+        Metrics(const Metrics &) = delete;
+        Metrics &operator=(const Metrics &) = delete;
+
+        static Metrics &instance()
+        {
+            static Metrics metrics;
+            return metrics;
+        }
+
+        // Label used for route `id` in the exposition. Call at startup.
+        void name_route(std::size_t id, std::string name)
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (id < max_routes)
+                names_[id] = std::move(name);
+        }
+
+        void record_request(std::size_t route, unsigned status, std::chrono::steady_clock::duration latency)
+        {
+            Shard &s = local_shard();
+            if (route >= max_routes)
+                route = unrouted;
+            Shard::Route &r = s.routes[route];
+            bump(r.requests[static_cast<std::size_t>(status_class(status))]);
+            record(r, latency);
+        }
+
+        // Phases that did not happen for this request (zero) are skipped.
+        void record_phases(PhaseDurations const &phases)
+        {
+            Shard &s = local_shard();
+            for (std::size_t p = 0; p < phase_count; ++p)
+                if (phases[p] > std::chrono::steady_clock::duration::zero())
+                    record(s.phases[p], phases[p]);
+        }
+
+        std::string route_name(std::size_t id) const
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            return id < max_routes ? names_[id] : std::string{};
+        }
+
+        void add_bytes_in(std::size_t kind, std::uint64_t n) { bump(local_shard().bytes_in[kind], n); }
+        void add_bytes_out(std::size_t kind, std::uint64_t n) { bump(local_shard().bytes_out[kind], n); }
+        void session_opened(std::size_t kind) { bump(local_shard().opened[kind]); }
+        void session_closed(std::size_t kind) { bump(local_shard().closed[kind]); }
+        void tls_handshake(bool resumed) { bump(local_shard().handshakes[resumed ? 1 : 0]); }
+        void ktls(bool offloaded) { bump(local_shard().ktls[offloaded ? 1 : 0]); }
+        void crypto_queued() { bump(local_shard().crypto[0]); }
+        void crypto_finished() { bump(local_shard().crypto[1]); }
+        void crypto_inline() { bump(local_shard().crypto[2]); }
+        void relay_buffer_acquired(std::uint64_t bytes) { bump(local_shard().relay_buffer_bytes[0], bytes); }
+        void relay_buffer_released(std::uint64_t bytes) { bump(local_shard().relay_buffer_bytes[1], bytes); }
+        void upstream_connection(bool reused) { bump(local_shard().upstream[reused ? 1 : 0]); }
+        void upstream_discarded() { bump(local_shard().upstream[2]); }
+        void dns_lookup(DnsLookup result) { bump(local_shard().dns[static_cast<std::size_t>(result)]); }
+        void connect_attempt(ConnectAttempt result) { bump(local_shard().connect[static_cast<std::size_t>(result)]); }
+        void http_cache(CacheResult result) { bump(local_shard().cache[static_cast<std::size_t>(result)]); }
+
+        // Shards allocated so far.
+        std::size_t shard_count() const
+        {
+            std::lock_guard<std::mutex> lock(pool_->mtx);
+            return pool_->shards.size();
+        }
+
+        Snapshot snapshot() const
+        {
+            Snapshot out;
+            std::lock_guard<std::mutex> lock(pool_->mtx);
+            for (auto const &s : pool_->shards)
+            {
+                for (std::size_t r = 0; r < max_routes; ++r)
+                {
+                    auto const &src = s->routes[r];
+                    auto &dst = out.routes[r];
+                    for (std::size_t c = 0; c < dst.requests.size(); ++c)
+                        dst.requests[c] += src.requests[c].load(std::memory_order_relaxed);
+                    merge(dst, src);
+                }
+                for (std::size_t p = 0; p < phase_count; ++p)
+                    merge(out.phases[p], s->phases[p]);
+                for (std::size_t k = 0; k < kinds; ++k)
+                {
+                    out.bytes_in[k] += s->bytes_in[k].load(std::memory_order_relaxed);
+                    out.bytes_out[k] += s->bytes_out[k].load(std::memory_order_relaxed);
+                    out.opened[k] += s->opened[k].load(std::memory_order_relaxed);
+                    out.closed[k] += s->closed[k].load(std::memory_order_relaxed);
+                }
+                for (std::size_t h = 0; h < out.handshakes.size(); ++h)
+                    out.handshakes[h] += s->handshakes[h].load(std::memory_order_relaxed);
+                for (std::size_t k = 0; k < out.ktls.size(); ++k)
+                    out.ktls[k] += s->ktls[k].load(std::memory_order_relaxed);
+                for (std::size_t c = 0; c < out.crypto.size(); ++c)
+                    out.crypto[c] += s->crypto[c].load(std::memory_order_relaxed);
+                for (std::size_t r = 0; r < out.relay_buffer_bytes.size(); ++r)
+                    out.relay_buffer_bytes[r] += s->relay_buffer_bytes[r].load(std::memory_order_relaxed);
+                for (std::size_t u = 0; u < out.upstream.size(); ++u)
+                    out.upstream[u] += s->upstream[u].load(std::memory_order_relaxed);
+                for (std::size_t d = 0; d < out.dns.size(); ++d)
+                    out.dns[d] += s->dns[d].load(std::memory_order_relaxed);
+                for (std::size_t c = 0; c < out.connect.size(); ++c)
+                    out.connect[c] += s->connect[c].load(std::memory_order_relaxed);
+                for (std::size_t c = 0; c < out.cache.size(); ++c)
+                    out.cache[c] += s->cache[c].load(std::memory_order_relaxed);
+            }
+            return out;
+        }
+
+        // Prometheus text exposition format, version 0.0.4.
+        std::string render() const
+        {
+            static constexpr const char *kind_names[kinds] = {"http", "tunnel"};
+            static constexpr const char *class_names[] = {"other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+            Snapshot snap = snapshot();
+            std::array<std::string, max_routes> names;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                names = names_;
+            }
+
+            std::string out;
+            out.reserve(8192);
+            char line[256];
+            auto emit = [&](const char *fmt, auto... args)
+            {
+                int n = std::snprintf(line, sizeof(line), fmt, args...);
+                if (n > 0)
+                    out.append(line, std::min<std::size_t>(static_cast<std::size_t>(n), sizeof(line) - 1));
+            };
+
+            out += "# HELP server_async_requests_total Responses written, by route and status class.\n"
+                   "# TYPE server_async_requests_total counter\n";
+            for (std::size_t r = 0; r < max_routes; ++r)
+                for (std::size_t c = 0; c < snap.routes[r].requests.size(); ++c)
+                    if (snap.routes[r].requests[c])
+                        emit("server_async_requests_total{route=\"%s\",code=\"%s\"} %llu\n", label(names, r),
+                             class_names[c], static_cast<unsigned long long>(snap.routes[r].requests[c]));
+
+            // Exposed at power-of-two microsecond boundaries, which line up
+            // with the fine buckets, so the cumulative counts are exact.
+            auto emit_histogram = [&](const char *name, const char *key, const char *value, Snapshot::Histogram const &h)
+            {
+                std::uint64_t cumulative = 0;
+                std::size_t b = 0;
+                for (unsigned p = LatencyBuckets::sub_bits; p <= LatencyBuckets::max_msb; ++p)
+                {
+                    std::uint64_t le = (std::uint64_t{1} << p) - 1;
+                    for (; b < LatencyBuckets::count && LatencyBuckets::upper(b) <= le; ++b)
+                        cumulative += h.buckets[b];
+                    emit("%s_bucket{%s=\"%s\",le=\"%.6f\"} %llu\n", name, key, value,
+                         static_cast<double>(le + 1) / 1e6, static_cast<unsigned long long>(cumulative));
+                }
+                emit("%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, key, value, static_cast<unsigned long long>(h.count));
+                emit("%s_sum{%s=\"%s\"} %.6f\n", name, key, value, static_cast<double>(h.sum_us) / 1e6);
+                emit("%s_count{%s=\"%s\"} %llu\n", name, key, value, static_cast<unsigned long long>(h.count));
+            };
+
+            out += "# HELP server_async_request_duration_seconds Time from request header to response written.\n"
+                   "# TYPE server_async_request_duration_seconds histogram\n";
+            for (std::size_t r = 0; r < max_routes; ++r)
+                if (snap.routes[r].count)
+                    emit_histogram("server_async_request_duration_seconds", "route", label(names, r), snap.routes[r]);
+
+            out += "# HELP server_async_phase_duration_seconds Time spent in each phase of a connection and request.\n"
+                   "# TYPE server_async_phase_duration_seconds histogram\n";
+            for (std::size_t p = 0; p < phase_count; ++p)
+                if (snap.phases[p].count)
+                    emit_histogram("server_async_phase_duration_seconds", "phase", phase_name(static_cast<Phase>(p)), snap.phases[p]);
+
+            out += "# HELP server_async_received_bytes_total Bytes read from clients.\n"
+                   "# TYPE server_async_received_bytes_total counter\n";
+            for (std::size_t k = 0; k < kinds; ++k)
+                emit("server_async_received_bytes_total{kind=\"%s\"} %llu\n", kind_names[k],
+                     static_cast<unsigned long long>(snap.bytes_in[k]));
+            out += "# HELP server_async_sent_bytes_total Bytes written to clients.\n"
+                   "# TYPE server_async_sent_bytes_total counter\n";
+            for (std::size_t k = 0; k < kinds; ++k)
+                emit("server_async_sent_bytes_total{kind=\"%s\"} %llu\n", kind_names[k],
+                     static_cast<unsigned long long>(snap.bytes_out[k]));
+            out += "# HELP server_async_sessions_total Sessions and tunnels opened.\n"
+                   "# TYPE server_async_sessions_total counter\n";
+            for (std::size_t k = 0; k < kinds; ++k)
+                emit("server_async_sessions_total{kind=\"%s\"} %llu\n", kind_names[k],
+                     static_cast<unsigned long long>(snap.opened[k]));
+            out += "# HELP server_async_sessions_active Sessions and tunnels currently open.\n"
+                   "# TYPE server_async_sessions_active gauge\n";
+            for (std::size_t k = 0; k < kinds; ++k)
+                emit("server_async_sessions_active{kind=\"%s\"} %llu\n", kind_names[k],
+                     static_cast<unsigned long long>(snap.opened[k] > snap.closed[k] ? snap.opened[k] - snap.closed[k] : 0));
+            out += "# HELP server_async_tls_handshakes_total Completed TLS handshakes, resumed ones skipped the key exchange.\n"
+                   "# TYPE server_async_tls_handshakes_total counter\n";
+            emit("server_async_tls_handshakes_total{resumed=\"false\"} %llu\n", static_cast<unsigned long long>(snap.handshakes[0]));
+            emit("server_async_tls_handshakes_total{resumed=\"true\"} %llu\n", static_cast<unsigned long long>(snap.handshakes[1]));
+            out += "# HELP server_async_ktls_total TLS connections that tried kernel TLS, by whether the kernel took the keys.\n"
+                   "# TYPE server_async_ktls_total counter\n";
+            emit("server_async_ktls_total{offloaded=\"false\"} %llu\n", static_cast<unsigned long long>(snap.ktls[0]));
+            emit("server_async_ktls_total{offloaded=\"true\"} %llu\n", static_cast<unsigned long long>(snap.ktls[1]));
+            out += "# HELP server_async_tls_handshake_steps_total TLS handshake computations, by the threads that ran them.\n"
+                   "# TYPE server_async_tls_handshake_steps_total counter\n";
+            emit("server_async_tls_handshake_steps_total{thread=\"crypto\"} %llu\n", static_cast<unsigned long long>(snap.crypto[0]));
+            emit("server_async_tls_handshake_steps_total{thread=\"io\"} %llu\n", static_cast<unsigned long long>(snap.crypto[2]));
+            out += "# HELP server_async_tls_handshake_queue TLS handshake computations waiting for or running on the crypto pool.\n"
+                   "# TYPE server_async_tls_handshake_queue gauge\n";
+            emit("server_async_tls_handshake_queue %llu\n",
+                 static_cast<unsigned long long>(snap.crypto[0] > snap.crypto[1] ? snap.crypto[0] - snap.crypto[1] : 0));
+            out += "# HELP server_async_relay_buffer_bytes Relay buffer memory held by tunnels and forward proxy connections.\n"
+                   "# TYPE server_async_relay_buffer_bytes gauge\n";
+            emit("server_async_relay_buffer_bytes %llu\n",
+                 static_cast<unsigned long long>(snap.relay_buffer_bytes[0] > snap.relay_buffer_bytes[1]
+                                                     ? snap.relay_buffer_bytes[0] - snap.relay_buffer_bytes[1]
+                                                     : 0));
+            out += "# HELP server_async_upstream_requests_total Forward proxy requests, by whether they reused a pooled origin connection.\n"
+                   "# TYPE server_async_upstream_requests_total counter\n";
+            emit("server_async_upstream_requests_total{reused=\"false\"} %llu\n", static_cast<unsigned long long>(snap.upstream[0]));
+            emit("server_async_upstream_requests_total{reused=\"true\"} %llu\n", static_cast<unsigned long long>(snap.upstream[1]));
+            out += "# HELP server_async_upstream_discarded_total Idle origin connections dropped as expired or closed by the origin.\n"
+                   "# TYPE server_async_upstream_discarded_total counter\n";
+            emit("server_async_upstream_discarded_total %llu\n", static_cast<unsigned long long>(snap.upstream[2]));
+            out += "# HELP server_async_dns_lookups_total Name lookups of the proxy and client, by how the DNS cache answered.\n"
+                   "# TYPE server_async_dns_lookups_total counter\n";
+            static constexpr const char *dns_results[] = {"hit", "miss", "coalesced", "refresh"};
+            for (std::size_t d = 0; d < snap.dns.size(); ++d)
+                emit("server_async_dns_lookups_total{result=\"%s\"} %llu\n", dns_results[d], static_cast<unsigned long long>(snap.dns[d]));
+            out += "# HELP server_async_connect_attempts_total Upstream connection attempts, by whether they won the race, failed or were closed for a faster one.\n"
+                   "# TYPE server_async_connect_attempts_total counter\n";
+            static constexpr const char *connect_results[] = {"won", "failed", "cancelled"};
+            for (std::size_t c = 0; c < snap.connect.size(); ++c)
+                emit("server_async_connect_attempts_total{result=\"%s\"} %llu\n", connect_results[c], static_cast<unsigned long long>(snap.connect[c]));
+            out += "# HELP server_async_http_cache_total Forward proxy GETs served from the cache, after revalidation, by the origin or from another client's fetch, and responses stored.\n"
+                   "# TYPE server_async_http_cache_total counter\n";
+            static constexpr const char *cache_results[] = {"hit", "revalidated", "miss", "store", "coalesced"};
+            for (std::size_t c = 0; c < snap.cache.size(); ++c)
+                emit("server_async_http_cache_total{result=\"%s\"} %llu\n", cache_results[c], static_cast<unsigned long long>(snap.cache[c]));
+            return out;
+        }
+
+    private:
+        using counter = std::atomic<std::uint64_t>;
+
+        struct alignas(64) Shard
+        {
+            struct Histogram
+            {
+                std::array<counter, LatencyBuckets::count> buckets{};
+                counter sum_us{0};
+            };
+
+            struct Route : Histogram
+            {
+                std::array<counter, static_cast<std::size_t>(StatusClass::count)> requests{};
+            };
+
+            std::array<Route, max_routes> routes{};
+            std::array<Histogram, phase_count> phases{};
+            std::array<counter, kinds> bytes_in{};
+            std::array<counter, kinds> bytes_out{};
+            std::array<counter, kinds> opened{};
+            std::array<counter, kinds> closed{};
+            std::array<counter, 2> handshakes{};
+            std::array<counter, 2> ktls{};
+            std::array<counter, 3> crypto{};
+            std::array<counter, 2> relay_buffer_bytes{};
+            std::array<counter, 3> upstream{};
+            std::array<counter, static_cast<std::size_t>(DnsLookup::count)> dns{};
+            std::array<counter, static_cast<std::size_t>(ConnectAttempt::count)> connect{};
+            std::array<counter, static_cast<std::size_t>(CacheResult::count)> cache{};
+        };
+
+        // Only the owning thread writes a counter, so a plain load and store
+        // is enough and keeps the cache line exclusive to that thread.
+        static void bump(counter &c, std::uint64_t n = 1)
+        {
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        static void record(Shard::Histogram &h, std::chrono::steady_clock::duration d)
+        {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+            std::uint64_t v = us > 0 ? static_cast<std::uint64_t>(us) : 0;
+            bump(h.buckets[LatencyBuckets::index(v)]);
+            bump(h.sum_us, v);
+        }
+
+        static void merge(Snapshot::Histogram &dst, Shard::Histogram const &src)
+        {
+            for (std::size_t b = 0; b < LatencyBuckets::count; ++b)
+            {
+                std::uint64_t n = src.buckets[b].load(std::memory_order_relaxed);
+                dst.buckets[b] += n;
+                dst.count += n;
+            }
+            dst.sum_us += src.sum_us.load(std::memory_order_relaxed);
+        }
+
+        static const char *label(std::array<std::string, max_routes> const &names, std::size_t r)
+        {
+            return names[r].empty() ? "unnamed" : names[r].c_str();
+        }
+
+        static std::uint64_t next_instance_id()
+        {
+            static std::atomic<std::uint64_t> next{0};
+            return ++next;
+        }
+
+        // All shards ever handed out, and those whose thread has exited.
+        // Shared with the threads so one exiting after the Metrics is gone
+        // has nothing to return its shard to.
+        struct ShardPool
+        {
+            std::mutex mtx;
+            std::vector<std::unique_ptr<Shard>> shards;
+            std::vector<Shard *> free;
+
+            Shard *acquire()
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!free.empty())
+                {
+                    Shard *shard = free.back();
+                    free.pop_back();
+                    return shard;
+                }
+                shards.push_back(std::make_unique<Shard>());
+                return shards.back().get();
+            }
+
+            void release(Shard *shard)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                free.push_back(shard);
+            }
+        };
+
+        // Shards outlive their threads: what a thread counted stays counted,
+        // and the next thread keeps adding to it.
+        Shard &local_shard()
+        {
+            struct Local
+            {
+                std::uint64_t owner = 0;
+                Shard *shard = nullptr;
+                std::weak_ptr<ShardPool> pool;
+
+                void release()
+                {
+                    if (auto p = pool.lock())
+                        p->release(shard);
+                }
+
+                ~Local() { release(); }
+            };
+            thread_local Local local;
+            if (local.owner != id_)
+            {
+                local.release();
+                local.shard = pool_->acquire();
+                local.pool = pool_;
+                local.owner = id_;
+            }
+            return *local.shard;
+        }
+
+        std::uint64_t id_;
+        mutable std::mutex mtx_;
+        std::shared_ptr<ShardPool> pool_;
+        std::array<std::string, max_routes> names_;
+    };
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+#ifndef SERVER_ASYNC_PROXY_HEADERS_HPP
+#define SERVER_ASYNC_PROXY_HEADERS_HPP
+
+#include <string>
+#include <vector>
+
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/rfc7230.hpp>
+
+// Header rewriting of the forward proxy, RFC 9110 section 7.6.
+namespace server_async
+{
+    // The name this proxy gives itself in Via.
+    inline constexpr char const *via_pseudonym = "server_async";
+
+    // Removes the fields that describe the connection a message came over
+    // rather than the message: Connection, the fields it names and the
+    // usual hop-by-hop ones. Transfer-Encoding stays, the message goes on
+    // with the same framing, and Connection cannot name it, Content-Length
+    // or Host away, which would let the two hops disagree on it.
+    template <bool isRequest, class Fields>
+    void
+    strip_hop_by_hop(boost::beast::http::header<isRequest, Fields> &h)
+    {
+        namespace http = boost::beast::http;
+        std::vector<std::string> named;
+        for (auto const &token : http::token_list{h[http::field::connection]})
+            named.emplace_back(token);
+        for (auto const &name : named)
+        {
+            auto f = http::string_to_field(name);
+            if (f != http::field::transfer_encoding && f != http::field::content_length && f != http::field::host)
+                h.erase(name);
+        }
+        for (auto f : {http::field::connection, http::field::keep_alive, http::field::proxy_connection,
+                       http::field::te, http::field::upgrade})
+            h.erase(f);
+    }
+
+    // Appends this hop to Via, e.g. "1.1 server_async".
+    template <bool isRequest, class Fields>
+    void
+    append_via(boost::beast::http::header<isRequest, Fields> &h)
+    {
+        namespace http = boost::beast::http;
+        std::string hop = std::to_string(h.version() / 10) + "." + std::to_string(h.version() % 10) + " " + via_pseudonym;
+        auto const via = h[http::field::via];
+        if (via.empty())
+            h.set(http::field::via, hop);
+        else
+            h.set(http::field::via, std::string(via) + ", " + hop);
+    }
+}
+
+#endif
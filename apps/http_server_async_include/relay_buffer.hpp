@@ -0,0 +1,199 @@
+#pragma once
+#ifndef SERVER_ASYNC_RELAY_BUFFER_HPP
+#define SERVER_ASYNC_RELAY_BUFFER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+
+#include "metrics.hpp"
+
+namespace server_async
+{
+    // Bytes a relay direction starts reading per step, and the least it
+    // shrinks back to. HttpServer::set_relay_buffer_size() changes it.
+    inline std::atomic<std::size_t> &relay_buffer_size()
+    {
+        static std::atomic<std::size_t> size{4096};
+        return size;
+    }
+
+    // The most a relay direction grows to while its reads fill the buffer.
+    inline std::atomic<std::size_t> &relay_buffer_max_size()
+    {
+        static std::atomic<std::size_t> size{256 << 10};
+        return size;
+    }
+
+    // Free relay buffer blocks of the calling thread, by power of two size
+    // from 4 KiB to 256 KiB. Each size keeps at most 1 MiB around, the rest
+    // goes back to the allocator.
+    class RelayBufferPool
+    {
+    public:
+        static constexpr std::size_t smallest = 4 << 10;
+        static constexpr std::size_t largest = 256 << 10;
+        static constexpr std::size_t cached_bytes_per_size = 1 << 20;
+
+        // The block size serving a request for `n` bytes.
+        static constexpr std::size_t
+        block_size(std::size_t n)
+        {
+            std::size_t size = smallest;
+            while (size < n && size < largest)
+                size *= 2;
+            return size;
+        }
+
+        static RelayBufferPool &
+        local()
+        {
+            thread_local RelayBufferPool pool;
+            return pool;
+        }
+
+        RelayBufferPool() = default;
+        RelayBufferPool(const RelayBufferPool &) = delete;
+        RelayBufferPool &operator=(const RelayBufferPool &) = delete;
+
+        ~RelayBufferPool()
+        {
+            for (auto &blocks : free_)
+                for (char *block : blocks)
+                    delete[] block;
+        }
+
+        // `size` is a block_size().
+        char *
+        acquire(std::size_t size)
+        {
+            Metrics::instance().relay_buffer_acquired(size);
+            auto &blocks = free_[index(size)];
+            if (blocks.empty())
+                return new char[size];
+            char *block = blocks.back();
+            blocks.pop_back();
+            return block;
+        }
+
+        void
+        release(char *block, std::size_t size)
+        {
+            Metrics::instance().relay_buffer_released(size);
+            auto &blocks = free_[index(size)];
+            if (blocks.size() * size >= cached_bytes_per_size)
+                delete[] block;
+            else
+                blocks.push_back(block);
+        }
+
+    private:
+        static constexpr std::size_t sizes = 7;
+
+        static std::size_t
+        index(std::size_t size)
+        {
+            std::size_t i = 0;
+            while ((smallest << i) < size)
+                ++i;
+            return i;
+        }
+
+        std::array<std::vector<char *>, sizes> free_;
+    };
+
+    // The buffer of one relay direction. It holds a pool block only while
+    // bytes are in flight, and its size follows the traffic: a read that
+    // fills it doubles it, a run of reads using under a quarter halves it.
+    class RelayBuffer
+    {
+    public:
+        RelayBuffer(std::size_t initial, std::size_t max)
+            : min_(RelayBufferPool::block_size(initial)),
+              max_(std::max(min_, RelayBufferPool::block_size(max))),
+              size_(min_)
+        {
+        }
+
+        RelayBuffer(const RelayBuffer &) = delete;
+        RelayBuffer &operator=(const RelayBuffer &) = delete;
+
+        ~RelayBuffer()
+        {
+            release();
+        }
+
+        // The block to read into, taken from this thread's pool if not held.
+        boost::asio::mutable_buffer
+        acquire()
+        {
+            if (!block_)
+            {
+                block_ = RelayBufferPool::local().acquire(size_);
+                block_size_ = size_;
+            }
+            return boost::asio::buffer(block_, block_size_);
+        }
+
+        // Gives the block back, e.g. while the source has nothing to read.
+        void
+        release()
+        {
+            if (block_)
+                RelayBufferPool::local().release(std::exchange(block_, nullptr), block_size_);
+        }
+
+        bool held() const { return block_ != nullptr; }
+        char *data() { return block_; }
+        std::size_t size() const { return size_; }
+        std::size_t max_size() const { return max_; }
+
+        // Called with the size of each read once its bytes are written.
+        void
+        adapt(std::size_t n)
+        {
+            if (n >= size_ && size_ < max_)
+                return resize(size_ * 2);
+            if (n < size_ / 4 && size_ > min_)
+            {
+                if (++small_reads_ >= shrink_after)
+                    resize(size_ / 2);
+                return;
+            }
+            small_reads_ = 0;
+        }
+
+    private:
+        static constexpr int shrink_after = 8;
+
+        void
+        resize(std::size_t size)
+        {
+            release();
+            size_ = size;
+            small_reads_ = 0;
+        }
+
+        std::size_t const min_;
+        std::size_t const max_;
+        std::size_t size_;
+        char *block_ = nullptr;
+        std::size_t block_size_ = 0;
+        int small_reads_ = 0;
+    };
+
+    inline std::shared_ptr<RelayBuffer>
+    make_relay_buffer()
+    {
+        return std::make_shared<RelayBuffer>(relay_buffer_size().load(std::memory_order_relaxed),
+                                             relay_buffer_max_size().load(std::memory_order_relaxed));
+    }
+}
+
+#endif
@@ -0,0 +1,122 @@
+#pragma once
+#ifndef SERVER_ASYNC_REQUEST_TIMING_H
+#define SERVER_ASYNC_REQUEST_TIMING_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace server_async
+{
+    // Where the time of a request goes, in lifecycle order.
+    enum class Phase : std::size_t
+    {
+        accept,    // accept completed -> session running on its strand
+        detect,    // async_detect_ssl
+        handshake, // TLS handshake
+        header,    // read started -> request header parsed, includes keep-alive idle time
+        handler,   // header parsed -> response queued, minus open
+        open,      // opening the file to serve
+        write,     // response queued -> last byte written
+        count
+    };
+
+    constexpr std::size_t phase_count = static_cast<std::size_t>(Phase::count);
+
+    inline const char *phase_name(Phase phase)
+    {
+        static constexpr const char *names[phase_count] = {
+            "accept", "detect", "handshake", "header", "handler", "open", "write"};
+        return names[static_cast<std::size_t>(phase)];
+    }
+
+    using PhaseDurations = std::array<std::chrono::steady_clock::duration, phase_count>;
+
+    // Requests whose server time (header parsed -> response written) exceeds
+    // this are logged with their full breakdown. Zero turns the log off.
+    inline std::atomic<std::int64_t> &slow_request_threshold_us()
+    {
+        static std::atomic<std::int64_t> threshold{1000000};
+        return threshold;
+    }
+
+    // Streams as " accept=12us detect=40us ...", phases that did not happen are left out.
+    struct PhaseBreakdown
+    {
+        PhaseDurations const &durations;
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, PhaseBreakdown const &b)
+    {
+        for (std::size_t p = 0; p < phase_count; ++p)
+            if (b.durations[p] > std::chrono::steady_clock::duration::zero())
+                os << ' ' << phase_name(static_cast<Phase>(p)) << '='
+                   << std::chrono::duration_cast<std::chrono::microseconds>(b.durations[p]).count() << "us";
+        return os;
+    }
+
+    // Monotonic timestamps of one connection and the request it is serving.
+    // Owned by the session and only touched on its strand.
+    struct RequestTimings
+    {
+        using clock = std::chrono::steady_clock;
+
+        // Connection setup, reported with the first request only.
+        clock::time_point accepted{};
+        clock::time_point started{};
+        clock::time_point detect_start{};
+        clock::time_point detected{};
+        clock::time_point handshake_start{};
+        clock::time_point handshake_done{};
+        bool first_request = true;
+
+        // The current request.
+        clock::time_point read_start{};
+        clock::time_point header_done{};
+        clock::duration open{};
+
+        static clock::duration between(clock::time_point from, clock::time_point to)
+        {
+            if (from == clock::time_point{} || to == clock::time_point{} || to < from)
+                return clock::duration::zero();
+            return to - from;
+        }
+
+        // The session is running on its strand. A session created by
+        // detect_session inherits the time detection started.
+        void start()
+        {
+            if (started == clock::time_point{})
+                started = clock::now();
+        }
+
+        // A new request header is about to be read.
+        void begin_read()
+        {
+            read_start = clock::now();
+            open = clock::duration::zero();
+        }
+
+        // The response has been queued; everything but the write is known.
+        PhaseDurations on_queued(clock::time_point now) const
+        {
+            PhaseDurations d{};
+            if (first_request)
+            {
+                d[static_cast<std::size_t>(Phase::accept)] = between(accepted, started);
+                d[static_cast<std::size_t>(Phase::detect)] = between(detect_start, detected);
+                d[static_cast<std::size_t>(Phase::handshake)] = between(handshake_start, handshake_done);
+            }
+            d[static_cast<std::size_t>(Phase::header)] = between(read_start, header_done);
+            auto handler = between(header_done, now);
+            d[static_cast<std::size_t>(Phase::handler)] = handler > open ? handler - open : clock::duration::zero();
+            d[static_cast<std::size_t>(Phase::open)] = open;
+            return d;
+        }
+    };
+}
+
+#endif
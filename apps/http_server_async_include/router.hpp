@@ -0,0 +1,201 @@
+#pragma once
+#ifndef SERVER_ASYNC_ROUTER_H
+#define SERVER_ASYNC_ROUTER_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace server_async
+{
+    /**
+     * @brief Path parameters captured by Router::match.
+     * Views point into the matched path, nothing is copied.
+     */
+    struct RouteParams
+    {
+        static constexpr std::size_t max_params = 8;
+
+        std::array<std::pair<std::string_view, std::string_view>, max_params> items{};
+        std::size_t count = 0;
+        // What a trailing "*" matched, without the leading '/'.
+        std::string_view wildcard;
+
+        std::string_view get(std::string_view name) const
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                if (items[i].first == name)
+                    return items[i].second;
+            return std::string_view{};
+        }
+    };
+
+    /**
+     * @brief Segment trie built once at startup, matched without allocating.
+     *
+     * Patterns are made of '/'-separated segments:
+     *   "/tasks"               static segment
+     *   "/tasks/{t_uuid}"      captures one segment as "t_uuid"
+     *   "*" as last segment    matches the rest of the path, may be empty
+     * A static segment wins over a capture, a capture wins over "*".
+     * Empty segments count: "/tasks/" and "/tasks//x" are not "/tasks" and
+     * "/tasks/x", and a capture never matches an empty segment.
+     *
+     * @tparam Value what a route resolves to, usually a small enum.
+     */
+    template <typename Value>
+    class Router
+    {
+    public:
+        Router() : nodes_(1) {}
+
+        // Throws std::invalid_argument on a malformed or duplicate pattern.
+        void add(std::string_view pattern, Value value)
+        {
+            std::size_t node = 0;
+            std::size_t pos = 0;
+            std::size_t params = 0;
+            std::string_view seg;
+            while (next(pattern, pos, seg))
+            {
+                if (seg == "*")
+                {
+                    if (pos < pattern.size())
+                        throw std::invalid_argument("'*' must be the last segment: " + std::string(pattern));
+                    set(nodes_[node].wildcard_value, value, pattern);
+                    return;
+                }
+                if (seg.size() > 2 && seg.front() == '{' && seg.back() == '}')
+                {
+                    std::string_view name = seg.substr(1, seg.size() - 2);
+                    if (++params > RouteParams::max_params)
+                        throw std::invalid_argument("too many parameters: " + std::string(pattern));
+                    if (nodes_[node].param_child == npos)
+                    {
+                        std::size_t child = nodes_.size();
+                        nodes_.emplace_back();
+                        nodes_[child].param_name = std::string(name);
+                        nodes_[node].param_child = child;
+                    }
+                    else if (nodes_[nodes_[node].param_child].param_name != name)
+                        throw std::invalid_argument("conflicting parameter name: " + std::string(pattern));
+                    node = nodes_[node].param_child;
+                    continue;
+                }
+                node = static_child(node, seg);
+            }
+            set(nodes_[node].value, value, pattern);
+        }
+
+        // Returns nullptr when no route matches. `params` is filled on success.
+        const Value *match(std::string_view path, RouteParams &params) const
+        {
+            params.count = 0;
+            params.wildcard = std::string_view{};
+            return match_from(0, path, 0, params);
+        }
+
+    private:
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+        struct Node
+        {
+            // Sorted by segment for binary search.
+            std::vector<std::pair<std::string, std::size_t>> static_children;
+            std::size_t param_child = npos;
+            std::string param_name;
+            std::size_t value = npos;
+            std::size_t wildcard_value = npos;
+        };
+
+        // Like next_segment() in string_util.hpp but on a string_view. `pos`
+        // is at the '/' before the segment; "/" is one empty segment and
+        // "/a//b/" is "a", "", "b", "". Returns false at the end of the path.
+        static bool next(std::string_view path, std::size_t &pos, std::string_view &seg)
+        {
+            if (pos >= path.size())
+                return false;
+            std::size_t start = path[pos] == '/' ? pos + 1 : pos;
+            std::size_t end = path.find('/', start);
+            if (end == std::string_view::npos)
+                end = path.size();
+            seg = path.substr(start, end - start);
+            pos = end;
+            return true;
+        }
+
+        std::size_t static_child(std::size_t node, std::string_view seg)
+        {
+            auto &children = nodes_[node].static_children;
+            auto it = std::lower_bound(children.begin(), children.end(), seg,
+                                       [](auto const &child, std::string_view s)
+                                       { return std::string_view(child.first) < s; });
+            if (it != children.end() && it->first == seg)
+                return it->second;
+            std::size_t child = nodes_.size();
+            children.insert(it, {std::string(seg), child});
+            nodes_.emplace_back();
+            return child;
+        }
+
+        void set(std::size_t &slot, Value value, std::string_view pattern)
+        {
+            if (slot != npos)
+                throw std::invalid_argument("duplicate route: " + std::string(pattern));
+            slot = values_.size();
+            values_.push_back(std::move(value));
+        }
+
+        const Value *match_from(std::size_t node, std::string_view path, std::size_t pos, RouteParams &params) const
+        {
+            Node const &n = nodes_[node];
+            std::size_t seg_pos = pos;
+            std::string_view seg;
+            if (!next(path, seg_pos, seg))
+            {
+                if (n.value != npos)
+                    return &values_[n.value];
+                if (n.wildcard_value != npos)
+                    return &values_[n.wildcard_value];
+                return nullptr;
+            }
+
+            auto const &children = n.static_children;
+            auto it = std::lower_bound(children.begin(), children.end(), seg,
+                                       [](auto const &child, std::string_view s)
+                                       { return std::string_view(child.first) < s; });
+            if (it != children.end() && it->first == seg)
+            {
+                if (const Value *v = match_from(it->second, path, seg_pos, params))
+                    return v;
+            }
+
+            if (n.param_child != npos && !seg.empty())
+            {
+                std::size_t saved = params.count;
+                params.items[params.count++] = {nodes_[n.param_child].param_name, seg};
+                if (const Value *v = match_from(n.param_child, path, seg_pos, params))
+                    return v;
+                params.count = saved;
+            }
+
+            if (n.wildcard_value != npos)
+            {
+                std::size_t start = pos < path.size() && path[pos] == '/' ? pos + 1 : pos;
+                params.wildcard = path.substr(start);
+                return &values_[n.wildcard_value];
+            }
+            return nullptr;
+        }
+
+        std::vector<Node> nodes_;
+        std::vector<Value> values_;
+    };
+}
+
+#endif
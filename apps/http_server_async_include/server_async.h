@@ -9,11 +9,18 @@
 #include <unistd.h>
 #endif
 
+#include <condition_variable>
+#include <csignal>
 #include <filesystem>
+#include <mutex>
 
 #include "server_async_util.h"
 #include "http_session.hpp"
 #include "http_handler_util.hpp"
+#include "session_registry.hpp"
+#include "socket_handoff.hpp"
+#include "tls_config.hpp"
+#include "tls_session.hpp"
 
 
 namespace server_async
@@ -30,6 +37,9 @@ namespace server_async
         beast::flat_buffer buffer_;
         HandlerEntryPoint<plain_http_session> &plain_handle_func;
         HandlerEntryPoint<ssl_http_session> &ssl_handle_func;
+        SessionRegistry &registry_;
+        CryptoPool *crypto_pool_;
+        RequestTimings timings_;
 
     public:
         explicit detect_session(
@@ -37,11 +47,19 @@ namespace server_async
             ssl::context &ctx,
             std::shared_ptr<std::string const> const &doc_root,
             HandlerEntryPoint<plain_http_session> &plain_handle_func,
-            HandlerEntryPoint<ssl_http_session> &ssl_handle_func)
-            : stream_(std::move(socket)), ctx_(ctx), doc_root_(doc_root), plain_handle_func(plain_handle_func), ssl_handle_func(ssl_handle_func)
+            HandlerEntryPoint<ssl_http_session> &ssl_handle_func,
+            SessionRegistry &registry,
+            CryptoPool *crypto_pool = nullptr)
+            : stream_(std::move(socket)), ctx_(ctx), doc_root_(doc_root), plain_handle_func(plain_handle_func), ssl_handle_func(ssl_handle_func), registry_(registry), crypto_pool_(crypto_pool)
         {
         }
 
+        RequestTimings &
+        timings()
+        {
+            return timings_;
+        }
+
         // Launch the detector
         void
         run()
@@ -60,6 +78,9 @@ namespace server_async
         void
         on_run()
         {
+            timings_.start();
+            timings_.detect_start = timings_.started;
+
             // Set the timeout.
             stream_.expires_after(std::chrono::seconds(30));
 
@@ -76,47 +97,75 @@ namespace server_async
         {
             if (ec)
                 return fail(ec, "detect");
+            timings_.detected = std::chrono::steady_clock::now();
 
             if (result)
             {
                 // Launch SSL session
-                std::make_shared<ssl_http_session>(
+                auto session = std::make_shared<ssl_http_session>(
                     std::move(stream_),
                     ctx_,
                     std::move(buffer_),
-                    ssl_handle_func)
-                    ->run();
+                    ssl_handle_func,
+                    registry_,
+                    crypto_pool_);
+                session->timings() = timings_;
+                session->run();
                 return;
             }
 
             // Launch plain session
-            std::make_shared<plain_http_session>(
+            auto session = std::make_shared<plain_http_session>(
                 std::move(stream_),
                 std::move(buffer_),
-                plain_handle_func)
-                ->run();
+                plain_handle_func,
+                registry_);
+            session->timings() = timings_;
+            session->run();
         }
     };
 
+    // What a listening port expects from its clients.
+    // A dedicated plain or TLS port starts the matching session straight away,
+    // only a detect port pays for the extra async_detect_ssl read.
+    enum class ListenerMode
+    {
+        plain,
+        tls,
+        detect
+    };
+
+    struct ListenerSpec
+    {
+        tcp::endpoint endpoint;
+        ListenerMode mode;
+    };
+
     // Accepts incoming connections and launches the sessions
     class listener : public std::enable_shared_from_this<listener>
     {
         net::io_context &ioc_;
         ssl::context &ctx_;
         tcp::acceptor acceptor_;
+        ListenerMode mode_;
         std::shared_ptr<std::string const> doc_root_;
         HandlerEntryPoint<plain_http_session> &plain_handle_func;
         HandlerEntryPoint<ssl_http_session> &ssl_handle_func;
+        SessionRegistry &registry_;
+        CryptoPool *crypto_pool_;
 
     public:
         listener(
             net::io_context &ioc,
             ssl::context &ctx,
             tcp::endpoint endpoint,
+            ListenerMode mode,
             std::shared_ptr<std::string const> const &doc_root,
             HandlerEntryPoint<plain_http_session> &plain_handle_func,
-            HandlerEntryPoint<ssl_http_session> &ssl_handle_func)
-            : ioc_(ioc), ctx_(ctx), acceptor_(net::make_strand(ioc)), doc_root_(doc_root), plain_handle_func(plain_handle_func), ssl_handle_func(ssl_handle_func)
+            HandlerEntryPoint<ssl_http_session> &ssl_handle_func,
+            SessionRegistry &registry,
+            CryptoPool *crypto_pool = nullptr)
+            : ioc_(ioc), ctx_(ctx), acceptor_(net::make_strand(ioc)), mode_(mode), doc_root_(doc_root), plain_handle_func(plain_handle_func), ssl_handle_func(ssl_handle_func), registry_(registry), crypto_pool_(crypto_pool)
         {
             beast::error_code ec;
 
@@ -154,6 +203,31 @@ namespace server_async
             }
         }
 
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        // Adopt a socket that is already bound and listening, e.g. one
+        // handed over by the previous server process.
+        listener(
+            net::io_context &ioc,
+            ssl::context &ctx,
+            tcp::acceptor::native_handle_type listening_fd,
+            ListenerMode mode,
+            std::shared_ptr<std::string const> const &doc_root,
+            HandlerEntryPoint<plain_http_session> &plain_handle_func,
+            HandlerEntryPoint<ssl_http_session> &ssl_handle_func,
+            SessionRegistry &registry,
+            CryptoPool *crypto_pool = nullptr)
+            : ioc_(ioc), ctx_(ctx), acceptor_(net::make_strand(ioc)), mode_(mode), doc_root_(doc_root), plain_handle_func(plain_handle_func), ssl_handle_func(ssl_handle_func), registry_(registry), crypto_pool_(crypto_pool)
+        {
+            beast::error_code ec;
+            acceptor_.assign(handoff::protocol_of(listening_fd), listening_fd, ec);
+            if (ec)
+            {
+                ::close(listening_fd);
+                fail(ec, "assign");
+            }
+        }
+#endif
+
         // Start accepting incoming connections
         void
         run()
@@ -161,6 +235,33 @@ namespace server_async
             do_accept();
         }
 
+        tcp::acceptor::native_handle_type
+        native_handle()
+        {
+            return acceptor_.native_handle();
+        }
+
+        tcp::endpoint
+        local_endpoint()
+        {
+            beast::error_code ec;
+            return acceptor_.local_endpoint(ec);
+        }
+
+        // Stop accepting new connections, the pending accept completes
+        // with operation_aborted and is not restarted.
+        void
+        stop()
+        {
+            net::dispatch(
+                acceptor_.get_executor(),
+                [self = shared_from_this()]
+                {
+                    beast::error_code ec;
+                    self->acceptor_.close(ec);
+                });
+        }
+
     private:
         void
         do_accept()
@@ -176,20 +277,53 @@ namespace server_async
         void
         on_accept(beast::error_code ec, tcp::socket socket)
         {
+            if (!acceptor_.is_open())
+                return;
+
+            auto accepted = std::chrono::steady_clock::now();
             if (ec)
             {
                 fail(ec, "accept");
             }
+            else if (mode_ == ListenerMode::plain)
+            {
+                // Known plain port, no need to sniff the first bytes
+                auto session = std::make_shared<plain_http_session>(
+                    beast::tcp_stream(std::move(socket)),
+                    beast::flat_buffer{},
+                    plain_handle_func,
+                    registry_);
+                session->timings().accepted = accepted;
+                net::dispatch(session->stream().get_executor(),
+                              beast::bind_front_handler(&plain_http_session::run, session));
+            }
+            else if (mode_ == ListenerMode::tls)
+            {
+                // Known TLS port, go straight to the handshake
+                auto session = std::make_shared<ssl_http_session>(
+                    beast::tcp_stream(std::move(socket)),
+                    ctx_,
+                    beast::flat_buffer{},
+                    ssl_handle_func,
+                    registry_,
+                    crypto_pool_);
+                session->timings().accepted = accepted;
+                net::dispatch(session->stream().get_executor(),
+                              beast::bind_front_handler(&ssl_http_session::run, session));
+            }
             else
             {
                 // Create the detector http_session and run it
-                std::make_shared<detect_session>(
+                auto session = std::make_shared<detect_session>(
                     std::move(socket),
                     ctx_,
                     doc_root_,
                     plain_handle_func,
-                    ssl_handle_func)
-                    ->run();
+                    ssl_handle_func,
+                    registry_,
+                    crypto_pool_);
+                session->timings().accepted = accepted;
+                session->run();
             }
 
             // Accept another connection
@@ -200,28 +334,64 @@ namespace server_async
     class HttpServer
     {
     private:
+        // Outlives the io_context, sessions unregister while it is destroyed.
+        SessionRegistry registry_;
+        // Referenced by the SSL context's ticket callback, so it outlives every session too.
+        std::unique_ptr<TicketKeys> ticket_keys_;
+        TlsSessionOptions tls_session_options_;
+        TlsOptions tls_options_;
         // The io_context is required for all I/O
         net::io_context ioc;
         // The SSL context is required, and holds certificates
         ssl::context ctx;
+        // Destroyed before the io_context: a step still running posts its
+        // completion there, queued steps are dropped with their sessions.
+        std::unique_ptr<CryptoPool> crypto_pool_;
+        std::size_t crypto_threads_ = 0;
+        std::size_t crypto_max_pending_ = 0;
         std::shared_ptr<std::string const> const doc_root;
         unsigned short const port;
         net::ip::address address;
         int threads;
         std::vector<std::thread> v;
         boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
+        std::vector<ListenerSpec> listener_specs_;
+        std::vector<std::shared_ptr<listener>> listeners_;
+        std::chrono::steady_clock::duration drain_timeout_;
+        net::steady_timer drain_timer_;
+        std::chrono::steady_clock::time_point drain_deadline_;
+        bool drain_forced_ = false;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        std::string handoff_path_;
+        std::unique_ptr<net::local::stream_protocol::acceptor> handoff_acceptor_;
+        std::function<std::string()> snapshot_provider_;
+        std::function<void(std::string const &)> snapshot_restorer_;
+        char handoff_ack_ = 0;
+#endif
+        std::mutex listening_mtx_;
+        std::condition_variable listening_cv_;
+        bool listening_ = false;
+        std::vector<tcp::endpoint> bound_endpoints_;
+
+        static constexpr std::chrono::milliseconds drain_poll_interval{50};
+        // After the deadline has force-closed everything, how long to wait for the closes to land.
+        static constexpr std::chrono::seconds drain_force_grace{1};
 
     public:
         HttpServer(net::ip::address address,
                    unsigned short port,
                    std::shared_ptr<std::string const> const doc_root,
-                   int threads) : address(address),
-                                  doc_root(doc_root),
-                                  port(port),
-                                  threads(threads),
-                                  ioc{threads},
-                                  ctx{ssl::context::tlsv12},
-                                  work_guard(boost::asio::make_work_guard(ioc))
+                   int threads,
+                   std::chrono::steady_clock::duration drain_timeout = std::chrono::seconds(30))
+            : address(address),
+              doc_root(doc_root),
+              port(port),
+              threads(threads),
+              ioc{threads},
+              ctx{ssl::context::tls_server},
+              work_guard(boost::asio::make_work_guard(ioc)),
+              drain_timeout_(drain_timeout),
+              drain_timer_(ioc)
         {
         }
 
@@ -231,7 +401,17 @@ namespace server_async
         {
             // HandlerFunc<plain_http_session> plain_handler_func = plain_handler;
             // This holds the self-signed certificate used by the server
+            configure_tls(ctx, tls_options_);
             load_server_certificate(ctx, ssl_cert_holder.cert, ssl_cert_holder.key, ssl_cert_holder.dh);
+            if (!ssl_cert_holder.ecdsa_cert.empty())
+                add_server_certificate(ctx, ssl_cert_holder.ecdsa_cert, ssl_cert_holder.ecdsa_key);
+            if (tls_session_options_.tickets)
+                ticket_keys_ = std::make_unique<TicketKeys>(tls_session_options_.ticket_key_lifetime);
+            configure_session_resumption(ctx, tls_session_options_, ticket_keys_.get());
+            if (ktls_enabled().load(std::memory_order_relaxed))
+                enable_ktls_capture(ctx.native_handle());
+            if (crypto_threads_ > 0)
+                crypto_pool_ = std::make_unique<CryptoPool>(crypto_threads_, crypto_max_pending_);
 #ifdef _WIN32
             DWORD pid = GetCurrentProcessId(); // Get PID on Windows
             std::cout << "Process ID (Windows): " << pid << std::endl;
@@ -242,25 +422,59 @@ namespace server_async
             std::filesystem::path cwd = std::filesystem::current_path();
             std::cout << "Current working directory: " << cwd << std::endl;
 
-            // Create and launch a listening port
-            std::make_shared<listener>(
-                ioc,
-                ctx,
-                tcp::endpoint{address, port},
-                doc_root,
-                plain_handler,
-                ssl_handler)
-                ->run();
+            // Without explicit listeners, serve plain and TLS on the one port
+            if (listener_specs_.empty())
+                listener_specs_.push_back({tcp::endpoint{address, port}, ListenerMode::detect});
+
+            // Take over the listening sockets of a running server if there is one,
+            // otherwise create and launch the listening ports
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+            std::vector<int> inherited = take_over_listeners();
+#endif
+            for (auto const &spec : listener_specs_)
+            {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+                auto it = std::find_if(inherited.begin(), inherited.end(), [&spec](int fd)
+                                       { return handoff::local_endpoint_of(fd) == spec.endpoint; });
+                if (it != inherited.end())
+                {
+                    listeners_.push_back(std::make_shared<listener>(
+                        ioc, ctx, *it, spec.mode, doc_root, plain_handler, ssl_handler, registry_, crypto_pool_.get()));
+                    inherited.erase(it);
+                    continue;
+                }
+#endif
+                listeners_.push_back(std::make_shared<listener>(
+                    ioc, ctx, spec.endpoint, spec.mode, doc_root, plain_handler, ssl_handler, registry_, crypto_pool_.get()));
+            }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+            // Ports the old process had but this configuration dropped.
+            for (int fd : inherited)
+                ::close(fd);
+#endif
+            for (auto &l : listeners_)
+                l->run();
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+            listen_for_handoff();
+#endif
+            {
+                std::lock_guard<std::mutex> lock(listening_mtx_);
+                for (auto &l : listeners_)
+                    bound_endpoints_.push_back(l->local_endpoint());
+                listening_ = true;
+            }
+            listening_cv_.notify_all();
 
             // Capture SIGINT and SIGTERM to perform a clean shutdown
             net::signal_set signals(ioc, SIGINT, SIGTERM);
             signals.async_wait(
-                [&](beast::error_code const &, int)
+                [&](beast::error_code const &ec, int)
                 {
-                    // Stop the `io_context`. This will cause `run()`
-                    // to return immediately, eventually destroying the
-                    // `io_context` and all of the sockets in it.
-                    ioc.stop();
+                    if (ec)
+                        return;
+                    // Stop accepting and let in-flight requests finish,
+                    // the `io_context` is stopped once they are done.
+                    drain(drain_timeout_);
                 });
 
             // Run the I/O service on the requested number of threads
@@ -280,13 +494,315 @@ namespace server_async
                 t.join();
         }
 
+        // Graceful shutdown. Stop accepting, close idle keep-alive connections,
+        // answer in-flight requests with "Connection: close" and wait for them
+        // and for open tunnels. Whatever is still open after `timeout` is closed,
+        // then the `io_context` is stopped. Safe to call from any thread.
+        void drain(std::chrono::steady_clock::duration timeout)
+        {
+            net::dispatch(
+                ioc,
+                [this, timeout]
+                {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+                    if (handoff_acceptor_)
+                    {
+                        beast::error_code ec;
+                        handoff_acceptor_->close(ec);
+                    }
+#endif
+                    for (auto &l : listeners_)
+                        l->stop();
+                    registry_.drain(false);
+                    drain_deadline_ = std::chrono::steady_clock::now() + timeout;
+                    drain_forced_ = false;
+                    schedule_drain_check();
+                });
+        }
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        // Zero-downtime restart, call before start().
+        // If a server is already running with the same `path`, start() takes
+        // over its listening sockets instead of binding new ones and the old
+        // server drains. Either way this server then listens on `path` for its
+        // own successor. The optional provider/restorer pair carries warm
+        // state (caches) from the old process to the new one.
+        void enable_handoff(std::string path,
+                            std::function<std::string()> snapshot_provider = {},
+                            std::function<void(std::string const &)> snapshot_restorer = {})
+        {
+            handoff_path_ = std::move(path);
+            snapshot_provider_ = std::move(snapshot_provider);
+            snapshot_restorer_ = std::move(snapshot_restorer);
+        }
+#endif
+
+        // Listen on an additional port, call before start(). Once any listener
+        // is added the address/port given to the constructor is not used.
+        //   add_listener({addr, 80}, ListenerMode::plain);
+        //   add_listener({addr, 443}, ListenerMode::tls);
+        //   add_listener({addr, 8080}, ListenerMode::detect);
+        void add_listener(tcp::endpoint endpoint, ListenerMode mode)
+        {
+            listener_specs_.push_back({endpoint, mode});
+        }
+
+        // Log requests slower than `threshold` with their phase breakdown, zero disables.
+        void set_slow_request_threshold(std::chrono::microseconds threshold)
+        {
+            slow_request_threshold_us().store(threshold.count(), std::memory_order_relaxed);
+        }
+
+        // Bytes read per step by each direction of a CONNECT tunnel or forward
+        // proxy relay: it starts at `initial` and grows up to `max` while the
+        // reads fill it. Sizes are rounded to a power of two from 4 KiB to
+        // 256 KiB, equal values fix the size. Applies to relays started afterwards.
+        void set_relay_buffer_size(std::size_t initial, std::size_t max = RelayBufferPool::largest)
+        {
+            relay_buffer_size().store(initial, std::memory_order_relaxed);
+            relay_buffer_max_size().store(std::max(initial, max), std::memory_order_relaxed);
+        }
+
+        // Relay plain CONNECT tunnels with splice(2) through a pipe per
+        // direction, sized like the largest relay buffer, so tunneled bytes stay in
+        // the kernel. Linux only, applies to tunnels started afterwards.
+        // splice() has no MSG_NOSIGNAL, so this ignores SIGPIPE for the process.
+        void set_relay_splice(bool enabled)
+        {
+#if SERVER_ASYNC_HAS_SPLICE
+            if (enabled)
+                std::signal(SIGPIPE, SIG_IGN);
+#endif
+            relay_splice().store(enabled, std::memory_order_relaxed);
+        }
+
+        // Keep up to `max_idle` connections per origin and io thread open
+        // after forward proxy requests, for `idle_ttl` each, so the next
+        // request to that origin skips DNS and the TCP handshake. Zero
+        // disables the pool, see server_async_upstream_requests_total.
+        void set_upstream_pool(std::size_t max_idle, std::chrono::milliseconds idle_ttl = std::chrono::seconds(30))
+        {
+            upstream_max_idle().store(max_idle, std::memory_order_relaxed);
+            upstream_idle_ttl_ms().store(idle_ttl.count(), std::memory_order_relaxed);
+        }
+
+        // How long the process-wide DNS cache of the proxy keeps resolved
+        // names and failed lookups. A zero `ttl` still lets concurrent
+        // lookups of one name share a resolution, see server_async_dns_lookups_total.
+        void set_dns_cache(std::chrono::milliseconds ttl, std::chrono::milliseconds negative_ttl = std::chrono::seconds(5))
+        {
+            dns_cache_ttl_ms().store(ttl.count(), std::memory_order_relaxed);
+            dns_negative_ttl_ms().store(negative_ttl.count(), std::memory_order_relaxed);
+        }
+
+        // Resolve proxy and client names with the built-in stub resolver
+        // (default) or with getaddrinfo() on the DNS cache's threads.
+        void set_dns_resolver(bool native)
+        {
+            dns_native().store(native, std::memory_order_relaxed);
+        }
+
+        // How long an upstream connect may go unanswered before the next
+        // resolved address is tried alongside it, see HappyEyeballs.
+        void set_connect_attempt_delay(std::chrono::milliseconds delay)
+        {
+            connect_attempt_delay_ms().store(delay.count(), std::memory_order_relaxed);
+        }
+
+        // Turns on the shared cache of the forward proxy, off by default.
+        // Requests in flight finish with what they started with.
+        void set_http_cache(HttpCacheOptions options)
+        {
+            HttpCache::instance().configure(std::move(options));
+        }
+
+        // Whether identical GETs through the forward proxy at the same
+        // time share one origin fetch, off by default. A follower waits
+        // `max_wait` for the leader at a time, see coalesced_wait_ms().
+        void set_request_coalescing(bool on, std::chrono::milliseconds max_wait = std::chrono::seconds(5))
+        {
+            request_coalescing().store(on, std::memory_order_relaxed);
+            coalesced_wait_ms().store(max_wait.count(), std::memory_order_relaxed);
+        }
+
+        // Protocol versions, cipher suites and groups of the TLS listeners, before start().
+        void set_tls_options(TlsOptions options)
+        {
+            tls_options_ = std::move(options);
+        }
+
+        // Hand TLS record encryption to the kernel after each handshake, before
+        // start(). Connections stay on OpenSSL when the kernel lacks the tls
+        // module or the cipher, see server_async_ktls_total.
+        void set_ktls(bool enabled)
+        {
+            ktls_enabled().store(enabled, std::memory_order_relaxed);
+        }
+
+        // Run the OpenSSL part of TLS handshakes on `threads` threads of their
+        // own, before start(), so new clients do not hold up the io threads.
+        // With more than `max_pending` steps queued, further ones run on the
+        // io thread again. server_async_tls_handshake_queue shows the backlog.
+        void set_crypto_threads(std::size_t threads, std::size_t max_pending = 1024)
+        {
+            crypto_threads_ = threads;
+            crypto_max_pending_ = max_pending;
+        }
+
+        // Ticket and session cache settings for TLS resumption, before start().
+        // Ticket keys live in memory only: a restarted or handed-off server
+        // makes new ones and its clients do one full handshake again.
+        void set_tls_session_options(TlsSessionOptions options)
+        {
+            tls_session_options_ = options;
+        }
+
+        std::size_t active_sessions() const
+        {
+            return registry_.active();
+        }
+
+        // Blocks until start() is accepting and returns the bound endpoints,
+        // one per listener in add_listener() order. Port 0 binds an ephemeral
+        // port, this is how to learn which one.
+        std::vector<tcp::endpoint> wait_until_listening()
+        {
+            std::unique_lock<std::mutex> lock(listening_mtx_);
+            listening_cv_.wait(lock, [this]
+                               { return listening_; });
+            return bound_endpoints_;
+        }
+
+        // Hard stop, every in-flight request and tunnel is cut.
+        // start() joins the I/O threads and returns.
         void stop()
         {
+            work_guard.reset();
             ioc.stop();
-            for (auto &thread : v) // Assuming you have a vector of threads
+        }
+
+    private:
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        std::vector<int> take_over_listeners()
+        {
+            if (handoff_path_.empty())
+                return {};
+
+            handoff::Received received;
+            beast::error_code ec;
+            if (!handoff::receive(handoff_path_, received, ec))
+            {
+                // Nobody listening on the path is a plain cold start, so is
+                // an old process that does not answer.
+                if (ec == net::error::timed_out)
+                    SA_LOG_WARN("handoff: no answer on " << handoff_path_ << ", starting cold");
+                else if (ec != net::error::connection_refused && ec != beast::errc::no_such_file_or_directory)
+                    fail(ec, "handoff receive");
+                return {};
+            }
+            SA_LOG_INFO("handoff: took over " << received.fds.size() << " listening sockets");
+            if (snapshot_restorer_ && !received.snapshot.empty())
+                snapshot_restorer_(received.snapshot);
+            return received.fds;
+        }
+
+        void listen_for_handoff()
+        {
+            if (handoff_path_.empty())
+                return;
+
+            // The old process may still be bound to the path, it keeps its
+            // open acceptor but nobody can reach it any more.
+            ::unlink(handoff_path_.c_str());
+
+            beast::error_code ec;
+            handoff_acceptor_ = std::make_unique<net::local::stream_protocol::acceptor>(ioc);
+            net::local::stream_protocol::endpoint endpoint{handoff_path_};
+            handoff_acceptor_->open(endpoint.protocol(), ec);
+            if (!ec)
+                handoff_acceptor_->bind(endpoint, ec);
+            if (!ec)
+                handoff_acceptor_->listen(1, ec);
+            if (ec)
+            {
+                fail(ec, "handoff listen");
+                handoff_acceptor_.reset();
+                return;
+            }
+            do_handoff_accept();
+        }
+
+        void do_handoff_accept()
+        {
+            handoff_acceptor_->async_accept(
+                [this](beast::error_code ec, net::local::stream_protocol::socket socket)
+                {
+                    if (ec)
+                    {
+                        if (ec != net::error::operation_aborted)
+                            fail(ec, "handoff accept");
+                        return;
+                    }
+                    on_handoff(std::move(socket));
+                });
+        }
+
+        void on_handoff(net::local::stream_protocol::socket socket)
+        {
+            std::vector<int> fds;
+            for (auto &l : listeners_)
+                fds.push_back(l->native_handle());
+            std::string snapshot = snapshot_provider_ ? snapshot_provider_() : std::string{};
+
+            beast::error_code ec;
+            if (!handoff::send(socket.native_handle(), fds, snapshot, ec))
             {
-                thread.join(); // Wait for each thread to finish
+                fail(ec, "handoff send");
+                return do_handoff_accept();
             }
+
+            // Keep serving until the successor confirms it owns the sockets.
+            auto peer = std::make_shared<net::local::stream_protocol::socket>(std::move(socket));
+            net::async_read(
+                *peer,
+                net::buffer(&handoff_ack_, 1),
+                [this, peer](beast::error_code ec, std::size_t)
+                {
+                    if (ec)
+                    {
+                        fail(ec, "handoff ack");
+                        return do_handoff_accept();
+                    }
+                    SA_LOG_INFO("handoff: successor took over, draining");
+                    drain(drain_timeout_);
+                });
+        }
+#endif
+
+        void schedule_drain_check()
+        {
+            drain_timer_.expires_after(drain_poll_interval);
+            drain_timer_.async_wait(
+                [this](beast::error_code ec)
+                {
+                    if (ec)
+                        return;
+                    auto now = std::chrono::steady_clock::now();
+                    if (registry_.active() == 0 ||
+                        (drain_forced_ && now >= drain_deadline_ + drain_force_grace))
+                    {
+                        work_guard.reset();
+                        ioc.stop();
+                        return;
+                    }
+                    if (!drain_forced_ && now >= drain_deadline_)
+                    {
+                        std::cerr << "drain: deadline reached, closing " << registry_.active() << " sessions" << std::endl;
+                        drain_forced_ = true;
+                        registry_.drain(true);
+                    }
+                    schedule_drain_check();
+                });
         }
     };
 }
@@ -4,6 +4,7 @@
 #define SERVER_ASYNC_UTIL_H
 
 #include "server_certificate.hpp"
+#include "logger.hpp"
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
@@ -63,7 +64,7 @@ namespace server_async
         if (ec == net::ssl::error::stream_truncated)
             return;
 
-        std::cerr << what << ": " << ec.message() << "\n";
+        SA_LOG_ERROR(what << ": " << ec.message());
     }
 
     // void serialize_headers_with_visitor(beast::flat_buffer &buffer, const http::request<http::empty_body> &req)
@@ -120,8 +120,11 @@ load_server_certificate(boost::asio::ssl::context &ctx,
         boost::asio::buffer(key.data(), key.size()),
         boost::asio::ssl::context::file_format::pem);
 
-    ctx.use_tmp_dh(
-        boost::asio::buffer(dh.data(), dh.size()));
+    // Only used by DHE cipher suites, which the ECDHE-only defaults of
+    // TlsOptions leave out, so the params are optional.
+    if (!dh.empty())
+        ctx.use_tmp_dh(
+            boost::asio::buffer(dh.data(), dh.size()));
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,142 @@
+#pragma once
+#ifndef SERVER_ASYNC_SESSION_REGISTRY_H
+#define SERVER_ASYNC_SESSION_REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace server_async
+{
+    enum class SessionKind
+    {
+        http,
+        tunnel
+    };
+
+    // Live set of sessions and tunnels owned by one server.
+    // Every http_session and copier registers itself when it starts and is
+    // removed again when it is destroyed, so the server can tell how much
+    // work is still in flight and ask it to wind down.
+    class SessionRegistry
+    {
+    public:
+        // Called on drain. force == false asks the session to finish the
+        // current request and close, force == true asks it to close now.
+        using DrainCallback = std::function<void(bool force)>;
+
+        // RAII handle, unregisters the session when destroyed.
+        class Registration
+        {
+        public:
+            Registration() = default;
+            Registration(SessionRegistry *registry, std::uint64_t id) : registry_(registry), id_(id) {}
+            Registration(Registration &&other) noexcept
+                : registry_(std::exchange(other.registry_, nullptr)), id_(other.id_)
+            {
+            }
+            Registration &operator=(Registration &&other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    registry_ = std::exchange(other.registry_, nullptr);
+                    id_ = other.id_;
+                }
+                return *this;
+            }
+            Registration(const Registration &) = delete;
+            Registration &operator=(const Registration &) = delete;
+            ~Registration() { reset(); }
+
+            bool active() const { return registry_ != nullptr; }
+
+            void reset()
+            {
+                if (registry_)
+                    std::exchange(registry_, nullptr)->remove(id_);
+            }
+
+        private:
+            SessionRegistry *registry_ = nullptr;
+            std::uint64_t id_ = 0;
+        };
+
+        Registration add(SessionKind kind, DrainCallback on_drain)
+        {
+            Metrics::instance().session_opened(static_cast<std::size_t>(kind));
+            std::lock_guard<std::mutex> lock(mtx_);
+            std::uint64_t id = ++next_id_;
+            entries_.emplace(id, Entry{kind, std::move(on_drain)});
+            return Registration{this, id};
+        }
+
+        std::size_t active() const
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            return entries_.size();
+        }
+
+        std::size_t active(SessionKind kind) const
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            std::size_t n = 0;
+            for (auto const &e : entries_)
+                if (e.second.kind == kind)
+                    ++n;
+            return n;
+        }
+
+        bool draining() const
+        {
+            return draining_.load(std::memory_order_acquire);
+        }
+
+        // Enter drain mode and notify every live session.
+        // The callbacks run outside the lock, they are expected to post
+        // onto the session's own executor.
+        void drain(bool force)
+        {
+            draining_.store(true, std::memory_order_release);
+            std::vector<DrainCallback> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                callbacks.reserve(entries_.size());
+                for (auto const &e : entries_)
+                    callbacks.push_back(e.second.on_drain);
+            }
+            for (auto &cb : callbacks)
+                cb(force);
+        }
+
+    private:
+        struct Entry
+        {
+            SessionKind kind;
+            DrainCallback on_drain;
+        };
+
+        void remove(std::uint64_t id)
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto it = entries_.find(id);
+            if (it == entries_.end())
+                return;
+            Metrics::instance().session_closed(static_cast<std::size_t>(it->second.kind));
+            entries_.erase(it);
+        }
+
+        mutable std::mutex mtx_;
+        std::unordered_map<std::uint64_t, Entry> entries_;
+        std::uint64_t next_id_ = 0;
+        std::atomic<bool> draining_{false};
+    };
+}
+
+#endif
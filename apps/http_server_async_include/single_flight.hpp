@@ -0,0 +1,459 @@
+#pragma once
+#ifndef SERVER_ASYNC_SINGLE_FLIGHT_HPP
+#define SERVER_ASYNC_SINGLE_FLIGHT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "http_cache.hpp"
+
+// Request coalescing of the forward proxy.
+//
+// A GET for a URL that another client is already fetching through the
+// proxy does not go to the origin again: it attaches to that fetch, the
+// flight, and is answered with the same response, streamed to every
+// attached client as the leader reads it. Whether the response fits the
+// followers is only known from its header: it must be one a shared cache
+// could store, and the followers must agree with the leader on the request
+// fields named in Vary. Otherwise the followers fetch on their own.
+namespace server_async
+{
+    // Whether identical GETs through the forward proxy share one origin
+    // fetch, off by default. HttpServer::set_request_coalescing() changes it.
+    inline std::atomic<bool> &request_coalescing()
+    {
+        static std::atomic<bool> on{false};
+        return on;
+    }
+
+    // How long a follower waits for the leader's header or the next piece
+    // of its body. Before the follower answered anything it then fetches on
+    // its own, after that it gives up.
+    inline std::atomic<std::int64_t> &coalesced_wait_ms()
+    {
+        static std::atomic<std::int64_t> wait{5000};
+        return wait;
+    }
+
+    class Flight
+    {
+    public:
+        enum class State
+        {
+            waiting,     // for the response header
+            streaming,   // the response is shared, its body arrives
+            complete,    // all of the body arrived
+            declined,    // the response is not for the followers, or never came
+            revalidated, // the origin confirmed the stored entry()
+            aborted      // the body broke off
+        };
+
+        // Called once, on whatever thread changes the flight; it posts to its owner.
+        using Waker = std::function<void()>;
+
+        // Part of the body, valid as long as `chunk` is held.
+        struct Piece
+        {
+            std::shared_ptr<std::string const> chunk;
+            char const *data = nullptr;
+            std::size_t size = 0;
+        };
+
+        // Bodies up to this size are kept whole for clients that attach
+        // late. Past it no one attaches and the leader does not read on
+        // while a follower is this far behind.
+        static constexpr std::uint64_t window = 4 << 20;
+
+        explicit Flight(std::string key) : key_(std::move(key)) {}
+
+        Flight(const Flight &) = delete;
+        Flight &operator=(const Flight &) = delete;
+
+        std::string const &
+        key() const
+        {
+            return key_;
+        }
+
+        // The leader has the header of a response the followers may share,
+        // without its framing, and the length of the body if it is known.
+        void respond(boost::beast::http::response_header<> header, std::optional<std::uint64_t> length, HttpCache::Vary vary);
+
+        // The response is not for the followers; they fetch on their own.
+        void
+        decline()
+        {
+            settle(State::declined);
+        }
+
+        // The origin answered 304: the followers are served `entry`.
+        void
+        revalidated(std::shared_ptr<CacheEntry const> entry)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                entry_ = std::move(entry);
+            }
+            settle(State::revalidated);
+        }
+
+        // Hands the next `n` bytes of the body to the followers.
+        void publish(void const *data, std::size_t n);
+
+        void
+        finish()
+        {
+            settle(State::complete);
+        }
+
+        // The leader gave up: before the header the followers go on their
+        // own, after it those already answering break off. A no-op once settled.
+        void
+        abort()
+        {
+            settle(State::aborted);
+        }
+
+        // Whether the leader has to wait before reading more of the body;
+        // `resume` is called once the slowest follower caught up.
+        bool
+        throttled(Waker resume)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!behind_window())
+                return false;
+            resume_ = std::move(resume);
+            return true;
+        }
+
+        // Whether a follower is still attached.
+        bool
+        followed() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return std::any_of(readers_.begin(), readers_.end(), [](Reader const &reader)
+                               { return reader.attached; });
+        }
+
+        // A new follower, unless followers can no longer attach.
+        std::optional<std::size_t>
+        attach()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!joinable_)
+                return std::nullopt;
+            readers_.push_back(Reader{});
+            return readers_.size() - 1;
+        }
+
+        // The follower is done with the flight, answered or not.
+        void detach(std::size_t reader);
+
+        // The flight's state; while it waits for the header, `waker` is
+        // called once it no longer does.
+        State
+        wait(std::size_t reader, Waker waker)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (state_ == State::waiting)
+                readers_[reader].waker = std::move(waker);
+            return state_;
+        }
+
+        // The next piece of the body for `reader`. An empty piece while the
+        // state is streaming means `waker` is called when there is more.
+        Piece read(std::size_t reader, Waker waker, State &state);
+
+        // What respond() was given; stable once the state is past waiting.
+        boost::beast::http::response_header<> const &
+        header() const
+        {
+            return header_;
+        }
+
+        std::optional<std::uint64_t>
+        length() const
+        {
+            return length_;
+        }
+
+        HttpCache::Vary const &
+        vary() const
+        {
+            return vary_;
+        }
+
+        std::shared_ptr<CacheEntry const>
+        entry() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return entry_;
+        }
+
+    private:
+        struct Reader
+        {
+            std::uint64_t offset = 0;
+            bool attached = true;
+            Waker waker;
+        };
+
+        // Moves to a final state, unless there already is one, and wakes everyone.
+        void settle(State state);
+
+        // Takes the wakers of all readers, to be called without the lock.
+        std::vector<Waker>
+        take_wakers()
+        {
+            std::vector<Waker> wakers;
+            for (auto &reader : readers_)
+                if (reader.waker)
+                {
+                    wakers.push_back(std::move(reader.waker));
+                    reader.waker = nullptr;
+                }
+            return wakers;
+        }
+
+        std::uint64_t
+        slowest() const
+        {
+            std::uint64_t offset = published_;
+            for (auto const &reader : readers_)
+                if (reader.attached)
+                    offset = std::min(offset, reader.offset);
+            return offset;
+        }
+
+        bool
+        behind_window() const
+        {
+            return !joinable_ && published_ - slowest() > window;
+        }
+
+        // Drops the chunks every follower has read, once no one can attach.
+        void
+        trim()
+        {
+            if (joinable_)
+                return;
+            std::uint64_t offset = slowest();
+            while (!chunks_.empty() && base_ + chunks_.front()->size() <= offset)
+            {
+                base_ += chunks_.front()->size();
+                chunks_.pop_front();
+            }
+        }
+
+        // A leader resumed after the slowest follower caught up.
+        Waker
+        take_resume()
+        {
+            Waker resume;
+            if (resume_ && !behind_window())
+                std::swap(resume, resume_);
+            return resume;
+        }
+
+        // Closes the flight to new followers, done by the caller without the lock.
+        bool
+        close_joins()
+        {
+            bool was = joinable_;
+            joinable_ = false;
+            return was;
+        }
+
+        std::string key_;
+        mutable std::mutex mutex_;
+        State state_ = State::waiting;
+        bool joinable_ = true;
+        boost::beast::http::response_header<> header_;
+        std::optional<std::uint64_t> length_;
+        HttpCache::Vary vary_;
+        std::shared_ptr<CacheEntry const> entry_;
+        std::deque<std::shared_ptr<std::string const>> chunks_;
+        std::uint64_t base_ = 0;      // offset of chunks_.front()
+        std::uint64_t published_ = 0; // bytes of the body so far
+        std::vector<Reader> readers_;
+        Waker resume_;
+    };
+
+    // The flights in progress, by the HttpCache key of their URL.
+    class Flights
+    {
+    public:
+        static Flights &
+        instance()
+        {
+            static Flights flights;
+            return flights;
+        }
+
+        // The flight of `key` and a reader of it, or a new flight the caller
+        // leads if it may `lead`, or nothing.
+        std::pair<std::shared_ptr<Flight>, std::optional<std::size_t>>
+        join(std::string const &key, bool lead = true)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = flights_.find(key);
+            if (it != flights_.end())
+                if (auto reader = it->second->attach())
+                    return {it->second, reader};
+            if (!lead)
+                return {};
+            auto flight = std::make_shared<Flight>(key);
+            flights_[key] = flight;
+            return {flight, std::nullopt};
+        }
+
+        // No one attaches to `flight` any more.
+        void
+        remove(Flight const *flight)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = flights_.find(flight->key());
+            if (it != flights_.end() && it->second.get() == flight)
+                flights_.erase(it);
+        }
+
+        std::size_t
+        size() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return flights_.size();
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+    };
+
+    inline void
+    Flight::respond(boost::beast::http::response_header<> header, std::optional<std::uint64_t> length, HttpCache::Vary vary)
+    {
+        std::vector<Waker> wakers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (state_ != State::waiting)
+                return;
+            header_ = std::move(header);
+            length_ = length;
+            vary_ = std::move(vary);
+            state_ = State::streaming;
+            wakers = take_wakers();
+        }
+        for (auto &waker : wakers)
+            waker();
+    }
+
+    inline void
+    Flight::publish(void const *data, std::size_t n)
+    {
+        if (n == 0)
+            return;
+        std::vector<Waker> wakers;
+        bool closed = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (state_ != State::streaming)
+                return;
+            chunks_.push_back(std::make_shared<std::string const>(static_cast<char const *>(data), n));
+            published_ += n;
+            if (published_ > window)
+                closed = close_joins();
+            trim();
+            wakers = take_wakers();
+        }
+        if (closed)
+            Flights::instance().remove(this);
+        for (auto &waker : wakers)
+            waker();
+    }
+
+    inline void
+    Flight::settle(State state)
+    {
+        std::vector<Waker> wakers;
+        bool closed = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (state_ != State::waiting && state_ != State::streaming)
+                return;
+            if (state == State::aborted && state_ == State::waiting)
+                state = State::declined;
+            state_ = state;
+            closed = close_joins();
+            resume_ = nullptr;
+            trim();
+            wakers = take_wakers();
+        }
+        if (closed)
+            Flights::instance().remove(this);
+        for (auto &waker : wakers)
+            waker();
+    }
+
+    inline void
+    Flight::detach(std::size_t reader)
+    {
+        Waker resume;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            readers_[reader].attached = false;
+            readers_[reader].waker = nullptr;
+            trim();
+            resume = take_resume();
+        }
+        if (resume)
+            resume();
+    }
+
+    inline Flight::Piece
+    Flight::read(std::size_t reader, Waker waker, State &state)
+    {
+        Piece piece;
+        Waker resume;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            state = state_;
+            auto &r = readers_[reader];
+            if (r.offset == published_)
+            {
+                if (state_ == State::streaming)
+                    r.waker = std::move(waker);
+                return piece;
+            }
+            // Chunks are only dropped behind every reader.
+            std::uint64_t at = base_;
+            for (auto const &chunk : chunks_)
+            {
+                if (r.offset < at + chunk->size())
+                {
+                    std::size_t skip = static_cast<std::size_t>(r.offset - at);
+                    piece = Piece{chunk, chunk->data() + skip, chunk->size() - skip};
+                    break;
+                }
+                at += chunk->size();
+            }
+            r.offset += piece.size;
+            trim();
+            resume = take_resume();
+        }
+        if (resume)
+            resume();
+        return piece;
+    }
+}
+
+#endif
@@ -3,13 +3,32 @@
 #ifndef SOCKET_COPY_H
 #define SOCKET_COPY_H
 
+#include <atomic>
 #include <iostream>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <optional>
 #include <boost/url.hpp>
 
 #include "server_async_util.h"
+#include "session_registry.hpp"
+#include "dns_cache.hpp"
+#include "happy_eyeballs.hpp"
+#include "ktls.hpp"
+#include "relay_buffer.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#define SERVER_ASYNC_HAS_SPLICE 1
+#else
+#define SERVER_ASYNC_HAS_SPLICE 0
+#endif
 
 using boost::asio::ip::tcp;
 
@@ -33,30 +52,120 @@ namespace server_async
   public:
     static constexpr bool value = decltype(test<T>(0))::value;
   };
-  template <typename SourceType, typename DestType, typename Derived, size_t max_length = 4096,
+  // The socket a plain relay source waits on for readability.
+  inline tcp::socket &relay_socket(tcp::socket &socket) { return socket; }
+  inline tcp::socket &relay_socket(beast::tcp_stream &stream) { return stream.socket(); }
+
+  // Called by a TLS relay each time one of its directions ends. The TLS
+  // shutdown reads and writes the stream, so it waits for the other
+  // direction, which is cut short instead of left running alongside.
+  // Returns true once both have ended and the shutdown may start.
+  inline bool
+  ssl_relay_ended(int &relays_done, tcp::socket &remote, ssl_beast_stream &stream)
+  {
+    if (++relays_done == 1)
+    {
+      beast::error_code ec;
+      remote.shutdown(tcp::socket::shutdown_both, ec);
+      beast::get_lowest_layer(stream).cancel();
+      return false;
+    }
+    return true;
+  }
+
+  // Sends close_notify and waits for the peer's, keeping `self` alive.
+  template <typename Self>
+  void
+  ssl_shutdown(std::shared_ptr<Self> self, ssl_beast_stream &stream)
+  {
+    // Set the timeout.
+    beast::get_lowest_layer(stream).expires_after(std::chrono::seconds(30));
+
+    // Perform the SSL shutdown
+    stream.async_shutdown(
+        [self](beast::error_code ec)
+        {
+          if (ec)
+            return fail(ec, "shutdown");
+          // At this point the connection is closed gracefully
+        });
+  }
+
+  // Sources that can be waited on without a buffer. A TLS stream cannot:
+  // asio may already hold its next record, with the socket quiet.
+  template <typename SourceType>
+  constexpr bool waits_for_readable =
+      std::is_same_v<SourceType, tcp::socket> || std::is_same_v<SourceType, beast::tcp_stream>;
+
+  template <typename SourceType, typename DestType, typename Derived>
+  void relay_read(std::shared_ptr<Derived> self, SourceType &source, DestType &dest, std::shared_ptr<RelayBuffer> &buffer, bool to_remote);
+
+  // Relays `source` to `dest` until either end fails. A plain source is
+  // waited on with no buffer held, so an idle tunnel holds no relay memory;
+  // the buffer comes from the thread's pool once there is something to read.
+  template <typename SourceType, typename DestType, typename Derived,
             typename = std::enable_if_t<has_do_eof<Derived>::value>>
-  void do_relay(std::shared_ptr<Derived> self, SourceType &source, DestType &dest, std::shared_ptr<std::array<char, max_length>> &buffer, bool to_remote)
+  void do_relay(std::shared_ptr<Derived> self, SourceType &source, DestType &dest, std::shared_ptr<RelayBuffer> &buffer, bool to_remote)
+  {
+    if constexpr (waits_for_readable<SourceType>)
+    {
+      if (!buffer->held())
+      {
+        relay_socket(source).async_wait(
+            tcp::socket::wait_read,
+            boost::asio::bind_executor(
+                source.get_executor(),
+                [self, &source, &dest, &buffer, to_remote](boost::system::error_code ec)
+                {
+                  if (ec)
+                  {
+                    if (ec != boost::asio::error::operation_aborted)
+                    {
+                      SA_LOG_WARN("Error waiting for: " << typeid(SourceType).name() << ", msg: " << ec.message());
+                    }
+                    return self->do_eof();
+                  }
+                  relay_read(self, source, dest, buffer, to_remote);
+                }));
+        return;
+      }
+    }
+    relay_read(self, source, dest, buffer, to_remote);
+  }
+
+  template <typename SourceType, typename DestType, typename Derived>
+  void relay_read(std::shared_ptr<Derived> self, SourceType &source, DestType &dest, std::shared_ptr<RelayBuffer> &buffer, bool to_remote)
   {
     source.async_read_some(
-        boost::asio::buffer(*buffer),
+        buffer->acquire(),
         boost::asio::bind_executor(
             source.get_executor(),
-            [self, &source, &dest, &buffer, &to_remote](boost::system::error_code ec, std::size_t bytes_transferred)
+            [self, &source, &dest, &buffer, to_remote](boost::system::error_code ec, std::size_t bytes_transferred)
             {
               if (!ec)
               {
                 boost::asio::async_write(
                     dest,
                     boost::asio::buffer(buffer->data(), bytes_transferred),
-                    [self, &source, &dest, &buffer, &to_remote](boost::system::error_code ec, std::size_t)
+                    [self, &source, &dest, &buffer, to_remote, bytes_transferred](boost::system::error_code ec, std::size_t written)
                     {
                       if (!ec)
                       {
+                        Metrics &metrics = Metrics::instance();
+                        if (to_remote)
+                          metrics.add_bytes_in(static_cast<std::size_t>(SessionKind::tunnel), written);
+                        else
+                          metrics.add_bytes_out(static_cast<std::size_t>(SessionKind::tunnel), written);
+                        // A short read emptied the socket, keep no block while it refills.
+                        bool drained = bytes_transferred < buffer->size();
+                        buffer->adapt(bytes_transferred);
+                        if (drained && waits_for_readable<SourceType>)
+                          buffer->release();
                         do_relay(self, source, dest, buffer, to_remote); // Continue relaying
                       }
                       else
                       {
-                        std::cout << "Error during write to: " << typeid(DestType).name() << ", msg: " << ec.message() << std::endl;
+                        SA_LOG_WARN("Error during write to: " << typeid(DestType).name() << ", msg: " << ec.message());
                         self->do_eof();
                       }
                     });
@@ -65,14 +174,159 @@ namespace server_async
               {
                 if (ec != boost::asio::error::eof)
                 {
-                  std::cout << "Error during read from: " << typeid(SourceType).name() << ", msg: " << ec.message() << std::endl;
+                  SA_LOG_WARN("Error during read from: " << typeid(SourceType).name() << ", msg: " << ec.message());
                 }
                 self->do_eof();
               }
             }));
   }
 
-  template <typename StreamType, typename Derived, size_t max_length = 4096>
+  // Whether plain CONNECT tunnels relay with splice(2), taken when the
+  // copier is created. HttpServer::set_relay_splice() changes it.
+  inline std::atomic<bool> &relay_splice()
+  {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+  }
+
+#if SERVER_ASYNC_HAS_SPLICE
+  // The kernel buffer one splice relay direction moves bytes through:
+  // socket to pipe, then pipe to socket, without a copy to user space.
+  class SplicePipe
+  {
+  public:
+    explicit SplicePipe(std::size_t size)
+    {
+      int fds[2];
+      if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+        return;
+      read_fd = fds[0];
+      write_fd = fds[1];
+      // Best effort, the kernel rounds up to pages and caps unprivileged sizes.
+      ::fcntl(write_fd, F_SETPIPE_SZ, static_cast<int>(size));
+      int actual = ::fcntl(write_fd, F_GETPIPE_SZ);
+      chunk = actual > 0 ? static_cast<std::size_t>(actual) : size;
+    }
+
+    SplicePipe(const SplicePipe &) = delete;
+    SplicePipe &operator=(const SplicePipe &) = delete;
+
+    ~SplicePipe()
+    {
+      if (read_fd >= 0)
+        ::close(read_fd);
+      if (write_fd >= 0)
+        ::close(write_fd);
+    }
+
+    bool ok() const { return read_fd >= 0; }
+
+    int read_fd = -1;
+    int write_fd = -1;
+    std::size_t chunk = 0;
+    // Bytes in the pipe not yet written to the destination.
+    std::size_t pending = 0;
+    // Whether any byte went through, a socket splice() refuses shows up on the first one.
+    bool moved = false;
+  };
+
+  // Relays `source` to `dest` like do_relay, but through `pipe` with
+  // splice() on readiness, so the bytes never enter user space. Falls back
+  // to do_relay with `buffer` when the kernel cannot splice `source`.
+  template <typename Derived>
+  void do_splice_relay(std::shared_ptr<Derived> self, tcp::socket &source, tcp::socket &dest,
+                       std::shared_ptr<SplicePipe> pipe, std::shared_ptr<RelayBuffer> &buffer, bool to_remote)
+  {
+    // Splices per turn before yielding to the other connections of this thread.
+    constexpr int max_steps = 16;
+    for (int step = 0; step < max_steps; ++step)
+    {
+      if (pipe->pending > 0)
+      {
+        ssize_t n = ::splice(pipe->read_fd, nullptr, dest.native_handle(), nullptr, pipe->pending,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+          pipe->pending -= static_cast<std::size_t>(n);
+          Metrics &metrics = Metrics::instance();
+          if (to_remote)
+            metrics.add_bytes_in(static_cast<std::size_t>(SessionKind::tunnel), static_cast<std::uint64_t>(n));
+          else
+            metrics.add_bytes_out(static_cast<std::size_t>(SessionKind::tunnel), static_cast<std::uint64_t>(n));
+          continue;
+        }
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0 && errno == EAGAIN)
+        {
+          dest.async_wait(
+              tcp::socket::wait_write,
+              [self, &source, &dest, pipe, &buffer, to_remote](boost::system::error_code ec)
+              {
+                if (ec)
+                  return self->do_eof();
+                do_splice_relay(self, source, dest, pipe, buffer, to_remote);
+              });
+          return;
+        }
+        SA_LOG_WARN("Error during splice to: " << (to_remote ? "remote" : "client") << ", msg: " << std::strerror(errno));
+        return self->do_eof();
+      }
+
+      ssize_t n = ::splice(source.native_handle(), nullptr, pipe->write_fd, nullptr, pipe->chunk,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0)
+      {
+        pipe->pending = static_cast<std::size_t>(n);
+        pipe->moved = true;
+        continue;
+      }
+      if (n == 0)
+        return self->do_eof();
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+      {
+        source.async_wait(
+            tcp::socket::wait_read,
+            [self, &source, &dest, pipe, &buffer, to_remote](boost::system::error_code ec)
+            {
+              if (ec)
+                return self->do_eof();
+              do_splice_relay(self, source, dest, pipe, buffer, to_remote);
+            });
+        return;
+      }
+      if (errno == EINVAL && !pipe->moved)
+        return do_relay(self, source, dest, buffer, to_remote);
+      SA_LOG_WARN("Error during splice from: " << (to_remote ? "client" : "remote") << ", msg: " << std::strerror(errno));
+      return self->do_eof();
+    }
+
+    net::post(source.get_executor(),
+              [self, &source, &dest, pipe, &buffer, to_remote]
+              { do_splice_relay(self, source, dest, pipe, buffer, to_remote); });
+  }
+#endif
+
+  // Registers a copier as a tunnel. A tunnel has no request boundary, so a
+  // graceful drain leaves it running and only the drain deadline closes it.
+  template <typename Derived, typename Executor>
+  SessionRegistry::Registration register_tunnel(SessionRegistry &registry, std::shared_ptr<Derived> self, Executor ex)
+  {
+    return registry.add(
+        SessionKind::tunnel,
+        [weak = std::weak_ptr<Derived>(self), ex](bool force)
+        {
+          if (!force)
+            return;
+          if (auto self = weak.lock())
+            net::post(ex, [self]
+                      { self->close(); });
+        });
+  }
+
+  template <typename StreamType, typename Derived>
   class socket_copier
   {
   public:
@@ -90,13 +344,14 @@ namespace server_async
     socket_copier(
         StreamType &&stream_,
         beast::flat_buffer &&buffer_,
-        http::request<http::empty_body> &&req_)
+        http::request<http::empty_body> &&req_,
+        SessionRegistry &registry_)
         : stream_(std::move(stream_)),
           remote_socket_(stream_.get_executor()),
-          resolver_(stream_.get_executor()),
+          registry_(registry_),
           req_(std::move(req_)),
-          to_remote_buffer(std::make_shared<std::array<char, max_length>>()),
-          to_client_buffer(std::make_shared<std::array<char, max_length>>())
+          to_remote_buffer(make_relay_buffer()),
+          to_client_buffer(make_relay_buffer())
     {
     }
 
@@ -114,11 +369,11 @@ namespace server_async
       {
         if (to_remote)
         {
-          std::cout << "Error " << operation << " to remote: " << ec.message() << std::endl;
+          SA_LOG_WARN("Error " << operation << " to remote: " << ec.message());
         }
         else
         {
-          std::cout << "Error " << operation << " to client: " << ec.message() << std::endl;
+          SA_LOG_WARN("Error " << operation << " to client: " << ec.message());
         }
       }
     }
@@ -134,19 +389,38 @@ namespace server_async
           {
             if (ec)
             {
-              std::cerr << "Error writing to proxy server: " << ec.message() << std::endl;
+              SA_LOG_ERROR("Error writing to proxy server: " << ec.message());
             }
             else
             {
-              std::cout << "start fetching from remote and send to client....." << std::endl;
-              do_relay(self, self->remote_socket_, self->stream_, self->to_client_buffer, false);
-              std::cout << "start fetching from client and sending to remote......" << std::endl;
-              // if (self->req_.method() == http::verb::post || self->req_.method() == http::verb::put)
-              do_relay(self, self->stream_, self->remote_socket_, self->to_remote_buffer, true);
+              self->relay();
             }
           });
     }
 
+    // Starts both relay directions, a derived class may relay differently.
+    void relay()
+    {
+      auto self = derived().shared_from_this();
+      SA_LOG_DEBUG("start fetching from remote and send to client.....");
+      do_relay(self, remote_socket_, stream_, to_client_buffer, false);
+      SA_LOG_DEBUG("start fetching from client and sending to remote......");
+      // if (req_.method() == http::verb::post || req_.method() == http::verb::put)
+      do_relay(self, stream_, remote_socket_, to_remote_buffer, true);
+    }
+
+    // Closes both ends of the tunnel, any pending relay completes with an
+    // error and a connect under way gives up its attempts.
+    void close()
+    {
+      closed_ = true;
+      if (auto connecting = connecting_.lock())
+        connecting->cancel();
+      beast::error_code ec;
+      beast::get_lowest_layer(stream_).socket().close(ec);
+      remote_socket_.close(ec);
+    }
+
     void write200ok_to_client(const std::string &response)
     {
       boost::asio::async_write(stream_, boost::asio::buffer(response),
@@ -158,13 +432,15 @@ namespace server_async
                                  }
                                  else
                                  {
-                                   std::cerr << "Error writing to proxy server: " << ec.message() << std::endl;
+                                   SA_LOG_ERROR("Error writing to proxy server: " << ec.message());
                                  }
                                });
     }
 
     void start()
     {
+      registration_ = register_tunnel(registry_, derived().shared_from_this(), stream_.get_executor());
+
       // boost::urls::url_view url{req_.target()};
       // if target has schema
       // std::string tg;
@@ -208,37 +484,41 @@ namespace server_async
       int deliminator = req_.target().find(':');
       if (deliminator == std::string::npos)
       {
-        std::cerr << "Error parsing target: " << req_.target() << std::endl;
+        SA_LOG_WARN("Error parsing target: " << req_.target());
         return;
       }
       const std::string &host = req_.target().substr(0, deliminator);
       std::string port = req_.target().substr(deliminator + 1);
 
-      std::cout << "target_endpoints_:" << req_.target() << ", start resolve: " << host << ", port: " << port << std::endl;
+      SA_LOG_DEBUG("target_endpoints_:" << req_.target() << ", start resolve: " << host << ", port: " << port);
       // tcp::resolver::results_type target_endpoints_resolved_ = resolver_.resolve(host, port);
-      resolver_.async_resolve(host, port,
-                              [self = derived().shared_from_this()](boost::system::error_code ec, tcp::resolver::results_type results)
+      DnsCache::instance().async_resolve(host, port, stream_.get_executor(),
+                              [self = derived().shared_from_this()](boost::system::error_code ec, DnsCache::Endpoints const &results)
                               {
+                                if (self->closed_)
+                                  return;
                                 if (!ec)
                                 {
-                                  std::cout << "result: " << results.begin()->endpoint() << std::endl;
-                                  boost::asio::async_connect(self->remote_socket_, results,
-                                                             [self](boost::system::error_code ec, const tcp::endpoint &)
-                                                             {
-                                                               if (!ec)
-                                                               {
-                                                                 self->write200ok_to_client("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n\r\n");
-                                                               }
-                                                               else
+                                  SA_LOG_DEBUG("result: " << results.front());
+                                  self->connecting_ = HappyEyeballs::async_connect(self->remote_socket_, results,
+                                                               [self](boost::system::error_code ec, const tcp::endpoint &)
                                                                {
-                                                                 std::cerr << "Error connecting to remote server: " << ec.message() << std::endl;
-                                                                 //  self->cleanup();
-                                                               }
-                                                             });
+                                                                 if (ec == net::error::operation_aborted)
+                                                                   return;
+                                                                 if (!ec)
+                                                                 {
+                                                                   self->write200ok_to_client("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n\r\n");
+                                                                 }
+                                                                 else
+                                                                 {
+                                                                   SA_LOG_ERROR("Error connecting to remote server: " << ec.message());
+                                                                   //  self->cleanup();
+                                                                 }
+                                                               });
                                 }
                                 else
                                 {
-                                  std::cerr << "Error resolving target endpoints: " << ec.message() << ", value: " << ec.value() << std::endl;
+                                  SA_LOG_ERROR("Error resolving target endpoints: " << ec.message() << ", value: " << ec.value());
                                   // self->cleanup();
                                 }
                               });
@@ -248,12 +528,17 @@ namespace server_async
     beast::flat_buffer buffer_;
     StreamType stream_;
     tcp::socket remote_socket_;
+    std::weak_ptr<HappyEyeballs> connecting_; // the connect to the origin under way
+    bool closed_ = false;
 
   private:
-    tcp::resolver resolver_; // need keep live for who async operations.
+    SessionRegistry &registry_;
+    SessionRegistry::Registration registration_;
     http::request<http::empty_body> req_;
-    std::shared_ptr<std::array<char, max_length>> to_remote_buffer;
-    std::shared_ptr<std::array<char, max_length>> to_client_buffer;
+
+  protected:
+    std::shared_ptr<RelayBuffer> to_remote_buffer;
+    std::shared_ptr<RelayBuffer> to_client_buffer;
   };
 
   class plain_socket_copy : public socket_copier<beast::tcp_stream, plain_socket_copy>,
@@ -263,22 +548,56 @@ namespace server_async
     plain_socket_copy(
         beast::tcp_stream &&stream_,
         beast::flat_buffer &&buffer_,
-        http::request<http::empty_body> &&req_)
+        http::request<http::empty_body> &&req_,
+        SessionRegistry &registry_)
         : socket_copier<beast::tcp_stream, plain_socket_copy>(
               std::move(stream_),
               std::move(buffer_),
-              std::move(req_))
+              std::move(req_),
+              registry_),
+          splice_(relay_splice().load(std::memory_order_relaxed))
     {
     }
 
+    // Splices both directions through a pipe each when enabled, otherwise
+    // copies through the relay buffers.
+    void relay()
+    {
+#if SERVER_ASYNC_HAS_SPLICE
+      if (splice_)
+      {
+        std::size_t size = to_remote_buffer->max_size();
+        auto to_client = std::make_shared<SplicePipe>(size);
+        auto to_remote = std::make_shared<SplicePipe>(size);
+        beast::error_code ec;
+        stream_.socket().non_blocking(true, ec);
+        if (!ec)
+          remote_socket_.non_blocking(true, ec);
+        if (!ec && to_client->ok() && to_remote->ok())
+        {
+          do_splice_relay(shared_from_this(), remote_socket_, stream_.socket(), to_client, to_client_buffer, false);
+          do_splice_relay(shared_from_this(), stream_.socket(), remote_socket_, to_remote, to_remote_buffer, true);
+          return;
+        }
+        SA_LOG_WARN("splice relay unavailable, copying instead");
+      }
+#endif
+      socket_copier<beast::tcp_stream, plain_socket_copy>::relay();
+    }
+
     void
     do_eof()
     {
+      // A TLS connection handed over after kTLS took its records ends with close_notify.
+      ktls_send_close_notify(stream_.socket().native_handle());
       // Send a TCP shutdown
       beast::error_code ec;
       stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
       // At this point the connection is closed gracefully
     }
+
+  private:
+    bool splice_;
   };
 
   class ssl_socket_copy : public socket_copier<ssl_beast_stream, ssl_socket_copy>,
@@ -288,33 +607,24 @@ namespace server_async
     ssl_socket_copy(
         ssl_beast_stream &&stream_,
         beast::flat_buffer &&buffer_,
-        http::request<http::empty_body> &&req_)
+        http::request<http::empty_body> &&req_,
+        SessionRegistry &registry_)
         : socket_copier<ssl_beast_stream, ssl_socket_copy>(std::move(stream_),
                                                            std::move(buffer_),
-                                                           std::move(req_))
+                                                           std::move(req_),
+                                                           registry_)
     {
     }
 
     void
     do_eof()
     {
-      // Set the timeout.
-      beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
-
-      // Perform the SSL shutdown
-      stream_.async_shutdown(
-          beast::bind_front_handler(
-              &ssl_socket_copy::on_shutdown,
-              shared_from_this()));
+      if (ssl_relay_ended(relays_done_, remote_socket_, stream_))
+        ssl_shutdown(shared_from_this(), stream_);
     }
 
-    void
-    on_shutdown(beast::error_code ec)
-    {
-      if (ec)
-        return fail(ec, "shutdown");
-      // At this point the connection is closed gracefully
-    }
+  private:
+    int relays_done_ = 0;
   };
 }
 #endif
@@ -0,0 +1,274 @@
+#pragma once
+#ifndef SERVER_ASYNC_SOCKET_HANDOFF_H
+#define SERVER_ASYNC_SOCKET_HANDOFF_H
+
+#include <boost/asio.hpp>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace server_async
+{
+    // Listening-socket handoff between an old and a new server process.
+    //
+    // The old process listens on a unix socket. A freshly started process
+    // connects to it and receives, in one sendmsg(), a header plus the
+    // listening fds as SCM_RIGHTS ancillary data, followed by an opaque
+    // warm-state snapshot. It answers with a single ack byte once its own
+    // listeners own the fds, and only then does the old process drain.
+    namespace handoff
+    {
+        constexpr std::uint32_t magic = 0x46464f48; // "HOFF"
+        constexpr std::uint32_t version = 1;
+        constexpr std::size_t max_fds = 16;
+
+        struct Header
+        {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint32_t fd_count;
+            std::uint32_t reserved;
+            std::uint64_t snapshot_size;
+        };
+
+        struct Received
+        {
+            std::vector<int> fds;
+            std::string snapshot;
+        };
+
+        inline boost::system::error_code last_error()
+        {
+            return boost::system::error_code(errno, boost::system::system_category());
+        }
+
+        inline bool write_all(int fd, const char *data, std::size_t size, boost::system::error_code &ec)
+        {
+            while (size > 0)
+            {
+                ssize_t n = ::write(fd, data, size);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    ec = last_error();
+                    return false;
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+            }
+            return true;
+        }
+
+        inline bool read_all(int fd, char *data, std::size_t size, boost::system::error_code &ec)
+        {
+            while (size > 0)
+            {
+                ssize_t n = ::read(fd, data, size);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    ec = last_error();
+                    return false;
+                }
+                if (n == 0)
+                {
+                    ec = boost::asio::error::eof;
+                    return false;
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+            }
+            return true;
+        }
+
+        // The protocol a listening socket was opened with, needed to adopt it.
+        inline boost::asio::ip::tcp protocol_of(int fd)
+        {
+            sockaddr_storage ss{};
+            socklen_t len = sizeof(ss);
+            if (::getsockname(fd, reinterpret_cast<sockaddr *>(&ss), &len) == 0 && ss.ss_family == AF_INET6)
+                return boost::asio::ip::tcp::v6();
+            return boost::asio::ip::tcp::v4();
+        }
+
+        // The address a listening socket is bound to, used to match an
+        // inherited socket to the listener configured for that address.
+        inline boost::asio::ip::tcp::endpoint local_endpoint_of(int fd)
+        {
+            boost::asio::ip::tcp::endpoint endpoint;
+            socklen_t len = static_cast<socklen_t>(endpoint.capacity());
+            if (::getsockname(fd, endpoint.data(), &len) == 0)
+                endpoint.resize(len);
+            return endpoint;
+        }
+
+        // Send the listening fds and the snapshot over a connected unix socket.
+        inline bool send(int sock, std::vector<int> const &fds, std::string const &snapshot, boost::system::error_code &ec)
+        {
+            if (fds.size() > max_fds)
+            {
+                ec = boost::asio::error::invalid_argument;
+                return false;
+            }
+
+            Header header{magic, version, static_cast<std::uint32_t>(fds.size()), 0, snapshot.size()};
+            iovec iov{&header, sizeof(header)};
+
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+            std::memset(control, 0, sizeof(control));
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if (!fds.empty())
+            {
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+            }
+
+            ssize_t n;
+            do
+            {
+                n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0)
+            {
+                ec = last_error();
+                return false;
+            }
+            if (static_cast<std::size_t>(n) != sizeof(header))
+            {
+                ec = boost::asio::error::message_size;
+                return false;
+            }
+            return write_all(sock, snapshot.data(), snapshot.size(), ec);
+        }
+
+        inline bool receive_within(std::string const &path, Received &out, boost::system::error_code &ec,
+                                   std::chrono::milliseconds timeout)
+        {
+            int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock < 0)
+            {
+                ec = last_error();
+                return false;
+            }
+            // Every blocking call below gives up after `timeout`.
+            timeval tv{static_cast<time_t>(timeout.count() / 1000), static_cast<suseconds_t>(timeout.count() % 1000 * 1000)};
+            ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+            {
+                ::close(sock);
+                ec = boost::asio::error::name_too_long;
+                return false;
+            }
+            std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+            if (::connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+            {
+                ec = last_error();
+                ::close(sock);
+                return false;
+            }
+
+            Header header{};
+            iovec iov{&header, sizeof(header)};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t n;
+            do
+            {
+                n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0)
+            {
+                ec = last_error();
+                ::close(sock);
+                return false;
+            }
+
+            // Take ownership of whatever fds arrived before validating anything,
+            // so they are closed on every error path.
+            out.fds.clear();
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                {
+                    std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const int *p = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                    out.fds.insert(out.fds.end(), p, p + count);
+                }
+            }
+            auto fail_with = [&](boost::system::error_code e)
+            {
+                for (int fd : out.fds)
+                    ::close(fd);
+                out.fds.clear();
+                ::close(sock);
+                ec = e;
+                return false;
+            };
+
+            if (static_cast<std::size_t>(n) != sizeof(header) || (msg.msg_flags & MSG_CTRUNC) ||
+                header.magic != magic || header.version != version || header.fd_count != out.fds.size())
+                return fail_with(boost::asio::error::invalid_argument);
+
+            out.snapshot.resize(header.snapshot_size);
+            if (!read_all(sock, out.snapshot.data(), out.snapshot.size(), ec))
+                return fail_with(ec);
+
+            // Tell the old process it can start draining.
+            char ack = 1;
+            if (!write_all(sock, &ack, 1, ec))
+                return fail_with(ec);
+
+            ::close(sock);
+            return true;
+        }
+
+        // Connect to an old process at `path` and take over its listening fds.
+        // Fails with connection_refused/not_found when nobody is there, which
+        // simply means this is a cold start, and with timed_out when the old
+        // process does not answer within `timeout`.
+        inline bool receive(std::string const &path, Received &out, boost::system::error_code &ec,
+                            std::chrono::milliseconds timeout = std::chrono::seconds(5))
+        {
+            if (receive_within(path, out, ec, timeout))
+                return true;
+            // The socket timeouts expire as EAGAIN, or EINPROGRESS for connect().
+            if (ec == boost::system::errc::resource_unavailable_try_again ||
+                ec == boost::system::errc::operation_would_block ||
+                ec == boost::system::errc::operation_in_progress)
+                ec = boost::asio::error::timed_out;
+            return false;
+        }
+    }
+}
+
+#endif
+#endif
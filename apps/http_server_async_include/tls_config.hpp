@@ -0,0 +1,67 @@
+#pragma once
+#ifndef SERVER_ASYNC_TLS_CONFIG_HPP
+#define SERVER_ASYNC_TLS_CONFIG_HPP
+
+#include <stdexcept>
+#include <string>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/ssl.h>
+
+namespace server_async
+{
+    // Protocol versions and algorithm preferences of the TLS listeners.
+    // Lists use OpenSSL's syntax, most preferred first.
+    struct TlsOptions
+    {
+        int min_version = TLS1_2_VERSION;
+        // 0 is the highest the OpenSSL build supports, TLS 1.3 since 1.1.1.
+        int max_version = 0;
+        // TLS 1.2 cipher suites. Forward secret ECDHE with AEAD only: no
+        // static RSA key exchange, no finite field DHE, no CBC.
+        std::string ciphers = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                              "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+                              "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+        // TLS 1.3 cipher suites, all of them ECDHE by construction.
+        std::string ciphersuites = "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_256_GCM_SHA384";
+        // Key exchange groups for both versions.
+        std::string groups = "X25519:P-256:P-384";
+        // Pick from the lists above in their order rather than the client's.
+        bool prefer_server_order = true;
+    };
+
+    // Applies `options` to `ctx`, throwing std::runtime_error when OpenSSL
+    // rejects a value so a typo fails at startup rather than per handshake.
+    inline void configure_tls(boost::asio::ssl::context &ctx, TlsOptions const &options)
+    {
+        SSL_CTX *native = ctx.native_handle();
+        if (SSL_CTX_set_min_proto_version(native, options.min_version) != 1 ||
+            SSL_CTX_set_max_proto_version(native, options.max_version) != 1)
+            throw std::runtime_error("Unsupported TLS protocol version");
+        if (SSL_CTX_set_cipher_list(native, options.ciphers.c_str()) != 1)
+            throw std::runtime_error("Invalid TLS cipher list: " + options.ciphers);
+        if (SSL_CTX_set_ciphersuites(native, options.ciphersuites.c_str()) != 1)
+            throw std::runtime_error("Invalid TLS 1.3 cipher suites: " + options.ciphersuites);
+        if (SSL_CTX_set1_groups_list(native, options.groups.c_str()) != 1)
+            throw std::runtime_error("Invalid TLS groups: " + options.groups);
+        if (options.prefer_server_order)
+            SSL_CTX_set_options(native, SSL_OP_CIPHER_SERVER_PREFERENCE);
+        else
+            SSL_CTX_clear_options(native, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    }
+
+    // Adds a second certificate next to the one load_server_certificate
+    // loaded. OpenSSL keeps one per key type and picks by what the client
+    // can verify, so an RSA and an ECDSA certificate can be served together.
+    inline void add_server_certificate(boost::asio::ssl::context &ctx,
+                                       std::string const &cert,
+                                       std::string const &key)
+    {
+        ctx.use_certificate_chain(boost::asio::buffer(cert.data(), cert.size()));
+        ctx.use_private_key(boost::asio::buffer(key.data(), key.size()),
+                            boost::asio::ssl::context::file_format::pem);
+    }
+}
+
+#endif
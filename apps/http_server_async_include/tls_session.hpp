@@ -0,0 +1,217 @@
+#pragma once
+#ifndef SERVER_ASYNC_TLS_SESSION_HPP
+#define SERVER_ASYNC_TLS_SESSION_HPP
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+namespace server_async
+{
+    struct TlsSessionOptions
+    {
+        // Stateless resumption: the session travels encrypted in a ticket the
+        // client keeps, so any thread (or a restarted server with the same
+        // keys) can resume it without server-side state.
+        bool tickets = true;
+        // A fresh ticket key is made this often. Tickets under the previous
+        // key still resume and get reissued under the current one.
+        std::chrono::seconds ticket_key_lifetime{std::chrono::hours(1)};
+        // Sessions the server remembers for session-ID resumption, used by
+        // TLS 1.2 clients without ticket support. Shared by all threads, 0 disables.
+        std::size_t cache_size = 20000;
+        // How long a session may be resumed, by ticket or from the cache.
+        std::chrono::seconds session_timeout{std::chrono::hours(2)};
+    };
+
+    // Ticket encryption keys: the current one and the one before it. Rotation
+    // happens lazily when a ticket is issued, so an idle server keeps its key.
+    class TicketKeys
+    {
+    public:
+        static constexpr std::size_t name_size = 16;
+
+        struct Key
+        {
+            std::array<unsigned char, name_size> name;
+            std::array<unsigned char, 32> aes;
+            std::array<unsigned char, 32> hmac;
+            std::chrono::steady_clock::time_point created;
+        };
+
+        explicit TicketKeys(std::chrono::seconds lifetime) : lifetime_(lifetime)
+        {
+            rotate();
+        }
+
+        // Key for a new ticket, rotating first when the current one is too old.
+        Key current()
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (std::chrono::steady_clock::now() - keys_.front().created >= lifetime_)
+                rotate_locked();
+            return keys_.front();
+        }
+
+        // Key a ticket was issued under, if it is still kept.
+        std::optional<Key> find(unsigned char const *name, bool &is_current)
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            for (std::size_t i = 0; i < keys_.size(); ++i)
+            {
+                if (std::memcmp(keys_[i].name.data(), name, name_size) == 0)
+                {
+                    is_current = i == 0;
+                    return keys_[i];
+                }
+            }
+            return std::nullopt;
+        }
+
+        void rotate()
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            rotate_locked();
+        }
+
+    private:
+        void rotate_locked()
+        {
+            Key key;
+            RAND_bytes(key.name.data(), static_cast<int>(key.name.size()));
+            RAND_bytes(key.aes.data(), static_cast<int>(key.aes.size()));
+            RAND_bytes(key.hmac.data(), static_cast<int>(key.hmac.size()));
+            key.created = std::chrono::steady_clock::now();
+            keys_.push_front(key);
+            if (keys_.size() > 2)
+                keys_.pop_back();
+        }
+
+        std::chrono::seconds lifetime_;
+        std::mutex mtx_;
+        // Newest first.
+        std::deque<Key> keys_;
+    };
+
+    namespace detail
+    {
+        inline int ticket_keys_index()
+        {
+            static int const index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+            return index;
+        }
+
+        inline TicketKeys *ticket_keys_of(SSL *ssl)
+        {
+            return static_cast<TicketKeys *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ticket_keys_index()));
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        using TicketMacCtx = EVP_MAC_CTX;
+
+        inline bool init_ticket_mac(TicketMacCtx *mac, TicketKeys::Key &key)
+        {
+            char digest[] = "SHA256";
+            OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac.data(), key.hmac.size()),
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                OSSL_PARAM_construct_end()};
+            return EVP_MAC_CTX_set_params(mac, params) == 1;
+        }
+#else
+        using TicketMacCtx = HMAC_CTX;
+
+        inline bool init_ticket_mac(TicketMacCtx *mac, TicketKeys::Key &key)
+        {
+            return HMAC_Init_ex(mac, key.hmac.data(), static_cast<int>(key.hmac.size()), EVP_sha256(), nullptr) == 1;
+        }
+#endif
+
+        // OpenSSL's ticket key callback. Returns 1 to use the key, 2 to accept
+        // a ticket under the previous key and issue a new one, 0 to fall back
+        // to a full handshake and -1 on error.
+        inline int ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                       EVP_CIPHER_CTX *cipher, TicketMacCtx *mac, int encrypt)
+        {
+            TicketKeys *keys = ticket_keys_of(ssl);
+            if (!keys)
+                return encrypt ? -1 : 0;
+
+            if (encrypt)
+            {
+                TicketKeys::Key key = keys->current();
+                if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+                    return -1;
+                std::memcpy(key_name, key.name.data(), TicketKeys::name_size);
+                if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes.data(), iv) != 1 ||
+                    !init_ticket_mac(mac, key))
+                    return -1;
+                return 1;
+            }
+
+            bool is_current = false;
+            auto key = keys->find(key_name, is_current);
+            if (!key)
+                return 0;
+            if (!init_ticket_mac(mac, *key) ||
+                EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key->aes.data(), iv) != 1)
+                return -1;
+            return is_current ? 1 : 2;
+        }
+    }
+
+    // Turns on session resumption for `ctx`. `keys` must outlive the context
+    // and may be null when options.tickets is false.
+    inline void configure_session_resumption(boost::asio::ssl::context &ctx,
+                                             TlsSessionOptions const &options,
+                                             TicketKeys *keys)
+    {
+        SSL_CTX *native = ctx.native_handle();
+
+        // Sessions only resume on a context with the same id.
+        static constexpr unsigned char session_id_context[] = "server_async";
+        SSL_CTX_set_session_id_context(native, session_id_context, sizeof session_id_context - 1);
+        SSL_CTX_set_timeout(native, static_cast<long>(options.session_timeout.count()));
+
+        if (options.cache_size > 0)
+        {
+            SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(native, static_cast<long>(options.cache_size));
+        }
+        else
+        {
+            SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_OFF);
+        }
+
+        if (options.tickets && keys)
+        {
+            SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+            SSL_CTX_set_ex_data(native, detail::ticket_keys_index(), keys);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb(native, detail::ticket_key_callback);
+#else
+            SSL_CTX_set_tlsext_ticket_key_cb(native, detail::ticket_key_callback);
+#endif
+        }
+        else
+        {
+            SSL_CTX_set_options(native, SSL_OP_NO_TICKET);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,192 @@
+#pragma once
+#ifndef SERVER_ASYNC_UPSTREAM_POOL_HPP
+#define SERVER_ASYNC_UPSTREAM_POOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "metrics.hpp"
+
+namespace server_async
+{
+    // Idle upstream connections kept per origin and thread, 0 disables the
+    // pool. HttpServer::set_upstream_pool() changes it.
+    inline std::atomic<std::size_t> &upstream_max_idle()
+    {
+        static std::atomic<std::size_t> max{8};
+        return max;
+    }
+
+    // How long an idle upstream connection is kept. Origins close idle
+    // connections on their own schedule (5 s to 75 s are common), one that
+    // did is caught by the health check or, failing that, retried.
+    inline std::atomic<std::int64_t> &upstream_idle_ttl_ms()
+    {
+        static std::atomic<std::int64_t> ttl{30000};
+        return ttl;
+    }
+
+    // Keep-alive connections to origins of the forward proxy, one pool per
+    // thread so checking out and in takes no lock. Idle connections are
+    // kept as bare descriptors: a checked out one is bound to the strand of
+    // the connection that takes it.
+    class UpstreamPool
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        static UpstreamPool &
+        local()
+        {
+            thread_local UpstreamPool pool;
+            return pool;
+        }
+
+        UpstreamPool() = default;
+        UpstreamPool(const UpstreamPool &) = delete;
+        UpstreamPool &operator=(const UpstreamPool &) = delete;
+
+        ~UpstreamPool()
+        {
+            for (auto &[origin, idle] : idle_)
+                for (auto const &c : idle)
+                    close(c.fd);
+        }
+
+        // A healthy idle connection to `origin` ("host:port"), bound to `ex`.
+        template <class Executor>
+        std::optional<boost::asio::ip::tcp::socket>
+        checkout(std::string const &origin, Executor const &ex)
+        {
+            sweep();
+            auto it = idle_.find(origin);
+            if (it == idle_.end())
+                return std::nullopt;
+            auto &idle = it->second;
+            // Most recently used first, it is the least likely to be closed.
+            while (!idle.empty())
+            {
+                Idle c = idle.back();
+                idle.pop_back();
+                if (!healthy(c.fd))
+                {
+                    close(c.fd);
+                    Metrics::instance().upstream_discarded();
+                    continue;
+                }
+                boost::asio::ip::tcp::socket socket(ex);
+                boost::system::error_code ec;
+                socket.assign(c.protocol, c.fd, ec);
+                if (ec)
+                {
+                    close(c.fd);
+                    continue;
+                }
+                if (idle.empty())
+                    idle_.erase(it);
+                return socket;
+            }
+            idle_.erase(it);
+            return std::nullopt;
+        }
+
+        // Keeps `socket` for the next request to `origin`, or closes it when
+        // that origin already has enough idle connections.
+        void
+        checkin(std::string const &origin, boost::asio::ip::tcp::socket &&socket)
+        {
+            std::size_t max = upstream_max_idle().load(std::memory_order_relaxed);
+            boost::system::error_code ec;
+            auto protocol = socket.local_endpoint(ec).protocol();
+            if (max == 0 || ec || !socket.is_open())
+                return;
+            auto fd = socket.release(ec);
+            if (ec)
+                return;
+            auto &idle = idle_[origin];
+            if (idle.size() >= max)
+            {
+                close(idle.front().fd);
+                idle.pop_front();
+            }
+            idle.push_back({fd, protocol, clock::now()});
+            sweep();
+        }
+
+        std::size_t
+        idle(std::string const &origin) const
+        {
+            auto it = idle_.find(origin);
+            return it == idle_.end() ? 0 : it->second.size();
+        }
+
+    private:
+        struct Idle
+        {
+            boost::asio::ip::tcp::socket::native_handle_type fd;
+            boost::asio::ip::tcp protocol;
+            clock::time_point since;
+        };
+
+        // An idle connection has nothing to read: readable means the
+        // origin closed it or sent bytes no request asked for.
+        static bool
+        healthy(boost::asio::ip::tcp::socket::native_handle_type fd)
+        {
+#ifndef _WIN32
+            char byte;
+            return ::recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+            return true;
+#endif
+        }
+
+        static void
+        close(boost::asio::ip::tcp::socket::native_handle_type fd)
+        {
+#ifndef _WIN32
+            ::close(fd);
+#else
+            ::closesocket(fd);
+#endif
+        }
+
+        // Drops connections idle past the TTL, at most every tenth of it.
+        void
+        sweep()
+        {
+            auto now = clock::now();
+            auto ttl = std::chrono::milliseconds(upstream_idle_ttl_ms().load(std::memory_order_relaxed));
+            if (now - last_sweep_ < ttl / 10)
+                return;
+            last_sweep_ = now;
+            for (auto it = idle_.begin(); it != idle_.end();)
+            {
+                auto &idle = it->second;
+                while (!idle.empty() && now - idle.front().since >= ttl)
+                {
+                    close(idle.front().fd);
+                    idle.pop_front();
+                    Metrics::instance().upstream_discarded();
+                }
+                it = idle.empty() ? idle_.erase(it) : std::next(it);
+            }
+        }
+
+        std::unordered_map<std::string, std::deque<Idle>> idle_;
+        clock::time_point last_sweep_{};
+    };
+}
+
+#endif
@@ -0,0 +1,59 @@
+#include <benchmark/benchmark.h>
+#include <sstream>
+#include <string>
+#include "json_util.hpp"
+
+// A task as returned by /tasks/{t_uuid}.
+static json::value make_task(int i)
+{
+    return json::value{
+        {"t_uuid", "6f1c2e4a-0b7d-4c55-9a51-" + std::to_string(100000000000 + i)},
+        {"name", "nightly build " + std::to_string(i)},
+        {"status", i % 3 == 0 ? "done" : "running"},
+        {"progress", i % 100},
+        {"created_at", "2024-11-03T12:34:56Z"},
+        {"tags", json::array{"ci", "linux", "x86_64"}},
+        {"owner", {{"id", i}, {"name", "build-bot"}, {"admin", false}}},
+        {"duration", 12.5 + i},
+    };
+}
+
+// The /tasks listing, with state.range(0) tasks.
+static json::value make_listing(std::int64_t n)
+{
+    json::array tasks;
+    for (std::int64_t i = 0; i < n; ++i)
+        tasks.push_back(make_task(static_cast<int>(i)));
+    return json::value{{"total", n}, {"tasks", std::move(tasks)}};
+}
+
+static void BM_PrettyPrint(benchmark::State &state)
+{
+    json::value const jv = make_listing(state.range(0));
+    std::ostringstream os;
+    for (auto _ : state)
+    {
+        os.str(std::string{});
+        server_async::pretty_print(os, jv);
+        benchmark::DoNotOptimize(os.tellp());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(os.str().size()));
+}
+BENCHMARK(BM_PrettyPrint)->Arg(1)->Arg(16)->Arg(256);
+
+// The compact serializer on the same documents, as a baseline.
+static void BM_Serialize(benchmark::State &state)
+{
+    json::value const jv = make_listing(state.range(0));
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        std::string s = json::serialize(jv);
+        size = s.size();
+        benchmark::DoNotOptimize(s.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(size));
+}
+BENCHMARK(BM_Serialize)->Arg(1)->Arg(16)->Arg(256);
+
+BENCHMARK_MAIN();
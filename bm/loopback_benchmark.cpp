@@ -0,0 +1,142 @@
+// End-to-end throughput of HttpServer over loopback. The server runs in this
+// process on an ephemeral port and client_async::run_load drives it with
+// keep-alive connections. Arguments are {scenario, server threads}.
+//
+// The server prints to stdout while starting, so keep the results apart:
+//   loopback_benchmark --benchmark_out=loopback.json --benchmark_out_format=json
+#include <benchmark/benchmark.h>
+#include "loopback_server.hpp"
+#include "http_load.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+namespace
+{
+    enum Scenario : int
+    {
+        small_file,
+        large_file,
+        upload,
+        not_found,
+        pipelined,
+        scenario_count
+    };
+
+    constexpr const char *scenario_names[scenario_count] = {"small_file", "large_file", "upload", "not_found", "pipelined"};
+
+    constexpr std::size_t small_file_size = 1 << 10;
+    constexpr std::size_t large_file_size = 1 << 20;
+    constexpr std::size_t upload_size = 64 << 10;
+    constexpr int connections = 64;
+    constexpr int pipeline_depth = 16;
+    constexpr std::chrono::seconds run_duration{2};
+
+    // Files served by every scenario, created once per process in a
+    // temporary directory that is removed again at exit.
+    std::filesystem::path const &doc_root()
+    {
+        struct TempDocRoot
+        {
+            std::filesystem::path dir = std::filesystem::temp_directory_path() / ("loopback_benchmark_" + std::to_string(::getpid()));
+
+            TempDocRoot()
+            {
+                std::filesystem::create_directories(dir);
+                std::ofstream(dir / "small.txt", std::ios::binary) << std::string(small_file_size, 's');
+                std::ofstream(dir / "large.bin", std::ios::binary) << std::string(large_file_size, 'l');
+            }
+
+            ~TempDocRoot()
+            {
+                std::error_code ec;
+                std::filesystem::remove_all(dir, ec);
+            }
+        };
+        static TempDocRoot const root;
+        return root.dir;
+    }
+
+    client_async::LoadOptions scenario_options(Scenario scenario, unsigned short port)
+    {
+        client_async::LoadOptions options;
+        options.port = std::to_string(port);
+        options.connections = connections;
+        options.threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+        options.duration = run_duration;
+        switch (scenario)
+        {
+        case small_file:
+            options.target = "/small.txt";
+            break;
+        case large_file:
+            options.target = "/large.bin";
+            break;
+        case upload:
+            options.target = "/upload/data";
+            options.method = http::verb::post;
+            options.body.assign(upload_size, 'u');
+            break;
+        case not_found:
+            options.target = "/missing.txt";
+            break;
+        case pipelined:
+            options.target = "/small.txt";
+            options.pipeline = pipeline_depth;
+            break;
+        default:
+            break;
+        }
+        return options;
+    }
+}
+
+static void BM_Loopback(benchmark::State &state)
+{
+    auto scenario = static_cast<Scenario>(state.range(0));
+    int threads = static_cast<int>(state.range(1));
+    state.SetLabel(scenario_names[scenario]);
+    server_async::Logger::instance().set_level(server_async::LogLevel::error);
+
+    LoopbackServer server{threads, doc_root().string()};
+    client_async::LoadResult result;
+    for (auto _ : state)
+        result = client_async::run_load(scenario_options(scenario, server.endpoint().port()));
+
+    // The 404 scenario counts its error responses, anything else is a failure.
+    std::uint64_t responses = result.completed + (scenario == not_found ? result.error_responses : 0);
+    std::uint64_t failures = result.errors - (scenario == not_found ? result.error_responses : 0);
+    double secs = std::chrono::duration<double>(result.elapsed).count();
+    state.counters["rps"] = secs > 0 ? static_cast<double>(responses) / secs : 0;
+    state.counters["MBps"] = secs > 0 ? static_cast<double>(result.bytes) / 1e6 / secs : 0;
+    state.counters["p50_us"] = static_cast<double>(result.corrected.quantile(0.5));
+    state.counters["p99_us"] = static_cast<double>(result.corrected.quantile(0.99));
+    state.counters["p999_us"] = static_cast<double>(result.corrected.quantile(0.999));
+    state.counters["max_us"] = static_cast<double>(result.corrected.max_us);
+    state.counters["failures"] = static_cast<double>(failures);
+    if (responses == 0)
+        state.SkipWithError("no responses");
+}
+
+// Every scenario on 1, 2, 4 .. hardware_concurrency server threads.
+static void LoopbackArguments(benchmark::internal::Benchmark *b)
+{
+    int max_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (int scenario = 0; scenario < scenario_count; ++scenario)
+    {
+        for (int threads = 1; threads < max_threads; threads *= 2)
+            b->Args({scenario, threads});
+        b->Args({scenario, max_threads});
+    }
+}
+BENCHMARK(BM_Loopback)
+    ->Apply(LoopbackArguments)
+    ->ArgNames({"scenario", "threads"})
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
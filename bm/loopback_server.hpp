@@ -0,0 +1,75 @@
+#pragma once
+#ifndef BM_LOOPBACK_SERVER_HPP
+#define BM_LOOPBACK_SERVER_HPP
+
+#include "server_async.h"
+#include "http_server_async.hpp"
+
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef SERVER_ASYNC_FIXTURES
+#define SERVER_ASYNC_FIXTURES "apps/fixtures"
+#endif
+
+// An HttpServer on 127.0.0.1 running on its own threads for the lifetime of
+// the object, one ephemeral port per listener mode.
+class LoopbackServer
+{
+    server_async::HttpServer server_;
+    server_async::handler<server_async::plain_http_session> plain_handler_;
+    server_async::handler<server_async::ssl_http_session> ssl_handler_;
+    std::thread thread_;
+    std::vector<tcp::endpoint> endpoints_;
+
+public:
+    // `configure` runs before start(), e.g. to enable handoff or add a
+    // listener on a fixed endpoint.
+    LoopbackServer(int threads, std::string const &doc_root,
+                   std::initializer_list<server_async::ListenerMode> modes = {server_async::ListenerMode::plain},
+                   std::function<void(server_async::HttpServer &)> const &configure = {})
+        : server_(net::ip::make_address("127.0.0.1"), 0, std::make_shared<std::string const>(doc_root), threads),
+          plain_handler_{doc_root},
+          ssl_handler_{doc_root}
+    {
+        for (auto mode : modes)
+            server_.add_listener(tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}, mode);
+        if (configure)
+            configure(server_);
+        server_async::SSLCertHolder ssl_cert_holder{server_async::read_whole_file(SERVER_ASYNC_FIXTURES "/cert.pem"),
+                                                    server_async::read_whole_file(SERVER_ASYNC_FIXTURES "/key.pem"),
+                                                    server_async::read_whole_file(SERVER_ASYNC_FIXTURES "/dh.pem"),
+                                                    server_async::read_whole_file(SERVER_ASYNC_FIXTURES "/ecdsa_cert.pem"),
+                                                    server_async::read_whole_file(SERVER_ASYNC_FIXTURES "/ecdsa_key.pem")};
+        thread_ = std::thread([this, ssl_cert_holder]
+                              { server_.start(ssl_cert_holder, plain_handler_, ssl_handler_); });
+        endpoints_ = server_.wait_until_listening();
+    }
+
+    ~LoopbackServer()
+    {
+        if (thread_.joinable())
+            drain(std::chrono::seconds(1));
+    }
+
+    // Drains the server and waits for start() to return.
+    void drain(std::chrono::steady_clock::duration timeout)
+    {
+        server_.drain(timeout);
+        join();
+    }
+
+    // Waits for start() to return on its own, e.g. after a handoff.
+    void join() { thread_.join(); }
+
+    server_async::HttpServer &server() { return server_; }
+
+    // Bound endpoint of the i-th listener mode given to the constructor.
+    tcp::endpoint const &endpoint(std::size_t i = 0) const { return endpoints_.at(i); }
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+#include "string_util.hpp"
+#include "router.hpp"
+#include "server_async_util.h"
+#include "http_handler_util.hpp"
+
+// Request paths as they show up in the access log: the route table entries,
+// static assets of a typical SPA build and a few deep or odd ones.
+static std::vector<std::string> const &path_corpus()
+{
+    static std::vector<std::string> const paths = {
+        "/",
+        "/index.html",
+        "/favicon.ico",
+        "/tasks",
+        "/tasks/",
+        "/tasks/6f1c2e4a-0b7d-4c55-9a51-5d8f0e3b2a91",
+        "/tasks/6f1c2e4a-0b7d-4c55-9a51-5d8f0e3b2a91/run",
+        "/tasks/6f1c2e4a-0b7d-4c55-9a51-5d8f0e3b2a91/logs/2024/11/03",
+        "/upload/data",
+        "/static/js/main.8d3f1c2a.chunk.js",
+        "/static/css/app.0b7d4c55.min.css",
+        "/static/media/logo.5d8f0e3b.svg",
+        "/assets/fonts/inter/Inter-Regular.woff2",
+        "/docs/api/v1/reference/endpoints/tasks.json",
+        "/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p",
+        "/images/2024/11/03/IMG_2048.jpeg",
+    };
+    return paths;
+}
+
+static void BM_NextSegment(benchmark::State &state)
+{
+    auto const &paths = path_corpus();
+    for (auto _ : state)
+    {
+        for (auto const &path : paths)
+        {
+            std::size_t pos = 0;
+            while (pos < path.length())
+                benchmark::DoNotOptimize(server_async::next_segment(path, pos));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_NextSegment);
+
+static void BM_AllSegments(benchmark::State &state)
+{
+    auto const &paths = path_corpus();
+    for (auto _ : state)
+        for (auto const &path : paths)
+            benchmark::DoNotOptimize(server_async::all_segments(path));
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_AllSegments);
+
+// The same corpus through the router, for comparison with splitting by hand.
+static void BM_RouterMatch(benchmark::State &state)
+{
+    server_async::Router<int> router;
+    router.add("/", 0);
+    router.add("/tasks", 1);
+    router.add("/tasks/{t_uuid}", 2);
+    router.add("/tasks/{t_uuid}/*", 3);
+    router.add("/index.html", 4);
+    router.add("/favicon.ico", 5);
+    router.add("/upload/data", 6);
+    router.add("/static/*", 7);
+
+    auto const &paths = path_corpus();
+    server_async::RouteParams params;
+    for (auto _ : state)
+        for (auto const &path : paths)
+            benchmark::DoNotOptimize(router.match(path, params));
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_RouterMatch);
+
+static void BM_PathCat(benchmark::State &state)
+{
+    auto const &paths = path_corpus();
+    std::string const doc_root = "/var/www/html";
+    for (auto _ : state)
+        for (auto const &path : paths)
+            benchmark::DoNotOptimize(server_async::path_cat(doc_root, path));
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_PathCat);
+
+static void BM_MimeType(benchmark::State &state)
+{
+    auto const &paths = path_corpus();
+    for (auto _ : state)
+        for (auto const &path : paths)
+            benchmark::DoNotOptimize(server_async::mime_type(path));
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_MimeType);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,365 @@
+// Relay throughput of the proxy paths over loopback. A local upstream
+// streams timestamped chunks as fast as it can, clients pull them through
+// HttpServer as a CONNECT tunnel (plain_socket_copy copying or splicing,
+// ssl_socket_copy) or a forward proxy (plain_http_copy). Arguments are
+// {mode, relay buffer bytes, connections, server threads}.
+//
+// Chunk latency is send to receive time. The upstream never waits, so at
+// saturation it is mostly time spent queued in socket buffers.
+//   relay_benchmark --benchmark_out=relay.json --benchmark_out_format=json
+#include <benchmark/benchmark.h>
+#include "loopback_server.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace
+{
+    enum Mode : int
+    {
+        connect_tunnel,
+        connect_tunnel_tls,
+        forward_proxy,
+        connect_tunnel_splice,
+        mode_count
+    };
+
+    constexpr const char *mode_names[mode_count] = {"connect", "connect_tls", "forward", "connect_splice"};
+
+    constexpr std::size_t chunk_size = 16 << 10;
+    constexpr std::chrono::milliseconds warmup{200};
+    constexpr std::chrono::seconds run_duration{1};
+
+    using clock = std::chrono::steady_clock;
+
+    std::int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+    }
+
+    // Writes chunks stamped with their send time back to back, and reads
+    // and drops whatever the proxy forwards. For the forward proxy the
+    // chunks are the body of a response that lasts until the connection closes.
+    class source_connection : public std::enable_shared_from_this<source_connection>
+    {
+        tcp::socket socket_;
+        std::vector<char> out_ = std::vector<char>(chunk_size, 'c');
+        std::vector<char> in_ = std::vector<char>(chunk_size);
+
+    public:
+        explicit source_connection(tcp::socket socket) : socket_(std::move(socket)) {}
+
+        void run(bool http)
+        {
+            do_read();
+            if (!http)
+                return do_write();
+            static constexpr char head[] = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n";
+            net::async_write(socket_, net::buffer(head, sizeof head - 1),
+                             [self = shared_from_this()](beast::error_code ec, std::size_t)
+                             {
+                                 if (!ec)
+                                     self->do_write();
+                             });
+        }
+
+    private:
+        void do_write()
+        {
+            std::int64_t stamp = now_ns();
+            std::memcpy(out_.data(), &stamp, sizeof stamp);
+            net::async_write(socket_, net::buffer(out_),
+                             [self = shared_from_this()](beast::error_code ec, std::size_t)
+                             {
+                                 if (!ec)
+                                     self->do_write();
+                             });
+        }
+
+        void do_read()
+        {
+            socket_.async_read_some(net::buffer(in_),
+                                    [self = shared_from_this()](beast::error_code ec, std::size_t)
+                                    {
+                                        if (!ec)
+                                            self->do_read();
+                                    });
+        }
+    };
+
+    // The upstream the proxy connects to, on its own threads so it is not
+    // measured against the server.
+    class ChunkSource
+    {
+        net::io_context ioc_;
+        tcp::acceptor acceptor_;
+        bool http_;
+        std::vector<std::thread> threads_;
+
+    public:
+        ChunkSource(int threads, bool http)
+            : ioc_{threads}, acceptor_(ioc_, tcp::endpoint{net::ip::make_address("127.0.0.1"), 0}), http_(http)
+        {
+            do_accept();
+            for (int i = 0; i < threads; ++i)
+                threads_.emplace_back([this]
+                                      { ioc_.run(); });
+        }
+
+        ~ChunkSource()
+        {
+            ioc_.stop();
+            for (auto &t : threads_)
+                t.join();
+        }
+
+        unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+    private:
+        void do_accept()
+        {
+            acceptor_.async_accept(net::make_strand(ioc_),
+                                   [this](beast::error_code ec, tcp::socket socket)
+                                   {
+                                       if (ec)
+                                           return;
+                                       socket.set_option(tcp::no_delay(true), ec);
+                                       std::make_shared<source_connection>(std::move(socket))->run(http_);
+                                       do_accept();
+                                   });
+        }
+    };
+
+    struct RelayResult
+    {
+        std::uint64_t bytes = 0;
+        std::uint64_t failures = 0;
+        server_async::LatencyHistogram chunk_latency;
+    };
+
+    // One client connection through the proxy, reading chunks until stopped.
+    // Stream is beast::tcp_stream or ssl::stream<beast::tcp_stream>.
+    template <class Stream>
+    class relay_client : public std::enable_shared_from_this<relay_client<Stream>>
+    {
+        static constexpr bool is_ssl = !std::is_same_v<Stream, beast::tcp_stream>;
+
+        Stream stream_;
+        std::string request_;
+        std::string head_;
+        std::vector<char> chunk_ = std::vector<char>(chunk_size);
+        std::size_t filled_ = 0;
+        clock::time_point measure_from_;
+        clock::time_point measure_until_;
+
+    public:
+        RelayResult result;
+
+        template <class... Args>
+        relay_client(Mode mode, unsigned short upstream_port, clock::time_point from, clock::time_point until,
+                     net::any_io_executor ex, Args &&...args)
+            : stream_(ex, std::forward<Args>(args)...), measure_from_(from), measure_until_(until)
+        {
+            std::string authority = "127.0.0.1:" + std::to_string(upstream_port);
+            if (mode == forward_proxy)
+                request_ = "GET http://" + authority + "/ HTTP/1.1\r\nHost: " + authority + "\r\n\r\n";
+            else
+                request_ = "CONNECT " + authority + " HTTP/1.1\r\nHost: " + authority + "\r\n\r\n";
+        }
+
+        void run(tcp::endpoint proxy)
+        {
+            beast::get_lowest_layer(stream_).async_connect(
+                proxy,
+                [self = this->shared_from_this()](beast::error_code ec)
+                {
+                    if (ec)
+                        return self->on_error();
+                    beast::get_lowest_layer(self->stream_).socket().set_option(tcp::no_delay(true), ec);
+                    if constexpr (is_ssl)
+                        self->stream_.async_handshake(ssl::stream_base::client,
+                                                      [self](beast::error_code ec)
+                                                      {
+                                                          if (ec)
+                                                              return self->on_error();
+                                                          self->do_request();
+                                                      });
+                    else
+                        self->do_request();
+                });
+        }
+
+    private:
+        void on_error()
+        {
+            ++result.failures;
+        }
+
+        void do_request()
+        {
+            net::async_write(stream_, net::buffer(request_),
+                             [self = this->shared_from_this()](beast::error_code ec, std::size_t)
+                             {
+                                 if (ec)
+                                     return self->on_error();
+                                 // The head is the upstream's response for the forward
+                                 // proxy, the proxy's own for CONNECT.
+                                 self->read_head();
+                             });
+        }
+
+        void read_head()
+        {
+            net::async_read_until(stream_, net::dynamic_buffer(head_), "\r\n\r\n",
+                                  [self = this->shared_from_this()](beast::error_code ec, std::size_t n)
+                                  {
+                                      if (ec || self->head_.compare(0, 12, "HTTP/1.1 200") != 0)
+                                          return self->on_error();
+                                      // Chunk bytes read past the head.
+                                      std::size_t pos = n;
+                                      while (self->head_.size() - pos >= chunk_size)
+                                      {
+                                          self->on_chunk(self->head_.data() + pos);
+                                          pos += chunk_size;
+                                      }
+                                      self->filled_ = self->head_.size() - pos;
+                                      std::memcpy(self->chunk_.data(), self->head_.data() + pos, self->filled_);
+                                      self->read_chunk();
+                                  });
+        }
+
+        void read_chunk()
+        {
+            net::async_read(stream_, net::buffer(chunk_.data() + filled_, chunk_size - filled_),
+                            [self = this->shared_from_this()](beast::error_code ec, std::size_t)
+                            {
+                                if (ec)
+                                    return self->on_error();
+                                self->filled_ = 0;
+                                self->on_chunk(self->chunk_.data());
+                                self->read_chunk();
+                            });
+        }
+
+        void on_chunk(char const *data)
+        {
+            auto now = clock::now();
+            if (now < measure_from_ || now >= measure_until_)
+                return;
+            std::int64_t stamp;
+            std::memcpy(&stamp, data, sizeof stamp);
+            result.bytes += chunk_size;
+            result.chunk_latency.record(static_cast<std::uint64_t>(std::max<std::int64_t>(0, now_ns() - stamp) / 1000));
+        }
+    };
+
+    template <class Stream, class... Args>
+    RelayResult run_clients(Mode mode, tcp::endpoint proxy, unsigned short upstream_port, int connections, Args &...args)
+    {
+        int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency() / 2));
+        net::io_context ioc{threads};
+        auto from = clock::now() + warmup;
+        auto until = from + run_duration;
+
+        std::vector<std::shared_ptr<relay_client<Stream>>> clients;
+        for (int i = 0; i < connections; ++i)
+        {
+            clients.push_back(std::make_shared<relay_client<Stream>>(
+                mode, upstream_port, from, until, net::make_strand(ioc), args...));
+            clients.back()->run(proxy);
+        }
+
+        net::steady_timer deadline{ioc};
+        deadline.expires_at(until);
+        deadline.async_wait([&ioc](beast::error_code)
+                            { ioc.stop(); });
+
+        std::vector<std::thread> pool;
+        for (int i = 1; i < threads; ++i)
+            pool.emplace_back([&ioc]
+                              { ioc.run(); });
+        ioc.run();
+        for (auto &t : pool)
+            t.join();
+
+        RelayResult total;
+        for (auto const &c : clients)
+        {
+            total.bytes += c->result.bytes;
+            total.failures += c->result.failures;
+            total.chunk_latency.merge(c->result.chunk_latency);
+        }
+        return total;
+    }
+}
+
+// 1 and all server threads.
+static std::vector<std::int64_t> server_threads()
+{
+    std::int64_t all = std::max(1u, std::thread::hardware_concurrency());
+    if (all == 1)
+        return {1};
+    return {1, all};
+}
+
+static void BM_Relay(benchmark::State &state)
+{
+    auto mode = static_cast<Mode>(state.range(0));
+    auto buffer_size = static_cast<std::size_t>(state.range(1));
+    int connections = static_cast<int>(state.range(2));
+    int threads = static_cast<int>(state.range(3));
+    state.SetLabel(mode_names[mode]);
+    server_async::Logger::instance().set_level(server_async::LogLevel::error);
+
+    ChunkSource upstream{2, mode == forward_proxy};
+    LoopbackServer server{threads, ".", {server_async::ListenerMode::plain, server_async::ListenerMode::tls}};
+    if (buffer_size > 0)
+        server.server().set_relay_buffer_size(buffer_size, buffer_size);
+    else
+        server.server().set_relay_buffer_size(4 << 10);
+    server.server().set_relay_splice(mode == connect_tunnel_splice);
+
+    RelayResult result;
+    for (auto _ : state)
+    {
+        if (mode == connect_tunnel_tls)
+        {
+            ssl::context ctx{ssl::context::tls_client};
+            ctx.set_verify_mode(ssl::verify_none);
+            result = run_clients<ssl::stream<beast::tcp_stream>>(mode, server.endpoint(1), upstream.port(), connections, ctx);
+        }
+        else
+        {
+            result = run_clients<beast::tcp_stream>(mode, server.endpoint(0), upstream.port(), connections);
+        }
+    }
+
+    double secs = std::chrono::duration<double>(run_duration).count();
+    state.counters["Gbps"] = static_cast<double>(result.bytes) * 8 / 1e9 / secs;
+    state.counters["chunk_p50_us"] = static_cast<double>(result.chunk_latency.quantile(0.5));
+    state.counters["chunk_p99_us"] = static_cast<double>(result.chunk_latency.quantile(0.99));
+    state.counters["chunk_p999_us"] = static_cast<double>(result.chunk_latency.quantile(0.999));
+    state.counters["failures"] = static_cast<double>(result.failures);
+    if (result.bytes == 0)
+        state.SkipWithError("nothing relayed");
+}
+
+// Every mode with adaptive buffers, fixed 4 KiB (the old size) to 256 KiB
+// buffers, and 1 to 64 connections.
+BENCHMARK(BM_Relay)
+    ->ArgsProduct({{connect_tunnel, connect_tunnel_tls, forward_proxy, connect_tunnel_splice},
+                   {0, 4 << 10, 16 << 10, 64 << 10, 256 << 10},
+                   {1, 16, 64},
+                   server_threads()})
+    ->ArgNames({"mode", "buffer", "connections", "threads"})
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,117 @@
+// TLS handshakes per second on one core, with the server context set up as
+// HttpServer sets it up. Client and server run in this thread over an
+// in-memory BIO pair, so there is no network in the numbers. Arguments are
+// {certificate, protocol version, resumed}.
+//
+// handshakes_per_sec counts both ends; server_handshakes_per_sec only the
+// time spent in the server's SSL_do_handshake, which is what one server
+// core can sustain.
+#include <benchmark/benchmark.h>
+#include <boost/asio/ssl.hpp>
+#include "server_certificate.hpp"
+#include "tls_config.hpp"
+#include "tls_pair.hpp"
+#include "tls_session.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#ifndef SERVER_ASYNC_FIXTURES
+#define SERVER_ASYNC_FIXTURES "apps/fixtures"
+#endif
+
+namespace ssl = boost::asio::ssl;
+
+namespace
+{
+    enum Certificate : int
+    {
+        rsa_2048,
+        ecdsa_p256,
+        certificate_count
+    };
+
+    constexpr const char *certificate_names[certificate_count] = {"rsa2048", "ecdsa_p256"};
+
+    std::string read_fixture(char const *name)
+    {
+        std::ifstream file(std::string(SERVER_ASYNC_FIXTURES "/") + name);
+        return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    }
+
+    void server_context(ssl::context &ctx, Certificate certificate, server_async::TicketKeys &keys)
+    {
+        server_async::configure_tls(ctx, server_async::TlsOptions{});
+        if (certificate == rsa_2048)
+            load_server_certificate(ctx, read_fixture("cert.pem"), read_fixture("key.pem"), "");
+        else
+            load_server_certificate(ctx, read_fixture("ecdsa_cert.pem"), read_fixture("ecdsa_key.pem"), "");
+        server_async::configure_session_resumption(ctx, server_async::TlsSessionOptions{}, &keys);
+    }
+
+    // One handshake, returning the client's session and adding the time the
+    // server spent to `server_time`.
+    SSL_SESSION *handshake(ssl::context &server, ssl::context &client, SSL_SESSION *resume,
+                           std::chrono::steady_clock::duration &server_time, bool &ok)
+    {
+        TlsPair pair{server, client, resume};
+        ok = pair.handshake(&server_time);
+        pair.read_tickets();
+        SSL_SESSION *session = SSL_get1_session(pair.client);
+        pair.shutdown();
+        return session;
+    }
+}
+
+static void BM_TlsHandshake(benchmark::State &state)
+{
+    auto certificate = static_cast<Certificate>(state.range(0));
+    int version = static_cast<int>(state.range(1));
+    bool resumed = state.range(2) != 0;
+    state.SetLabel(std::string(certificate_names[certificate]) +
+                   (version == TLS1_3_VERSION ? " tls1.3" : " tls1.2") +
+                   (resumed ? " resumed" : " full"));
+
+    server_async::TicketKeys keys{std::chrono::hours(1)};
+    ssl::context server{ssl::context::tls_server};
+    server_context(server, certificate, keys);
+
+    ssl::context client{ssl::context::tls_client};
+    client.set_verify_mode(ssl::verify_none);
+    SSL_CTX_set_min_proto_version(client.native_handle(), version);
+    SSL_CTX_set_max_proto_version(client.native_handle(), version);
+
+    std::chrono::steady_clock::duration server_time{};
+    bool ok = false;
+    SSL_SESSION *session = resumed ? handshake(server, client, nullptr, server_time, ok) : nullptr;
+    server_time = {};
+
+    std::int64_t failures = 0;
+    for (auto _ : state)
+    {
+        SSL_SESSION *next = handshake(server, client, session, server_time, ok);
+        failures += ok ? 0 : 1;
+        // Resume the same session every time rather than chaining tickets.
+        SSL_SESSION_free(next);
+    }
+    if (session)
+        SSL_SESSION_free(session);
+
+    double server_secs = std::chrono::duration<double>(server_time).count();
+    state.counters["handshakes_per_sec"] = benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+    state.counters["server_handshakes_per_sec"] = server_secs > 0 ? static_cast<double>(state.iterations()) / server_secs : 0;
+    state.counters["failures"] = static_cast<double>(failures);
+    if (failures > 0)
+        state.SkipWithError("handshake failed");
+}
+
+BENCHMARK(BM_TlsHandshake)
+    ->ArgsProduct({{rsa_2048, ecdsa_p256},
+                   {TLS1_2_VERSION, TLS1_3_VERSION},
+                   {0, 1}})
+    ->ArgNames({"cert", "version", "resumed"})
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,96 @@
+#pragma once
+#ifndef BM_TLS_PAIR_HPP
+#define BM_TLS_PAIR_HPP
+
+#include <boost/asio/ssl.hpp>
+#include <openssl/ssl.h>
+
+#include <chrono>
+#include <vector>
+
+// A server and a client SSL joined by an in-memory BIO pair, so a handshake
+// runs in one thread without sockets. Both ends are freed with the object.
+class TlsPair
+{
+public:
+    SSL *server = nullptr;
+    SSL *client = nullptr;
+    BIO *server_bio = nullptr;
+    BIO *client_bio = nullptr;
+
+    // The client resumes `resume` if given.
+    TlsPair(boost::asio::ssl::context &server_ctx, boost::asio::ssl::context &client_ctx, SSL_SESSION *resume = nullptr)
+        : server(SSL_new(server_ctx.native_handle())),
+          client(SSL_new(client_ctx.native_handle()))
+    {
+        BIO_new_bio_pair(&server_bio, 0, &client_bio, 0);
+        SSL_set_bio(server, server_bio, server_bio);
+        SSL_set_bio(client, client_bio, client_bio);
+        SSL_set_accept_state(server);
+        SSL_set_connect_state(client);
+        if (resume)
+            SSL_set_session(client, resume);
+    }
+
+    TlsPair(const TlsPair &) = delete;
+    TlsPair &operator=(const TlsPair &) = delete;
+
+    ~TlsPair()
+    {
+        SSL_free(client);
+        SSL_free(server);
+    }
+
+    // Takes turns until both ends finished the handshake, and returns
+    // whether they did. The server's share of the time is added to
+    // `server_time` if given.
+    bool
+    handshake(std::chrono::steady_clock::duration *server_time = nullptr)
+    {
+        for (int i = 0; i < 20 && !finished(); ++i)
+        {
+            SSL_do_handshake(client);
+            auto start = std::chrono::steady_clock::now();
+            SSL_do_handshake(server);
+            if (server_time)
+                *server_time += std::chrono::steady_clock::now() - start;
+        }
+        return finished();
+    }
+
+    bool
+    finished() const
+    {
+        return SSL_is_init_finished(server) && SSL_is_init_finished(client);
+    }
+
+    // TLS 1.3 tickets arrive after the handshake, a read on the client
+    // picks them up.
+    void
+    read_tickets()
+    {
+        char byte;
+        SSL_read(client, &byte, 1);
+    }
+
+    // Sends close_notify both ways: a session torn down without it is not resumable.
+    void
+    shutdown()
+    {
+        SSL_shutdown(client);
+        SSL_shutdown(server);
+    }
+
+    // The records waiting to be read from `bio`, taken from its end, e.g.
+    // drain(client_bio) is what the server wrote since the last call.
+    static std::vector<unsigned char>
+    drain(BIO *bio)
+    {
+        std::vector<unsigned char> bytes(BIO_ctrl_pending(bio));
+        if (!bytes.empty())
+            BIO_read(bio, bytes.data(), static_cast<int>(bytes.size()));
+        return bytes;
+    }
+};
+
+#endif
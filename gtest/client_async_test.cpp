@@ -4,6 +4,7 @@
 #include <boost/url.hpp>
 #include <filesystem>
 #include "http_server_async.hpp"
+#include "loopback_server.hpp"
 #include "models.hpp"
 #include "json_util.hpp"
 #include "string_util.hpp"
@@ -170,51 +171,135 @@ TEST(UrlTest, UrlNoScheme)
 
 TEST(ServerTest, start)
 {
-    net::ip::address address = net::ip::make_address("0.0.0.0");                            // net::ip::make_address(argv[1]);
-    unsigned short port{8080};                                                              // static_cast<unsigned short>(std::atoi(argv[2]));
-    std::shared_ptr<std::string const> const doc_root = std::make_shared<std::string>("."); // std::make_shared<std::string>(argv[3]);
-    auto const threads = 1;                                                                 // std::max<int>(1, std::atoi(argv[4]));
-    server_async::HttpServer server(address, port, doc_root, threads);
-
-    std::filesystem::path cwd = std::filesystem::current_path();
-    std::cout << "Current working directory: " << cwd << std::endl;
-
-    const char *cert_filepath = "../../apps/fixtures/cert.pem";
-    const char *key_filepath = "../../apps/fixtures/key.pem";
-    const char *dh_filepath = "../../apps/fixtures/dh.pem";
-
-    // print out current directory absolutely
-
-    server_async::SSLCertHolder ssl_cert_holder{server_async::read_whole_file(cert_filepath),
-                                                server_async::read_whole_file(key_filepath),
-                                                server_async::read_whole_file(dh_filepath)};
-
-    // server_async::HandlerFunc<server_async::plain_http_session> plain_handler =
-    //     std::bind(&handler<server_async::plain_http_session>, std::placeholders::_1, std::placeholders::_2);
-    // server_async::HandlerFunc<server_async::ssl_http_session> ssl_handler =
-    //     std::bind(&handler<server_async::ssl_http_session>, std::placeholders::_1, std::placeholders::_2);
-    // server_async::HandlerCommon handler_common = [&doc_root](server_async::EmptyBodyParser ebr,
-    //                                                          server_async::SessionVariant sv)
-    // {
-    //     http::response<http::string_body> res{http::status::ok, ebr.version()};
-    //     res.keep_alive(ebr.keep_alive());
+    LoopbackServer server{1, "."};
+    server.server().stop();
+    server.join();
+}
+
+namespace
+{
+    // Status line of a HEAD /README.md sent on its own connection.
+    std::string head_status(tcp::endpoint const &endpoint)
+    {
+        net::io_context client_ioc;
+        tcp::socket socket{client_ioc};
+        socket.connect(endpoint);
+        std::string req = "HEAD /README.md HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        net::write(socket, net::buffer(req));
+        net::streambuf res;
+        net::read_until(socket, res, "\r\n\r\n");
+        return std::string(net::buffers_begin(res.data()), net::buffers_begin(res.data()) + 12);
+    }
+}
 
-    //     auto file_res = std::make_shared<server_async::FileRequestHandler>(*doc_root, std::move(ebr))->handle_request();
-    //     std::visit([&file_res](auto &&arg)
-    //                { arg->queue_write(std::move(file_res)); },
-    //                sv);
-    // };
+TEST(ServerTest, drain)
+{
+    LoopbackServer server{2, "."};
+
+    // An idle keep-alive connection must not hold the drain until the deadline.
+    net::io_context client_ioc;
+    tcp::socket idle{client_ioc};
+    idle.connect(server.endpoint());
+    std::string req = "HEAD /README.md HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    net::write(idle, net::buffer(req));
+    net::streambuf res;
+    net::read_until(idle, res, "\r\n\r\n");
+
+    auto begin = std::chrono::steady_clock::now();
+    server.drain(std::chrono::seconds(10));
+    ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+    ASSERT_EQ(server.server().active_sessions(), 0);
+}
 
-    server_async::handler<server_async::plain_http_session> plain_handler;
-    server_async::handler<server_async::ssl_http_session> ssl_handler;
+TEST(ServerTest, dedicated_listeners)
+{
+    LoopbackServer server{1, ".", {server_async::ListenerMode::plain, server_async::ListenerMode::detect}};
 
-    std::thread t([&server, &ssl_cert_holder, &plain_handler, &ssl_handler]()
-                  { server.start(ssl_cert_holder, plain_handler, ssl_handler); });
+    for (std::size_t i : {0, 1})
+        ASSERT_EQ(head_status(server.endpoint(i)), "HTTP/1.1 200") << server.endpoint(i);
+}
 
-    std::this_thread::sleep_for(std::chrono::seconds(3));
-    server.stop();
-    t.join();
+TEST(ServerTest, keep_alive)
+{
+    LoopbackServer server{1, "."};
+
+    // Two requests pipelined, then an upload, all on one connection.
+    net::io_context client_ioc;
+    tcp::socket socket{client_ioc};
+    socket.connect(server.endpoint());
+    std::string req = "HEAD /README.md HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                      "GET /missing.txt HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                      "POST /upload/data HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\nContent-Length: 4\r\n\r\ndata";
+    net::write(socket, net::buffer(req));
+    beast::flat_buffer buffer;
+    std::pair<unsigned, bool> const expected[] = {{200, true}, {404, false}, {200, false}};
+    for (auto [status, head] : expected)
+    {
+        http::response_parser<http::string_body> parser;
+        // The HEAD response has a Content-Length but no body.
+        parser.skip(head);
+        http::read(socket, buffer, parser);
+        ASSERT_EQ(parser.get().result_int(), status);
+    }
+
+    // Now idle, the drain closes it without waiting for the deadline.
+    auto begin = std::chrono::steady_clock::now();
+    server.drain(std::chrono::seconds(10));
+    ASSERT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(5));
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+TEST(ServerTest, handoff)
+{
+    std::string handoff_path = (std::filesystem::temp_directory_path() /
+                                ("server_async_handoff_test_" + std::to_string(::getpid()) + ".sock"))
+                                   .string();
+
+    LoopbackServer old_server{1, ".", {server_async::ListenerMode::plain}, [&](server_async::HttpServer &server)
+                              { server.enable_handoff(handoff_path, []
+                                                      { return std::string{"warm"}; }); }};
+
+    // The new server asks for the same endpoint, so it takes over the socket.
+    std::string restored;
+    LoopbackServer new_server{1, ".", {}, [&](server_async::HttpServer &server)
+                              {
+                                  server.add_listener(old_server.endpoint(), server_async::ListenerMode::plain);
+                                  server.enable_handoff(handoff_path, {}, [&restored](std::string const &snapshot)
+                                                        { restored = snapshot; });
+                              }};
+
+    // The old server drains and returns once the new one owns the socket.
+    old_server.join();
+    ASSERT_EQ(restored, "warm");
+
+    // The port keeps accepting, now served by the new process.
+    ASSERT_EQ(new_server.endpoint(), old_server.endpoint());
+    ASSERT_EQ(head_status(new_server.endpoint()), "HTTP/1.1 200");
+
+    new_server.drain(std::chrono::seconds(1));
+    std::filesystem::remove(handoff_path);
+}
+
+TEST(ServerTest, handoff_gives_up_on_a_silent_predecessor)
+{
+    std::string handoff_path = (std::filesystem::temp_directory_path() /
+                                ("server_async_silent_test_" + std::to_string(::getpid()) + ".sock"))
+                                   .string();
+    std::filesystem::remove(handoff_path);
+
+    // Connections complete in the backlog, nobody ever sends.
+    net::io_context ioc;
+    net::local::stream_protocol::acceptor acceptor{ioc, net::local::stream_protocol::endpoint{handoff_path}};
+
+    server_async::handoff::Received received;
+    boost::system::error_code ec;
+    auto begin = std::chrono::steady_clock::now();
+    ASSERT_FALSE(server_async::handoff::receive(handoff_path, received, ec, std::chrono::milliseconds(200)));
+    EXPECT_EQ(ec, net::error::timed_out);
+    EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(2));
+    std::filesystem::remove(handoff_path);
 }
+#endif
 
 TEST(ModelsTest, JsonResponse)
 {
@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <optional>
+#include <string>
+#include <thread>
+#include "crypto_pool.hpp"
+#include "tls_config.hpp"
+
+using server_async::CryptoPool;
+
+namespace
+{
+    struct Result
+    {
+        beast::error_code ec;
+        std::thread::id thread;
+        std::string request;
+    };
+
+    // One TLS connection over loopback: the server side handshakes through
+    // `pool`, the client sends `after` right behind its Finished.
+    Result pooled_connection(CryptoPool &pool, std::string const &after, bool tls_client = true)
+    {
+        net::io_context ioc;
+        ssl::context server_ctx{ssl::context::tls_server};
+        server_async::configure_tls(server_ctx, server_async::TlsOptions{});
+        server_ctx.use_certificate_chain_file("apps/fixtures/cert.pem");
+        server_ctx.use_private_key_file("apps/fixtures/key.pem", ssl::context::pem);
+        ssl::context client_ctx{ssl::context::tls_client};
+        client_ctx.set_verify_mode(ssl::verify_none);
+
+        tcp::acceptor acceptor{ioc, {net::ip::make_address("127.0.0.1"), 0}};
+        std::optional<ssl::stream<beast::tcp_stream>> server;
+        ssl::stream<tcp::socket> client{ioc, client_ctx};
+        Result result;
+        std::string buffer(after.size(), '\0');
+
+        acceptor.async_accept(
+            net::make_strand(ioc),
+            [&](beast::error_code ec, tcp::socket socket)
+            {
+                ASSERT_FALSE(ec);
+                server.emplace(beast::tcp_stream(std::move(socket)), server_ctx);
+                server_async::async_pooled_handshake(
+                    *server, pool, net::const_buffer{},
+                    [&](beast::error_code ec, std::size_t)
+                    {
+                        result.ec = ec;
+                        result.thread = std::this_thread::get_id();
+                        if (ec || after.empty())
+                            return;
+                        net::async_read(*server, net::buffer(buffer),
+                                        [&](beast::error_code ec, std::size_t)
+                                        { result.request = ec ? ec.message() : buffer; });
+                    });
+            });
+        client.next_layer().async_connect(
+            acceptor.local_endpoint(),
+            [&](beast::error_code ec)
+            {
+                ASSERT_FALSE(ec);
+                if (!tls_client)
+                {
+                    static char const garbage[] = "GET / HTTP/1.1\r\n\r\n";
+                    net::write(client.next_layer(), net::buffer(garbage));
+                    return;
+                }
+                client.async_handshake(ssl::stream_base::client,
+                                       [&](beast::error_code ec)
+                                       {
+                                           if (!ec && !after.empty())
+                                               net::write(client, net::buffer(after));
+                                       });
+            });
+        ioc.run();
+        return result;
+    }
+}
+
+TEST(CryptoPoolTest, completes_on_the_io_thread)
+{
+    CryptoPool pool{1, 16};
+    auto before = server_async::Metrics::instance().snapshot().crypto;
+    Result result = pooled_connection(pool, "ping");
+    auto after = server_async::Metrics::instance().snapshot().crypto;
+
+    EXPECT_FALSE(result.ec) << result.ec.message();
+    EXPECT_EQ(result.thread, std::this_thread::get_id());
+    EXPECT_GT(after[0], before[0]);
+    EXPECT_EQ(after[2], before[2]);
+    EXPECT_EQ(pool.pending(), 0u);
+}
+
+TEST(CryptoPoolTest, leaves_data_after_the_handshake_to_the_stream)
+{
+    CryptoPool pool{1, 16};
+    EXPECT_EQ(pooled_connection(pool, "GET / HTTP/1.1\r\n\r\n").request, "GET / HTTP/1.1\r\n\r\n");
+}
+
+TEST(CryptoPoolTest, runs_on_the_io_thread_when_full)
+{
+    CryptoPool pool{1, 0};
+    auto before = server_async::Metrics::instance().snapshot().crypto;
+    Result result = pooled_connection(pool, "ping");
+    auto after = server_async::Metrics::instance().snapshot().crypto;
+
+    EXPECT_FALSE(result.ec) << result.ec.message();
+    EXPECT_EQ(result.request, "ping");
+    EXPECT_EQ(after[0], before[0]);
+    EXPECT_GT(after[2], before[2]);
+}
+
+TEST(CryptoPoolTest, reports_handshake_errors)
+{
+    CryptoPool pool{1, 16};
+    Result result = pooled_connection(pool, "", false);
+    EXPECT_TRUE(result.ec);
+    EXPECT_EQ(result.thread, std::this_thread::get_id());
+}
@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <thread>
+#include "dns_cache.hpp"
+
+using server_async::DnsCache;
+using server_async::Metrics;
+
+namespace
+{
+    struct Lookup
+    {
+        boost::system::error_code ec;
+        DnsCache::Endpoints endpoints;
+        bool done = false;
+    };
+
+    std::uint64_t count(Metrics::DnsLookup result)
+    {
+        return Metrics::instance().snapshot().dns[static_cast<std::size_t>(result)];
+    }
+
+    // Runs lookups of `names` side by side and waits for all of them.
+    std::vector<Lookup> resolve(DnsCache &cache, std::vector<std::pair<std::string, std::string>> const &names)
+    {
+        boost::asio::io_context ioc;
+        std::vector<Lookup> lookups(names.size());
+        for (std::size_t i = 0; i < names.size(); ++i)
+            cache.async_resolve(names[i].first, names[i].second, ioc.get_executor(),
+                                [&lookups, i](boost::system::error_code ec, DnsCache::Endpoints const &endpoints)
+                                { lookups[i] = {ec, endpoints, true}; });
+        ioc.run();
+        return lookups;
+    }
+
+    // Sets the cache TTLs for one test.
+    struct Ttls
+    {
+        std::int64_t ttl = server_async::dns_cache_ttl_ms().exchange(60000);
+        std::int64_t negative = server_async::dns_negative_ttl_ms().exchange(5000);
+        ~Ttls()
+        {
+            server_async::dns_cache_ttl_ms() = ttl;
+            server_async::dns_negative_ttl_ms() = negative;
+        }
+    };
+}
+
+TEST(DnsCacheTest, answers_addresses_without_a_lookup)
+{
+    DnsCache cache{1};
+    auto misses = count(Metrics::DnsLookup::miss);
+    auto lookups = resolve(cache, {{"127.0.0.1", "8080"}, {"::1", "443"}});
+    ASSERT_FALSE(lookups[0].ec);
+    ASSERT_EQ(lookups[0].endpoints.size(), 1u);
+    EXPECT_EQ(lookups[0].endpoints[0], boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 8080));
+    EXPECT_EQ(lookups[1].endpoints[0].port(), 443);
+    EXPECT_EQ(count(Metrics::DnsLookup::miss), misses);
+}
+
+TEST(DnsCacheTest, rejects_ports_out_of_range)
+{
+    DnsCache cache{1};
+    auto lookups = resolve(cache, {{"127.0.0.1", "65535"}, {"127.0.0.1", "65616"}, {"127.0.0.1", "99999999999999999999"}, {"localhost", "70000"}});
+    ASSERT_FALSE(lookups[0].ec);
+    EXPECT_EQ(lookups[0].endpoints[0].port(), 65535);
+    for (std::size_t i = 1; i < lookups.size(); ++i)
+    {
+        EXPECT_TRUE(lookups[i].done);
+        EXPECT_EQ(lookups[i].ec, boost::asio::error::service_not_found);
+        EXPECT_TRUE(lookups[i].endpoints.empty());
+    }
+}
+
+TEST(DnsCacheTest, coalesces_and_caches_a_name)
+{
+    Ttls ttls;
+    DnsCache cache{2};
+    auto misses = count(Metrics::DnsLookup::miss);
+    auto coalesced = count(Metrics::DnsLookup::coalesced);
+    auto hits = count(Metrics::DnsLookup::hit);
+
+    auto lookups = resolve(cache, {{"localhost", "80"}, {"localhost", "80"}, {"localhost", "80"}});
+    for (auto const &l : lookups)
+    {
+        ASSERT_TRUE(l.done);
+        ASSERT_FALSE(l.ec) << l.ec.message();
+        ASSERT_FALSE(l.endpoints.empty());
+        EXPECT_TRUE(l.endpoints[0].address().is_loopback());
+        EXPECT_EQ(l.endpoints, lookups[0].endpoints);
+    }
+    // One resolution; the others waited for it, or found it done if it was quick.
+    EXPECT_EQ(count(Metrics::DnsLookup::miss), misses + 1);
+    EXPECT_EQ(count(Metrics::DnsLookup::coalesced) + count(Metrics::DnsLookup::hit), coalesced + hits + 2);
+
+    hits = count(Metrics::DnsLookup::hit);
+    EXPECT_EQ(resolve(cache, {{"localhost", "80"}})[0].endpoints, lookups[0].endpoints);
+    EXPECT_EQ(count(Metrics::DnsLookup::hit), hits + 1);
+    EXPECT_EQ(count(Metrics::DnsLookup::miss), misses + 1);
+}
+
+TEST(DnsCacheTest, remembers_failures_for_the_negative_ttl)
+{
+    Ttls ttls;
+    server_async::dns_negative_ttl_ms() = 50;
+    DnsCache cache{1};
+    auto misses = count(Metrics::DnsLookup::miss);
+
+    EXPECT_TRUE(resolve(cache, {{"localhost", "no-such-service"}})[0].ec);
+    EXPECT_TRUE(resolve(cache, {{"localhost", "no-such-service"}})[0].ec);
+    EXPECT_EQ(count(Metrics::DnsLookup::miss), misses + 1);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    EXPECT_TRUE(resolve(cache, {{"localhost", "no-such-service"}})[0].ec);
+    EXPECT_EQ(count(Metrics::DnsLookup::miss), misses + 2);
+}
+
+TEST(DnsCacheTest, refreshes_busy_names_before_they_expire)
+{
+    Ttls ttls;
+    server_async::dns_cache_ttl_ms() = 200;
+    DnsCache cache{1};
+    resolve(cache, {{"localhost", "80"}});
+    auto misses = count(Metrics::DnsLookup::miss);
+    auto refreshes = count(Metrics::DnsLookup::refresh);
+
+    // In the last fifth of the TTL: answered from the cache, resolved again behind it.
+    std::this_thread::sleep_for(std::chrono::milliseconds(170));
+    EXPECT_FALSE(resolve(cache, {{"localhost", "80"}})[0].ec);
+    EXPECT_EQ(count(Metrics::DnsLookup::refresh), refreshes + 1);
+
+    // The refresh gave the name a new TTL, it does not miss.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_FALSE(resolve(cache, {{"localhost", "80"}})[0].ec);
+    EXPECT_EQ(count(Metrics::DnsLookup::miss), misses);
+}
@@ -0,0 +1,334 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <map>
+#include <sstream>
+#include "dns_resolver.hpp"
+
+using server_async::DnsConfig;
+using server_async::DnsResolver;
+using server_async::HostsFile;
+namespace asio = boost::asio;
+using asio::ip::tcp;
+using asio::ip::udp;
+
+namespace
+{
+    // A nameserver on 127.0.0.1 answering from `records` over UDP and TCP,
+    // with ways to misbehave.
+    class FakeDns
+    {
+    public:
+        struct Records
+        {
+            std::vector<std::string> a, aaaa;
+            std::uint32_t ttl = 300;
+        };
+
+        std::map<std::string, Records> records;
+        int drop = 0;         // UDP queries to ignore
+        int servfail = 0;     // queries to answer with SERVFAIL
+        bool truncate = false; // answer over UDP with TC set and no records
+        bool spoof = false;   // send a reply with the wrong ID first
+        int udp_queries = 0;
+        int tcp_queries = 0;
+        std::vector<std::string> asked;
+
+        explicit FakeDns(asio::io_context &ioc)
+            : udp_(ioc, {asio::ip::make_address("127.0.0.1"), 0}),
+              acceptor_(ioc, {asio::ip::make_address("127.0.0.1"), udp_.local_endpoint().port()})
+        {
+            receive();
+            accept();
+        }
+
+        DnsConfig config(std::chrono::milliseconds timeout = std::chrono::milliseconds(200), int attempts = 2) const
+        {
+            DnsConfig config;
+            config.nameservers.push_back(udp_.local_endpoint());
+            config.timeout = timeout;
+            config.attempts = attempts;
+            return config;
+        }
+
+    private:
+        udp::socket udp_;
+        tcp::acceptor acceptor_;
+        std::array<std::uint8_t, 512> in_{};
+        udp::endpoint peer_;
+
+        void receive()
+        {
+            udp_.async_receive_from(asio::buffer(in_), peer_,
+                                    [this](boost::system::error_code ec, std::size_t n)
+                                    {
+                                        if (ec)
+                                            return;
+                                        ++udp_queries;
+                                        std::vector<std::uint8_t> query(in_.begin(), in_.begin() + n);
+                                        if (drop > 0)
+                                            --drop;
+                                        else
+                                        {
+                                            if (spoof)
+                                            {
+                                                auto fake = answer(query, false);
+                                                fake[1] ^= 1;
+                                                udp_.send_to(asio::buffer(fake), peer_);
+                                            }
+                                            udp_.send_to(asio::buffer(answer(query, truncate)), peer_);
+                                        }
+                                        receive();
+                                    });
+        }
+
+        void accept()
+        {
+            acceptor_.async_accept(
+                [this](boost::system::error_code ec, tcp::socket socket)
+                {
+                    if (ec)
+                        return;
+                    ++tcp_queries;
+                    serve(std::make_shared<tcp::socket>(std::move(socket)));
+                    accept();
+                });
+        }
+
+        void serve(std::shared_ptr<tcp::socket> socket)
+        {
+            auto message = std::make_shared<std::vector<std::uint8_t>>(2);
+            asio::async_read(*socket, asio::buffer(*message),
+                             [this, socket, message](boost::system::error_code ec, std::size_t)
+                             {
+                                 if (ec)
+                                     return;
+                                 message->resize((*message)[0] << 8 | (*message)[1]);
+                                 asio::async_read(*socket, asio::buffer(*message),
+                                                  [this, socket, message](boost::system::error_code ec, std::size_t)
+                                                  {
+                                                      if (ec)
+                                                          return;
+                                                      *message = answer(*message, false);
+                                                      message->insert(message->begin(), {std::uint8_t(message->size() >> 8), std::uint8_t(message->size())});
+                                                      asio::async_write(*socket, asio::buffer(*message),
+                                                                        [socket, message](boost::system::error_code, std::size_t) {});
+                                                  });
+                             });
+        }
+
+        std::vector<std::uint8_t> answer(std::vector<std::uint8_t> const &query, bool truncated)
+        {
+            std::string name;
+            std::size_t pos = 12;
+            while (query[pos] != 0)
+            {
+                if (!name.empty())
+                    name += '.';
+                name.append(reinterpret_cast<char const *>(&query[pos + 1]), query[pos]);
+                pos += 1 + query[pos];
+            }
+            std::uint16_t type = query[pos + 1] << 8 | query[pos + 2];
+            asked.push_back(name + (type == 1 ? "/A" : "/AAAA"));
+
+            std::vector<std::uint8_t> out(query.begin(), query.begin() + pos + 5);
+            out[2] = 0x81 | (truncated ? 0x02 : 0);
+            out[3] = 0x80;
+            auto it = records.find(name);
+            if (servfail > 0)
+            {
+                --servfail;
+                out[3] |= 2;
+                return out;
+            }
+            if (it == records.end())
+            {
+                out[3] |= 3;
+                return out;
+            }
+            if (truncated)
+                return out;
+            auto const &addresses = type == 1 ? it->second.a : it->second.aaaa;
+            for (auto const &a : addresses)
+            {
+                auto address = asio::ip::make_address(a);
+                out.insert(out.end(), {0xC0, 12, 0, std::uint8_t(type), 0, 1});
+                for (int shift = 24; shift >= 0; shift -= 8)
+                    out.push_back(std::uint8_t(it->second.ttl >> shift));
+                if (address.is_v4())
+                {
+                    auto bytes = address.to_v4().to_bytes();
+                    out.insert(out.end(), {0, 4});
+                    out.insert(out.end(), bytes.begin(), bytes.end());
+                }
+                else
+                {
+                    auto bytes = address.to_v6().to_bytes();
+                    out.insert(out.end(), {0, 16});
+                    out.insert(out.end(), bytes.begin(), bytes.end());
+                }
+            }
+            out[7] = static_cast<std::uint8_t>(addresses.size());
+            return out;
+        }
+    };
+
+    struct Result
+    {
+        boost::system::error_code ec;
+        std::vector<std::string> addresses;
+        std::chrono::seconds ttl{};
+    };
+
+    Result resolve(asio::io_context &ioc, DnsResolver &resolver, std::string const &host)
+    {
+        Result result;
+        bool done = false;
+        resolver.async_resolve(ioc.get_executor(), host,
+                               [&](boost::system::error_code ec, DnsResolver::Addresses addresses, std::chrono::seconds ttl)
+                               {
+                                   result.ec = ec;
+                                   for (auto const &a : addresses)
+                                       result.addresses.push_back(a.to_string());
+                                   result.ttl = ttl;
+                                   done = true;
+                               });
+        ioc.restart();
+        while (!done && ioc.run_one())
+            ;
+        return result;
+    }
+}
+
+TEST(DnsResolverTest, reads_resolv_conf)
+{
+    std::istringstream in("# comment\n"
+                          "nameserver 10.0.0.1\n"
+                          "nameserver ::1 ; trailing comment\n"
+                          "nameserver not-an-address\n"
+                          "domain old.example\n"
+                          "search Corp.Example lab.example\n"
+                          "nameserver 10.0.0.3\n"
+                          "nameserver 10.0.0.4\n"
+                          "options rotate ndots:2 timeout:1 attempts:3\n");
+    DnsConfig config = DnsConfig::parse(in);
+    ASSERT_EQ(config.nameservers.size(), 3u);
+    EXPECT_EQ(config.nameservers[1], udp::endpoint(asio::ip::make_address("::1"), 53));
+    EXPECT_EQ(config.nameservers[2].address().to_string(), "10.0.0.3");
+    EXPECT_EQ(config.search, (std::vector<std::string>{"corp.example", "lab.example"}));
+    EXPECT_EQ(config.ndots, 2);
+    EXPECT_EQ(config.timeout, std::chrono::seconds(1));
+    EXPECT_EQ(config.attempts, 3);
+}
+
+TEST(DnsResolverTest, answers_from_the_hosts_file_first)
+{
+    std::istringstream hosts("127.0.0.1 localhost\n"
+                             "::1 localhost ip6-localhost # comment\n"
+                             "192.0.2.7 Build.Example build\n");
+    asio::io_context ioc;
+    DnsResolver resolver{DnsConfig{}, HostsFile::parse(hosts)};
+    Result r = resolve(ioc, resolver, "localhost");
+    EXPECT_FALSE(r.ec);
+    EXPECT_EQ(r.addresses, (std::vector<std::string>{"127.0.0.1", "::1"}));
+    EXPECT_EQ(resolve(ioc, resolver, "BUILD.example.").addresses, std::vector<std::string>{"192.0.2.7"});
+}
+
+TEST(DnsResolverTest, orders_search_candidates_like_res_search)
+{
+    std::istringstream in("search corp.example\noptions ndots:2\n");
+    DnsResolver resolver{DnsConfig::parse(in), HostsFile{}};
+    EXPECT_EQ(resolver.candidates("api"), (std::vector<std::string>{"api.corp.example", "api"}));
+    EXPECT_EQ(resolver.candidates("a.b.c"), (std::vector<std::string>{"a.b.c", "a.b.c.corp.example"}));
+    EXPECT_EQ(resolver.candidates("api."), (std::vector<std::string>{"api."}));
+}
+
+TEST(DnsResolverTest, queries_a_and_aaaa_together)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.records["www.example.test"] = {{"192.0.2.1", "192.0.2.2"}, {"2001:db8::1"}, 120};
+    DnsResolver resolver{server.config(), HostsFile{}};
+
+    Result r = resolve(ioc, resolver, "www.example.test");
+    EXPECT_FALSE(r.ec) << r.ec.message();
+    // IPv6 first, for HappyEyeballs to start with.
+    EXPECT_EQ(r.addresses, (std::vector<std::string>{"2001:db8::1", "192.0.2.1", "192.0.2.2"}));
+    EXPECT_EQ(r.ttl, std::chrono::seconds(120));
+    EXPECT_EQ(server.udp_queries, 2);
+}
+
+TEST(DnsResolverTest, retries_when_a_query_is_lost)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.records["www.example.test"] = {{"192.0.2.1"}, {}, 60};
+    server.drop = 2;
+    DnsResolver resolver{server.config(std::chrono::milliseconds(50)), HostsFile{}};
+
+    Result r = resolve(ioc, resolver, "www.example.test");
+    EXPECT_FALSE(r.ec) << r.ec.message();
+    EXPECT_EQ(r.addresses, std::vector<std::string>{"192.0.2.1"});
+    EXPECT_EQ(server.udp_queries, 4);
+}
+
+TEST(DnsResolverTest, skips_a_failing_server)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.records["www.example.test"] = {{"192.0.2.1"}, {}, 60};
+    server.servfail = 1;
+    DnsResolver resolver{server.config(), HostsFile{}};
+    EXPECT_EQ(resolve(ioc, resolver, "www.example.test").addresses, std::vector<std::string>{"192.0.2.1"});
+}
+
+TEST(DnsResolverTest, asks_again_over_tcp_when_truncated)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.records["big.example.test"] = {{"192.0.2.1", "192.0.2.2", "192.0.2.3"}, {"2001:db8::5"}, 60};
+    server.truncate = true;
+    DnsResolver resolver{server.config(), HostsFile{}};
+
+    Result r = resolve(ioc, resolver, "big.example.test");
+    EXPECT_FALSE(r.ec) << r.ec.message();
+    EXPECT_EQ(r.addresses.size(), 4u);
+    EXPECT_EQ(server.tcp_queries, 2);
+}
+
+TEST(DnsResolverTest, ignores_replies_to_other_queries)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.records["www.example.test"] = {{"192.0.2.1"}, {}, 60};
+    server.spoof = true;
+    DnsResolver resolver{server.config(), HostsFile{}};
+    EXPECT_EQ(resolve(ioc, resolver, "www.example.test").addresses, std::vector<std::string>{"192.0.2.1"});
+}
+
+TEST(DnsResolverTest, walks_the_search_list)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.records["api"] = {{"192.0.2.9"}, {}, 60};
+    DnsConfig config = server.config();
+    config.search = {"corp.test"};
+    DnsResolver resolver{config, HostsFile{}};
+
+    EXPECT_EQ(resolve(ioc, resolver, "api").addresses, std::vector<std::string>{"192.0.2.9"});
+    EXPECT_EQ(server.asked, (std::vector<std::string>{"api.corp.test/A", "api.corp.test/AAAA", "api/A", "api/AAAA"}));
+
+    Result missing = resolve(ioc, resolver, "missing");
+    EXPECT_EQ(missing.ec, asio::error::host_not_found);
+}
+
+TEST(DnsResolverTest, gives_up_on_a_silent_server)
+{
+    asio::io_context ioc;
+    FakeDns server{ioc};
+    server.drop = 100;
+    DnsResolver resolver{server.config(std::chrono::milliseconds(30), 2), HostsFile{}};
+
+    Result r = resolve(ioc, resolver, "www.example.test");
+    EXPECT_EQ(r.ec, asio::error::host_not_found_try_again);
+    EXPECT_EQ(server.udp_queries, 4);
+}
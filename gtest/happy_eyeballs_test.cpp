@@ -0,0 +1,169 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include "happy_eyeballs.hpp"
+
+using server_async::HappyEyeballs;
+using server_async::Metrics;
+namespace asio = boost::asio;
+using asio::ip::tcp;
+
+namespace
+{
+    tcp::endpoint loopback(unsigned short port = 0)
+    {
+        return {asio::ip::make_address("127.0.0.1"), port};
+    }
+
+    // A port nothing listens on.
+    tcp::endpoint refused(asio::io_context &ioc)
+    {
+        tcp::acceptor acceptor(ioc, loopback());
+        return acceptor.local_endpoint();
+    }
+
+    // A listener whose accept queue is full, so new SYNs go unanswered.
+    struct Blackhole
+    {
+        tcp::acceptor acceptor;
+        tcp::socket filler;
+
+        explicit Blackhole(asio::io_context &ioc) : acceptor(ioc, loopback()), filler(ioc)
+        {
+            acceptor.listen(0);
+            filler.connect(acceptor.local_endpoint());
+        }
+    };
+
+    struct Result
+    {
+        bool called = false;
+        boost::system::error_code ec;
+        tcp::endpoint endpoint;
+    };
+
+    Result connect(asio::io_context &ioc, tcp::socket &socket, HappyEyeballs::Endpoints const &endpoints,
+                   HappyEyeballs::duration timeout = HappyEyeballs::duration::max())
+    {
+        Result result;
+        HappyEyeballs::async_connect(socket, endpoints,
+                                     [&](boost::system::error_code ec, tcp::endpoint endpoint)
+                                     {
+                                         result.called = true;
+                                         result.ec = ec;
+                                         result.endpoint = endpoint;
+                                     },
+                                     timeout);
+        EXPECT_FALSE(result.called);
+        ioc.run_for(std::chrono::seconds(5));
+        return result;
+    }
+
+    std::uint64_t attempts(Metrics::ConnectAttempt result)
+    {
+        return Metrics::instance().snapshot().connect[static_cast<std::size_t>(result)];
+    }
+}
+
+TEST(HappyEyeballsTest, alternates_address_families)
+{
+    auto v4 = [](char const *a)
+    { return tcp::endpoint(asio::ip::make_address(a), 80); };
+    HappyEyeballs::Endpoints in{v4("2001:db8::1"), v4("2001:db8::2"), v4("2001:db8::3"), v4("192.0.2.1"), v4("192.0.2.2")};
+    HappyEyeballs::Endpoints out{v4("2001:db8::1"), v4("192.0.2.1"), v4("2001:db8::2"), v4("192.0.2.2"), v4("2001:db8::3")};
+    EXPECT_EQ(HappyEyeballs::interleave(in), out);
+    EXPECT_TRUE(HappyEyeballs::interleave({}).empty());
+}
+
+TEST(HappyEyeballsTest, moves_on_as_soon_as_an_attempt_fails)
+{
+    server_async::connect_attempt_delay_ms() = 10000;
+    asio::io_context ioc;
+    tcp::acceptor live(ioc, loopback());
+    tcp::socket socket(ioc);
+    auto start = std::chrono::steady_clock::now();
+
+    Result r = connect(ioc, socket, {refused(ioc), live.local_endpoint()});
+    EXPECT_FALSE(r.ec) << r.ec.message();
+    EXPECT_EQ(r.endpoint, live.local_endpoint());
+    EXPECT_EQ(socket.remote_endpoint(), live.local_endpoint());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+}
+
+TEST(HappyEyeballsTest, races_an_address_that_never_answers)
+{
+    server_async::connect_attempt_delay_ms() = 50;
+    asio::io_context ioc;
+    Blackhole silent(ioc);
+    tcp::acceptor live(ioc, loopback());
+    tcp::socket socket(ioc);
+    auto won = attempts(Metrics::ConnectAttempt::won);
+    auto cancelled = attempts(Metrics::ConnectAttempt::cancelled);
+    auto start = std::chrono::steady_clock::now();
+
+    Result r = connect(ioc, socket, {silent.acceptor.local_endpoint(), live.local_endpoint()});
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_FALSE(r.ec) << r.ec.message();
+    EXPECT_EQ(r.endpoint, live.local_endpoint());
+    EXPECT_GE(elapsed, std::chrono::milliseconds(50));
+    EXPECT_LT(elapsed, std::chrono::seconds(2));
+    EXPECT_EQ(attempts(Metrics::ConnectAttempt::won), won + 1);
+    EXPECT_EQ(attempts(Metrics::ConnectAttempt::cancelled), cancelled + 1);
+}
+
+TEST(HappyEyeballsTest, reports_the_last_error_when_every_attempt_fails)
+{
+    server_async::connect_attempt_delay_ms() = 250;
+    asio::io_context ioc;
+    tcp::socket socket(ioc);
+    Result r = connect(ioc, socket, {refused(ioc), refused(ioc)});
+    EXPECT_TRUE(r.called);
+    EXPECT_EQ(r.ec, asio::error::connection_refused);
+    EXPECT_FALSE(socket.is_open());
+}
+
+TEST(HappyEyeballsTest, gives_up_after_the_timeout)
+{
+    server_async::connect_attempt_delay_ms() = 250;
+    asio::io_context ioc;
+    Blackhole silent(ioc);
+    tcp::socket socket(ioc);
+    Result r = connect(ioc, socket, {silent.acceptor.local_endpoint()}, std::chrono::milliseconds(100));
+    EXPECT_TRUE(r.called);
+    EXPECT_EQ(r.ec, asio::error::timed_out);
+    EXPECT_FALSE(socket.is_open());
+}
+
+TEST(HappyEyeballsTest, fails_without_addresses)
+{
+    asio::io_context ioc;
+    tcp::socket socket(ioc);
+    Result r = connect(ioc, socket, {});
+    EXPECT_TRUE(r.called);
+    EXPECT_EQ(r.ec, asio::error::host_not_found);
+}
+
+TEST(HappyEyeballsTest, cancel_gives_up_every_attempt)
+{
+    server_async::connect_attempt_delay_ms() = 250;
+    asio::io_context ioc;
+    Blackhole silent(ioc);
+    tcp::acceptor live(ioc, loopback());
+    tcp::socket socket(ioc);
+    Result r;
+    auto connector = HappyEyeballs::async_connect(socket, {silent.acceptor.local_endpoint(), live.local_endpoint()},
+                                                  [&](boost::system::error_code ec, tcp::endpoint endpoint)
+                                                  {
+                                                      r = {true, ec, endpoint};
+                                                  });
+    // Cancelled before the second attempt could win.
+    asio::post(ioc, [&]
+               { connector.lock()->cancel();
+                 EXPECT_FALSE(r.called); });
+    auto start = std::chrono::steady_clock::now();
+    ioc.run_for(std::chrono::seconds(5));
+    EXPECT_TRUE(r.called);
+    EXPECT_EQ(r.ec, asio::error::operation_aborted);
+    EXPECT_FALSE(socket.is_open());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    EXPECT_TRUE(connector.expired());
+}
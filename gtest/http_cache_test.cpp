@@ -0,0 +1,332 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include "http_cache.hpp"
+
+using server_async::CacheControl;
+using server_async::CacheEntry;
+using server_async::HttpCache;
+using server_async::HttpCacheOptions;
+namespace http = boost::beast::http;
+
+namespace
+{
+    // 2024-01-01 00:00:00 GMT
+    constexpr std::int64_t t0 = 1704067200;
+
+    http::request_header<> get(std::string target = "/")
+    {
+        http::request_header<> req;
+        req.method(http::verb::get);
+        req.target(target);
+        req.version(11);
+        return req;
+    }
+
+    http::response_header<> ok(std::string cache_control)
+    {
+        http::response_header<> res;
+        res.result(http::status::ok);
+        res.version(11);
+        res.set(http::field::date, "Mon, 01 Jan 2024 00:00:00 GMT");
+        if (!cache_control.empty())
+            res.set(http::field::cache_control, cache_control);
+        return res;
+    }
+
+    bool put(HttpCache &cache, std::string const &key, http::request_header<> const &req,
+             http::response_header<> const &res, std::string const &body)
+    {
+        auto writer = cache.store(key, req, res, t0, t0);
+        if (!writer)
+            return false;
+        for (std::size_t i = 0; i < body.size(); i += 1000)
+            writer->append(body.data() + i, std::min<std::size_t>(1000, body.size() - i));
+        writer->commit();
+        return true;
+    }
+
+    std::string body_of(CacheEntry const &entry)
+    {
+        if (entry.body)
+            return *entry.body;
+        std::ifstream in(entry.path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    }
+
+    struct TempDir
+    {
+        std::filesystem::path path;
+
+        TempDir() : path(std::filesystem::temp_directory_path() / ("http_cache_test_" + std::to_string(::getpid())))
+        {
+            std::filesystem::remove_all(path);
+        }
+
+        ~TempDir()
+        {
+            std::filesystem::remove_all(path);
+        }
+    };
+}
+
+TEST(HttpCacheTest, parses_http_dates_in_all_formats)
+{
+    EXPECT_EQ(server_async::parse_http_date("Mon, 01 Jan 2024 00:00:00 GMT"), t0);
+    EXPECT_EQ(server_async::parse_http_date("Monday, 01-Jan-24 00:00:00 GMT"), t0);
+    EXPECT_EQ(server_async::parse_http_date("Mon Jan  1 00:00:00 2024"), t0);
+    EXPECT_FALSE(server_async::parse_http_date("yesterday"));
+}
+
+TEST(HttpCacheTest, parses_cache_control)
+{
+    auto res = ok("public, max-age=60, s-maxage=\"120\", no-cache=\"Set-Cookie\"");
+    auto cc = CacheControl::parse(res);
+    EXPECT_TRUE(cc.is_public);
+    EXPECT_TRUE(cc.no_cache);
+    EXPECT_EQ(cc.max_age, 60);
+    EXPECT_EQ(cc.s_maxage, 120);
+
+    auto req = get();
+    req.set(http::field::pragma, "no-cache");
+    EXPECT_TRUE(CacheControl::parse(req).no_cache);
+    req.set(http::field::cache_control, "max-stale, min-fresh=5");
+    cc = CacheControl::parse(req);
+    EXPECT_FALSE(cc.no_cache);
+    EXPECT_EQ(cc.max_stale, std::numeric_limits<std::int64_t>::max());
+    EXPECT_EQ(cc.min_fresh, 5);
+}
+
+TEST(HttpCacheTest, computes_freshness_and_age)
+{
+    EXPECT_EQ(server_async::freshness_lifetime(ok("max-age=60, s-maxage=30"), t0), 30);
+    auto res = ok("");
+    res.set(http::field::expires, "Mon, 01 Jan 2024 01:00:00 GMT");
+    EXPECT_EQ(server_async::freshness_lifetime(res, t0), 3600);
+    res.set(http::field::expires, "0");
+    EXPECT_EQ(server_async::freshness_lifetime(res, t0), 0);
+
+    // A tenth of the time since the last modification.
+    res = ok("");
+    res.set(http::field::last_modified, "Mon, 01 Jan 2024 00:00:00 GMT");
+    res.set(http::field::date, "Mon, 01 Jan 2024 10:00:00 GMT");
+    EXPECT_EQ(server_async::freshness_lifetime(res, t0), 3600);
+    res.result(http::status::found);
+    EXPECT_EQ(server_async::freshness_lifetime(res, t0), 0);
+
+    res = ok("max-age=60");
+    res.set(http::field::age, "10");
+    EXPECT_EQ(server_async::initial_age(res, t0 - 2, t0), 12);
+}
+
+TEST(HttpCacheTest, stores_only_what_a_shared_cache_may)
+{
+    auto req = get();
+    EXPECT_TRUE(server_async::storable(req, ok("max-age=60")));
+    EXPECT_FALSE(server_async::storable(req, ok("private, max-age=60")));
+    EXPECT_FALSE(server_async::storable(req, ok("no-store")));
+    EXPECT_FALSE(server_async::storable(req, ok("")));
+
+    auto res = ok("max-age=60");
+    res.set(http::field::vary, "*");
+    EXPECT_FALSE(server_async::storable(req, res));
+    res = ok("max-age=60");
+    res.set(http::field::set_cookie, "id=1");
+    EXPECT_FALSE(server_async::storable(req, res));
+
+    auto authorized = get();
+    authorized.set(http::field::authorization, "Basic eDp5");
+    EXPECT_FALSE(server_async::storable(authorized, ok("max-age=60")));
+    EXPECT_TRUE(server_async::storable(authorized, ok("s-maxage=60")));
+
+    auto post = get();
+    post.method(http::verb::post);
+    EXPECT_FALSE(server_async::storable(post, ok("max-age=60")));
+}
+
+TEST(HttpCacheTest, serves_fresh_responses_from_memory)
+{
+    HttpCache cache(HttpCacheOptions{});
+    auto req = get();
+    auto res = ok("max-age=60");
+    res.set(http::field::content_length, "5");
+    ASSERT_TRUE(put(cache, "k", req, res, "hello"));
+
+    auto found = cache.lookup("k", req, t0 + 10);
+    ASSERT_TRUE(found);
+    EXPECT_TRUE(found->fresh);
+    EXPECT_EQ(body_of(*found->entry), "hello");
+    EXPECT_EQ(found->entry->age(t0 + 10), 10);
+    EXPECT_FALSE(found->entry->header.count(http::field::content_length));
+    EXPECT_EQ(cache.usage().first, 5u);
+
+    EXPECT_FALSE(cache.lookup("k", req, t0 + 61)->fresh);
+    auto no_cache = get();
+    no_cache.set(http::field::cache_control, "no-cache");
+    EXPECT_FALSE(cache.lookup("k", no_cache, t0 + 10)->fresh);
+    auto max_stale = get();
+    max_stale.set(http::field::cache_control, "max-stale=30");
+    EXPECT_TRUE(cache.lookup("k", max_stale, t0 + 70)->fresh);
+    EXPECT_FALSE(cache.lookup("other", req, t0));
+}
+
+TEST(HttpCacheTest, keeps_a_response_per_variant)
+{
+    HttpCache cache(HttpCacheOptions{});
+    auto res = ok("max-age=60");
+    res.set(http::field::vary, "Accept-Encoding");
+    auto gzip = get();
+    gzip.set(http::field::accept_encoding, "gzip");
+    auto plain = get();
+    ASSERT_TRUE(put(cache, "k", gzip, res, "zipped"));
+    EXPECT_FALSE(cache.lookup("k", plain, t0));
+    ASSERT_TRUE(put(cache, "k", plain, res, "plain"));
+    EXPECT_EQ(body_of(*cache.lookup("k", gzip, t0)->entry), "zipped");
+    EXPECT_EQ(body_of(*cache.lookup("k", plain, t0)->entry), "plain");
+
+    // The same variant again replaces the first.
+    ASSERT_TRUE(put(cache, "k", gzip, res, "zipped2"));
+    EXPECT_EQ(body_of(*cache.lookup("k", gzip, t0)->entry), "zipped2");
+    EXPECT_EQ(cache.usage().first, 12u);
+}
+
+TEST(HttpCacheTest, evicts_the_least_recently_used)
+{
+    HttpCacheOptions options;
+    options.memory_bytes = 2500;
+    options.memory_object_max = 1000;
+    HttpCache cache(options);
+    auto req = get();
+    std::string body(1000, 'x');
+    ASSERT_TRUE(put(cache, "a", req, ok("max-age=60"), body));
+    ASSERT_TRUE(put(cache, "b", req, ok("max-age=60"), body));
+    cache.lookup("a", req, t0);
+    ASSERT_TRUE(put(cache, "c", req, ok("max-age=60"), body));
+    EXPECT_TRUE(cache.lookup("a", req, t0));
+    EXPECT_FALSE(cache.lookup("b", req, t0));
+    EXPECT_TRUE(cache.lookup("c", req, t0));
+    EXPECT_EQ(cache.usage().first, 2000u);
+
+    // Too large for memory, and there is no disk tier.
+    EXPECT_TRUE(put(cache, "d", req, ok("max-age=60"), std::string(1001, 'x')));
+    EXPECT_FALSE(cache.lookup("d", req, t0));
+}
+
+TEST(HttpCacheTest, keeps_large_bodies_on_disk_across_restarts)
+{
+    TempDir dir;
+    HttpCacheOptions options;
+    options.memory_object_max = 1000;
+    options.disk_dir = dir.path.string();
+    options.disk_slots = 4;
+    std::string large(100000, 'y');
+    large[5] = 'z';
+    {
+        HttpCache cache(options);
+        auto res = ok("max-age=60");
+        res.set(http::field::etag, "\"v1\"");
+        ASSERT_TRUE(put(cache, "big", get(), res, large));
+        ASSERT_TRUE(put(cache, "small", get(), ok("max-age=60"), "tiny"));
+        auto found = cache.lookup("big", get(), t0);
+        ASSERT_TRUE(found);
+        EXPECT_FALSE(found->entry->body);
+        EXPECT_EQ(body_of(*found->entry), large);
+        EXPECT_EQ(cache.usage(), (std::pair<std::uint64_t, std::uint64_t>(4, 100000)));
+    }
+    HttpCache cache(options);
+    auto found = cache.lookup("big", get(), t0 + 1);
+    ASSERT_TRUE(found);
+    EXPECT_TRUE(found->fresh);
+    EXPECT_EQ(found->entry->header[http::field::etag], "\"v1\"");
+    EXPECT_EQ(body_of(*found->entry), large);
+    // The memory tier starts empty.
+    EXPECT_FALSE(cache.lookup("small", get(), t0));
+
+    // Slots run out: the oldest body on disk goes.
+    for (int i = 0; i < 4; ++i)
+        ASSERT_TRUE(put(cache, "more" + std::to_string(i), get(), ok("max-age=60"), large));
+    EXPECT_FALSE(cache.lookup("big", get(), t0));
+    EXPECT_EQ(cache.usage().second, 400000u);
+    std::size_t files = 0;
+    for (auto const &f : std::filesystem::directory_iterator(dir.path))
+        files += f.path().extension() == ".body";
+    EXPECT_EQ(files, 4u);
+}
+
+TEST(HttpCacheTest, keeps_the_disk_lru_order_across_restarts)
+{
+    TempDir dir;
+    HttpCacheOptions options;
+    options.memory_object_max = 0;
+    options.disk_dir = dir.path.string();
+    options.disk_slots = 2;
+    std::string large(2000, 'y');
+    {
+        HttpCache cache(options);
+        ASSERT_TRUE(put(cache, "a", get(), ok("max-age=60"), large));
+        ASSERT_TRUE(put(cache, "b", get(), ok("max-age=60"), large));
+        cache.lookup("a", get(), t0);
+    }
+    HttpCache cache(options);
+    ASSERT_TRUE(put(cache, "c", get(), ok("max-age=60"), large));
+    EXPECT_TRUE(cache.lookup("a", get(), t0));
+    EXPECT_FALSE(cache.lookup("b", get(), t0));
+    EXPECT_TRUE(cache.lookup("c", get(), t0));
+}
+
+TEST(HttpCacheTest, refreshes_an_entry_after_a_not_modified)
+{
+    TempDir dir;
+    HttpCacheOptions options;
+    options.memory_object_max = 4;
+    options.disk_dir = dir.path.string();
+    HttpCache cache(options);
+    auto res = ok("max-age=60");
+    res.set(http::field::etag, "\"v1\"");
+    res.set(http::field::content_type, "text/plain");
+    ASSERT_TRUE(put(cache, "k", get(), res, "stale body"));
+    auto stale = cache.lookup("k", get(), t0 + 100);
+    ASSERT_TRUE(stale);
+    EXPECT_FALSE(stale->fresh);
+    EXPECT_TRUE(stale->entry->has_validator());
+
+    http::response_header<> not_modified;
+    not_modified.result(http::status::not_modified);
+    not_modified.set(http::field::date, "Mon, 01 Jan 2024 00:01:40 GMT");
+    not_modified.set(http::field::cache_control, "max-age=120");
+    not_modified.set(http::field::content_length, "0");
+    auto refreshed = cache.refresh(stale->entry, not_modified, t0 + 100, t0 + 100);
+    EXPECT_EQ(refreshed->header[http::field::cache_control], "max-age=120");
+    EXPECT_EQ(refreshed->header[http::field::content_type], "text/plain");
+    EXPECT_FALSE(refreshed->header.count(http::field::content_length));
+
+    auto found = cache.lookup("k", get(), t0 + 200);
+    ASSERT_TRUE(found);
+    EXPECT_TRUE(found->fresh);
+    EXPECT_EQ(body_of(*found->entry), "stale body");
+    // The refreshed header is what a restart finds.
+    HttpCache reopened(options);
+    EXPECT_TRUE(reopened.lookup("k", get(), t0 + 200)->fresh);
+}
+
+TEST(HttpCacheTest, invalidates_and_abandons)
+{
+    HttpCache cache(HttpCacheOptions{});
+    ASSERT_TRUE(put(cache, "k", get(), ok("max-age=60"), "body"));
+    cache.invalidate("k");
+    EXPECT_FALSE(cache.lookup("k", get(), t0));
+    EXPECT_EQ(cache.usage().first, 0u);
+
+    // A body that never completes is not stored.
+    {
+        auto writer = cache.store("k", get(), ok("max-age=60"), t0, t0);
+        ASSERT_TRUE(writer);
+        writer->append("part", 4);
+    }
+    EXPECT_FALSE(cache.lookup("k", get(), t0));
+
+    // Nor is anything while the cache is off.
+    HttpCache off;
+    EXPECT_FALSE(off.enabled());
+    EXPECT_FALSE(off.store("k", get(), ok("max-age=60"), t0, t0));
+}
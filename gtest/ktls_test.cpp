@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+#include <boost/asio/ssl.hpp>
+#include <string>
+#include <vector>
+#include "ktls.hpp"
+#include "tls_config.hpp"
+#include "tls_pair.hpp"
+#include "tls_session.hpp"
+
+namespace ssl = boost::asio::ssl;
+using server_async::KtlsCapture;
+using server_async::KtlsDirection;
+using server_async::KtlsKeys;
+
+// The kernel needs the exact keys, nonces and sequence numbers OpenSSL
+// used, and a test machine rarely has the tls module. So these tests
+// decrypt records OpenSSL wrote with the derived keys instead.
+namespace
+{
+    // A handshake that records what kTLS needs on the server side.
+    bool handshake(TlsPair &pair, KtlsCapture &capture)
+    {
+        server_async::ktls_capture(pair.server, capture);
+        bool ok = pair.handshake();
+        server_async::ktls_capture_done(pair.server);
+        return ok;
+    }
+
+    // Decrypts the last record in `wire` the way the kernel would with `keys`.
+    std::string open_last_record(std::vector<unsigned char> const &wire, KtlsKeys const &keys, KtlsDirection const &direction)
+    {
+        // Skip to the last record. Records before it are TLS 1.3 session
+        // tickets, already counted in direction.seq.
+        std::size_t pos = 0;
+        std::uint64_t seq = direction.seq;
+        while (pos + 5 + (wire[pos + 3] << 8 | wire[pos + 4]) < wire.size())
+            pos += 5 + (wire[pos + 3] << 8 | wire[pos + 4]);
+        unsigned char const *header = wire.data() + pos;
+        std::size_t length = header[3] << 8 | header[4];
+        unsigned char const *payload = header + 5;
+
+        bool tls13 = keys.version == TLS1_3_VERSION;
+        bool explicit_nonce = !tls13 && keys.cipher_nid != NID_chacha20_poly1305;
+        unsigned char nonce[12] = {};
+        std::size_t skip = 0;
+        if (explicit_nonce)
+        {
+            std::memcpy(nonce, direction.iv.data(), 4);
+            std::memcpy(nonce + 4, payload, 8);
+            skip = 8;
+        }
+        else
+        {
+            std::memcpy(nonce, direction.iv.data(), 12);
+            for (int i = 0; i < 8; ++i)
+                nonce[4 + i] ^= static_cast<unsigned char>(seq >> (56 - 8 * i));
+        }
+        std::size_t text_len = length - skip - 16;
+
+        std::vector<unsigned char> aad;
+        if (tls13)
+        {
+            aad.assign(header, header + 5);
+        }
+        else
+        {
+            for (int i = 0; i < 8; ++i)
+                aad.push_back(static_cast<unsigned char>(seq >> (56 - 8 * i)));
+            aad.insert(aad.end(), {header[0], header[1], header[2],
+                                   static_cast<unsigned char>(text_len >> 8), static_cast<unsigned char>(text_len)});
+        }
+
+        EVP_CIPHER const *cipher = EVP_get_cipherbynid(keys.cipher_nid);
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        std::string plain(text_len, '\0');
+        int out = 0;
+        int final_len = 0;
+        bool ok = EVP_DecryptInit_ex(ctx, cipher, nullptr, direction.key.data(), nonce) == 1 &&
+                  EVP_DecryptUpdate(ctx, nullptr, &out, aad.data(), static_cast<int>(aad.size())) == 1 &&
+                  EVP_DecryptUpdate(ctx, reinterpret_cast<unsigned char *>(plain.data()), &out, payload + skip, static_cast<int>(text_len)) == 1 &&
+                  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, const_cast<unsigned char *>(payload + skip + text_len)) == 1 &&
+                  EVP_DecryptFinal_ex(ctx, nullptr, &final_len) == 1;
+        EVP_CIPHER_CTX_free(ctx);
+        if (!ok)
+            return "<authentication failed>";
+        // TLS 1.3 hides the content type at the end of the plaintext.
+        if (tls13)
+            plain.pop_back();
+        return plain;
+    }
+
+    struct Case
+    {
+        int version;
+        char const *suite;
+        int cipher_nid;
+    };
+}
+
+TEST(KtlsTest, derived_keys_open_openssl_records)
+{
+    for (Case test : {Case{TLS1_2_VERSION, "ECDHE-RSA-AES128-GCM-SHA256", NID_aes_128_gcm},
+                      Case{TLS1_2_VERSION, "ECDHE-RSA-AES256-GCM-SHA384", NID_aes_256_gcm},
+                      Case{TLS1_2_VERSION, "ECDHE-RSA-CHACHA20-POLY1305", NID_chacha20_poly1305},
+                      Case{TLS1_3_VERSION, "TLS_AES_128_GCM_SHA256", NID_aes_128_gcm},
+                      Case{TLS1_3_VERSION, "TLS_AES_256_GCM_SHA384", NID_aes_256_gcm},
+                      Case{TLS1_3_VERSION, "TLS_CHACHA20_POLY1305_SHA256", NID_chacha20_poly1305}})
+    {
+        SCOPED_TRACE(test.suite);
+        server_async::TlsOptions options;
+        options.min_version = options.max_version = test.version;
+        (test.version == TLS1_3_VERSION ? options.ciphersuites : options.ciphers) = test.suite;
+        ssl::context server{ssl::context::tls_server};
+        server_async::configure_tls(server, options);
+        server.use_certificate_chain_file("apps/fixtures/cert.pem");
+        server.use_private_key_file("apps/fixtures/key.pem", ssl::context::pem);
+        server_async::TicketKeys ticket_keys{std::chrono::hours(1)};
+        server_async::configure_session_resumption(server, server_async::TlsSessionOptions{}, &ticket_keys);
+        server_async::enable_ktls_capture(server.native_handle());
+
+        ssl::context client{ssl::context::tls_client};
+        client.set_verify_mode(ssl::verify_none);
+
+        TlsPair c{server, client};
+        KtlsCapture capture;
+        ASSERT_TRUE(handshake(c, capture));
+
+        auto keys = server_async::derive_ktls_keys(c.server, capture);
+        ASSERT_TRUE(keys);
+        EXPECT_EQ(keys->version, test.version);
+        EXPECT_EQ(keys->cipher_nid, test.cipher_nid);
+
+        // Server to client, after any session tickets still in flight.
+        SSL_write(c.server, "response", 8);
+        EXPECT_EQ(open_last_record(TlsPair::drain(c.client_bio), *keys, keys->tx), "response");
+
+        // Client to server.
+        SSL_write(c.client, "request", 7);
+        EXPECT_EQ(open_last_record(TlsPair::drain(c.server_bio), *keys, keys->rx), "request");
+    }
+}
+
+TEST(KtlsTest, falls_back_without_kernel_support)
+{
+    ssl::context server{ssl::context::tls_server};
+    server_async::configure_tls(server, server_async::TlsOptions{});
+    server.use_certificate_chain_file("apps/fixtures/cert.pem");
+    server.use_private_key_file("apps/fixtures/key.pem", ssl::context::pem);
+    server_async::enable_ktls_capture(server.native_handle());
+    ssl::context client{ssl::context::tls_client};
+    client.set_verify_mode(ssl::verify_none);
+
+    TlsPair c{server, client};
+    KtlsCapture capture;
+    ASSERT_TRUE(handshake(c, capture));
+
+    // Not a TCP socket, so never offloaded, and the connection still works.
+    EXPECT_EQ(server_async::enable_ktls(c.server, -1, capture), server_async::KtlsResult::unavailable);
+    SSL_write(c.client, "ping", 4);
+    char buf[4];
+    EXPECT_EQ(SSL_read(c.server, buf, sizeof buf), 4);
+
+    // Ciphertext OpenSSL holds past the handshake keeps it on OpenSSL too.
+    SSL_write(c.client, "ping", 4);
+    EXPECT_GT(BIO_ctrl_pending(SSL_get_rbio(c.server)), 0u);
+    EXPECT_EQ(server_async::enable_ktls(c.server, -1, capture), server_async::KtlsResult::unavailable);
+}
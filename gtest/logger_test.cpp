@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logger.hpp"
+
+namespace
+{
+    std::string read_all(std::FILE *f)
+    {
+        std::fflush(f);
+        std::rewind(f);
+        std::string out;
+        char buf[4096];
+        std::size_t n;
+        while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+            out.append(buf, n);
+        return out;
+    }
+
+    std::size_t count(std::string const &s, std::string const &needle)
+    {
+        std::size_t n = 0;
+        for (std::size_t pos = s.find(needle); pos != std::string::npos; pos = s.find(needle, pos + 1))
+            ++n;
+        return n;
+    }
+}
+
+TEST(LoggerTest, levels_and_streams)
+{
+    std::FILE *out = std::tmpfile();
+    std::FILE *err = std::tmpfile();
+    {
+        server_async::Logger logger(out, err);
+        logger.set_level(server_async::LogLevel::info);
+        SA_LOG_AT(logger, server_async::LogLevel::debug, "hidden");
+        SA_LOG_AT(logger, server_async::LogLevel::info, "request " << 42);
+        SA_LOG_AT(logger, server_async::LogLevel::error, "broken");
+        logger.flush();
+    }
+    std::string o = read_all(out), e = read_all(err);
+    EXPECT_EQ(o.find("hidden"), std::string::npos);
+    EXPECT_NE(o.find("[info] request 42\n"), std::string::npos);
+    EXPECT_NE(e.find("[error] broken\n"), std::string::npos);
+    std::fclose(out);
+    std::fclose(err);
+}
+
+TEST(LoggerTest, truncates_long_lines)
+{
+    std::FILE *out = std::tmpfile();
+    {
+        server_async::Logger logger(out, out);
+        SA_LOG_AT(logger, server_async::LogLevel::info, std::string(1000, 'x'));
+    }
+    std::string o = read_all(out);
+    EXPECT_EQ(count(o, "x"), server_async::Logger::max_line);
+    std::fclose(out);
+}
+
+TEST(LoggerTest, many_threads)
+{
+    constexpr int threads = 4;
+    constexpr int per_thread = 500; // below ring_size, nothing is dropped
+    std::FILE *out = std::tmpfile();
+    std::uint64_t dropped;
+    {
+        server_async::Logger logger(out, out);
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t)
+            pool.emplace_back([&, t]
+                              {
+                                  for (int i = 0; i < per_thread; ++i)
+                                      SA_LOG_AT(logger, server_async::LogLevel::info, "thread " << t << " line " << i); });
+        for (auto &th : pool)
+            th.join();
+        dropped = logger.dropped();
+    }
+    std::string o = read_all(out);
+    EXPECT_EQ(dropped, 0u);
+    EXPECT_EQ(count(o, "\n"), static_cast<std::size_t>(threads * per_thread));
+    EXPECT_NE(o.find("thread 3 line 499\n"), std::string::npos);
+    std::fclose(out);
+}
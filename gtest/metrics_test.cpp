@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.hpp"
+
+using namespace std::chrono_literals;
+using server_async::LatencyBuckets;
+using server_async::Metrics;
+
+TEST(MetricsTest, buckets_are_log_linear)
+{
+    for (std::uint64_t v : {0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 1000ull, 123456789ull})
+    {
+        std::size_t i = LatencyBuckets::index(v);
+        EXPECT_LE(v, LatencyBuckets::upper(i)) << v;
+        if (i > 0)
+        {
+            EXPECT_GT(v, LatencyBuckets::upper(i - 1)) << v;
+        }
+        // Relative bucket width stays within 1/16.
+        EXPECT_LE(LatencyBuckets::upper(i) - v, v / 16 + 1) << v;
+    }
+    EXPECT_EQ(LatencyBuckets::index(~0ull), LatencyBuckets::count - 1);
+}
+
+TEST(MetricsTest, merges_shards_from_all_threads)
+{
+    Metrics metrics;
+    metrics.name_route(0, "root");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&]
+                             {
+                                 for (int i = 1; i <= 100; ++i)
+                                     metrics.record_request(0, i % 10 == 0 ? 500 : 200, std::chrono::microseconds(i * 10));
+                                 metrics.add_bytes_out(0, 10);
+                                 metrics.session_opened(0); });
+    for (auto &t : threads)
+        t.join();
+    metrics.session_closed(0);
+
+    auto snap = metrics.snapshot();
+    auto const &root = snap.routes[0];
+    EXPECT_EQ(root.count, 400u);
+    EXPECT_EQ(root.requests[static_cast<std::size_t>(server_async::StatusClass::success)], 360u);
+    EXPECT_EQ(root.requests[static_cast<std::size_t>(server_async::StatusClass::server_error)], 40u);
+    EXPECT_EQ(snap.bytes_out[0], 40u);
+    // p50 is 500us and p99 990us, each within a bucket's width.
+    EXPECT_NEAR(static_cast<double>(root.quantile(0.5)), 500.0, 500.0 / 16 + 1);
+    EXPECT_NEAR(static_cast<double>(root.quantile(0.99)), 990.0, 990.0 / 16 + 1);
+
+    std::string text = metrics.render();
+    EXPECT_NE(text.find("server_async_requests_total{route=\"root\",code=\"2xx\"} 360\n"), std::string::npos);
+    EXPECT_NE(text.find("server_async_request_duration_seconds_count{route=\"root\"} 400\n"), std::string::npos);
+    EXPECT_NE(text.find("server_async_request_duration_seconds_bucket{route=\"root\",le=\"+Inf\"} 400\n"), std::string::npos);
+    EXPECT_NE(text.find("server_async_sessions_active{kind=\"http\"} 3\n"), std::string::npos);
+}
+
+TEST(MetricsTest, reuses_shards_of_exited_threads)
+{
+    Metrics metrics;
+    for (int t = 0; t < 20; ++t)
+        std::thread([&]
+                    { metrics.record_request(0, 200, 100us);
+                      metrics.add_bytes_in(0, 5); })
+            .join();
+
+    auto snap = metrics.snapshot();
+    EXPECT_EQ(snap.routes[0].count, 20u);
+    EXPECT_EQ(snap.bytes_in[0], 100u);
+    EXPECT_EQ(metrics.shard_count(), 1u);
+
+    // A Metrics destroyed while a thread still holds one of its shards.
+    std::thread late;
+    {
+        Metrics gone;
+        std::atomic<bool> recorded{false};
+        late = std::thread([&]
+                           { gone.session_opened(0);
+                             recorded = true; });
+        while (!recorded)
+            std::this_thread::yield();
+    }
+    late.join();
+}
+
+TEST(MetricsTest, phase_breakdown)
+{
+    using clock = std::chrono::steady_clock;
+    server_async::RequestTimings t;
+    auto base = clock::now();
+    t.accepted = base;
+    t.started = base + 10us;
+    t.handshake_start = base + 10us;
+    t.handshake_done = base + 1010us;
+    t.read_start = base + 1010us;
+    t.header_done = base + 1510us;
+    t.open = 200us;
+
+    server_async::PhaseDurations d = t.on_queued(base + 2510us);
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::accept)], 10us);
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::detect)], clock::duration::zero());
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::handshake)], 1000us);
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::header)], 500us);
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::handler)], 800us);
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::open)], 200us);
+
+    // Connection setup is only charged to the first request.
+    t.first_request = false;
+    d = t.on_queued(base + 2510us);
+    EXPECT_EQ(d[static_cast<std::size_t>(server_async::Phase::handshake)], clock::duration::zero());
+
+    Metrics metrics;
+    metrics.record_phases(d);
+    std::string text = metrics.render();
+    EXPECT_NE(text.find("server_async_phase_duration_seconds_count{phase=\"header\"} 1\n"), std::string::npos);
+    EXPECT_EQ(text.find("phase=\"handshake\""), std::string::npos);
+}
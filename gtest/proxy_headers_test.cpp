@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+#include <boost/beast/http.hpp>
+#include "proxy_headers.hpp"
+
+namespace http = boost::beast::http;
+
+TEST(ProxyHeadersTest, strips_connection_fields)
+{
+    http::request<http::empty_body> req{http::verb::get, "/", 11};
+    req.set(http::field::host, "origin");
+    req.set(http::field::connection, "keep-alive, X-Secret, Upgrade");
+    req.set("X-Secret", "1");
+    req.set(http::field::keep_alive, "timeout=5");
+    req.set(http::field::proxy_connection, "keep-alive");
+    req.set(http::field::te, "trailers");
+    req.set(http::field::upgrade, "h2c");
+    req.set(http::field::accept, "*/*");
+
+    server_async::strip_hop_by_hop(req);
+    for (auto f : {"Connection", "X-Secret", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade"})
+        EXPECT_EQ(req.count(f), 0u) << f;
+    EXPECT_EQ(req[http::field::host], "origin");
+    EXPECT_EQ(req[http::field::accept], "*/*");
+}
+
+TEST(ProxyHeadersTest, keeps_the_framing)
+{
+    http::response<http::empty_body> res{http::status::ok, 11};
+    res.set(http::field::connection, "close, Transfer-Encoding, Content-Length");
+    res.set(http::field::transfer_encoding, "chunked");
+    res.set(http::field::content_length, "5");
+    res.set(http::field::trailer, "Digest");
+
+    server_async::strip_hop_by_hop(res);
+    EXPECT_EQ(res[http::field::transfer_encoding], "chunked");
+    EXPECT_EQ(res[http::field::content_length], "5");
+    // Trailer announces end-to-end fields, it is not hop-by-hop.
+    EXPECT_EQ(res[http::field::trailer], "Digest");
+    EXPECT_EQ(res.count(http::field::connection), 0u);
+}
+
+TEST(ProxyHeadersTest, appends_to_via)
+{
+    http::response<http::empty_body> res{http::status::ok, 10};
+    server_async::append_via(res);
+    EXPECT_EQ(res[http::field::via], "1.0 server_async");
+
+    http::request<http::empty_body> req{http::verb::get, "/", 11};
+    req.set(http::field::via, "1.1 edge");
+    server_async::append_via(req);
+    EXPECT_EQ(req[http::field::via], "1.1 edge, 1.1 server_async");
+}
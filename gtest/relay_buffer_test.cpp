@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+#include "relay_buffer.hpp"
+
+using server_async::RelayBuffer;
+using server_async::RelayBufferPool;
+
+namespace
+{
+    std::uint64_t held_bytes()
+    {
+        auto bytes = server_async::Metrics::instance().snapshot().relay_buffer_bytes;
+        return bytes[0] - bytes[1];
+    }
+}
+
+TEST(RelayBufferTest, rounds_sizes_to_pool_blocks)
+{
+    EXPECT_EQ(RelayBufferPool::block_size(1), 4096u);
+    EXPECT_EQ(RelayBufferPool::block_size(4096), 4096u);
+    EXPECT_EQ(RelayBufferPool::block_size(5000), 8192u);
+    EXPECT_EQ(RelayBufferPool::block_size(1 << 30), 256u << 10);
+}
+
+TEST(RelayBufferTest, grows_while_reads_fill_it)
+{
+    RelayBuffer buffer{4096, 256 << 10};
+    std::size_t sizes = 0;
+    while (buffer.size() < buffer.max_size())
+    {
+        EXPECT_EQ(buffer.acquire().size(), buffer.size());
+        buffer.adapt(buffer.size());
+        ++sizes;
+    }
+    EXPECT_EQ(sizes, 6u);
+    buffer.adapt(buffer.size());
+    EXPECT_EQ(buffer.size(), 256u << 10);
+}
+
+TEST(RelayBufferTest, shrinks_after_a_run_of_small_reads)
+{
+    RelayBuffer buffer{4096, 64 << 10};
+    buffer.adapt(4096);
+    buffer.adapt(8192);
+    ASSERT_EQ(buffer.size(), 16384u);
+
+    // One larger read in between restarts the count.
+    for (int i = 0; i < 7; ++i)
+        buffer.adapt(100);
+    buffer.adapt(8000);
+    for (int i = 0; i < 7; ++i)
+        buffer.adapt(100);
+    EXPECT_EQ(buffer.size(), 16384u);
+    buffer.adapt(100);
+    EXPECT_EQ(buffer.size(), 8192u);
+
+    for (int i = 0; i < 100; ++i)
+        buffer.adapt(1);
+    EXPECT_EQ(buffer.size(), 4096u);
+}
+
+TEST(RelayBufferTest, fixed_when_initial_equals_max)
+{
+    RelayBuffer buffer{16 << 10, 16 << 10};
+    buffer.adapt(16 << 10);
+    EXPECT_EQ(buffer.size(), 16u << 10);
+    for (int i = 0; i < 100; ++i)
+        buffer.adapt(1);
+    EXPECT_EQ(buffer.size(), 16u << 10);
+}
+
+TEST(RelayBufferTest, holds_memory_only_while_acquired)
+{
+    std::uint64_t before = held_bytes();
+    RelayBuffer buffer{4096, 4096};
+    EXPECT_FALSE(buffer.held());
+    EXPECT_EQ(held_bytes(), before);
+
+    char *first = static_cast<char *>(buffer.acquire().data());
+    EXPECT_TRUE(buffer.held());
+    EXPECT_EQ(held_bytes(), before + 4096);
+
+    // The thread's pool hands the same block out again.
+    buffer.release();
+    EXPECT_EQ(held_bytes(), before);
+    EXPECT_EQ(buffer.acquire().data(), first);
+
+    {
+        RelayBuffer other{4096, 4096};
+        other.acquire();
+        EXPECT_EQ(held_bytes(), before + 8192);
+    }
+    EXPECT_EQ(held_bytes(), before + 4096);
+}
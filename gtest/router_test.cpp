@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "router.hpp"
+
+// Counts heap allocations so the test can check that matching does none.
+// The replacements stay out of line: inlined, GCC pairs the free() below
+// with a new-expression at the call site and warns of a mismatch.
+static std::atomic<std::size_t> allocations{0};
+
+[[gnu::noinline]] void *operator new(std::size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+enum class R
+{
+    root,
+    tasks,
+    task,
+    task_action,
+    task_files,
+    upload,
+    metrics
+};
+
+static server_async::Router<R> make_router()
+{
+    server_async::Router<R> router;
+    router.add("/", R::root);
+    router.add("/tasks", R::tasks);
+    router.add("/tasks/{t_uuid}", R::task);
+    router.add("/tasks/{t_uuid}/{action}", R::task_action);
+    router.add("/tasks/{t_uuid}/files/*", R::task_files);
+    router.add("/upload/data", R::upload);
+    router.add("/metrics", R::metrics);
+    return router;
+}
+
+TEST(RouterTest, StaticAndParams)
+{
+    auto router = make_router();
+    server_async::RouteParams params;
+
+    const R *r = router.match("/", params);
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(*r, R::root);
+
+    r = router.match("/tasks", params);
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(*r, R::tasks);
+
+    r = router.match("/tasks/123", params);
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(*r, R::task);
+    ASSERT_EQ(params.get("t_uuid"), "123");
+
+    r = router.match("/tasks/123/cancel", params);
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(*r, R::task_action);
+    ASSERT_EQ(params.get("t_uuid"), "123");
+    ASSERT_EQ(params.get("action"), "cancel");
+
+    // Empty segments are segments of their own, captures do not take them.
+    ASSERT_EQ(router.match("/tasks/", params), nullptr);
+    ASSERT_EQ(router.match("/upload//data", params), nullptr);
+    ASSERT_EQ(router.match("/upload/data/", params), nullptr);
+    ASSERT_EQ(router.match("//", params), nullptr);
+    ASSERT_EQ(router.match("/tasks//cancel", params), nullptr);
+
+    ASSERT_EQ(router.match("/nothing", params), nullptr);
+    ASSERT_EQ(router.match("/tasks/1/2/3", params), nullptr);
+}
+
+TEST(RouterTest, StaticBeatsParamAndWildcard)
+{
+    auto router = make_router();
+    server_async::RouteParams params;
+
+    // "files" is static under {t_uuid}, so it wins over {action}
+    const R *r = router.match("/tasks/abc/files/a/b.txt", params);
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(*r, R::task_files);
+    ASSERT_EQ(params.get("t_uuid"), "abc");
+    ASSERT_EQ(params.wildcard, "a/b.txt");
+
+    // a wildcard also matches an empty rest
+    r = router.match("/tasks/abc/files", params);
+    ASSERT_NE(r, nullptr);
+    ASSERT_EQ(*r, R::task_files);
+    ASSERT_TRUE(params.wildcard.empty());
+}
+
+TEST(RouterTest, RejectsBadPatterns)
+{
+    server_async::Router<R> router;
+    router.add("/tasks/{id}", R::task);
+    ASSERT_THROW(router.add("/tasks/{id}", R::task), std::invalid_argument);
+    ASSERT_THROW(router.add("/tasks/{other}/x", R::task), std::invalid_argument);
+    ASSERT_THROW(router.add("/a/*/b", R::task), std::invalid_argument);
+}
+
+TEST(RouterTest, MatchDoesNotAllocate)
+{
+    auto router = make_router();
+    server_async::RouteParams params;
+    std::size_t before = allocations.load();
+    for (int i = 0; i < 1000; ++i)
+    {
+        router.match("/tasks/0f8fad5b-d9cb-469f-a165-70867728950e/files/x/y", params);
+        router.match("/upload/data", params);
+        router.match("/missing/path", params);
+    }
+    ASSERT_EQ(allocations.load(), before);
+}
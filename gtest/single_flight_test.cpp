@@ -0,0 +1,184 @@
+#include <gtest/gtest.h>
+#include "single_flight.hpp"
+
+using server_async::Flight;
+using server_async::Flights;
+using server_async::HttpCache;
+namespace http = boost::beast::http;
+
+namespace
+{
+    http::response_header<> shared_response()
+    {
+        http::response_header<> res;
+        res.result(http::status::ok);
+        res.set(http::field::cache_control, "max-age=60");
+        return res;
+    }
+
+    // Reads everything `reader` can have right now.
+    std::string drain(Flight &flight, std::size_t reader, Flight::State &state, int *woken = nullptr)
+    {
+        std::string out;
+        for (;;)
+        {
+            auto piece = flight.read(reader, [woken]
+                                     { if (woken) ++*woken; }, state);
+            if (!piece.chunk)
+                return out;
+            out.append(piece.data, piece.size);
+        }
+    }
+}
+
+TEST(SingleFlightTest, the_first_request_leads_and_the_others_follow)
+{
+    auto [leader, none] = Flights::instance().join("http://a:80/x");
+    ASSERT_TRUE(leader);
+    EXPECT_FALSE(none);
+    auto [same, reader] = Flights::instance().join("http://a:80/x");
+    EXPECT_EQ(same, leader);
+    ASSERT_TRUE(reader);
+    auto [other, no_reader] = Flights::instance().join("http://a:80/y");
+    EXPECT_NE(other, leader);
+    EXPECT_FALSE(no_reader);
+    // A conditional request follows but does not lead.
+    EXPECT_FALSE(Flights::instance().join("http://a:80/z", false).first);
+
+    leader->finish();
+    other->finish();
+    EXPECT_EQ(Flights::instance().size(), 0u);
+    auto [next, next_reader] = Flights::instance().join("http://a:80/x");
+    EXPECT_NE(next, leader);
+    EXPECT_FALSE(next_reader);
+    next->abort();
+}
+
+TEST(SingleFlightTest, followers_stream_the_body_as_it_arrives)
+{
+    Flight flight("k");
+    auto early = *flight.attach();
+    int woken = 0;
+    EXPECT_EQ(flight.wait(early, [&]
+                          { ++woken; }),
+              Flight::State::waiting);
+
+    flight.respond(shared_response(), 11, {});
+    EXPECT_EQ(woken, 1);
+    flight.publish("hello ", 6);
+
+    Flight::State state;
+    EXPECT_EQ(drain(flight, early, state, &woken), "hello ");
+    EXPECT_EQ(state, Flight::State::streaming);
+
+    // A late follower still gets the body from the start.
+    auto late = *flight.attach();
+    EXPECT_EQ(flight.wait(late, [] {}), Flight::State::streaming);
+    flight.publish("world", 5);
+    EXPECT_EQ(woken, 2);
+    EXPECT_EQ(drain(flight, early, state), "world");
+    flight.finish();
+    EXPECT_EQ(drain(flight, late, state), "hello world");
+    EXPECT_EQ(state, Flight::State::complete);
+    EXPECT_EQ(flight.length(), 11u);
+    EXPECT_EQ(flight.header()[http::field::cache_control], "max-age=60");
+    EXPECT_FALSE(flight.attach());
+}
+
+TEST(SingleFlightTest, followers_go_on_their_own_when_declined)
+{
+    Flight flight("k");
+    auto reader = *flight.attach();
+    int woken = 0;
+    flight.wait(reader, [&]
+                { ++woken; });
+    flight.decline();
+    EXPECT_EQ(woken, 1);
+    EXPECT_EQ(flight.wait(reader, [] {}), Flight::State::declined);
+    // Nothing the leader reads afterwards is kept.
+    flight.publish("ignored", 7);
+    Flight::State state;
+    EXPECT_EQ(drain(flight, reader, state), "");
+
+    // A leader that fails before the header declines too; after it, it aborts.
+    Flight before("k");
+    auto b = *before.attach();
+    before.abort();
+    EXPECT_EQ(before.wait(b, [] {}), Flight::State::declined);
+    Flight after("k");
+    auto r = *after.attach();
+    after.respond(shared_response(), std::nullopt, {});
+    after.publish("part", 4);
+    after.abort();
+    EXPECT_EQ(drain(after, r, state), "part");
+    EXPECT_EQ(state, Flight::State::aborted);
+}
+
+TEST(SingleFlightTest, revalidation_hands_over_the_stored_entry)
+{
+    Flight flight("k");
+    auto reader = *flight.attach();
+    auto entry = std::make_shared<server_async::CacheEntry>();
+    flight.revalidated(entry);
+    EXPECT_EQ(flight.wait(reader, [] {}), Flight::State::revalidated);
+    EXPECT_EQ(flight.entry(), entry);
+}
+
+TEST(SingleFlightTest, a_slow_follower_holds_the_leader_back)
+{
+    Flight flight("k");
+    auto fast = *flight.attach();
+    auto slow = *flight.attach();
+    flight.respond(shared_response(), std::nullopt, {});
+    std::string chunk(64 << 10, 'x');
+    Flight::State state;
+    std::uint64_t published = 0;
+    while (published <= 2 * Flight::window)
+    {
+        flight.publish(chunk.data(), chunk.size());
+        published += chunk.size();
+        drain(flight, fast, state);
+    }
+    // Past the window no one attaches any more.
+    EXPECT_FALSE(flight.attach());
+
+    int resumed = 0;
+    EXPECT_TRUE(flight.throttled([&]
+                                 { ++resumed; }));
+    auto piece = flight.read(slow, [] {}, state);
+    EXPECT_EQ(piece.size, chunk.size());
+    EXPECT_EQ(resumed, 0);
+    // Once the slow one is within the window the leader reads on.
+    std::uint64_t read = piece.size;
+    while (published - read > Flight::window)
+        read += flight.read(slow, [] {}, state).size;
+    EXPECT_EQ(resumed, 1);
+    EXPECT_FALSE(flight.throttled([] {}));
+
+    // A follower that leaves does not hold anyone back.
+    for (int i = 0; i < 80; ++i)
+    {
+        flight.publish(chunk.data(), chunk.size());
+        drain(flight, fast, state);
+    }
+    EXPECT_TRUE(flight.throttled([&]
+                                 { ++resumed; }));
+    flight.detach(slow);
+    EXPECT_EQ(resumed, 2);
+    flight.finish();
+}
+
+TEST(SingleFlightTest, followers_match_the_leader_on_vary)
+{
+    http::request_header<> leader, same, other;
+    leader.set(http::field::accept_language, "en");
+    same.set(http::field::accept_language, "en");
+    other.set(http::field::accept_language, "de");
+    auto res = shared_response();
+    res.set(http::field::vary, "Accept-Language");
+    auto vary = HttpCache::vary_of(leader, res);
+    ASSERT_EQ(vary.size(), 1u);
+    EXPECT_EQ(vary[0].first, "accept-language");
+    EXPECT_TRUE(HttpCache::matches(vary, same));
+    EXPECT_FALSE(HttpCache::matches(vary, other));
+}
@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+#include <boost/asio/ssl.hpp>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include "server_certificate.hpp"
+#include "tls_config.hpp"
+#include "tls_pair.hpp"
+
+namespace ssl = boost::asio::ssl;
+using server_async::configure_tls;
+using server_async::TlsOptions;
+
+namespace
+{
+    std::string read_fixture(std::string const &name)
+    {
+        std::ifstream file("apps/fixtures/" + name);
+        return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    }
+
+    // The server context HttpServer builds, with both certificates.
+    void server_context(ssl::context &ctx, TlsOptions const &options = {})
+    {
+        configure_tls(ctx, options);
+        load_server_certificate(ctx, read_fixture("cert.pem"), read_fixture("key.pem"), read_fixture("dh.pem"));
+        server_async::add_server_certificate(ctx, read_fixture("ecdsa_cert.pem"), read_fixture("ecdsa_key.pem"));
+    }
+
+    struct Negotiated
+    {
+        bool ok = false;
+        int version = 0;
+        std::string cipher;
+        int key_type = EVP_PKEY_NONE;
+    };
+
+    // One handshake over an in-memory BIO pair, as seen by the client.
+    Negotiated handshake(ssl::context &server, ssl::context &client)
+    {
+        TlsPair pair{server, client};
+        Negotiated result;
+        result.ok = pair.handshake();
+        if (result.ok)
+        {
+            result.version = SSL_version(pair.client);
+            result.cipher = SSL_get_cipher_name(pair.client);
+            X509 *cert = SSL_get_peer_certificate(pair.client);
+            result.key_type = EVP_PKEY_base_id(X509_get0_pubkey(cert));
+            X509_free(cert);
+        }
+        return result;
+    }
+
+    ssl::context client_context()
+    {
+        ssl::context ctx{ssl::context::tls_client};
+        ctx.set_verify_mode(ssl::verify_none);
+        return ctx;
+    }
+}
+
+TEST(TlsConfigTest, prefers_tls13)
+{
+    ssl::context server{ssl::context::tls_server};
+    server_context(server);
+    ssl::context client = client_context();
+
+    Negotiated result = handshake(server, client);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(result.version, TLS1_3_VERSION);
+    EXPECT_EQ(result.cipher, "TLS_AES_128_GCM_SHA256");
+}
+
+TEST(TlsConfigTest, picks_certificate_by_client_support)
+{
+    ssl::context server{ssl::context::tls_server};
+    server_context(server);
+
+    ssl::context ecdsa_client = client_context();
+    SSL_CTX_set1_sigalgs_list(ecdsa_client.native_handle(), "ECDSA+SHA256");
+    EXPECT_EQ(handshake(server, ecdsa_client).key_type, EVP_PKEY_EC);
+
+    ssl::context rsa_client = client_context();
+    SSL_CTX_set1_sigalgs_list(rsa_client.native_handle(), "RSA-PSS+SHA256:RSA+SHA256");
+    EXPECT_EQ(handshake(server, rsa_client).key_type, EVP_PKEY_RSA);
+}
+
+TEST(TlsConfigTest, tls12_is_ecdhe_only)
+{
+    ssl::context server{ssl::context::tls_server};
+    server_context(server);
+
+    ssl::context client = client_context();
+    SSL_CTX_set_max_proto_version(client.native_handle(), TLS1_2_VERSION);
+    Negotiated result = handshake(server, client);
+    ASSERT_TRUE(result.ok);
+    EXPECT_EQ(result.cipher.rfind("ECDHE-", 0), 0u) << result.cipher;
+
+    // Static RSA and finite field DHE key exchange are refused.
+    SSL_CTX_set_cipher_list(client.native_handle(), "AES128-GCM-SHA256:DHE-RSA-AES128-GCM-SHA256");
+    EXPECT_FALSE(handshake(server, client).ok);
+}
+
+TEST(TlsConfigTest, rejects_invalid_options)
+{
+    ssl::context server{ssl::context::tls_server};
+    TlsOptions options;
+    options.ciphers = "NOT-A-CIPHER";
+    EXPECT_THROW(configure_tls(server, options), std::runtime_error);
+
+    options = TlsOptions{};
+    options.groups = "P-1";
+    EXPECT_THROW(configure_tls(server, options), std::runtime_error);
+}
@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include <boost/asio/ssl.hpp>
+#include <string>
+#include "tls_pair.hpp"
+#include "tls_session.hpp"
+
+namespace ssl = boost::asio::ssl;
+using server_async::configure_session_resumption;
+using server_async::TicketKeys;
+using server_async::TlsSessionOptions;
+
+namespace
+{
+    struct HandshakeResult
+    {
+        bool ok = false;
+        bool resumed = false;
+        // Client session to resume next time, owned by the caller.
+        SSL_SESSION *session = nullptr;
+    };
+
+    // One handshake over an in-memory BIO pair, resuming `resume` if given.
+    HandshakeResult handshake(ssl::context &server, ssl::context &client, SSL_SESSION *resume = nullptr)
+    {
+        TlsPair pair{server, client, resume};
+        HandshakeResult result;
+        result.ok = pair.handshake();
+        pair.read_tickets();
+        result.resumed = SSL_session_reused(pair.server) == 1;
+        result.session = SSL_get1_session(pair.client);
+        pair.shutdown();
+        return result;
+    }
+
+    void load_fixture_certificate(ssl::context &ctx)
+    {
+        ctx.use_certificate_chain_file("apps/fixtures/cert.pem");
+        ctx.use_private_key_file("apps/fixtures/key.pem", ssl::context::pem);
+    }
+
+    ssl::context client_context(ssl::context::method method)
+    {
+        ssl::context ctx{method};
+        ctx.set_verify_mode(ssl::verify_none);
+        SSL_CTX_set_session_cache_mode(ctx.native_handle(), SSL_SESS_CACHE_CLIENT);
+        return ctx;
+    }
+
+    // Full handshake, then a second one resuming the first session.
+    bool resumes(ssl::context &server, ssl::context &client)
+    {
+        HandshakeResult first = handshake(server, client);
+        EXPECT_TRUE(first.ok);
+        EXPECT_FALSE(first.resumed);
+        HandshakeResult second = handshake(server, client, first.session);
+        EXPECT_TRUE(second.ok);
+        SSL_SESSION_free(first.session);
+        SSL_SESSION_free(second.session);
+        return second.resumed;
+    }
+}
+
+TEST(TlsSessionTest, resumes_from_ticket)
+{
+    for (auto method : {ssl::context::tlsv12_client, ssl::context::tlsv13_client})
+    {
+        ssl::context server{ssl::context::tls_server};
+        load_fixture_certificate(server);
+        TlsSessionOptions options;
+        options.cache_size = 0;
+        TicketKeys keys{options.ticket_key_lifetime};
+        configure_session_resumption(server, options, &keys);
+
+        ssl::context client = client_context(method);
+        EXPECT_TRUE(resumes(server, client)) << method;
+    }
+}
+
+TEST(TlsSessionTest, resumes_from_cache_without_tickets)
+{
+    ssl::context server{ssl::context::tlsv12_server};
+    load_fixture_certificate(server);
+    TlsSessionOptions options;
+    options.tickets = false;
+    configure_session_resumption(server, options, nullptr);
+
+    ssl::context client = client_context(ssl::context::tlsv12_client);
+    EXPECT_TRUE(resumes(server, client));
+
+    // Neither tickets nor cache: every handshake is a full one.
+    ssl::context stateless{ssl::context::tlsv12_server};
+    load_fixture_certificate(stateless);
+    options.cache_size = 0;
+    configure_session_resumption(stateless, options, nullptr);
+    EXPECT_FALSE(resumes(stateless, client));
+}
+
+TEST(TlsSessionTest, ticket_keys_rotate)
+{
+    ssl::context server{ssl::context::tlsv12_server};
+    load_fixture_certificate(server);
+    TlsSessionOptions options;
+    options.cache_size = 0;
+    TicketKeys keys{options.ticket_key_lifetime};
+    configure_session_resumption(server, options, &keys);
+    ssl::context client = client_context(ssl::context::tlsv12_client);
+
+    HandshakeResult first = handshake(server, client);
+    ASSERT_TRUE(first.ok);
+
+    // Still accepted under the previous key.
+    keys.rotate();
+    HandshakeResult second = handshake(server, client, first.session);
+    EXPECT_TRUE(second.resumed);
+
+    // Two rotations later the key is gone.
+    keys.rotate();
+    keys.rotate();
+    HandshakeResult third = handshake(server, client, first.session);
+    EXPECT_TRUE(third.ok);
+    EXPECT_FALSE(third.resumed);
+
+    SSL_SESSION_free(first.session);
+    SSL_SESSION_free(second.session);
+    SSL_SESSION_free(third.session);
+}
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <boost/asio.hpp>
+#include <thread>
+#include "upstream_pool.hpp"
+
+using server_async::UpstreamPool;
+using boost::asio::ip::tcp;
+
+namespace
+{
+    // A connected loopback pair: `client` plays the proxy, `origin` the server.
+    struct Connection
+    {
+        tcp::socket client;
+        tcp::socket origin;
+    };
+
+    Connection connect(boost::asio::io_context &ioc)
+    {
+        tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+        tcp::socket client{ioc};
+        client.connect(acceptor.local_endpoint());
+        return {std::move(client), acceptor.accept()};
+    }
+
+    std::uint64_t discarded()
+    {
+        return server_async::Metrics::instance().snapshot().upstream[2];
+    }
+}
+
+TEST(UpstreamPoolTest, hands_back_the_idle_connection)
+{
+    boost::asio::io_context ioc;
+    UpstreamPool pool;
+    EXPECT_FALSE(pool.checkout("a:80", ioc.get_executor()));
+
+    Connection c = connect(ioc);
+    auto local = c.client.local_endpoint();
+    pool.checkin("a:80", std::move(c.client));
+    EXPECT_EQ(pool.idle("a:80"), 1u);
+    EXPECT_FALSE(pool.checkout("b:80", ioc.get_executor()));
+
+    auto socket = pool.checkout("a:80", ioc.get_executor());
+    ASSERT_TRUE(socket);
+    EXPECT_EQ(socket->local_endpoint(), local);
+    EXPECT_EQ(pool.idle("a:80"), 0u);
+
+    // Still the same connection to the origin.
+    boost::asio::write(*socket, boost::asio::buffer("x", 1));
+    char byte = 0;
+    boost::asio::read(c.origin, boost::asio::buffer(&byte, 1));
+    EXPECT_EQ(byte, 'x');
+}
+
+TEST(UpstreamPoolTest, drops_connections_the_origin_closed)
+{
+    boost::asio::io_context ioc;
+    UpstreamPool pool;
+    Connection c = connect(ioc);
+    pool.checkin("a:80", std::move(c.client));
+    c.origin.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto before = discarded();
+    EXPECT_FALSE(pool.checkout("a:80", ioc.get_executor()));
+    EXPECT_EQ(discarded(), before + 1);
+}
+
+TEST(UpstreamPoolTest, drops_connections_with_unasked_data)
+{
+    boost::asio::io_context ioc;
+    UpstreamPool pool;
+    Connection c = connect(ioc);
+    pool.checkin("a:80", std::move(c.client));
+    boost::asio::write(c.origin, boost::asio::buffer("HTTP/1.1 408\r\n\r\n"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(pool.checkout("a:80", ioc.get_executor()));
+}
+
+TEST(UpstreamPoolTest, keeps_at_most_max_idle_per_origin)
+{
+    boost::asio::io_context ioc;
+    UpstreamPool pool;
+    auto max = server_async::upstream_max_idle().exchange(2);
+    std::vector<Connection> connections;
+    for (int i = 0; i < 3; ++i)
+    {
+        connections.push_back(connect(ioc));
+        pool.checkin("a:80", std::move(connections.back().client));
+    }
+    EXPECT_EQ(pool.idle("a:80"), 2u);
+
+    server_async::upstream_max_idle() = 0;
+    connections.push_back(connect(ioc));
+    pool.checkin("b:80", std::move(connections.back().client));
+    EXPECT_EQ(pool.idle("b:80"), 0u);
+    server_async::upstream_max_idle() = max;
+}
+
+TEST(UpstreamPoolTest, expires_idle_connections)
+{
+    boost::asio::io_context ioc;
+    UpstreamPool pool;
+    auto ttl = server_async::upstream_idle_ttl_ms().exchange(50);
+    Connection c = connect(ioc);
+    pool.checkin("a:80", std::move(c.client));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+
+    auto before = discarded();
+    EXPECT_FALSE(pool.checkout("a:80", ioc.get_executor()));
+    EXPECT_EQ(discarded(), before + 1);
+    server_async::upstream_idle_ttl_ms() = ttl;
+}